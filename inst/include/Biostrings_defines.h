@@ -88,8 +88,9 @@ typedef struct mindex_holder {
 
 
 /*
- * The BitCol, BitMatrix and HeadTail structs are used for preprocessing
- * and fast matching of the head and tail of a PDict object.
+ * The BitCol and BitMatrix structs are general purpose bit containers.
+ * The PPHeadTail and HeadTail structs are used for preprocessing and fast
+ * matching of the head and tail of a PDict object.
  */
 typedef unsigned long int BitWord;
 
@@ -108,13 +109,25 @@ typedef struct bitmatrix {
 	int ncol;
 } BitMatrix;
 
+/*
+ * The heads and tails of the grouped keys are stored "one-hot packed" in
+ * FlankWords: each letter is a 4-bit mask with 1 bit set per base (0 for
+ * non-base letters) so the number of matching letters between 2 packed
+ * flanks is the popcount of their bitwise AND.
+ */
+typedef unsigned long long int FlankWord;
+
+#define NLETTER_PER_FLANKWORD (sizeof(FlankWord) * CHAR_BIT / 4)
+
 typedef struct ppheadtail {
 	int is_init;
 	ByteTrTable byte2offset;
-	BitMatrix head_bmbuf[4], tail_bmbuf[4];
-	BitMatrix nmis_bmbuf;
-	BitMatrix tmp_match_bmbuf;
-	int *tmp_tb_end_buf;
+	int nword_per_flank;
+	int nkey_max;  /* multiple of 4 */
+	FlankWord *packed_flanks;  /* nword_per_flank x nkey_max, by word */
+	FlankWord *packed_S;
+	FlankWord *nmatch_buf;
+	int *HTwidth_buf;
 } PPHeadTail;
 
 typedef struct headtail {
@@ -194,4 +207,26 @@ typedef struct matchpdict_buf {
 	MatchBuf matches;
 } MatchPDictBuf;
 
+/*
+ * The TBLaneMatchBuf struct is used by the interleaved Trusted Band
+ * scanners, which walk up to MAX_TB_NLANE subjects in lockstep, for storing
+ * the matches found in each subject ("lane") of the batch.
+ * The buffers are malloc()'ed (so they can be filled by worker threads) and
+ * must be released with _free_TBLaneMatchBuf().
+ */
+#define MAX_TB_NLANE 16
+
+/* Nb of subjects in the g-th group of MAX_TB_NLANE subjects */
+#define TB_GROUP_NLANE(nsubject, g) \
+	((nsubject) - (g) * MAX_TB_NLANE < MAX_TB_NLANE ? \
+	 (nsubject) - (g) * MAX_TB_NLANE : MAX_TB_NLANE)
+
+typedef struct tblane_match_buf {
+	int *PSpair_ids[MAX_TB_NLANE];
+	int *ends[MAX_TB_NLANE];
+	int nelt[MAX_TB_NLANE];
+	int buflength[MAX_TB_NLANE];
+	int alloc_failed;
+} TBLaneMatchBuf;
+
 #endif
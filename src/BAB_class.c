@@ -43,11 +43,65 @@ SEXP _get_BAB_blocks(SEXP x)
 	return R_ExternalPtrTag(xp);
 }
 
+/*
+ * A "mapped" BAB is a read-only BAB whose blocks are stored contiguously in
+ * a memory region that is not managed by R (typically a file mapped with
+ * mmap()). Its external pointer points to the 1st block, its tag is the
+ * external pointer that owns the memory region, and its protected INTSXP
+ * has a 3rd element: the length of a (full) block.
+ * The address of an external pointer is reset to NULL when the pointer is
+ * serialized so a mapped BAB cannot survive a save()/load() round trip.
+ */
+SEXP _IntegerBAB_new_mapped(SEXP region, int *blocks, int nblock,
+		int lastblock_nelt, int block_length)
+{
+	SEXP prot, xp, classdef, ans;
+
+	PROTECT(prot = NEW_INTEGER(3));
+	INTEGER(prot)[0] = nblock;
+	INTEGER(prot)[1] = lastblock_nelt;
+	INTEGER(prot)[2] = block_length;
+	PROTECT(xp = R_MakeExternalPtr(blocks, region, prot));
+	PROTECT(classdef = MAKE_CLASS("IntegerBAB"));
+	PROTECT(ans = NEW_OBJECT(classdef));
+	SET_SLOT(ans, mkChar("xp"), xp);
+	UNPROTECT(4);
+	return ans;
+}
+
+int _BAB_is_mapped(SEXP x)
+{
+	SEXP xp;
+
+	xp = GET_SLOT(x, install("xp"));
+	return LENGTH(R_ExternalPtrProtected(xp)) == 3;
+}
+
+int *_get_BAB_block(SEXP x, int b)
+{
+	SEXP xp, prot;
+	int *blocks;
+
+	xp = GET_SLOT(x, install("xp"));
+	prot = R_ExternalPtrProtected(xp);
+	if (LENGTH(prot) != 3)
+		return INTEGER(VECTOR_ELT(R_ExternalPtrTag(xp), b));
+	blocks = (int *) R_ExternalPtrAddr(xp);
+	if (blocks == NULL)
+		error("this object was created by loadPDict() and cannot be "
+		      "used after a\n  serialization round trip, please "
+		      "call loadPDict() again");
+	return blocks + (size_t) b * INTEGER(prot)[2];
+}
+
 SEXP _IntegerBAB_addblock(SEXP x, int block_length)
 {
 	SEXP xp, blocks, prot, block;
 	int max_nblock, nblock; 
 
+	if (_BAB_is_mapped(x))
+		error("_IntegerBAB_addblock(): cannot add a block to a "
+		      "read-only buffer");
 	xp = GET_SLOT(x, install("xp"));
 	blocks = R_ExternalPtrTag(xp);
 	max_nblock = LENGTH(blocks);
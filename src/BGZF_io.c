@@ -0,0 +1,524 @@
+/****************************************************************************
+ *                  Parallel (de)compression of BGZF files                  *
+ *                                 --------                                 *
+ ****************************************************************************/
+#include "Biostrings.h"
+
+#include <stdio.h>
+#include <stdlib.h>  /* for malloc, realloc, free */
+#include <string.h>  /* for memset */
+#include <limits.h>  /* for UINT_MAX */
+#include <zlib.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/*
+ * BGZF (the format used by bgzip, BAM, tabix, etc...) is a series of gzip
+ * members (or blocks) of at most 64KB each. The size of each block is stored
+ * in the "BC" subfield of its gzip header and the size of its uncompressed
+ * data in its gzip footer, so the blocks can be located without
+ * decompressing anything and then be inflated (or deflated) independently.
+ * A BGZF file is a valid gzip file.
+ */
+
+#define BGZF_HEADER_SIZE 18
+#define BGZF_FOOTER_SIZE 8
+#define BGZF_MAX_BLOCK_SIZE 65536
+/* Same as htslib, leaves room for incompressible data */
+#define BGZF_BLOCK_DATA_SIZE 0xff00
+/* Nb of blocks compressed per thread between 2 writes */
+#define BGZF_NBLOCK_PER_THREAD 16
+
+static const unsigned char BGZF_EOF_block[28] = {
+	0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0xff, 0x06, 0x00, 0x42, 0x43, 0x02, 0x00,
+	0x1b, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00
+};
+
+static unsigned int get_le16(const unsigned char *p)
+{
+	return (unsigned int) p[0] | ((unsigned int) p[1] << 8);
+}
+
+static unsigned int get_le32(const unsigned char *p)
+{
+	return (unsigned int) p[0] | ((unsigned int) p[1] << 8) |
+	       ((unsigned int) p[2] << 16) | ((unsigned int) p[3] << 24);
+}
+
+static void set_le16(unsigned char *p, unsigned int x)
+{
+	p[0] = x & 0xff;
+	p[1] = (x >> 8) & 0xff;
+	return;
+}
+
+static void set_le32(unsigned char *p, unsigned int x)
+{
+	p[0] = x & 0xff;
+	p[1] = (x >> 8) & 0xff;
+	p[2] = (x >> 16) & 0xff;
+	p[3] = (x >> 24) & 0xff;
+	return;
+}
+
+/* Returns the size of the BGZF block starting at 'p' or 0 if there is no
+   valid BGZF block there. */
+static long long int get_BGZF_block_size(const unsigned char *p,
+		long long int nbyte, int *data_offset)
+{
+	unsigned int xlen, slen, i;
+	long long int block_size;
+
+	if (nbyte < BGZF_HEADER_SIZE + BGZF_FOOTER_SIZE
+	 || p[0] != 0x1f || p[1] != 0x8b || p[2] != 8 || !(p[3] & 4))
+		return 0;
+	xlen = get_le16(p + 10);
+	if (12 + xlen > nbyte)
+		return 0;
+	for (i = 12; i + 4 <= 12 + xlen; i += 4 + slen) {
+		slen = get_le16(p + i + 2);
+		if (p[i] == 'B' && p[i + 1] == 'C' && slen == 2) {
+			block_size = (long long int) get_le16(p + i + 4) + 1;
+			if (block_size > nbyte
+			 || block_size < 12 + xlen + BGZF_FOOTER_SIZE)
+				return 0;
+			*data_offset = 12 + xlen;
+			return block_size;
+		}
+	}
+	return 0;
+}
+
+typedef struct bgzf_block {
+	const unsigned char *data;
+	unsigned int data_size;
+	unsigned int crc;
+	unsigned int isize;
+	long long int out_offset;
+} BGZFblock;
+
+/* Called by the worker threads. */
+static int inflate_BGZF_block(const BGZFblock *block, unsigned char *out)
+{
+	z_stream zs;
+	int ret;
+
+	memset(&zs, 0, sizeof(z_stream));
+	if (inflateInit2(&zs, -15) != Z_OK)
+		return 0;
+	zs.next_in = (unsigned char *) block->data;
+	zs.avail_in = block->data_size;
+	zs.next_out = out;
+	zs.avail_out = block->isize;
+	ret = inflate(&zs, Z_FINISH);
+	inflateEnd(&zs);
+	return ret == Z_STREAM_END && zs.total_out == block->isize &&
+	       crc32(0L, out, block->isize) == block->crc;
+}
+
+
+/****************************************************************************
+ * Reading gzip-compressed data by batches.
+ *
+ * The decompressed data is delivered in batches of bounded size so a large
+ * file never needs to be decompressed in memory at once. As long as the
+ * input is made of BGZF blocks, a batch is made of whole blocks that are
+ * inflated in parallel. From the first gzip member that is not a BGZF block
+ * (i.e. right from the start for a plain gzip file), the rest of the input
+ * is inflated as a gzip stream by the calling thread.
+ * The readers don't use the R API so they can be used outside the main
+ * thread.
+ */
+
+struct gzip_reader {
+	const unsigned char *in;
+	long long int in_size, in_offset;
+	int nthreads;
+	BGZFblock *blocks;
+	long long int blocks_buflength;
+	int in_stream;       /* reading the input as a gzip stream */
+	int zs_initialized;
+	z_stream zs;
+	int eof;
+};
+
+GZIPreader *_new_GZIPreader(const char *in, long long int in_size,
+		int nthreads)
+{
+	GZIPreader *reader;
+
+	reader = (GZIPreader *) malloc(sizeof(GZIPreader));
+	if (reader == NULL)
+		return NULL;
+	reader->in = (const unsigned char *) in;
+	reader->in_size = in_size;
+	reader->in_offset = 0;
+	reader->nthreads = nthreads;
+	reader->blocks = NULL;
+	reader->blocks_buflength = 0;
+	reader->in_stream = 0;
+	reader->zs_initialized = 0;
+	reader->eof = in_size == 0;
+	return reader;
+}
+
+int _GZIPreader_eof(const GZIPreader *reader)
+{
+	return reader->eof;
+}
+
+void _free_GZIPreader(GZIPreader *reader)
+{
+	if (reader->zs_initialized)
+		inflateEnd(&(reader->zs));
+	free(reader->blocks);
+	free(reader);
+	return;
+}
+
+/* Makes sure that '*buf' can hold at least 'min_size' bytes. */
+static int reserve_buf(char **buf, long long int *buf_size,
+		long long int min_size)
+{
+	long long int new_size;
+	char *new_buf;
+
+	if (*buf_size >= min_size)
+		return 1;
+	new_size = *buf_size == 0 ? 65536 : 2 * *buf_size;
+	while (new_size < min_size)
+		new_size *= 2;
+	new_buf = realloc(*buf, new_size);
+	if (new_buf == NULL)
+		return 0;
+	*buf = new_buf;
+	*buf_size = new_size;
+	return 1;
+}
+
+/* Collects the BGZF blocks to inflate until they add up to 'target'
+   decompressed bytes. Returns the nb of blocks or -1 if out of memory. */
+static long long int next_BGZF_blocks(GZIPreader *reader,
+		long long int nbyte, long long int target,
+		long long int *out_size)
+{
+	long long int nblock, block_size;
+	int data_offset;
+	BGZFblock *block;
+
+	nblock = 0;
+	*out_size = nbyte;
+	while (*out_size < target && reader->in_offset < reader->in_size) {
+		block_size = get_BGZF_block_size(
+				reader->in + reader->in_offset,
+				reader->in_size - reader->in_offset,
+				&data_offset);
+		if (block_size == 0) {
+			reader->in_stream = 1;
+			break;
+		}
+		if (nblock == reader->blocks_buflength) {
+			block = realloc(reader->blocks,
+					(nblock + 1024) * sizeof(BGZFblock));
+			if (block == NULL)
+				return -1;
+			reader->blocks = block;
+			reader->blocks_buflength = nblock + 1024;
+		}
+		block = reader->blocks + nblock++;
+		block->data = reader->in + reader->in_offset + data_offset;
+		block->data_size = (unsigned int) (block_size - data_offset -
+						   BGZF_FOOTER_SIZE);
+		block->crc = get_le32(reader->in + reader->in_offset +
+				      block_size - 8);
+		block->isize = get_le32(reader->in + reader->in_offset +
+					block_size - 4);
+		block->out_offset = *out_size;
+		*out_size += block->isize;
+		reader->in_offset += block_size;
+	}
+	return nblock;
+}
+
+static const char *read_BGZF_blocks(GZIPreader *reader,
+		char **buf, long long int *buf_size, long long int *nbyte,
+		long long int target)
+{
+	long long int nblock, out_size, i, nbad;
+	const BGZFblock *blocks;
+
+	nblock = next_BGZF_blocks(reader, *nbyte, target, &out_size);
+	/* +1 so that an empty result is not a NULL pointer */
+	if (nblock < 0 || !reserve_buf(buf, buf_size, out_size + 1))
+		return "cannot allocate memory for the decompressed data";
+	blocks = reader->blocks;
+	nbad = 0;
+#ifdef _OPENMP
+	#pragma omp parallel for num_threads(reader->nthreads) \
+		schedule(dynamic, 16) reduction(+:nbad)
+#endif
+	for (i = 0; i < nblock; i++) {
+		if (!inflate_BGZF_block(blocks + i,
+			(unsigned char *) *buf + blocks[i].out_offset))
+			nbad++;
+	}
+	if (nbad != 0)
+		return "corrupted BGZF block";
+	*nbyte = out_size;
+	return NULL;
+}
+
+static const char *read_gzip_stream(GZIPreader *reader,
+		char **buf, long long int *buf_size, long long int *nbyte,
+		long long int target)
+{
+	z_stream *zs;
+	const unsigned char *in;
+	long long int in_left;
+	unsigned int avail_in, avail_out;
+	int ret;
+
+	zs = &(reader->zs);
+	in = reader->in + reader->in_offset;
+	in_left = reader->in_size - reader->in_offset;
+	if (!reader->zs_initialized) {
+		/* What follows the last BGZF block is not a gzip member */
+		if (in_left < 2 || in[0] != 0x1f || in[1] != 0x8b) {
+			reader->eof = 1;
+			return NULL;
+		}
+		memset(zs, 0, sizeof(z_stream));
+		if (inflateInit2(zs, 15 + 16) != Z_OK)
+			return "cannot initialize the gzip decompressor";
+		reader->zs_initialized = 1;
+	}
+	while (*nbyte < target) {
+		if (!reserve_buf(buf, buf_size, *nbyte + 65536))
+			return "cannot allocate memory "
+			       "for the decompressed data";
+		avail_in = in_left > UINT_MAX ? UINT_MAX : (unsigned int) in_left;
+		avail_out = *buf_size - *nbyte > UINT_MAX ?
+			UINT_MAX : (unsigned int) (*buf_size - *nbyte);
+		zs->next_in = (unsigned char *) in;
+		zs->avail_in = avail_in;
+		zs->next_out = (unsigned char *) *buf + *nbyte;
+		zs->avail_out = avail_out;
+		ret = inflate(zs, Z_NO_FLUSH);
+		in += avail_in - zs->avail_in;
+		in_left -= avail_in - zs->avail_in;
+		reader->in_offset = reader->in_size - in_left;
+		*nbyte += avail_out - zs->avail_out;
+		if (ret == Z_STREAM_END) {
+			/* Next gzip member, if any */
+			if (in_left < 2 || in[0] != 0x1f || in[1] != 0x8b) {
+				reader->eof = 1;
+				break;
+			}
+			inflateReset(zs);
+			continue;
+		}
+		/* No progress possible: the input is truncated */
+		if (ret == Z_BUF_ERROR && zs->avail_out != 0)
+			return "unexpected end of gzip stream";
+		if (ret != Z_OK && ret != Z_BUF_ERROR)
+			return "corrupted gzip stream";
+	}
+	return NULL;
+}
+
+/*
+ * Appends at least 'min_nbyte' decompressed bytes (less if the end of the
+ * input is reached) to the '*nbyte' bytes already in '*buf'. '*buf' is a
+ * buffer of '*buf_size' bytes allocated with malloc() (or NULL) that is
+ * reallocated if needed. It must be freed with free().
+ * Returns NULL or an error message.
+ */
+const char *_GZIPreader_read(GZIPreader *reader,
+		char **buf, long long int *buf_size, long long int *nbyte,
+		long long int min_nbyte)
+{
+	long long int target;
+	const char *errmsg;
+
+	target = *nbyte + min_nbyte;
+	if (!reader->in_stream && !reader->eof) {
+		errmsg = read_BGZF_blocks(reader, buf, buf_size, nbyte,
+					  target);
+		if (errmsg != NULL)
+			return errmsg;
+		if (!reader->in_stream
+		 && reader->in_offset == reader->in_size)
+			reader->eof = 1;
+	}
+	if (reader->in_stream && !reader->eof && *nbyte < target)
+		return read_gzip_stream(reader, buf, buf_size, nbyte, target);
+	return NULL;
+}
+
+
+/****************************************************************************
+ * Writing BGZF files.
+ *
+ * The data is accumulated in a buffer of 'nthreads' * BGZF_NBLOCK_PER_THREAD
+ * blocks. When the buffer is full, its blocks are deflated in parallel and
+ * written to the file in order.
+ */
+
+struct bgzf_writer {
+	FILE *stream;
+	int level, nthreads;
+	char *inbuf;
+	long int inbuf_nelt, inbuf_size;
+	unsigned char *outbuf;  /* 1 compressed block per input block */
+	int *outblock_size;
+};
+
+BGZFwriter *_new_BGZFwriter(const char *path, int append, int level,
+		int nthreads)
+{
+	BGZFwriter *bgzf;
+	int nblock;
+
+	bgzf = malloc(sizeof(BGZFwriter));
+	if (bgzf == NULL)
+		return NULL;
+	nblock = nthreads * BGZF_NBLOCK_PER_THREAD;
+	bgzf->level = level;
+	bgzf->nthreads = nthreads;
+	bgzf->inbuf_nelt = 0;
+	bgzf->inbuf_size = (long int) nblock * BGZF_BLOCK_DATA_SIZE;
+	bgzf->inbuf = malloc(bgzf->inbuf_size);
+	bgzf->outbuf = malloc((size_t) nblock * BGZF_MAX_BLOCK_SIZE);
+	bgzf->outblock_size = malloc(nblock * sizeof(int));
+	bgzf->stream = NULL;
+	if (bgzf->inbuf != NULL && bgzf->outbuf != NULL
+	 && bgzf->outblock_size != NULL)
+		bgzf->stream = fopen(path, append ? "ab" : "wb");
+	if (bgzf->stream == NULL) {
+		_free_BGZFwriter(bgzf);
+		return NULL;
+	}
+	return bgzf;
+}
+
+/* Called by the worker threads. Returns the size of the compressed block
+   or 0 if an error occured. */
+static int deflate_BGZF_block(const char *data, int data_size,
+		unsigned char *out, int level)
+{
+	z_stream zs;
+	int ret, block_size;
+
+	memset(&zs, 0, sizeof(z_stream));
+	if (deflateInit2(&zs, level, Z_DEFLATED, -15, 8,
+			 Z_DEFAULT_STRATEGY) != Z_OK)
+		return 0;
+	zs.next_in = (unsigned char *) data;
+	zs.avail_in = data_size;
+	zs.next_out = out + BGZF_HEADER_SIZE;
+	zs.avail_out = BGZF_MAX_BLOCK_SIZE - BGZF_HEADER_SIZE -
+		       BGZF_FOOTER_SIZE;
+	ret = deflate(&zs, Z_FINISH);
+	deflateEnd(&zs);
+	if (ret != Z_STREAM_END)
+		return 0;
+	block_size = BGZF_HEADER_SIZE + zs.total_out + BGZF_FOOTER_SIZE;
+	memcpy(out, BGZF_EOF_block, BGZF_HEADER_SIZE);
+	set_le16(out + 16, block_size - 1);
+	set_le32(out + block_size - 8,
+		 crc32(0L, (const unsigned char *) data, data_size));
+	set_le32(out + block_size - 4, data_size);
+	return block_size;
+}
+
+static const char *flush_BGZFwriter(BGZFwriter *bgzf)
+{
+	int nblock, i, nbad, data_size;
+
+	nblock = (bgzf->inbuf_nelt + BGZF_BLOCK_DATA_SIZE - 1) /
+		 BGZF_BLOCK_DATA_SIZE;
+	nbad = 0;
+#ifdef _OPENMP
+	#pragma omp parallel for num_threads(bgzf->nthreads) \
+		schedule(dynamic, 1) private(data_size) reduction(+:nbad)
+#endif
+	for (i = 0; i < nblock; i++) {
+		data_size = BGZF_BLOCK_DATA_SIZE;
+		if (i == nblock - 1)
+			data_size = bgzf->inbuf_nelt -
+				    (long int) i * BGZF_BLOCK_DATA_SIZE;
+		bgzf->outblock_size[i] = deflate_BGZF_block(
+				bgzf->inbuf + (long int) i * BGZF_BLOCK_DATA_SIZE,
+				data_size,
+				bgzf->outbuf + (long int) i * BGZF_MAX_BLOCK_SIZE,
+				bgzf->level);
+		if (bgzf->outblock_size[i] == 0)
+			nbad++;
+	}
+	if (nbad != 0)
+		return "BGZF compression failed";
+	for (i = 0; i < nblock; i++) {
+		if (fwrite(bgzf->outbuf + (long int) i * BGZF_MAX_BLOCK_SIZE,
+			   1, bgzf->outblock_size[i], bgzf->stream)
+		    != bgzf->outblock_size[i])
+			return "write error";
+	}
+	bgzf->inbuf_nelt = 0;
+	return NULL;
+}
+
+/* Returns NULL or an error message. */
+const char *_BGZFwriter_write(BGZFwriter *bgzf, const char *data,
+		long int nbyte)
+{
+	long int n;
+	const char *errmsg;
+
+	while (nbyte > 0) {
+		n = bgzf->inbuf_size - bgzf->inbuf_nelt;
+		if (n > nbyte)
+			n = nbyte;
+		memcpy(bgzf->inbuf + bgzf->inbuf_nelt, data, n);
+		bgzf->inbuf_nelt += n;
+		data += n;
+		nbyte -= n;
+		if (bgzf->inbuf_nelt == bgzf->inbuf_size) {
+			errmsg = flush_BGZFwriter(bgzf);
+			if (errmsg != NULL)
+				return errmsg;
+		}
+	}
+	return NULL;
+}
+
+/* Writes the remaining data and the EOF marker block. The writer must
+   still be freed with _free_BGZFwriter(). */
+const char *_finish_BGZFwriter(BGZFwriter *bgzf)
+{
+	const char *errmsg;
+
+	if (bgzf->inbuf_nelt != 0) {
+		errmsg = flush_BGZFwriter(bgzf);
+		if (errmsg != NULL)
+			return errmsg;
+	}
+	if (fwrite(BGZF_EOF_block, 1, sizeof(BGZF_EOF_block), bgzf->stream)
+	    != sizeof(BGZF_EOF_block)
+	 || fflush(bgzf->stream) != 0)
+		return "write error";
+	return NULL;
+}
+
+void _free_BGZFwriter(BGZFwriter *bgzf)
+{
+	if (bgzf->stream != NULL)
+		fclose(bgzf->stream);
+	free(bgzf->inbuf);
+	free(bgzf->outbuf);
+	free(bgzf->outblock_size);
+	free(bgzf);
+	return;
+}
@@ -7,6 +7,13 @@
 		NAME ## _symbol = install(# NAME); \
 }
 
+/* Hint that the memory at 'addr' is going to be read soon */
+#ifdef __GNUC__
+#define PREFETCH_READ(addr) __builtin_prefetch((addr), 0, 1)
+#else
+#define PREFETCH_READ(addr)
+#endif
+
 
 /* utils.c */
 
@@ -176,6 +183,48 @@ SEXP XString_xscat(SEXP args);
 SEXP XStringSet_xscat(SEXP args);
 
 
+/* BGZF_io.c */
+
+typedef struct gzip_reader GZIPreader;
+
+GZIPreader *_new_GZIPreader(
+	const char *in,
+	long long int in_size,
+	int nthreads
+);
+
+int _GZIPreader_eof(const GZIPreader *reader);
+
+void _free_GZIPreader(GZIPreader *reader);
+
+const char *_GZIPreader_read(
+	GZIPreader *reader,
+	char **buf,
+	long long int *buf_size,
+	long long int *nbyte,
+	long long int min_nbyte
+);
+
+typedef struct bgzf_writer BGZFwriter;
+
+BGZFwriter *_new_BGZFwriter(
+	const char *path,
+	int append,
+	int level,
+	int nthreads
+);
+
+const char *_BGZFwriter_write(
+	BGZFwriter *bgzf,
+	const char *data,
+	long int nbyte
+);
+
+const char *_finish_BGZFwriter(BGZFwriter *bgzf);
+
+void _free_BGZFwriter(BGZFwriter *bgzf);
+
+
 /* XStringSet_io.c */
 
 SEXP fasta_index(
@@ -202,6 +251,19 @@ SEXP write_XStringSet_to_fasta(
 	SEXP lkup
 );
 
+SEXP fasta_faidx(SEXP filexp_list);
+
+SEXP read_XStringSet_from_faidx(
+	SEXP filepath,
+	SEXP offset,
+	SEXP linebases,
+	SEXP linewidth,
+	SEXP start,
+	SEXP width,
+	SEXP elementType,
+	SEXP lkup
+);
+
 SEXP fastq_geometry(
 	SEXP filexp_list,
 	SEXP nrec,
@@ -216,7 +278,20 @@ SEXP read_XStringSet_from_fastq(
 	SEXP seek_first_rec,
 	SEXP use_names,
 	SEXP elementType,
-	SEXP lkup
+	SEXP lkup,
+	SEXP with_qualities
+);
+
+SEXP read_XStringSet_from_fastq_chunks(
+	SEXP filepath,
+	SEXP nrec,
+	SEXP skip,
+	SEXP seek_first_rec,
+	SEXP use_names,
+	SEXP elementType,
+	SEXP lkup,
+	SEXP with_qualities,
+	SEXP nthreads
 );
 
 SEXP write_XStringSet_to_fastq(
@@ -226,6 +301,41 @@ SEXP write_XStringSet_to_fastq(
 	SEXP lkup
 );
 
+SEXP write_XStringSet_to_bgzf(
+	SEXP x,
+	SEXP filepath,
+	SEXP append,
+	SEXP format,
+	SEXP width,
+	SEXP qualities,
+	SEXP lkup,
+	SEXP compression_level,
+	SEXP nthreads
+);
+
+SEXP new_FASTX_stream(void);
+
+SEXP read_XStringSet_chunk_from_fasta(
+	SEXP filexp_list,
+	SEXP state,
+	SEXP nrec,
+	SEXP seek_first_rec,
+	SEXP use_names,
+	SEXP elementType,
+	SEXP lkup
+);
+
+SEXP read_XStringSet_chunk_from_fastq(
+	SEXP filexp_list,
+	SEXP state,
+	SEXP nrec,
+	SEXP seek_first_rec,
+	SEXP use_names,
+	SEXP elementType,
+	SEXP lkup,
+	SEXP with_qualities
+);
+
 
 /* letter_frequency.c */
 
@@ -278,7 +388,8 @@ SEXP XStringSet_oligo_frequency(
 	SEXP fast_moving_side,
 	SEXP with_labels,
 	SEXP simplify_as,
-	SEXP base_codes
+	SEXP base_codes,
+	SEXP nthreads
 );
 
 SEXP XStringSet_nucleotide_frequency_at(
@@ -326,6 +437,19 @@ SEXP XStringSet_two_way_letter_frequency_by_quality(
         SEXP with_other
 );
 
+
+/* sparse_oligo_frequency.c */
+
+SEXP XStringSet_sparse_oligo_frequency(
+	SEXP x,
+	SEXP width,
+	SEXP step,
+	SEXP canonical,
+	SEXP collapse,
+	SEXP base_codes
+);
+
+
 /* gtestsim.c */
 
 void gtestsim(
@@ -351,7 +475,27 @@ SEXP DNAStringSet_translate(
 	SEXP dna_codes,
 	SEXP lkup,
 	SEXP if_non_ambig,
-	SEXP if_ambig
+	SEXP if_ambig,
+	SEXP nthreads
+);
+
+SEXP DNAStringSet_translate_six_frames(
+	SEXP x,
+	SEXP skip_code,
+	SEXP dna_codes,
+	SEXP lkup,
+	SEXP if_non_ambig,
+	SEXP if_ambig,
+	SEXP nthreads
+);
+
+SEXP DNAStringSet_find_ORFs(
+	SEXP x,
+	SEXP base_codes,
+	SEXP codon_types,
+	SEXP min_width,
+	SEXP both_strands,
+	SEXP nthreads
 );
 
 /* replaceAt.c */
@@ -588,7 +732,24 @@ SEXP XStringSet_vmatch_pattern_at(
 	SEXP auto_reduce_pattern
 );
 
-SEXP XStringSet_dist_hamming(SEXP x);
+SEXP XStringSet_dist_hamming(
+	SEXP x,
+	SEXP max_dist,
+	SEXP nthreads
+);
+
+SEXP XStringSet_hamming_pairs(
+	SEXP x,
+	SEXP max_dist,
+	SEXP nthreads
+);
+
+SEXP XStringSet_dist_levenshtein(
+	SEXP x,
+	SEXP ignore_case,
+	SEXP max_dist,
+	SEXP nthreads
+);
 
 
 /* match_pattern_boyermoore.c */
@@ -712,6 +873,14 @@ SEXP XStringViews_match_PWM(
 	SEXP base_codes
 );
 
+SEXP XStringSet_match_PWMList(
+	SEXP pwms,
+	SEXP min_scores,
+	SEXP subject,
+	SEXP base_codes,
+	SEXP nthreads
+);
+
 
 /* find_palindromes.c */
 
@@ -817,6 +986,14 @@ SEXP _get_PreprocessedTB_low2high(SEXP x);
 
 SEXP _get_Twobit_sign2pos_tag(SEXP x);
 
+SEXP _get_TwobitHash_keys_tag(SEXP x);
+
+SEXP _get_TwobitHash_pos_tag(SEXP x);
+
+SEXP _get_ACtree2DFA_transitions_tag(SEXP x);
+
+SEXP _get_ACtree2DFA_leaf_P_ids_tag(SEXP x);
+
 SEXP _get_ACtree2_nodebuf_ptr(SEXP x);
 
 SEXP _get_ACtree2_nodeextbuf_ptr(SEXP x);
@@ -848,6 +1025,23 @@ void _TBMatchBuf_report_match(
 
 void _TBMatchBuf_flush(TBMatchBuf *buf);
 
+TBLaneMatchBuf _new_TBLaneMatchBuf();
+
+void _TBLaneMatchBuf_report_match(
+	TBLaneMatchBuf *buf,
+	int lane,
+	int PSpair_id,
+	int end
+);
+
+void _TBLaneMatchBuf_move_lane_to_TBMatchBuf(
+	TBLaneMatchBuf *buf,
+	int lane,
+	TBMatchBuf *tb_matches
+);
+
+void _free_TBLaneMatchBuf(TBLaneMatchBuf *buf);
+
 MatchPDictBuf _new_MatchPDictBuf(
 	SEXP matches_as,
 	int tb_length,
@@ -912,6 +1106,12 @@ SEXP build_Twobit(
 	SEXP base_codes
 );
 
+SEXP build_TwobitHash(
+	SEXP tb,
+	SEXP pp_exclude,
+	SEXP base_codes
+);
+
 void _match_Twobit(
 	SEXP pptb,
 	const Chars_holder *S,
@@ -919,6 +1119,29 @@ void _match_Twobit(
 	TBMatchBuf *tb_matches
 );
 
+void _match_TwobitHash(
+	SEXP pptb,
+	const Chars_holder *S,
+	int fixedS,
+	TBMatchBuf *tb_matches
+);
+
+void _match_Twobit_lane_groups(
+	SEXP pptb,
+	const Chars_holder *S,
+	int S_length,
+	TBLaneMatchBuf *lane_matches,
+	int nthreads
+);
+
+void _match_TwobitHash_lane_groups(
+	SEXP pptb,
+	const Chars_holder *S,
+	int S_length,
+	TBLaneMatchBuf *lane_matches,
+	int nthreads
+);
+
 
 /* BAB_class.c */
 
@@ -930,6 +1153,21 @@ int *_get_BAB_lastblock_nelt_ptr(SEXP x);
 
 SEXP _get_BAB_blocks(SEXP x);
 
+SEXP _IntegerBAB_new_mapped(
+	SEXP region,
+	int *blocks,
+	int nblock,
+	int lastblock_nelt,
+	int block_length
+);
+
+int _BAB_is_mapped(SEXP x);
+
+int *_get_BAB_block(
+	SEXP x,
+	int b
+);
+
 SEXP _IntegerBAB_addblock(
 	SEXP x,
 	int block_length
@@ -958,7 +1196,11 @@ SEXP ACtree2_build(
 
 SEXP ACtree2_has_all_flinks(SEXP pptb);
 
-SEXP ACtree2_compute_all_flinks(SEXP pptb);
+SEXP ACtree2_compute_all_flinks(
+	SEXP pptb,
+	SEXP nthreads,
+	SEXP freeze
+);
 
 void _match_tbACtree2(
 	SEXP pptb,
@@ -967,6 +1209,14 @@ void _match_tbACtree2(
 	TBMatchBuf *tb_matches
 );
 
+void _match_tbACtree2_lane_groups(
+	SEXP pptb,
+	const Chars_holder *S,
+	int S_length,
+	TBLaneMatchBuf *lane_matches,
+	int nthreads
+);
+
 void _match_pdictACtree2(
 	SEXP pptb,
 	HeadTail *headtail,
@@ -978,6 +1228,31 @@ void _match_pdictACtree2(
 	MatchPDictBuf *matchpdict_buf
 );
 
+SEXP ACtree2_freeze(SEXP pptb);
+
+void _match_ACtree2DFA(
+	SEXP pptb,
+	const Chars_holder *S,
+	int fixedS,
+	TBMatchBuf *tb_matches
+);
+
+void _match_ACtree2DFA_lane_groups(
+	SEXP pptb,
+	const Chars_holder *S,
+	int S_length,
+	TBLaneMatchBuf *lane_matches,
+	int nthreads
+);
+
+SEXP ACtree2_write_file(
+	SEXP pptbs,
+	SEXP bytes,
+	SEXP filepath
+);
+
+SEXP ACtree2_map_file(SEXP filepath);
+
 
 /* match_pdict.c */
 
@@ -1044,7 +1319,8 @@ SEXP vmatch_PDict3Parts_XStringSet(
 	SEXP collapse,
 	SEXP weight,
 	SEXP matches_as,
-	SEXP envir
+	SEXP envir,
+	SEXP nthreads
 );
 
 SEXP vmatch_XStringSet_XStringSet(
@@ -1131,7 +1407,8 @@ SEXP XStringSet_align_pairwiseAlignment(
 	SEXP substitutionLookupTable,
 	SEXP fuzzyMatrix,
 	SEXP fuzzyMatrixDim,
-	SEXP fuzzyLookupTable
+	SEXP fuzzyLookupTable,
+	SEXP bandWidth
 );
 
 SEXP XStringSet_align_distance(
@@ -1146,7 +1423,10 @@ SEXP XStringSet_align_distance(
 	SEXP substitutionLookupTable,
 	SEXP fuzzyMatrix,
 	SEXP fuzzyMatrixDim,
-	SEXP fuzzyLookupTable
+	SEXP fuzzyLookupTable,
+	SEXP bandWidth,
+	SEXP minScore,
+	SEXP nthreads
 );
 
 
@@ -81,6 +81,58 @@ SEXP _get_Twobit_sign2pos_tag(SEXP x)
 }
 
 
+/****************************************************************************
+ * C-level slot getters for TwobitHash objects.
+ *
+ * Be careful that these functions do NOT duplicate the returned slot.
+ * Thus they cannot be made .Call() entry points!
+ */
+
+static SEXP
+	keys_symbol = NULL,
+	pos_symbol = NULL;
+
+/* Not strict "slot getters" but very much like. */
+
+SEXP _get_TwobitHash_keys_tag(SEXP x)
+{
+	INIT_STATIC_SYMBOL(keys)
+	return get_XVector_tag(GET_SLOT(x, keys_symbol));
+}
+
+SEXP _get_TwobitHash_pos_tag(SEXP x)
+{
+	INIT_STATIC_SYMBOL(pos)
+	return get_XVector_tag(GET_SLOT(x, pos_symbol));
+}
+
+
+/****************************************************************************
+ * C-level slot getters for ACtree2DFA objects.
+ *
+ * Be careful that these functions do NOT duplicate the returned slot.
+ * Thus they cannot be made .Call() entry points!
+ */
+
+static SEXP
+	transitions_symbol = NULL,
+	leaf_P_ids_symbol = NULL;
+
+/* Not strict "slot getters" but very much like. */
+
+SEXP _get_ACtree2DFA_transitions_tag(SEXP x)
+{
+	INIT_STATIC_SYMBOL(transitions)
+	return get_XVector_tag(GET_SLOT(x, transitions_symbol));
+}
+
+SEXP _get_ACtree2DFA_leaf_P_ids_tag(SEXP x)
+{
+	INIT_STATIC_SYMBOL(leaf_P_ids)
+	return get_XVector_tag(GET_SLOT(x, leaf_P_ids_symbol));
+}
+
+
 /****************************************************************************
  * C-level slot getters for ACtree2 objects.
  *
@@ -45,9 +45,16 @@ static const R_CallMethodDef callMethods[] = {
 	CALLMETHOD_DEF(fasta_index, 5),
 	CALLMETHOD_DEF(read_XStringSet_from_fasta_blocks, 6),
 	CALLMETHOD_DEF(write_XStringSet_to_fasta, 4),
+	CALLMETHOD_DEF(fasta_faidx, 1),
+	CALLMETHOD_DEF(read_XStringSet_from_faidx, 8),
 	CALLMETHOD_DEF(fastq_geometry, 4),
-	CALLMETHOD_DEF(read_XStringSet_from_fastq, 7),
+	CALLMETHOD_DEF(read_XStringSet_from_fastq, 8),
+	CALLMETHOD_DEF(read_XStringSet_from_fastq_chunks, 9),
 	CALLMETHOD_DEF(write_XStringSet_to_fastq, 4),
+	CALLMETHOD_DEF(write_XStringSet_to_bgzf, 9),
+	CALLMETHOD_DEF(new_FASTX_stream, 0),
+	CALLMETHOD_DEF(read_XStringSet_chunk_from_fasta, 7),
+	CALLMETHOD_DEF(read_XStringSet_chunk_from_fastq, 8),
 
 /* letter_frequency.c */
 	CALLMETHOD_DEF(XString_letter_frequency, 3),
@@ -55,15 +62,20 @@ static const R_CallMethodDef callMethods[] = {
 	CALLMETHOD_DEF(XString_letterFrequencyInSlidingView, 5),
 	CALLMETHOD_DEF(XStringSet_letterFrequency, 5),
 	CALLMETHOD_DEF(XString_oligo_frequency, 8),
-	CALLMETHOD_DEF(XStringSet_oligo_frequency, 9),
+	CALLMETHOD_DEF(XStringSet_oligo_frequency, 10),
 	CALLMETHOD_DEF(XStringSet_nucleotide_frequency_at, 7),
 	CALLMETHOD_DEF(XStringSet_consensus_matrix, 5),
 	CALLMETHOD_DEF(XString_two_way_letter_frequency, 5),
 	CALLMETHOD_DEF(XStringSet_two_way_letter_frequency, 6),
 	CALLMETHOD_DEF(XStringSet_two_way_letter_frequency_by_quality, 7),
 
+/* sparse_oligo_frequency.c */
+	CALLMETHOD_DEF(XStringSet_sparse_oligo_frequency, 6),
+
 /* translate.c */
-	CALLMETHOD_DEF(DNAStringSet_translate, 6),
+	CALLMETHOD_DEF(DNAStringSet_translate, 7),
+	CALLMETHOD_DEF(DNAStringSet_translate_six_frames, 7),
+	CALLMETHOD_DEF(DNAStringSet_find_ORFs, 6),
 
 /* replaceAt.c */
 	CALLMETHOD_DEF(XString_replaceAt, 3),
@@ -87,7 +99,9 @@ static const R_CallMethodDef callMethods[] = {
 /* lowlevel_matching.c */
 	CALLMETHOD_DEF(XString_match_pattern_at, 10),
 	CALLMETHOD_DEF(XStringSet_vmatch_pattern_at, 10),
-	CALLMETHOD_DEF(XStringSet_dist_hamming, 1),
+	CALLMETHOD_DEF(XStringSet_dist_hamming, 3),
+	CALLMETHOD_DEF(XStringSet_hamming_pairs, 3),
+	CALLMETHOD_DEF(XStringSet_dist_levenshtein, 4),
 
 /* match_pattern_shiftor.c */
 	CALLMETHOD_DEF(bits_per_long, 0),
@@ -101,6 +115,7 @@ static const R_CallMethodDef callMethods[] = {
 	CALLMETHOD_DEF(PWM_score_starting_at, 4),
 	CALLMETHOD_DEF(XString_match_PWM, 5),
 	CALLMETHOD_DEF(XStringViews_match_PWM, 7),
+	CALLMETHOD_DEF(XStringSet_match_PWMList, 5),
 
 /* find_palindromes.c */
 	CALLMETHOD_DEF(find_palindromes, 5),
@@ -108,6 +123,7 @@ static const R_CallMethodDef callMethods[] = {
 
 /* match_pdict_Twobit.c */
 	CALLMETHOD_DEF(build_Twobit, 3),
+	CALLMETHOD_DEF(build_TwobitHash, 3),
 
 /* BAB_class.c */
 	CALLMETHOD_DEF(IntegerBAB_new, 1),
@@ -120,14 +136,17 @@ static const R_CallMethodDef callMethods[] = {
 	CALLMETHOD_DEF(ACtree2_summary, 1),
 	CALLMETHOD_DEF(ACtree2_build, 5),
 	CALLMETHOD_DEF(ACtree2_has_all_flinks, 1),
-	CALLMETHOD_DEF(ACtree2_compute_all_flinks, 1),
+	CALLMETHOD_DEF(ACtree2_compute_all_flinks, 3),
+	CALLMETHOD_DEF(ACtree2_freeze, 1),
+	CALLMETHOD_DEF(ACtree2_write_file, 3),
+	CALLMETHOD_DEF(ACtree2_map_file, 1),
 
 /* match_pdict.c */
 	CALLMETHOD_DEF(match_PDict3Parts_XString, 9),
 	CALLMETHOD_DEF(match_XStringSet_XString, 9),
 	CALLMETHOD_DEF(match_PDict3Parts_XStringViews, 11),
 	CALLMETHOD_DEF(match_XStringSet_XStringViews, 11),
-	CALLMETHOD_DEF(vmatch_PDict3Parts_XStringSet, 11),
+	CALLMETHOD_DEF(vmatch_PDict3Parts_XStringSet, 12),
 	CALLMETHOD_DEF(vmatch_XStringSet_XStringSet, 11),
 
 /* align_utils.c */
@@ -142,8 +161,8 @@ static const R_CallMethodDef callMethods[] = {
 	CALLMETHOD_DEF(lcsuffix, 6),
 
 /* align_pairwiseAlignment.c */
-	CALLMETHOD_DEF(XStringSet_align_pairwiseAlignment, 14),
-	CALLMETHOD_DEF(XStringSet_align_distance, 12),
+	CALLMETHOD_DEF(XStringSet_align_pairwiseAlignment, 15),
+	CALLMETHOD_DEF(XStringSet_align_distance, 15),
 
 /* align_needwunsQS.c */
 	CALLMETHOD_DEF(align_needwunsQS, 7),
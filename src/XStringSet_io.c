@@ -8,6 +8,17 @@
 #include "S4Vectors_interface.h"
 
 #include <math.h>  /* for llround */
+#include <ctype.h>  /* for isspace */
+#include <limits.h>  /* for INT_MAX */
+#ifndef _WIN32
+#include <fcntl.h>  /* for open */
+#include <unistd.h>  /* for close */
+#include <sys/stat.h>  /* for fstat */
+#include <sys/mman.h>  /* for mmap, munmap, madvise */
+#endif
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 
 #define IOBUF_SIZE 20002
@@ -26,6 +37,249 @@ static int has_prefix(const char *s, const char *prefix)
 	return 1;
 }
 
+/*
+ * Memory-mapped input files. On Windows, get_MappedFile_bytes() falls back
+ * to reading the requested bytes with fread() so only small regions should
+ * be requested at once.
+ */
+
+typedef struct mapped_file {
+	long long int size;
+#ifdef _WIN32
+	FILE *stream;
+	char *buf;
+	int buf_size;
+#else
+	int fd;
+	const char *bytes;
+#endif
+} MappedFile;
+
+static const char *open_MappedFile(MappedFile *mf,
+		const char *path, int random_access)
+{
+#ifdef _WIN32
+	mf->stream = fopen(path, "rb");
+	if (mf->stream == NULL)
+		return "cannot open file";
+	if (fseeko64(mf->stream, 0, SEEK_END) != 0) {
+		fclose(mf->stream);
+		return "cannot seek file";
+	}
+	mf->size = ftello64(mf->stream);
+	mf->buf = NULL;
+	mf->buf_size = 0;
+#else
+	struct stat file_stat;
+	void *bytes;
+
+	mf->fd = open(path, O_RDONLY);
+	if (mf->fd == -1)
+		return "cannot open file";
+	if (fstat(mf->fd, &file_stat) != 0) {
+		close(mf->fd);
+		return "cannot stat file";
+	}
+	mf->size = (long long int) file_stat.st_size;
+	mf->bytes = NULL;
+	if (mf->size == 0)
+		return NULL;
+	bytes = mmap(NULL, (size_t) mf->size, PROT_READ, MAP_SHARED, mf->fd, 0);
+	if (bytes == MAP_FAILED) {
+		close(mf->fd);
+		return "cannot map file into memory";
+	}
+	mf->bytes = bytes;
+#ifdef MADV_RANDOM
+	madvise(bytes, (size_t) mf->size,
+		random_access ? MADV_RANDOM : MADV_SEQUENTIAL);
+#endif
+#endif
+	return NULL;
+}
+
+static void close_MappedFile(MappedFile *mf)
+{
+#ifdef _WIN32
+	fclose(mf->stream);
+#else
+	if (mf->bytes != NULL)
+		munmap((void *) mf->bytes, (size_t) mf->size);
+	close(mf->fd);
+#endif
+	return;
+}
+
+/* Returns NULL if the requested bytes are beyond the end of the file. */
+static const char *get_MappedFile_bytes(MappedFile *mf,
+		long long int offset, int nbyte)
+{
+	if (offset < 0 || offset + nbyte > mf->size)
+		return NULL;
+#ifdef _WIN32
+	if (nbyte > mf->buf_size) {
+		mf->buf = R_alloc(nbyte, sizeof(char));
+		mf->buf_size = nbyte;
+	}
+	if (fseeko64(mf->stream, offset, SEEK_SET) != 0
+	 || fread(mf->buf, sizeof(char), nbyte, mf->stream) != nbyte)
+		return NULL;
+	return mf->buf;
+#else
+	return mf->bytes + offset;
+#endif
+}
+
+
+/*
+ * The writers send their output either to a file external pointer or to a
+ * BGZF writer, thru a large buffer so that whole records are formatted in
+ * memory and written with a few big writes.
+ */
+
+#define SINK_BUF_SIZE 4194304
+
+typedef struct output_sink {
+	SEXP filexp;
+	BGZFwriter *bgzf;
+	char *buf;  /* SINK_BUF_SIZE + 1 bytes for the trailing nul */
+	int nelt;
+} OutputSink;
+
+static void init_OutputSink(OutputSink *sink, SEXP filexp, BGZFwriter *bgzf)
+{
+	sink->filexp = filexp;
+	sink->bgzf = bgzf;
+	sink->buf = R_alloc(SINK_BUF_SIZE + 1, sizeof(char));
+	sink->nelt = 0;
+	return;
+}
+
+static void flush_OutputSink(OutputSink *sink)
+{
+	const char *errmsg;
+
+	if (sink->nelt == 0)
+		return;
+	if (sink->bgzf == NULL) {
+		/* filexp_puts() expects a nul-terminated string */
+		sink->buf[sink->nelt] = '\0';
+		filexp_puts(sink->filexp, sink->buf);
+	} else {
+		errmsg = _BGZFwriter_write(sink->bgzf, sink->buf, sink->nelt);
+		if (errmsg != NULL)
+			error("%s", errmsg);
+	}
+	sink->nelt = 0;
+	return;
+}
+
+/* Returns a pointer to at most 'n' free bytes of the buffer and sets 'n'
+   to the actual number of bytes available (always > 0). */
+static char *get_OutputSink_space(OutputSink *sink, int *n)
+{
+	if (sink->nelt == SINK_BUF_SIZE)
+		flush_OutputSink(sink);
+	if (*n > SINK_BUF_SIZE - sink->nelt)
+		*n = SINK_BUF_SIZE - sink->nelt;
+	return sink->buf + sink->nelt;
+}
+
+static void sink_write(OutputSink *sink, const char *s, int n)
+{
+	int n2;
+	char *dest;
+
+	while (n > 0) {
+		n2 = n;
+		dest = get_OutputSink_space(sink, &n2);
+		memcpy(dest, s, n2);
+		sink->nelt += n2;
+		s += n2;
+		n -= n2;
+	}
+	return;
+}
+
+static void sink_puts(OutputSink *sink, const char *s)
+{
+	sink_write(sink, s, strlen(s));
+	return;
+}
+
+/* Decodes the bytes with 'lkup' directly into the buffer. */
+static void sink_write_with_lkup(OutputSink *sink, const char *s, int n,
+		const int *lkup, int lkup_length)
+{
+	int n2;
+	char *dest;
+
+	while (n > 0) {
+		n2 = n;
+		dest = get_OutputSink_space(sink, &n2);
+		Ocopy_bytes_from_i1i2_with_lkup(0, n2 - 1, dest, n2,
+						s, n2, lkup, lkup_length);
+		sink->nelt += n2;
+		s += n2;
+		n -= n2;
+	}
+	return;
+}
+
+static void sink_fill(OutputSink *sink, char c, int n)
+{
+	int n2;
+	char *dest;
+
+	while (n > 0) {
+		n2 = n;
+		dest = get_OutputSink_space(sink, &n2);
+		memset(dest, c, n2);
+		sink->nelt += n2;
+		n -= n2;
+	}
+	return;
+}
+
+
+/*
+ * The FASTA and FASTQ parsers stop when they reach the first line of the
+ * record that follows the last record to load. In streaming mode, this line
+ * is kept in a PendingLine struct and is the first line seen by the parser
+ * at the next call.
+ */
+
+typedef struct pending_line {
+	int has_line;
+	int lineno;
+	char buf[IOBUF_SIZE];
+} PendingLine;
+
+static int get_next_line(SEXP filexp, PendingLine *pending,
+		char *buf, int *EOL_in_buf)
+{
+	if (pending != NULL && pending->has_line) {
+		/* The pending line is always complete and its trailing LF
+		   or CRLF was deleted */
+		strcpy(buf, pending->buf);
+		*EOL_in_buf = 1;
+		pending->has_line = 0;
+		return 1;
+	}
+	return filexp_gets(filexp, buf, IOBUF_SIZE, EOL_in_buf);
+}
+
+static void set_pending_line(PendingLine *pending, const char *buf,
+		int lineno)
+{
+	if (pending == NULL)
+		return;
+	strcpy(pending->buf, buf);
+	pending->lineno = lineno;
+	pending->has_line = 1;
+	return;
+}
+
 
 
 /****************************************************************************
@@ -239,7 +493,8 @@ static int translate(Chars_holder *seq_data, const int *lkup, int lkup_length)
 static const char *parse_FASTA_file(SEXP filexp,
 		int nrec, int skip, int seek_first_rec,
 		FASTAloader *loader,
-		int *recno, long long int *offset, long long int *ninvalid)
+		int *recno, long long int *offset, long long int *ninvalid,
+		PendingLine *pending)
 {
 	int lineno, EOL_in_buf, EOL_in_prev_buf, ret_code, nbyte_in,
 	    FASTA_desc_markup_length, load_rec, is_new_rec;
@@ -249,8 +504,9 @@ static const char *parse_FASTA_file(SEXP filexp,
 
 	FASTA_desc_markup_length = strlen(FASTA_desc_markup);
 	load_rec = -1;
-	for (lineno = EOL_in_prev_buf = 1;
-	     (ret_code = filexp_gets(filexp, buf, IOBUF_SIZE, &EOL_in_buf));
+	for (lineno = pending != NULL ? pending->lineno : 1,
+	     EOL_in_prev_buf = 1;
+	     (ret_code = get_next_line(filexp, pending, buf, &EOL_in_buf));
 	     lineno += EOL_in_prev_buf = EOL_in_buf)
 	{
 		if (ret_code == -1) {
@@ -299,8 +555,10 @@ static const char *parse_FASTA_file(SEXP filexp,
 				return errmsg_buf;
 			}
 			load_rec = *recno >= skip;
-			if (load_rec && nrec >= 0 && *recno >= skip + nrec)
+			if (load_rec && nrec >= 0 && *recno >= skip + nrec) {
+				set_pending_line(pending, buf, lineno);
 				return NULL;
+			}
 			load_rec = load_rec && loader != NULL;
 			if (load_rec && loader->load_desc_line != NULL) {
 				data.ptr += FASTA_desc_markup_length;
@@ -420,7 +678,8 @@ SEXP fasta_index(SEXP filexp_list,
 		filexp = VECTOR_ELT(filexp_list, i);
 		offset = ninvalid = 0LL;
 		errmsg = parse_FASTA_file(filexp, nrec0, skip0, seek_rec0,
-					  &loader, &recno, &offset, &ninvalid);
+					  &loader, &recno, &offset, &ninvalid,
+					  NULL);
 		if (errmsg != NULL)
 			error("reading FASTA file %s: %s",
 			      CHAR(STRING_ELT(GET_NAMES(filexp_list), i)),
@@ -502,7 +761,8 @@ SEXP read_XStringSet_from_fasta_blocks(SEXP seqlength,
 			recno = 0;
 			ninvalid = 0LL;
 			parse_FASTA_file(filexp, nrec_j, 0, 0,
-					 &loader, &recno, &offset_j, &ninvalid);
+					 &loader, &recno, &offset_j, &ninvalid,
+					 NULL);
 		}
 	}
 	UNPROTECT(1);
@@ -514,23 +774,19 @@ SEXP read_XStringSet_from_fasta_blocks(SEXP seqlength,
  * Writing FASTA files.
  */
 
-/* --- .Call ENTRY POINT --- */
-SEXP write_XStringSet_to_fasta(SEXP x, SEXP filexp_list, SEXP width, SEXP lkup)
+static void write_FASTA_recs(OutputSink *sink, SEXP x, SEXP width, SEXP lkup)
 {
 	XStringSet_holder X;
-	int x_length, width0, lkup_length, i, j1, j2, dest_nbytes;
+	int x_length, width0, lkup_length, i, j1, nbyte;
 	const int *lkup0;
-	SEXP filexp, x_names, desc;
+	SEXP x_names, desc;
 	Chars_holder X_elt;
-	char buf[IOBUF_SIZE];
 
 	X = _hold_XStringSet(x);
 	x_length = _get_length_from_XStringSet_holder(&X);
-	filexp = VECTOR_ELT(filexp_list, 0);
 	width0 = INTEGER(width)[0];
 	if (width0 >= IOBUF_SIZE)
 		error("'width' must be <= %d", IOBUF_SIZE - 1);
-	buf[width0] = 0;
 	if (lkup == R_NilValue) {
 		lkup0 = NULL;
 		lkup_length = 0;
@@ -540,33 +796,407 @@ SEXP write_XStringSet_to_fasta(SEXP x, SEXP filexp_list, SEXP width, SEXP lkup)
 	}
 	x_names = get_XVectorList_names(x);
 	for (i = 0; i < x_length; i++) {
-		filexp_puts(filexp, FASTA_desc_markup);
+		sink_puts(sink, FASTA_desc_markup);
 		if (x_names != R_NilValue) {
 			desc = STRING_ELT(x_names, i);
 			if (desc == NA_STRING)
 				error("'names(x)' contains NAs");
-			filexp_puts(filexp, CHAR(desc));
+			sink_write(sink, CHAR(desc), LENGTH(desc));
 		}
-		filexp_puts(filexp, "\n");
+		sink_write(sink, "\n", 1);
 		X_elt = _get_elt_from_XStringSet_holder(&X, i);
 		for (j1 = 0; j1 < X_elt.length; j1 += width0) {
-			j2 = j1 + width0;
-			if (j2 > X_elt.length)
-				j2 = X_elt.length;
-			dest_nbytes = j2 - j1;
-			j2--;
-			Ocopy_bytes_from_i1i2_with_lkup(j1, j2,
-				buf, dest_nbytes,
-				X_elt.ptr, X_elt.length,
-				lkup0, lkup_length);
-			buf[dest_nbytes] = 0;
-			filexp_puts(filexp, buf);
-			filexp_puts(filexp, "\n");
+			nbyte = X_elt.length - j1;
+			if (nbyte > width0)
+				nbyte = width0;
+			sink_write_with_lkup(sink, X_elt.ptr + j1, nbyte,
+					     lkup0, lkup_length);
+			sink_write(sink, "\n", 1);
 		}
 	}
+	return;
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP write_XStringSet_to_fasta(SEXP x, SEXP filexp_list, SEXP width, SEXP lkup)
+{
+	OutputSink sink;
+
+	init_OutputSink(&sink, VECTOR_ELT(filexp_list, 0), NULL);
+	write_FASTA_recs(&sink, x, width, lkup);
+	flush_OutputSink(&sink);
 	return R_NilValue;
 }
 
+/****************************************************************************
+ * Random access to indexed FASTA files.
+ *
+ * The index is compatible with the .fai files produced by 'samtools faidx'
+ * i.e. it has 1 row per record and 5 columns: the name of the record (first
+ * word of the description line), the length of its sequence, the offset of
+ * the 1st letter of the sequence (in bytes, relative to the start of the
+ * file), the number of letters per line, and the number of bytes per line
+ * (i.e. including the LF or CRLF). All the lines of a record but the last
+ * one must have the same length.
+ */
+
+typedef struct faidx_buf {
+	CharAEAE *name_buf;
+	LLongAE *length_buf;
+	LLongAE *offset_buf;
+	IntAE *linebases_buf;
+	IntAE *linewidth_buf;
+} FAIDXbuf;
+
+static FAIDXbuf new_FAIDXbuf()
+{
+	FAIDXbuf faidx_buf;
+
+	faidx_buf.name_buf = new_CharAEAE(0, 0);
+	faidx_buf.length_buf = new_LLongAE(0, 0, 0);
+	faidx_buf.offset_buf = new_LLongAE(0, 0, 0);
+	faidx_buf.linebases_buf = new_IntAE(0, 0, 0);
+	faidx_buf.linewidth_buf = new_IntAE(0, 0, 0);
+	return faidx_buf;
+}
+
+static void append_faidx_rec(FAIDXbuf *faidx_buf,
+		const char *desc, long long int offset)
+{
+	char name[IOBUF_SIZE];
+	int i;
+
+	for (i = 0; desc[i] != '\0' && !isspace((unsigned char) desc[i]); i++)
+		name[i] = desc[i];
+	name[i] = '\0';
+	CharAEAE_append_string(faidx_buf->name_buf, name);
+	LLongAE_insert_at(faidx_buf->length_buf,
+			  LLongAE_get_nelt(faidx_buf->length_buf), 0LL);
+	LLongAE_insert_at(faidx_buf->offset_buf,
+			  LLongAE_get_nelt(faidx_buf->offset_buf), offset);
+	IntAE_insert_at(faidx_buf->linebases_buf,
+			IntAE_get_nelt(faidx_buf->linebases_buf), 0);
+	IntAE_insert_at(faidx_buf->linewidth_buf,
+			IntAE_get_nelt(faidx_buf->linewidth_buf), 0);
+	return;
+}
+
+/*
+ * Returns 0 if the line was accepted, -1 if its length is inconsistent with
+ * the previous lines of the record.
+ */
+static int add_faidx_seq_line(FAIDXbuf *faidx_buf, int linebases,
+		int linewidth, int *last_line_seen)
+{
+	int i, *rec_linebases, *rec_linewidth;
+
+	i = IntAE_get_nelt(faidx_buf->linebases_buf) - 1;
+	rec_linebases = faidx_buf->linebases_buf->elts + i;
+	rec_linewidth = faidx_buf->linewidth_buf->elts + i;
+	if (linebases == 0) {
+		/* An empty line can only be followed by other empty lines
+		   or by the next record */
+		*last_line_seen = 1;
+		return 0;
+	}
+	if (*last_line_seen)
+		return -1;
+	if (*rec_linebases == 0) {
+		*rec_linebases = linebases;
+		*rec_linewidth = linewidth;
+	} else if (linebases > *rec_linebases) {
+		return -1;
+	}
+	/* A short line (or a line that is not terminated like the previous
+	   ones) must be the last line of the record */
+	if (linebases < *rec_linebases || linewidth != *rec_linewidth)
+		*last_line_seen = 1;
+	faidx_buf->length_buf->elts[i] += linebases;
+	return 0;
+}
+
+static const char *parse_FASTA_file_for_faidx(SEXP filexp,
+		FAIDXbuf *faidx_buf)
+{
+	int lineno, EOL_in_buf, EOL_in_prev_buf, ret_code, nbyte_in,
+	    linebases, linewidth, in_rec, last_line_seen, prev_ends_with_CR;
+	char buf[IOBUF_SIZE];
+	long long int offset;
+
+	offset = 0LL;
+	in_rec = last_line_seen = prev_ends_with_CR = 0;
+	linebases = linewidth = 0;
+	for (lineno = EOL_in_prev_buf = 1;
+	     (ret_code = filexp_gets(filexp, buf, IOBUF_SIZE, &EOL_in_buf));
+	     lineno += EOL_in_prev_buf = EOL_in_buf)
+	{
+		if (ret_code == -1) {
+			snprintf(errmsg_buf, sizeof(errmsg_buf),
+				 "read error while reading characters "
+				 "from line %d", lineno);
+			return errmsg_buf;
+		}
+		nbyte_in = strlen(buf);
+		offset += nbyte_in;
+		if (EOL_in_prev_buf && has_prefix(buf, FASTA_desc_markup)) {
+			if (!EOL_in_buf) {
+				snprintf(errmsg_buf, sizeof(errmsg_buf),
+					 "cannot read line %d, "
+					 "line is too long", lineno);
+				return errmsg_buf;
+			}
+			buf[delete_trailing_LF_or_CRLF(buf, nbyte_in)] = '\0';
+			append_faidx_rec(faidx_buf,
+					 buf + strlen(FASTA_desc_markup),
+					 offset);
+			in_rec = 1;
+			last_line_seen = 0;
+			continue;
+		}
+		/* Sequence lines can span more than 1 buffer */
+		linewidth += nbyte_in;
+		if (!EOL_in_buf) {
+			linebases += nbyte_in;
+			prev_ends_with_CR = buf[nbyte_in - 1] == '\r';
+			continue;
+		}
+		linebases += delete_trailing_LF_or_CRLF(buf, nbyte_in);
+		if (nbyte_in == 1 && prev_ends_with_CR)
+			linebases--;  /* CRLF split across 2 buffers */
+		if (!in_rec) {
+			if (linebases != 0) {
+				snprintf(errmsg_buf, sizeof(errmsg_buf),
+					 "\"%s\" expected at beginning of "
+					 "line %d", FASTA_desc_markup, lineno);
+				return errmsg_buf;
+			}
+		} else if (add_faidx_seq_line(faidx_buf, linebases, linewidth,
+					      &last_line_seen) != 0)
+		{
+			snprintf(errmsg_buf, sizeof(errmsg_buf),
+				 "line %d: all the sequence lines of a record "
+				 "but the last one must have the same length",
+				 lineno);
+			return errmsg_buf;
+		}
+		linebases = linewidth = prev_ends_with_CR = 0;
+	}
+	/* Last line not terminated by an EOL */
+	if (linewidth != 0 && in_rec
+	 && add_faidx_seq_line(faidx_buf, linebases, linewidth,
+			       &last_line_seen) != 0)
+	{
+		snprintf(errmsg_buf, sizeof(errmsg_buf),
+			 "line %d: all the sequence lines of a record "
+			 "but the last one must have the same length", lineno);
+		return errmsg_buf;
+	}
+	return NULL;
+}
+
+static SEXP make_faidx_data_frame(const FAIDXbuf *faidx_buf)
+{
+	SEXP df, colnames, tmp;
+	int nrec, i;
+	long long int length;
+
+	nrec = IntAE_get_nelt(faidx_buf->linebases_buf);
+	PROTECT(df = NEW_LIST(5));
+
+	PROTECT(colnames = NEW_CHARACTER(5));
+	PROTECT(tmp = mkChar("name"));
+	SET_STRING_ELT(colnames, 0, tmp);
+	UNPROTECT(1);
+	PROTECT(tmp = mkChar("length"));
+	SET_STRING_ELT(colnames, 1, tmp);
+	UNPROTECT(1);
+	PROTECT(tmp = mkChar("offset"));
+	SET_STRING_ELT(colnames, 2, tmp);
+	UNPROTECT(1);
+	PROTECT(tmp = mkChar("linebases"));
+	SET_STRING_ELT(colnames, 3, tmp);
+	UNPROTECT(1);
+	PROTECT(tmp = mkChar("linewidth"));
+	SET_STRING_ELT(colnames, 4, tmp);
+	UNPROTECT(1);
+	SET_NAMES(df, colnames);
+	UNPROTECT(1);
+
+	PROTECT(tmp = new_CHARACTER_from_CharAEAE(faidx_buf->name_buf));
+	SET_ELEMENT(df, 0, tmp);
+	UNPROTECT(1);
+
+	PROTECT(tmp = NEW_INTEGER(nrec));
+	for (i = 0; i < nrec; i++) {
+		length = faidx_buf->length_buf->elts[i];
+		if (length > INT_MAX) {
+			UNPROTECT(2);
+			error("reading FASTA file: record %d is too long "
+			      "(sequences longer than %d letters are not "
+			      "supported)", i + 1, INT_MAX);
+		}
+		INTEGER(tmp)[i] = (int) length;
+	}
+	SET_ELEMENT(df, 1, tmp);
+	UNPROTECT(1);
+
+	PROTECT(tmp = NEW_NUMERIC(nrec));
+	for (i = 0; i < nrec; i++)
+		REAL(tmp)[i] = (double) faidx_buf->offset_buf->elts[i];
+	SET_ELEMENT(df, 2, tmp);
+	UNPROTECT(1);
+
+	PROTECT(tmp = new_INTEGER_from_IntAE(faidx_buf->linebases_buf));
+	SET_ELEMENT(df, 3, tmp);
+	UNPROTECT(1);
+
+	PROTECT(tmp = new_INTEGER_from_IntAE(faidx_buf->linewidth_buf));
+	SET_ELEMENT(df, 4, tmp);
+	UNPROTECT(1);
+
+	/* list_as_data_frame() performs IN-PLACE coercion */
+	list_as_data_frame(df, nrec);
+	UNPROTECT(1);
+	return df;
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP fasta_faidx(SEXP filexp_list)
+{
+	FAIDXbuf faidx_buf;
+	const char *errmsg;
+
+	faidx_buf = new_FAIDXbuf();
+	errmsg = parse_FASTA_file_for_faidx(VECTOR_ELT(filexp_list, 0),
+					    &faidx_buf);
+	if (errmsg != NULL)
+		error("reading FASTA file %s: %s",
+		      CHAR(STRING_ELT(GET_NAMES(filexp_list), 0)), errmsg);
+	return make_faidx_data_frame(&faidx_buf);
+}
+
+/*
+ * The file is memory-mapped so the letters of a region are copied (and
+ * encoded) directly from the page cache to the XStringSet payload.
+ */
+static const char *copy_faidx_region(MappedFile *mf,
+		long long int offset, int linebases, int linewidth,
+		long long int start, int width,
+		char *dest, const int *lkup, int lkup_length)
+{
+	long long int lineno;
+	int col, nbyte, i, key, val;
+	const char *src;
+
+	if (width > 0 && (linebases <= 0 || linewidth < linebases))
+		return "invalid line length in the FASTA index";
+	while (width > 0) {
+		lineno = start / linebases;
+		col = (int) (start % linebases);
+		nbyte = linebases - col;
+		if (nbyte > width)
+			nbyte = width;
+		src = get_MappedFile_bytes(mf,
+				offset + lineno * linewidth + col, nbyte);
+		if (src == NULL)
+			return "file is shorter than expected, "
+			       "the FASTA index is probably out of date";
+		if (lkup == NULL) {
+			memcpy(dest, src, nbyte);
+		} else {
+			for (i = 0; i < nbyte; i++) {
+				key = (unsigned char) src[i];
+				if (key >= lkup_length
+				 || (val = lkup[key]) == NA_INTEGER)
+					return "invalid one-letter sequence "
+					       "code in requested region";
+				dest[i] = (char) val;
+			}
+		}
+		dest += nbyte;
+		start += nbyte;
+		width -= nbyte;
+	}
+	return NULL;
+}
+
+/* --- .Call ENTRY POINT ---
+ * Args:
+ *   filepath:    The path to an uncompressed FASTA file.
+ *   offset, linebases, linewidth:
+ *                Numeric, integer, and integer vectors with 1 element per
+ *                region to read. Taken from the FASTA index rows of the
+ *                records where the regions are located.
+ *   start:       Integer vector with 1 element per region. The 1-based start
+ *                of the region relative to its record.
+ *   width:       Integer vector with 1 element per region. The regions must
+ *                be within the limits of their record. This is NOT checked!
+ *   elementType: The elementType of the XStringSet to return (its class is
+ *                inferred from this).
+ *   lkup:        Lookup table for encoding the incoming sequence bytes.
+ */
+SEXP read_XStringSet_from_faidx(SEXP filepath,
+		SEXP offset, SEXP linebases, SEXP linewidth,
+		SEXP start, SEXP width, SEXP elementType, SEXP lkup)
+{
+	const char *path, *element_type, *errmsg;
+	char classname[40];  /* longest string should be "DNAStringSet" */
+	SEXP ans;
+	XVectorList_holder ans_holder;
+	Chars_holder ans_elt_holder;
+	MappedFile mf;
+	const int *lkup0;
+	int ans_length, lkup_length, i;
+
+	path = translateChar(STRING_ELT(filepath, 0));
+	element_type = CHAR(STRING_ELT(elementType, 0));
+	if (snprintf(classname, sizeof(classname), "%sSet", element_type)
+	    >= sizeof(classname))
+	{
+		error("Biostrings internal error in "
+		      "read_XStringSet_from_faidx(): "
+		      "'classname' buffer too small");
+	}
+	if (lkup == R_NilValue) {
+		lkup0 = NULL;
+		lkup_length = 0;
+	} else {
+		lkup0 = INTEGER(lkup);
+		lkup_length = LENGTH(lkup);
+	}
+	ans_length = LENGTH(width);
+	PROTECT(ans = alloc_XRawList(classname, element_type, width));
+	ans_holder = hold_XVectorList(ans);
+	errmsg = open_MappedFile(&mf, path, 1);
+	if (errmsg != NULL) {
+		UNPROTECT(1);
+		error("reading FASTA file %s: %s", path, errmsg);
+	}
+	for (i = 0; i < ans_length; i++) {
+		ans_elt_holder = get_elt_from_XRawList_holder(&ans_holder, i);
+		/* ans_elt_holder.ptr is a const char * so we need to cast it
+		   to char * before we can write to it */
+		errmsg = copy_faidx_region(&mf,
+				llround(REAL(offset)[i]),
+				INTEGER(linebases)[i], INTEGER(linewidth)[i],
+				(long long int) INTEGER(start)[i] - 1,
+				ans_elt_holder.length,
+				(char *) ans_elt_holder.ptr,
+				lkup0, lkup_length);
+		if (errmsg != NULL)
+			break;
+	}
+	close_MappedFile(&mf);
+	if (errmsg != NULL) {
+		UNPROTECT(1);
+		error("reading FASTA file %s: %s (region %d)",
+		      path, errmsg, i + 1);
+	}
+	UNPROTECT(1);
+	return ans;
+}
+
+
 
 
 /****************************************************************************
@@ -640,23 +1270,55 @@ static FASTQloader new_FASTQGEOM_loader(FASTQGEOM_loaderExt *loader_ext)
 }
 
 /*
- * The FASTQ loader.
+ * The FASTQWIDTH loader collects the widths of the sequences.
+ */
+
+static void FASTQWIDTH_load_seq(FASTQloader *loader, const Chars_holder *seq)
+{
+	IntAE *width_buf;
+
+	width_buf = loader->ext;
+	IntAE_insert_at(width_buf, IntAE_get_nelt(width_buf), seq->length);
+	return;
+}
+
+static FASTQloader new_FASTQWIDTH_loader(IntAE *width_buf)
+{
+	FASTQloader loader;
+
+	loader.load_seqid = NULL;
+	loader.load_seq = FASTQWIDTH_load_seq;
+	loader.load_qualid = NULL;
+	loader.load_qual = NULL;
+	loader.nrec = 0;
+	loader.ext = width_buf;
+	return loader;
+}
+
+/*
+ * The FASTQ loader.
  */
 
 typedef struct fastq_loader_ext {
 	CharAEAE *ans_names_buf;
 	XVectorList_holder ans_holder;
+	int load_quals;
+	XVectorList_holder quals_holder;
 	const int *lkup;
 	int lkup_length;
 } FASTQ_loaderExt;
 
-static FASTQ_loaderExt new_FASTQ_loaderExt(SEXP ans, SEXP lkup)
+/* 'quals' must be R_NilValue or a BStringSet with the same shape as 'ans' */
+static FASTQ_loaderExt new_FASTQ_loaderExt(SEXP ans, SEXP quals, SEXP lkup)
 {
 	FASTQ_loaderExt loader_ext;
 
 	loader_ext.ans_names_buf =
 		new_CharAEAE(_get_XStringSet_length(ans), 0);
 	loader_ext.ans_holder = hold_XVectorList(ans);
+	loader_ext.load_quals = quals != R_NilValue;
+	if (loader_ext.load_quals)
+		loader_ext.quals_holder = hold_XVectorList(quals);
 	if (lkup == R_NilValue) {
 		loader_ext.lkup = NULL;
 		loader_ext.lkup_length = 0;
@@ -696,6 +1358,25 @@ static void FASTQ_load_seq(FASTQloader *loader, const Chars_holder *seq)
 	return;
 }
 
+static void FASTQ_load_qual(FASTQloader *loader, const Chars_holder *qual)
+{
+	FASTQ_loaderExt *loader_ext;
+	Chars_holder quals_elt_holder;
+
+	loader_ext = loader->ext;
+	quals_elt_holder = get_elt_from_XRawList_holder(
+					&(loader_ext->quals_holder),
+					loader->nrec);
+	if (qual->length != quals_elt_holder.length)
+		error("read_XStringSet_from_fastq(): the quality string of "
+		      "record %d does not have the length of its sequence",
+		      loader->nrec + 1);
+	/* quals_elt_holder.ptr is a const char * so we need to cast it to
+	   char * before we can write to it */
+	memcpy((char *) quals_elt_holder.ptr, qual->ptr, qual->length);
+	return;
+}
+
 static FASTQloader new_FASTQ_loader(int load_seqids,
 				    FASTQ_loaderExt *loader_ext)
 {
@@ -704,7 +1385,7 @@ static FASTQloader new_FASTQ_loader(int load_seqids,
 	loader.load_seqid = load_seqids ? &FASTQ_load_seqid : NULL;
 	loader.load_seq = FASTQ_load_seq;
 	loader.load_qualid = NULL;
-	loader.load_qual = NULL;
+	loader.load_qual = loader_ext->load_quals ? &FASTQ_load_qual : NULL;
 	loader.nrec = 0;
 	loader.ext = loader_ext;
 	return loader;
@@ -715,7 +1396,7 @@ static FASTQloader new_FASTQ_loader(int load_seqids,
  */
 static const char *parse_FASTQ_file(SEXP filexp,
 		int nrec, int skip, int seek_first_rec,
-		FASTQloader *loader, int *recno)
+		FASTQloader *loader, int *recno, PendingLine *pending)
 {
 	int lineno, EOL_in_buf, EOL_in_prev_buf, ret_code,
 	    FASTQ_line1_markup_length, FASTQ_line3_markup_length,
@@ -726,8 +1407,9 @@ static const char *parse_FASTQ_file(SEXP filexp,
 	FASTQ_line1_markup_length = strlen(FASTQ_line1_markup);
 	FASTQ_line3_markup_length = strlen(FASTQ_line3_markup);
 	lineinrecno = 0;
-	for (lineno = EOL_in_prev_buf = 1;
-	     (ret_code = filexp_gets(filexp, buf, IOBUF_SIZE, &EOL_in_buf));
+	for (lineno = pending != NULL ? pending->lineno : 1,
+	     EOL_in_prev_buf = 1;
+	     (ret_code = get_next_line(filexp, pending, buf, &EOL_in_buf));
 	     lineno += EOL_in_prev_buf = EOL_in_buf)
 	{
 		if (ret_code == -1) {
@@ -767,8 +1449,10 @@ static const char *parse_FASTQ_file(SEXP filexp,
 				return errmsg_buf;
 			}
 			load_rec = *recno >= skip;
-			if (load_rec && nrec >= 0 && *recno >= skip + nrec)
+			if (load_rec && nrec >= 0 && *recno >= skip + nrec) {
+				set_pending_line(pending, buf, lineno);
 				return NULL;
+			}
 			load_rec = load_rec && loader != NULL;
 			if (load_rec && nrec >= 0)
 				load_rec = *recno < skip + nrec;
@@ -831,7 +1515,7 @@ SEXP fastq_geometry(SEXP filexp_list,
 	for (i = 0; i < LENGTH(filexp_list); i++) {
 		filexp = VECTOR_ELT(filexp_list, i);
 		errmsg = parse_FASTQ_file(filexp, nrec0, skip0, seek_rec0,
-					  &loader, &recno);
+					  &loader, &recno, NULL);
 		if (errmsg != NULL)
 			error("reading FASTQ file %s: %s",
 			      CHAR(STRING_ELT(GET_NAMES(filexp_list), i)),
@@ -844,15 +1528,21 @@ SEXP fastq_geometry(SEXP filexp_list,
 	return ans;
 }
 
-/* --- .Call ENTRY POINT --- */
+/* --- .Call ENTRY POINT ---
+ * Returns a list of length 2: the XStringSet object containing the
+ * sequences, and a BStringSet object containing the qualities (or NULL if
+ * 'with_qualities' is FALSE).
+ */
 SEXP read_XStringSet_from_fastq(SEXP filexp_list, SEXP nrec, SEXP skip,
 		SEXP seek_first_rec,
-		SEXP use_names, SEXP elementType, SEXP lkup)
+		SEXP use_names, SEXP elementType, SEXP lkup,
+		SEXP with_qualities)
 {
-	int nrec0, skip0, seek_rec0, load_seqids, ans_length, i, recno;
-	SEXP filexp, ans_geom, ans_width, ans, ans_names;
-	const char *element_type;
+	int nrec0, skip0, seek_rec0, load_seqids, i, recno;
+	SEXP filexp, ans_width, ans, ans_names, quals, ans_list;
+	const char *element_type, *errmsg;
 	char classname[40];  /* longest string should be "DNAStringSet" */
+	IntAE *width_buf;
 	FASTQ_loaderExt loader_ext;
 	FASTQloader loader;
 
@@ -860,37 +1550,44 @@ SEXP read_XStringSet_from_fastq(SEXP filexp_list, SEXP nrec, SEXP skip,
 	skip0 = INTEGER(skip)[0];
 	seek_rec0 = LOGICAL(seek_first_rec)[0];
 	load_seqids = LOGICAL(use_names)[0];
-	PROTECT(ans_geom = fastq_geometry(filexp_list, nrec, skip,
-					  seek_first_rec));
-	ans_length = INTEGER(ans_geom)[0];
-	PROTECT(ans_width = NEW_INTEGER(ans_length));
-	if (ans_length != 0) {
-		if (INTEGER(ans_geom)[1] == NA_INTEGER) {
-			UNPROTECT(2);
-			error("read_XStringSet_from_fastq(): FASTQ files with "
-			      "variable sequence lengths are not supported yet");
-		}
-		for (recno = 0; recno < ans_length; recno++)
-			INTEGER(ans_width)[recno] = INTEGER(ans_geom)[1];
+	/* 1st pass: collect the widths of the sequences */
+	width_buf = new_IntAE(0, 0, 0);
+	loader = new_FASTQWIDTH_loader(width_buf);
+	recno = 0;
+	for (i = 0; i < LENGTH(filexp_list); i++) {
+		filexp = VECTOR_ELT(filexp_list, i);
+		errmsg = parse_FASTQ_file(filexp, nrec0, skip0, seek_rec0,
+					  &loader, &recno, NULL);
+		if (errmsg != NULL)
+			error("reading FASTQ file %s: %s",
+			      CHAR(STRING_ELT(GET_NAMES(filexp_list), i)),
+			      errmsg);
 	}
+	PROTECT(ans_width = new_INTEGER_from_IntAE(width_buf));
 	element_type = CHAR(STRING_ELT(elementType, 0));
 	if (snprintf(classname, sizeof(classname), "%sSet", element_type)
 	    >= sizeof(classname))
 	{
-		UNPROTECT(2);
+		UNPROTECT(1);
 		error("Biostrings internal error in "
 		      "read_XStringSet_from_fastq(): "
 		      "'classname' buffer too small");
 	}
 	PROTECT(ans = alloc_XRawList(classname, element_type, ans_width));
-	loader_ext = new_FASTQ_loaderExt(ans, lkup);
+	if (LOGICAL(with_qualities)[0])
+		quals = alloc_XRawList("BStringSet", "BString", ans_width);
+	else
+		quals = R_NilValue;
+	PROTECT(quals);
+	loader_ext = new_FASTQ_loaderExt(ans, quals, lkup);
+	/* 2nd pass: load the records */
 	loader = new_FASTQ_loader(load_seqids, &loader_ext);
 	recno = 0;
 	for (i = 0; i < LENGTH(filexp_list); i++) {
 		filexp = VECTOR_ELT(filexp_list, i);
 		filexp_rewind(filexp);
 		parse_FASTQ_file(filexp, nrec0, skip0, seek_rec0,
-				 &loader, &recno);
+				 &loader, &recno, NULL);
 	}
 	if (load_seqids) {
 		PROTECT(ans_names =
@@ -898,8 +1595,711 @@ SEXP read_XStringSet_from_fastq(SEXP filexp_list, SEXP nrec, SEXP skip,
 		_set_XStringSet_names(ans, ans_names);
 		UNPROTECT(1);
 	}
-	UNPROTECT(3);
-	return ans;
+	PROTECT(ans_list = NEW_LIST(2));
+	SET_ELEMENT(ans_list, 0, ans);
+	SET_ELEMENT(ans_list, 1, quals);
+	UNPROTECT(4);
+	return ans_list;
+}
+
+
+/****************************************************************************
+ * Parallel parsing of FASTQ files.
+ *
+ * The files are memory-mapped and parsed by batches. An uncompressed file is
+ * parsed in a single batch. A gzip-compressed file is decompressed by
+ * batches of about 'nthreads' * FASTQ_BATCH_SIZE_PER_THREAD bytes (in
+ * parallel if it's a BGZF file) so its decompressed content never needs to
+ * fit in memory. The incomplete record at the end of a batch is moved to the
+ * beginning of the next batch.
+ * A batch is split into byte ranges ("chunks") that are re-synchronized on
+ * record boundaries and parsed concurrently. The files are swept twice: the
+ * 1st sweep collects the widths of the records to load and the 2nd sweep
+ * copies their sequences and qualities directly to the payloads of the
+ * XStringSet objects (and collects their seqids). During a sweep, each batch
+ * is parsed in 2 passes: pass 1 counts the records of each chunk (so the
+ * rank of the 1st record of each chunk is known), then pass 2 or 3 does the
+ * actual work (see parse_FASTQ_chunk()). The worker threads never use the R
+ * API: everything they need is prepared by the main thread between 2
+ * passes.
+ *
+ * The chunk parser follows the rules of parse_FASTQ_file() (empty lines are
+ * ignored, an incomplete record at the end of a file is dropped) so the
+ * result doesn't depend on the number of threads.
+ */
+
+#ifndef _WIN32
+
+#define FASTQ_MIN_CHUNK_SIZE 1048576
+#define FASTQ_BATCH_SIZE_PER_THREAD (8 * FASTQ_MIN_CHUNK_SIZE)
+
+typedef struct fastq_chunk {
+	const char *start;     /* beginning of the 1st record in the chunk */
+	const char *end;       /* beginning of the 1st record in next chunk */
+	const char *batch_end;
+	int nrec;              /* nb of records starting in the chunk */
+	const char *incomplete;  /* beginning of an incomplete record */
+	long long int recno0;  /* 0-based rank of its 1st record (all files) */
+	const char *errmsg, *errpos;
+} FASTQchunk;
+
+typedef struct fastq_rec {
+	Chars_holder seqid, seq, qual;
+} FASTQrec;
+
+/*
+ * The records with 0-based rank in [skip, skip + nload) are loaded. Record
+ * 'skip' + i goes to 'width[i - rec0]', 'seqids[i - rec0]', 'seqs[i]' and
+ * 'quals[i]'.
+ */
+typedef struct fastq_target {
+	long long int skip, nload, rec0;
+	int *width;
+	Chars_holder *seqids;  /* NULL if the seqids are not loaded */
+	int load_quals;
+	Chars_holder *seqs, *quals;
+	const int *lkup;
+	int lkup_length;
+} FASTQtarget;
+
+/* Sets 'line' (without its LF or CRLF) and returns the end of the line. */
+static const char *next_nonempty_line(const char *p, const char *end,
+		Chars_holder *line)
+{
+	const char *eol, *next;
+	int length;
+
+	while (p < end) {
+		eol = memchr(p, '\n', end - p);
+		if (eol == NULL)
+			eol = next = end;
+		else
+			next = eol + 1;
+		length = eol - p;
+		if (length != 0 && p[length - 1] == '\r')
+			length--;
+		if (length != 0) {
+			line->ptr = p;
+			line->length = length;
+			return next;
+		}
+		p = next;
+	}
+	return NULL;
+}
+
+/*
+ * 'p' must point to the first line of a record. Returns the end of the
+ * record or NULL if the record is incomplete or invalid (in which case
+ * '*errmsg' is set).
+ */
+static const char *parse_FASTQ_rec(const char *p, const char *end,
+		FASTQrec *rec, const char **errmsg, const char **errpos)
+{
+	Chars_holder line3;
+
+	p = next_nonempty_line(p, end, &(rec->seqid));
+	if (p == NULL)
+		return NULL;
+	if (!has_prefix(rec->seqid.ptr, FASTQ_line1_markup)) {
+		*errmsg = "\"@\" expected at beginning of line";
+		*errpos = rec->seqid.ptr;
+		return NULL;
+	}
+	rec->seqid.ptr += strlen(FASTQ_line1_markup);
+	rec->seqid.length -= strlen(FASTQ_line1_markup);
+	p = next_nonempty_line(p, end, &(rec->seq));
+	if (p == NULL)
+		return NULL;
+	p = next_nonempty_line(p, end, &line3);
+	if (p == NULL)
+		return NULL;
+	if (!has_prefix(line3.ptr, FASTQ_line3_markup)) {
+		*errmsg = "\"+\" expected at beginning of line";
+		*errpos = line3.ptr;
+		return NULL;
+	}
+	return next_nonempty_line(p, end, &(rec->qual));
+}
+
+/*
+ * Returns the beginning of the first record that starts at or after 'p'.
+ * A line is the first line of a record if it starts with "@" and if the
+ * 2nd non-empty line after it starts with "+" (a quality line can start
+ * with "@" but then the 2nd line after it is a sequence line).
+ */
+static const char *sync_FASTQ_chunk(const char *p, const char *end)
+{
+	Chars_holder line;
+	const char *q;
+
+	if (p[-1] != '\n') {
+		q = memchr(p, '\n', end - p);
+		if (q == NULL)
+			return end;
+		p = q + 1;
+	}
+	while (p < end) {
+		if (has_prefix(p, FASTQ_line1_markup)) {
+			q = next_nonempty_line(p, end, &line);
+			if (q != NULL)
+				q = next_nonempty_line(q, end, &line);
+			if (q != NULL)
+				q = next_nonempty_line(q, end, &line);
+			/* Can't tell, so leave the rest of the file to the
+			   previous chunk */
+			if (q == NULL)
+				return end;
+			if (has_prefix(line.ptr, FASTQ_line3_markup))
+				return p;
+		}
+		q = memchr(p, '\n', end - p);
+		if (q == NULL)
+			return end;
+		p = q + 1;
+	}
+	return end;
+}
+
+static int copy_FASTQ_seq(const Chars_holder *seq, const Chars_holder *dest,
+		const int *lkup, int lkup_length)
+{
+	/* dest->ptr is a const char * so we need to cast it to char *
+	   before we can write to it */
+	char *dest_ptr = (char *) dest->ptr;
+	int i, key, val;
+
+	if (lkup == NULL) {
+		memcpy(dest_ptr, seq->ptr, seq->length);
+		return 0;
+	}
+	for (i = 0; i < seq->length; i++) {
+		key = (unsigned char) seq->ptr[i];
+		if (key >= lkup_length || (val = lkup[key]) == NA_INTEGER)
+			return -1;
+		dest_ptr[i] = (char) val;
+	}
+	return 0;
+}
+
+/*
+ * pass 1: count the records (and find the incomplete record at the end of
+ *         the batch, if any).
+ * pass 2: collect the widths of the records to load.
+ * pass 3: copy the sequences and qualities of the records to load, and
+ *         collect their seqids.
+ */
+static void parse_FASTQ_chunk(FASTQchunk *chunk, int pass,
+		const FASTQtarget *target)
+{
+	const char *p;
+	long long int recno, i;
+	Chars_holder line;
+	FASTQrec rec;
+
+	if (pass == 1) {
+		chunk->nrec = 0;
+		chunk->incomplete = NULL;
+	}
+	recno = chunk->recno0;
+	p = chunk->start;
+	while (1) {
+		/* Skip the empty lines preceding the next record */
+		if (next_nonempty_line(p, chunk->batch_end, &line) == NULL)
+			break;
+		p = line.ptr;
+		if (p >= chunk->end)
+			break;
+		if (pass != 1 && recno >= target->skip + target->nload)
+			break;
+		p = parse_FASTQ_rec(line.ptr, chunk->batch_end, &rec,
+				    &(chunk->errmsg), &(chunk->errpos));
+		if (p == NULL) {
+			if (pass == 1 && chunk->errmsg == NULL)
+				chunk->incomplete = line.ptr;
+			break;
+		}
+		if (pass == 1) {
+			chunk->nrec++;
+			continue;
+		}
+		i = recno++ - target->skip;
+		if (i < 0)
+			continue;
+		if (pass == 2) {
+			if (target->load_quals
+			 && rec.qual.length != rec.seq.length) {
+				chunk->errmsg = "quality string does not have "
+						"the length of the sequence";
+				chunk->errpos = rec.qual.ptr;
+				break;
+			}
+			target->width[i - target->rec0] = rec.seq.length;
+			continue;
+		}
+		if (target->seqids != NULL)
+			target->seqids[i - target->rec0] = rec.seqid;
+		if (copy_FASTQ_seq(&(rec.seq), target->seqs + i,
+				   target->lkup, target->lkup_length) != 0)
+		{
+			chunk->errmsg = "invalid one-letter sequence code";
+			chunk->errpos = rec.seq.ptr;
+			break;
+		}
+		if (target->load_quals)
+			copy_FASTQ_seq(&(rec.qual), target->quals + i,
+				       NULL, 0);
+	}
+	return;
+}
+
+static void parse_FASTQ_chunks(FASTQchunk *chunks, int nchunk, int pass,
+		const FASTQtarget *target, int nthreads)
+{
+	int k;
+
+#ifdef _OPENMP
+	#pragma omp parallel for num_threads(nthreads) schedule(dynamic, 1)
+#endif
+	for (k = 0; k < nchunk; k++) {
+		if (pass != 1
+		 && (chunks[k].recno0 + chunks[k].nrec <= target->skip
+		  || chunks[k].recno0 >= target->skip + target->nload))
+			continue;
+		parse_FASTQ_chunk(chunks + k, pass, target);
+	}
+	return;
+}
+
+typedef struct fastq_chunks_call {
+	SEXP filepath, nrec, skip, seek_first_rec, use_names,
+	     elementType, lkup, with_qualities, nthreads;
+	MappedFile *mfs;
+	int nmapped;
+	/* The current batch */
+	int fileno;
+	GZIPreader *gz;    /* NULL if the current file is not compressed */
+	char *buf;         /* malloc'ed buffer for the decompressed data */
+	long long int buf_size;
+	const char *batch;
+	long long int batch_size, batch_offset;
+	int last_batch;
+	/* malloc'ed buffers for the widths and seqids of the current batch */
+	int *widths;
+	Chars_holder *seqids;
+	long long int batch_buflength;
+} FASTQchunksCall;
+
+static void end_FASTQ_file(FASTQchunksCall *call)
+{
+	if (call->gz != NULL) {
+		_free_GZIPreader(call->gz);
+		call->gz = NULL;
+	}
+	return;
+}
+
+static void release_FASTQ_files(void *data)
+{
+	FASTQchunksCall *call = data;
+	int i;
+
+	end_FASTQ_file(call);
+	free(call->buf);
+	call->buf = NULL;
+	free(call->widths);
+	call->widths = NULL;
+	free(call->seqids);
+	call->seqids = NULL;
+	for (i = 0; i < call->nmapped; i++)
+		close_MappedFile(call->mfs + i);
+	call->nmapped = 0;
+	return;
+}
+
+static void start_FASTQ_file(FASTQchunksCall *call, int fileno)
+{
+	const MappedFile *mf;
+
+	call->fileno = fileno;
+	call->batch = NULL;
+	call->batch_size = call->batch_offset = 0;
+	call->last_batch = 0;
+	mf = call->mfs + fileno;
+	if (mf->size < 2 || (unsigned char) mf->bytes[0] != 0x1f
+			 || (unsigned char) mf->bytes[1] != 0x8b)
+		return;
+	call->gz = _new_GZIPreader(mf->bytes, mf->size,
+				   INTEGER(call->nthreads)[0]);
+	if (call->gz == NULL)
+		error("reading FASTQ file %s: cannot allocate memory",
+		      CHAR(STRING_ELT(call->filepath, fileno)));
+	return;
+}
+
+/*
+ * Moves to the next batch of the current file. The last 'nkeep' bytes of
+ * the current batch are kept at the beginning of the next one. Returns 0 if
+ * the current batch is the last one.
+ */
+static int next_FASTQ_batch(FASTQchunksCall *call, long long int nkeep)
+{
+	const MappedFile *mf;
+	const char *errmsg;
+
+	if (call->last_batch)
+		return 0;
+	mf = call->mfs + call->fileno;
+	if (call->gz == NULL) {
+		call->batch = mf->bytes;
+		call->batch_size = mf->size;
+		call->last_batch = 1;
+		return 1;
+	}
+	if (nkeep != 0)
+		memmove(call->buf, call->buf + call->batch_size - nkeep,
+			nkeep);
+	call->batch_offset += call->batch_size - nkeep;
+	call->batch_size = nkeep;
+	errmsg = _GZIPreader_read(call->gz, &(call->buf), &(call->buf_size),
+			&(call->batch_size), (long long int)
+			INTEGER(call->nthreads)[0] * FASTQ_BATCH_SIZE_PER_THREAD);
+	if (errmsg != NULL)
+		error("reading FASTQ file %s: %s",
+		      CHAR(STRING_ELT(call->filepath, call->fileno)), errmsg);
+	call->batch = call->buf;
+	call->last_batch = _GZIPreader_eof(call->gz);
+	return 1;
+}
+
+static void check_FASTQ_chunks(const FASTQchunksCall *call,
+		const FASTQchunk *chunks, int nchunk)
+{
+	int k;
+
+	for (k = 0; k < nchunk; k++) {
+		if (chunks[k].errmsg == NULL)
+			continue;
+		error("reading FASTQ file %s: %s (at byte %lld)",
+		      CHAR(STRING_ELT(call->filepath, call->fileno)),
+		      chunks[k].errmsg,
+		      call->batch_offset +
+		      (long long int) (chunks[k].errpos - call->batch));
+	}
+	return;
+}
+
+/*
+ * Splits the bytes of the current batch that are in [first, end) in at most
+ * 'max_nchunk' chunks. Returns the nb of chunks.
+ */
+static int split_FASTQ_batch(const char *first, const char *end,
+		int max_nchunk, FASTQchunk *chunks)
+{
+	long long int size;
+	int n, k;
+	FASTQchunk *chunk;
+
+	size = end - first;
+	if (size == 0)
+		return 0;
+	n = (int) (size / FASTQ_MIN_CHUNK_SIZE) + 1;
+	if (n > max_nchunk)
+		n = max_nchunk;
+	for (k = 0; k < n; k++) {
+		chunk = chunks + k;
+		chunk->batch_end = end;
+		chunk->start = first + size * k / n;
+		if (k != 0)
+			chunk->start = sync_FASTQ_chunk(chunk->start, end);
+		chunk->nrec = 0;
+		chunk->errmsg = NULL;
+	}
+	for (k = 0; k < n; k++) {
+		chunk = chunks + k;
+		chunk->end = k + 1 < n ? chunk[1].start : end;
+	}
+	return n;
+}
+
+/* Returns the beginning of the 1st line of the current batch that starts
+   with "@" or NULL if there is none. */
+static const char *seek_FASTQ_rec(const FASTQchunksCall *call)
+{
+	const char *p, *end;
+
+	end = call->batch + call->batch_size;
+	for (p = call->batch; p < end; p++) {
+		if ((p == call->batch || p[-1] == '\n')
+		 && has_prefix(p, FASTQ_line1_markup))
+			return p;
+	}
+	return NULL;
+}
+
+/* Makes sure that the buffers for the current batch can hold the widths and
+   seqids of 'n' records. */
+static void reserve_FASTQ_batch_bufs(FASTQchunksCall *call, long long int n)
+{
+	int *widths;
+	Chars_holder *seqids;
+
+	if (n <= call->batch_buflength)
+		return;
+	widths = realloc(call->widths, n * sizeof(int));
+	if (widths != NULL)
+		call->widths = widths;
+	seqids = realloc(call->seqids, n * sizeof(Chars_holder));
+	if (seqids != NULL)
+		call->seqids = seqids;
+	if (widths == NULL || seqids == NULL)
+		error("read_XStringSet_from_fastq_chunks(): "
+		      "cannot allocate memory");
+	call->batch_buflength = n;
+	return;
+}
+
+/*
+ * Parses the current batch with pass 1 and then with pass 'pass' (2 or 3).
+ * The widths (pass 2) or seqids (pass 3) of the records to load are
+ * appended to 'width_buf' or stored in 'ans_names'. The records of the batch
+ * get the ranks starting at '*recno' which is updated.
+ * Returns the nb of bytes at the end of the batch that were not parsed (the
+ * beginning of an incomplete record or an incomplete line) and must be kept
+ * for the next batch.
+ */
+static long long int parse_FASTQ_batch(FASTQchunksCall *call,
+		int pass, const char *first, FASTQchunk *chunks,
+		FASTQtarget *target, IntAE *width_buf, SEXP ans_names,
+		long long int *recno)
+{
+	const char *batch_end, *end;
+	int nthreads, nchunk, k;
+	long long int rec1, rec2, i;
+
+	nthreads = INTEGER(call->nthreads)[0];
+	batch_end = call->batch + call->batch_size;
+	/* Don't parse the incomplete line at the end of the batch */
+	end = batch_end;
+	if (!call->last_batch) {
+		while (end > first && end[-1] != '\n')
+			end--;
+	}
+	nchunk = split_FASTQ_batch(first, end, 4 * nthreads, chunks);
+
+	/* Pass 1 */
+	parse_FASTQ_chunks(chunks, nchunk, 1, NULL, nthreads);
+	check_FASTQ_chunks(call, chunks, nchunk);
+	rec1 = *recno;
+	for (k = 0; k < nchunk; k++) {
+		chunks[k].recno0 = *recno;
+		*recno += chunks[k].nrec;
+		if (chunks[k].incomplete != NULL && chunks[k].incomplete < end)
+			end = chunks[k].incomplete;
+	}
+
+	/* Pass 2 or 3 on the records of the batch that are loaded */
+	if (rec1 < target->skip)
+		rec1 = target->skip;
+	rec2 = *recno;
+	if (rec2 > target->skip + target->nload)
+		rec2 = target->skip + target->nload;
+	if (rec1 < rec2) {
+		if (rec2 - target->skip > INT_MAX)
+			error("read_XStringSet_from_fastq_chunks(): "
+			      "too many FASTQ records to load");
+		reserve_FASTQ_batch_bufs(call, rec2 - rec1);
+		target->rec0 = rec1 - target->skip;
+		target->width = call->widths;
+		if (pass == 3 && ans_names != R_NilValue)
+			target->seqids = call->seqids;
+		parse_FASTQ_chunks(chunks, nchunk, pass, target, nthreads);
+		check_FASTQ_chunks(call, chunks, nchunk);
+		if (pass == 2)
+			IntAE_append(width_buf, call->widths, rec2 - rec1);
+		if (target->seqids != NULL) {
+			for (i = 0; i < rec2 - rec1; i++)
+				SET_STRING_ELT(ans_names, target->rec0 + i,
+					mkCharLen(call->seqids[i].ptr,
+						  call->seqids[i].length));
+		}
+	}
+	/* The incomplete record at the end of the file is dropped */
+	return call->last_batch ? 0 : batch_end - end;
+}
+
+/*
+ * Parses all the files by batches (see parse_FASTQ_batch()). Stops after
+ * the last record to load. Returns the nb of records seen.
+ */
+static long long int sweep_FASTQ_files(FASTQchunksCall *call, int pass,
+		FASTQchunk *chunks, FASTQtarget *target,
+		IntAE *width_buf, SEXP ans_names)
+{
+	int i, seeking;
+	long long int recno, nkeep;
+	const char *first;
+
+	recno = 0;
+	for (i = 0; i < call->nmapped; i++) {
+		start_FASTQ_file(call, i);
+		seeking = LOGICAL(call->seek_first_rec)[0];
+		nkeep = 0;
+		while (next_FASTQ_batch(call, nkeep)) {
+			first = call->batch;
+			if (seeking) {
+				first = seek_FASTQ_rec(call);
+				if (first == NULL) {
+					if (call->last_batch)
+						error("reading FASTQ file %s: "
+						      "no FASTQ record found",
+						      CHAR(STRING_ELT(
+							call->filepath, i)));
+					/* Keep the incomplete last line */
+					for (nkeep = 0;
+					     nkeep < call->batch_size &&
+					     call->batch[call->batch_size -
+							 nkeep - 1] != '\n';
+					     nkeep++) ;
+					continue;
+				}
+				seeking = 0;
+			}
+			nkeep = parse_FASTQ_batch(call, pass, first, chunks,
+						  target, width_buf, ans_names,
+						  &recno);
+			if (recno >= target->skip + target->nload)
+				break;
+		}
+		end_FASTQ_file(call);
+		if (recno >= target->skip + target->nload)
+			break;
+	}
+	return recno;
+}
+
+static SEXP do_read_XStringSet_from_fastq_chunks(void *data)
+{
+	FASTQchunksCall *call = data;
+	const char *errmsg, *element_type;
+	char classname[40];  /* longest string should be "DNAStringSet" */
+	int nthreads, nfile, i;
+	long long int nrec0;
+	FASTQchunk *chunks;
+	FASTQtarget target;
+	IntAE *width_buf;
+	RoSeqs seqs_holder, quals_holder;
+	SEXP ans_width, ans, quals, ans_names, ans_list;
+
+	nthreads = INTEGER(call->nthreads)[0];
+	nfile = LENGTH(call->filepath);
+	call->mfs = (MappedFile *) R_alloc(nfile, sizeof(MappedFile));
+	for (i = 0; i < nfile; i++) {
+		errmsg = open_MappedFile(call->mfs + i,
+			translateChar(STRING_ELT(call->filepath, i)), 0);
+		if (errmsg != NULL)
+			error("reading FASTQ file %s: %s",
+			      CHAR(STRING_ELT(call->filepath, i)), errmsg);
+		call->nmapped++;
+	}
+	chunks = (FASTQchunk *) R_alloc(4 * nthreads, sizeof(FASTQchunk));
+
+	/* 1st sweep */
+	target.skip = INTEGER(call->skip)[0];
+	nrec0 = INTEGER(call->nrec)[0];
+	target.nload = nrec0 >= 0 ? nrec0 : LLONG_MAX - target.skip;
+	target.seqids = NULL;
+	target.load_quals = LOGICAL(call->with_qualities)[0];
+	width_buf = new_IntAE(0, 0, 0);
+	sweep_FASTQ_files(call, 2, chunks, &target, width_buf, R_NilValue);
+	target.nload = IntAE_get_nelt(width_buf);
+
+	/* 2nd sweep */
+	PROTECT(ans_width = new_INTEGER_from_IntAE(width_buf));
+	element_type = CHAR(STRING_ELT(call->elementType, 0));
+	if (snprintf(classname, sizeof(classname), "%sSet", element_type)
+	    >= sizeof(classname))
+	{
+		error("Biostrings internal error in "
+		      "read_XStringSet_from_fastq_chunks(): "
+		      "'classname' buffer too small");
+	}
+	PROTECT(ans = alloc_XRawList(classname, element_type, ans_width));
+	seqs_holder = _new_RoSeqs_from_XStringSet((int) target.nload, ans);
+	target.seqs = seqs_holder.elts;
+	if (target.load_quals) {
+		quals = alloc_XRawList("BStringSet", "BString", ans_width);
+	} else {
+		quals = R_NilValue;
+	}
+	PROTECT(quals);
+	if (target.load_quals) {
+		quals_holder = _new_RoSeqs_from_XStringSet((int) target.nload,
+							   quals);
+		target.quals = quals_holder.elts;
+	}
+	if (call->lkup == R_NilValue) {
+		target.lkup = NULL;
+		target.lkup_length = 0;
+	} else {
+		target.lkup = INTEGER(call->lkup);
+		target.lkup_length = LENGTH(call->lkup);
+	}
+	if (LOGICAL(call->use_names)[0])
+		ans_names = NEW_CHARACTER((int) target.nload);
+	else
+		ans_names = R_NilValue;
+	PROTECT(ans_names);
+	if (target.nload != 0)
+		sweep_FASTQ_files(call, 3, chunks, &target, NULL, ans_names);
+	if (ans_names != R_NilValue)
+		_set_XStringSet_names(ans, ans_names);
+	PROTECT(ans_list = NEW_LIST(2));
+	SET_ELEMENT(ans_list, 0, ans);
+	SET_ELEMENT(ans_list, 1, quals);
+	UNPROTECT(5);
+	return ans_list;
+}
+
+#endif  /* _WIN32 */
+
+/* --- .Call ENTRY POINT ---
+ * Same as read_XStringSet_from_fastq() except that the input files are
+ * given by their paths (they must be local files, uncompressed or
+ * gzip-compressed) and are parsed in parallel by 'nthreads' threads.
+ */
+SEXP read_XStringSet_from_fastq_chunks(SEXP filepath, SEXP nrec, SEXP skip,
+		SEXP seek_first_rec,
+		SEXP use_names, SEXP elementType, SEXP lkup,
+		SEXP with_qualities, SEXP nthreads)
+{
+#ifdef _WIN32
+	error("parallel parsing of FASTQ files is not supported on Windows");
+	return R_NilValue;
+#else
+	FASTQchunksCall call;
+
+	call.filepath = filepath;
+	call.nrec = nrec;
+	call.skip = skip;
+	call.seek_first_rec = seek_first_rec;
+	call.use_names = use_names;
+	call.elementType = elementType;
+	call.lkup = lkup;
+	call.with_qualities = with_qualities;
+	call.nthreads = nthreads;
+	call.nmapped = 0;
+	call.gz = NULL;
+	call.buf = NULL;
+	call.buf_size = 0;
+	call.widths = NULL;
+	call.seqids = NULL;
+	call.batch_buflength = 0;
+	/* Make sure the files get unmapped and the buffers freed if an error
+	   is raised */
+	return R_ExecWithCleanup(do_read_XStringSet_from_fastq_chunks, &call,
+				 release_FASTQ_files, &call);
+#endif
 }
 
 
@@ -938,53 +2338,49 @@ static const char *get_FASTQ_rec_id(SEXP x_names, SEXP q_names, int i)
 	return CHAR(seqid);
 }
 
-static void write_FASTQ_id(SEXP filexp, const char *markup, const char *id)
+static void write_FASTQ_id(OutputSink *sink, const char *markup,
+		const char *id)
 {
-	filexp_puts(filexp, markup);
-	filexp_puts(filexp, id);
-	filexp_puts(filexp, "\n");
+	sink_puts(sink, markup);
+	sink_puts(sink, id);
+	sink_write(sink, "\n", 1);
 }
 
-static void write_FASTQ_seq(SEXP filexp, const char *buf)
+static void write_FASTQ_seq(OutputSink *sink, const Chars_holder *X_elt,
+		const int *lkup, int lkup_length)
 {
-	filexp_puts(filexp, buf);
-	filexp_puts(filexp, "\n");
+	sink_write_with_lkup(sink, X_elt->ptr, X_elt->length,
+			     lkup, lkup_length);
+	sink_write(sink, "\n", 1);
 }
 
-static void write_FASTQ_qual(SEXP filexp, int seqlen,
+static void write_FASTQ_qual(OutputSink *sink, int seqlen,
 		const XStringSet_holder *Q, int i)
 {
 	Chars_holder Q_elt;
-	int j;
 
 	Q_elt = _get_elt_from_XStringSet_holder(Q, i);
 	if (Q_elt.length != seqlen)
 		error("'x' and 'quality' must have the same width");
-	for (j = 0; j < seqlen; j++)
-		filexp_putc(filexp, (int) *(Q_elt.ptr++));
-	filexp_puts(filexp, "\n");
+	sink_write(sink, Q_elt.ptr, seqlen);
+	sink_write(sink, "\n", 1);
 }
 
-static void write_FASTQ_fakequal(SEXP filexp, int seqlen)
+static void write_FASTQ_fakequal(OutputSink *sink, int seqlen)
 {
-	int j;
-
-	for (j = 0; j < seqlen; j++)
-		filexp_putc(filexp, (int) ';');
-	filexp_puts(filexp, "\n");
+	sink_fill(sink, ';', seqlen);
+	sink_write(sink, "\n", 1);
 }
 
-/* --- .Call ENTRY POINT --- */
-SEXP write_XStringSet_to_fastq(SEXP x, SEXP filexp_list,
+static void write_FASTQ_recs(OutputSink *sink, SEXP x,
 		SEXP qualities, SEXP lkup)
 {
 	XStringSet_holder X, Q;
 	int x_length, lkup_length, i;
 	const int *lkup0;
-	SEXP filexp, x_names, q_names;
+	SEXP x_names, q_names;
 	const char *id;
 	Chars_holder X_elt;
-	char buf[IOBUF_SIZE];
 
 	X = _hold_XStringSet(x);
 	x_length = _get_length_from_XStringSet_holder(&X);
@@ -996,7 +2392,6 @@ SEXP write_XStringSet_to_fastq(SEXP x, SEXP filexp_list,
 	} else {
 		q_names = R_NilValue;
 	}
-	filexp = VECTOR_ELT(filexp_list, 0);
 	if (lkup == R_NilValue) {
 		lkup0 = NULL;
 		lkup_length = 0;
@@ -1008,20 +2403,514 @@ SEXP write_XStringSet_to_fastq(SEXP x, SEXP filexp_list,
 	for (i = 0; i < x_length; i++) {
 		id = get_FASTQ_rec_id(x_names, q_names, i);
 		X_elt = _get_elt_from_XStringSet_holder(&X, i);
-		Ocopy_bytes_from_i1i2_with_lkup(0, X_elt.length - 1,
-			buf, X_elt.length,
-			X_elt.ptr, X_elt.length,
-			lkup0, lkup_length);
-		buf[X_elt.length] = 0;
-		write_FASTQ_id(filexp, FASTQ_line1_markup, id);
-		write_FASTQ_seq(filexp, buf);
-		write_FASTQ_id(filexp, FASTQ_line3_markup, id);
+		write_FASTQ_id(sink, FASTQ_line1_markup, id);
+		write_FASTQ_seq(sink, &X_elt, lkup0, lkup_length);
+		write_FASTQ_id(sink, FASTQ_line3_markup, id);
 		if (qualities != R_NilValue) {
-			write_FASTQ_qual(filexp, X_elt.length, &Q, i);
+			write_FASTQ_qual(sink, X_elt.length, &Q, i);
 		} else {
-			write_FASTQ_fakequal(filexp, X_elt.length);
+			write_FASTQ_fakequal(sink, X_elt.length);
 		}
 	}
+	return;
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP write_XStringSet_to_fastq(SEXP x, SEXP filexp_list,
+		SEXP qualities, SEXP lkup)
+{
+	OutputSink sink;
+
+	init_OutputSink(&sink, VECTOR_ELT(filexp_list, 0), NULL);
+	write_FASTQ_recs(&sink, x, qualities, lkup);
+	flush_OutputSink(&sink);
+	return R_NilValue;
+}
+
+
+/****************************************************************************
+ * Writing BGZF-compressed FASTA/FASTQ files.
+ */
+
+typedef struct bgzf_write_call {
+	SEXP x, format, width, qualities, lkup;
+	OutputSink sink;
+} BGZFwriteCall;
+
+static void free_BGZF_sink(void *data)
+{
+	BGZFwriteCall *call = data;
+
+	if (call->sink.bgzf != NULL) {
+		_free_BGZFwriter(call->sink.bgzf);
+		call->sink.bgzf = NULL;
+	}
+	return;
+}
+
+static SEXP do_write_XStringSet_to_bgzf(void *data)
+{
+	BGZFwriteCall *call = data;
+	const char *errmsg;
+
+	if (strcmp(CHAR(STRING_ELT(call->format, 0)), "fasta") == 0)
+		write_FASTA_recs(&(call->sink), call->x, call->width,
+				 call->lkup);
+	else
+		write_FASTQ_recs(&(call->sink), call->x, call->qualities,
+				 call->lkup);
+	flush_OutputSink(&(call->sink));
+	errmsg = _finish_BGZFwriter(call->sink.bgzf);
+	if (errmsg != NULL)
+		error("%s", errmsg);
 	return R_NilValue;
 }
 
+/* --- .Call ENTRY POINT ---
+ * Writes 'x' in FASTA or FASTQ format to a BGZF file. The blocks of the file
+ * are compressed in parallel by 'nthreads' threads.
+ */
+SEXP write_XStringSet_to_bgzf(SEXP x, SEXP filepath, SEXP append,
+		SEXP format, SEXP width, SEXP qualities, SEXP lkup,
+		SEXP compression_level, SEXP nthreads)
+{
+	BGZFwriteCall call;
+	int level;
+
+	level = INTEGER(compression_level)[0];
+	if (level == NA_INTEGER)
+		level = -1;  /* zlib default (Z_DEFAULT_COMPRESSION) */
+	call.x = x;
+	call.format = format;
+	call.width = width;
+	call.qualities = qualities;
+	call.lkup = lkup;
+	init_OutputSink(&(call.sink), R_NilValue, NULL);
+	call.sink.bgzf = _new_BGZFwriter(
+			translateChar(STRING_ELT(filepath, 0)),
+			LOGICAL(append)[0], level, INTEGER(nthreads)[0]);
+	if (call.sink.bgzf == NULL)
+		error("cannot open file '%s' for writing",
+		      CHAR(STRING_ELT(filepath, 0)));
+	/* Make sure the file gets closed if an error is raised */
+	return R_ExecWithCleanup(do_write_XStringSet_to_bgzf, &call,
+				 free_BGZF_sink, &call);
+}
+
+
+
+
+/****************************************************************************
+ *  C. STREAMING FASTA/FASTQ FILES                                          *
+ ****************************************************************************/
+
+/*
+ * A stream reads successive chunks of records from a list of files that
+ * stay open between calls. Its state is kept in a FASTXstream struct
+ * pointed to by an external pointer.
+ */
+
+typedef struct fastx_stream {
+	int fileno;         /* 0-based rank of the file being read */
+	int at_file_start;  /* nothing was read from that file yet */
+	PendingLine pending;
+} FASTXstream;
+
+static void free_FASTXstream(SEXP state)
+{
+	FASTXstream *stream;
+
+	stream = R_ExternalPtrAddr(state);
+	if (stream == NULL)
+		return;
+	Free(stream);
+	R_ClearExternalPtr(state);
+	return;
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP new_FASTX_stream(void)
+{
+	FASTXstream *stream;
+	SEXP state;
+
+	stream = Calloc(1, FASTXstream);
+	stream->fileno = 0;
+	stream->at_file_start = 1;
+	stream->pending.has_line = 0;
+	stream->pending.lineno = 1;
+	PROTECT(state = R_MakeExternalPtr(stream, R_NilValue, R_NilValue));
+	R_RegisterCFinalizer(state, free_FASTXstream);
+	UNPROTECT(1);
+	return state;
+}
+
+static FASTXstream *get_FASTXstream(SEXP state)
+{
+	FASTXstream *stream;
+
+	stream = R_ExternalPtrAddr(state);
+	if (stream == NULL)
+		error("Biostrings internal error in get_FASTXstream(): "
+		      "invalid stream state");
+	return stream;
+}
+
+/* Must be called when the current file of the stream is exhausted. */
+static void move_FASTXstream_to_next_file(FASTXstream *stream)
+{
+	stream->fileno++;
+	stream->at_file_start = 1;
+	stream->pending.has_line = 0;
+	stream->pending.lineno = 1;
+	return;
+}
+
+/*
+ * The records of a chunk are accumulated in a BytesBuf (for the sequence
+ * data or the qualities) and an IntAE (for the widths), then copied to the
+ * XStringSet object once the size of the chunk is known.
+ */
+
+typedef struct bytes_buf {
+	char *elts;
+	long int nelt, buflength;
+} BytesBuf;
+
+static BytesBuf new_BytesBuf()
+{
+	BytesBuf bytes_buf;
+
+	bytes_buf.elts = NULL;
+	bytes_buf.nelt = bytes_buf.buflength = 0;
+	return bytes_buf;
+}
+
+static void BytesBuf_append(BytesBuf *bytes_buf, const char *bytes, int n)
+{
+	long int new_buflength;
+
+	if (bytes_buf->nelt + n > bytes_buf->buflength) {
+		new_buflength = bytes_buf->buflength == 0 ?
+				IOBUF_SIZE : 2 * bytes_buf->buflength;
+		while (new_buflength < bytes_buf->nelt + n)
+			new_buflength *= 2;
+		bytes_buf->elts = S_realloc(bytes_buf->elts, new_buflength,
+					    bytes_buf->buflength,
+					    sizeof(char));
+		bytes_buf->buflength = new_buflength;
+	}
+	memcpy(bytes_buf->elts + bytes_buf->nelt, bytes, n);
+	bytes_buf->nelt += n;
+	return;
+}
+
+/* Only the first 'nrec' records in 'bytes_buf' are copied. */
+static SEXP new_XStringSet_from_BytesBuf(const char *classname,
+		const char *element_type, const BytesBuf *bytes_buf,
+		const IntAE *width_buf, int nrec, SEXP lkup)
+{
+	SEXP ans_width, ans;
+	XVectorList_holder ans_holder;
+	Chars_holder ans_elt_holder;
+	const char *src;
+	int i;
+
+	PROTECT(ans_width = NEW_INTEGER(nrec));
+	memcpy(INTEGER(ans_width), width_buf->elts, sizeof(int) * nrec);
+	PROTECT(ans = alloc_XRawList(classname, element_type, ans_width));
+	ans_holder = hold_XVectorList(ans);
+	src = bytes_buf->elts;
+	for (i = 0; i < nrec; i++) {
+		ans_elt_holder = get_elt_from_XRawList_holder(&ans_holder, i);
+		/* ans_elt_holder.ptr is a const char * so we need to cast it
+		   to char * before we can write to it */
+		if (lkup == R_NilValue) {
+			memcpy((char *) ans_elt_holder.ptr, src,
+			       ans_elt_holder.length);
+		} else {
+			Ocopy_bytes_to_i1i2_with_lkup(0,
+				ans_elt_holder.length - 1,
+				(char *) ans_elt_holder.ptr,
+				ans_elt_holder.length,
+				src, ans_elt_holder.length,
+				INTEGER(lkup), LENGTH(lkup));
+		}
+		src += ans_elt_holder.length;
+	}
+	UNPROTECT(2);
+	return ans;
+}
+
+static void set_chunk_names(SEXP ans, CharAEAE *names_buf, int nrec)
+{
+	SEXP ans_names;
+
+	CharAEAE_set_nelt(names_buf, nrec);
+	PROTECT(ans_names = new_CHARACTER_from_CharAEAE(names_buf));
+	_set_XStringSet_names(ans, ans_names);
+	UNPROTECT(1);
+	return;
+}
+
+/*
+ * The FASTASTREAM loader.
+ */
+
+typedef struct fastastream_loader_ext {
+	CharAEAE *desc_buf;
+	IntAE *width_buf;
+	BytesBuf seq_buf;
+} FASTASTREAM_loaderExt;
+
+static void FASTASTREAM_load_desc_line(FASTAloader *loader,
+				       int recno, long long int offset,
+				       const Chars_holder *desc_line)
+{
+	FASTASTREAM_loaderExt *loader_ext;
+
+	loader_ext = loader->ext;
+	// This works only because desc_line->seq is nul-terminated!
+	CharAEAE_append_string(loader_ext->desc_buf, desc_line->ptr);
+	return;
+}
+
+static void FASTASTREAM_load_empty_seq(FASTAloader *loader)
+{
+	FASTASTREAM_loaderExt *loader_ext;
+	IntAE *width_buf;
+
+	loader_ext = loader->ext;
+	width_buf = loader_ext->width_buf;
+	IntAE_insert_at(width_buf, IntAE_get_nelt(width_buf), 0);
+	return;
+}
+
+static void FASTASTREAM_load_seq_data(FASTAloader *loader,
+		const Chars_holder *seq_data)
+{
+	FASTASTREAM_loaderExt *loader_ext;
+	IntAE *width_buf;
+
+	loader_ext = loader->ext;
+	width_buf = loader_ext->width_buf;
+	BytesBuf_append(&(loader_ext->seq_buf), seq_data->ptr,
+			seq_data->length);
+	width_buf->elts[IntAE_get_nelt(width_buf) - 1] += seq_data->length;
+	return;
+}
+
+/* --- .Call ENTRY POINT ---
+ * Reads the next 'nrec' records (or less if the end of the last file is
+ * reached) of a FASTA stream. Returns an XStringSet object of length 0 when
+ * there are no more records.
+ */
+SEXP read_XStringSet_chunk_from_fasta(SEXP filexp_list, SEXP state,
+		SEXP nrec, SEXP seek_first_rec,
+		SEXP use_names, SEXP elementType, SEXP lkup)
+{
+	FASTXstream *stream;
+	FASTASTREAM_loaderExt loader_ext;
+	FASTAloader loader;
+	int nrec0, recno;
+	long long int offset, ninvalid;
+	const char *errmsg, *element_type;
+	char classname[40];  /* longest string should be "DNAStringSet" */
+	SEXP filexp, ans;
+
+	stream = get_FASTXstream(state);
+	nrec0 = INTEGER(nrec)[0];
+	element_type = CHAR(STRING_ELT(elementType, 0));
+	if (snprintf(classname, sizeof(classname), "%sSet", element_type)
+	    >= sizeof(classname))
+	{
+		error("Biostrings internal error in "
+		      "read_XStringSet_chunk_from_fasta(): "
+		      "'classname' buffer too small");
+	}
+	loader_ext.desc_buf = new_CharAEAE(0, 0);
+	loader_ext.width_buf = new_IntAE(0, 0, 0);
+	loader_ext.seq_buf = new_BytesBuf();
+	if (lkup == R_NilValue) {
+		loader.lkup = NULL;
+		loader.lkup_length = 0;
+	} else {
+		loader.lkup = INTEGER(lkup);
+		loader.lkup_length = LENGTH(lkup);
+	}
+	loader.load_desc_line = LOGICAL(use_names)[0] ?
+				&FASTASTREAM_load_desc_line : NULL;
+	loader.load_empty_seq = &FASTASTREAM_load_empty_seq;
+	loader.load_seq_data = &FASTASTREAM_load_seq_data;
+	loader.nrec = 0;
+	loader.ext = &loader_ext;
+	while (stream->fileno < LENGTH(filexp_list) && loader.nrec < nrec0) {
+		filexp = VECTOR_ELT(filexp_list, stream->fileno);
+		recno = 0;
+		offset = ninvalid = 0LL;
+		errmsg = parse_FASTA_file(filexp, nrec0 - loader.nrec, 0,
+				stream->at_file_start &&
+					LOGICAL(seek_first_rec)[0],
+				&loader, &recno, &offset, &ninvalid,
+				&(stream->pending));
+		stream->at_file_start = 0;
+		if (errmsg != NULL)
+			error("reading FASTA file %s: %s",
+			      CHAR(STRING_ELT(GET_NAMES(filexp_list),
+					      stream->fileno)),
+			      errmsg_buf);
+		if (ninvalid != 0LL)
+			warning("reading FASTA file %s: ignored %lld "
+				"invalid one-letter sequence codes",
+				CHAR(STRING_ELT(GET_NAMES(filexp_list),
+						stream->fileno)),
+				ninvalid);
+		if (!stream->pending.has_line)
+			move_FASTXstream_to_next_file(stream);
+	}
+	/* The sequence data was already encoded by the parser */
+	PROTECT(ans = new_XStringSet_from_BytesBuf(classname, element_type,
+			&(loader_ext.seq_buf), loader_ext.width_buf,
+			loader.nrec, R_NilValue));
+	if (LOGICAL(use_names)[0])
+		set_chunk_names(ans, loader_ext.desc_buf, loader.nrec);
+	UNPROTECT(1);
+	return ans;
+}
+
+/*
+ * The FASTQSTREAM loader.
+ */
+
+typedef struct fastqstream_loader_ext {
+	CharAEAE *seqid_buf;
+	IntAE *width_buf;
+	BytesBuf seq_buf;
+	int load_quals;
+	BytesBuf qual_buf;
+} FASTQSTREAM_loaderExt;
+
+static void FASTQSTREAM_load_seqid(FASTQloader *loader,
+		const Chars_holder *seqid)
+{
+	FASTQSTREAM_loaderExt *loader_ext;
+	CharAEAE *seqid_buf;
+
+	loader_ext = loader->ext;
+	seqid_buf = loader_ext->seqid_buf;
+	/* Drop the seqid of an incomplete record */
+	CharAEAE_set_nelt(seqid_buf, loader->nrec);
+	// This works only because seqid->ptr is nul-terminated!
+	CharAEAE_append_string(seqid_buf, seqid->ptr);
+	return;
+}
+
+static void FASTQSTREAM_load_seq(FASTQloader *loader, const Chars_holder *seq)
+{
+	FASTQSTREAM_loaderExt *loader_ext;
+	IntAE *width_buf;
+	BytesBuf *seq_buf;
+	int i;
+
+	loader_ext = loader->ext;
+	width_buf = loader_ext->width_buf;
+	seq_buf = &(loader_ext->seq_buf);
+	/* Drop the sequence of an incomplete record */
+	for (i = IntAE_get_nelt(width_buf); i > loader->nrec; i--)
+		seq_buf->nelt -= width_buf->elts[i - 1];
+	IntAE_set_nelt(width_buf, loader->nrec);
+	IntAE_insert_at(width_buf, loader->nrec, seq->length);
+	BytesBuf_append(seq_buf, seq->ptr, seq->length);
+	return;
+}
+
+static void FASTQSTREAM_load_qual(FASTQloader *loader,
+		const Chars_holder *qual)
+{
+	FASTQSTREAM_loaderExt *loader_ext;
+
+	loader_ext = loader->ext;
+	if (qual->length != loader_ext->width_buf->elts[loader->nrec])
+		error("reading FASTQ file: the quality string of record %d "
+		      "does not have the length of its sequence",
+		      loader->nrec + 1);
+	BytesBuf_append(&(loader_ext->qual_buf), qual->ptr, qual->length);
+	return;
+}
+
+/* --- .Call ENTRY POINT ---
+ * Reads the next 'nrec' records (or less if the end of the last file is
+ * reached) of a FASTQ stream. Returns a list of length 2 like
+ * read_XStringSet_from_fastq(). The XStringSet object has length 0 when
+ * there are no more records.
+ */
+SEXP read_XStringSet_chunk_from_fastq(SEXP filexp_list, SEXP state,
+		SEXP nrec, SEXP seek_first_rec,
+		SEXP use_names, SEXP elementType, SEXP lkup,
+		SEXP with_qualities)
+{
+	FASTXstream *stream;
+	FASTQSTREAM_loaderExt loader_ext;
+	FASTQloader loader;
+	int nrec0, recno;
+	const char *errmsg, *element_type;
+	char classname[40];  /* longest string should be "DNAStringSet" */
+	SEXP filexp, ans, quals, ans_list;
+
+	stream = get_FASTXstream(state);
+	nrec0 = INTEGER(nrec)[0];
+	element_type = CHAR(STRING_ELT(elementType, 0));
+	if (snprintf(classname, sizeof(classname), "%sSet", element_type)
+	    >= sizeof(classname))
+	{
+		error("Biostrings internal error in "
+		      "read_XStringSet_chunk_from_fastq(): "
+		      "'classname' buffer too small");
+	}
+	loader_ext.seqid_buf = new_CharAEAE(0, 0);
+	loader_ext.width_buf = new_IntAE(0, 0, 0);
+	loader_ext.seq_buf = new_BytesBuf();
+	loader_ext.load_quals = LOGICAL(with_qualities)[0];
+	loader_ext.qual_buf = new_BytesBuf();
+	loader.load_seqid = LOGICAL(use_names)[0] ?
+			    &FASTQSTREAM_load_seqid : NULL;
+	loader.load_seq = &FASTQSTREAM_load_seq;
+	loader.load_qualid = NULL;
+	loader.load_qual = loader_ext.load_quals ?
+			   &FASTQSTREAM_load_qual : NULL;
+	loader.nrec = 0;
+	loader.ext = &loader_ext;
+	while (stream->fileno < LENGTH(filexp_list) && loader.nrec < nrec0) {
+		filexp = VECTOR_ELT(filexp_list, stream->fileno);
+		recno = 0;
+		errmsg = parse_FASTQ_file(filexp, nrec0 - loader.nrec, 0,
+				stream->at_file_start &&
+					LOGICAL(seek_first_rec)[0],
+				&loader, &recno, &(stream->pending));
+		stream->at_file_start = 0;
+		if (errmsg != NULL)
+			error("reading FASTQ file %s: %s",
+			      CHAR(STRING_ELT(GET_NAMES(filexp_list),
+					      stream->fileno)),
+			      errmsg_buf);
+		if (!stream->pending.has_line)
+			move_FASTXstream_to_next_file(stream);
+	}
+	PROTECT(ans = new_XStringSet_from_BytesBuf(classname, element_type,
+			&(loader_ext.seq_buf), loader_ext.width_buf,
+			loader.nrec, lkup));
+	if (LOGICAL(use_names)[0])
+		set_chunk_names(ans, loader_ext.seqid_buf, loader.nrec);
+	if (loader_ext.load_quals)
+		quals = new_XStringSet_from_BytesBuf("BStringSet", "BString",
+				&(loader_ext.qual_buf), loader_ext.width_buf,
+				loader.nrec, R_NilValue);
+	else
+		quals = R_NilValue;
+	PROTECT(quals);
+	PROTECT(ans_list = NEW_LIST(2));
+	SET_ELEMENT(ans_list, 0, ans);
+	SET_ELEMENT(ans_list, 1, quals);
+	UNPROTECT(3);
+	return ans_list;
+}
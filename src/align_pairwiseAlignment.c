@@ -4,7 +4,15 @@
 #include <R_ext/Utils.h>        /* R_CheckUserInterrupt */
 
 #include <float.h>
+#include <limits.h>  /* for SHRT_MIN and SHRT_MAX */
+#include <stdint.h>  /* for uintptr_t */
 #include <stdlib.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>  /* SSE2 is part of the x86-64 baseline */
+#endif
 
 #define MAX(x, y) (x > y ? x : y)
 #define MIN(x, y) (x < y ? x : y)
@@ -121,6 +129,40 @@ struct IndelBuffer {
 };
 void function4(struct IndelBuffer *);
 
+
+/* Structure to hold the optional restrictions on the DP. With 'd' equal to
+ * nchar(string1) - nchar(string2), only the cells on the diagonals
+ * min(0, d) - width to max(0, d) + width are filled. */
+struct AlignBand {
+	int width;             /* < 0 means no band */
+	float minScore;        /* scores below are reported as -Inf */
+	float maxSubstitution; /* largest value in the substitution array */
+};
+void function5(struct AlignBand *);
+
+static void init_AlignBand(struct AlignBand *alignBandPtr,
+		int width, double minScore,
+		const double *substitutionArray, int substitutionArrayLength)
+{
+	int i;
+	double maxSubstitution = 0.0;
+
+	for (i = 0; i < substitutionArrayLength; i++)
+		maxSubstitution = MAX(maxSubstitution, substitutionArray[i]);
+	alignBandPtr->width = width;
+	alignBandPtr->minScore = (float) minScore;
+	alignBandPtr->maxSubstitution = (float) maxSubstitution;
+	return;
+}
+
+/* A band at least as wide as the shortest string covers the whole DP */
+static int band_is_active(const struct AlignBand *alignBandPtr,
+		int nCharString1, int nCharString2)
+{
+	return alignBandPtr->width >= 0 &&
+	       alignBandPtr->width < MIN(nCharString1, nCharString2);
+}
+
 /* Traceback through the score matrices */
 static void traceback(const struct AlignBuffer *alignBufferPtr,
 		      char currTraceMatrix,
@@ -233,9 +275,10 @@ static double pairwiseAlignment(
 		const int *fuzzyMatrixDim,
 		const int *fuzzyLookupTable,
 		const int fuzzyLookupTableLength,
+		const struct AlignBand *alignBandPtr,
 		struct AlignBuffer *alignBufferPtr)
 {
-	int i, j, iMinus1, jMinus1;
+	int i, j, iMinus1, jMinus1, iLow, iHigh;
 
 	/* Step 1:  Get information on input XString objects */
 	const int nCharString1 = align1InfoPtr->string.length;
@@ -259,21 +302,51 @@ static double pairwiseAlignment(
 		return zeroCharScore;
 	}
 
+	/* Step 1a:  Get the range of diagonals (i - j) to fill */
+	const int banded = band_is_active(alignBandPtr, nCharString1, nCharString2);
+	int bandLow = - nCharString2, bandHigh = nCharString1;
+	if (banded) {
+		bandLow = MIN(0, nCharString1 - nCharString2) - alignBandPtr->width;
+		bandHigh = MAX(0, nCharString1 - nCharString2) + alignBandPtr->width;
+	}
+	const float minScore = alignBandPtr->minScore;
+	const float maxGain = MAX(0.0, alignBandPtr->maxSubstitution);
+	/* 'minScore' is only used to stop early for global alignments: their
+	 * score is always read in the last cell so a column that can no longer
+	 * reach 'minScore' settles it */
+	const int useMinScore = scoreOnly && !localAlignment &&
+		align1InfoPtr->endGap && align2InfoPtr->endGap &&
+		minScore > NEGATIVE_INFINITY;
+	if (useMinScore && nCharString1 != nCharString2) {
+		/* The length difference has to be paid with gaps */
+		if (maxGain * MIN(nCharString1, nCharString2) - gapOpening -
+		    abs(nCharString1 - nCharString2) * gapExtension < minScore)
+			return NEGATIVE_INFINITY;
+	}
+
 	/* Step 2:  Create objects for scores values */
 	/* Rows of currMatrix and prevMatrix = (0) substitution, (1) deletion, and (2) insertion */
 	float *currMatrix = alignBufferPtr->currMatrix;
 	float *prevMatrix = alignBufferPtr->prevMatrix;
+	if (banded) {
+		/* The cells outside of the band stay at -Inf */
+		for (i = 0; i < 3 * nCharString1Plus1; i++) {
+			currMatrix[i] = NEGATIVE_INFINITY;
+			prevMatrix[i] = NEGATIVE_INFINITY;
+		}
+	}
+	iHigh = MIN(nCharString1, bandHigh);
 	CURR_MATRIX(0, 0) = 0.0;
 	CURR_MATRIX(0, 1) = (align2InfoPtr->endGap ? - gapOpening : 0.0);
-	for (i = 1, iMinus1 = 0; i <= nCharString1; i++, iMinus1++) {
+	for (i = 1, iMinus1 = 0; i <= iHigh; i++, iMinus1++) {
 		CURR_MATRIX(i, 0) = NEGATIVE_INFINITY;
 		CURR_MATRIX(i, 1) = NEGATIVE_INFINITY;
 	}
 	if (align1InfoPtr->endGap) {
-		for (i = 0; i <= nCharString1; i++)
+		for (i = 0; i <= iHigh; i++)
 			CURR_MATRIX(i, 2) = - gapOpening - i * gapExtension;
 	} else {
-		for (i = 0; i <= nCharString1; i++)
+		for (i = 0; i <= iHigh; i++)
 			CURR_MATRIX(i, 2) = 0.0;
 	}
 
@@ -305,8 +378,19 @@ static double pairwiseAlignment(
 			prevMatrix = currMatrix;
 			currMatrix = tempMatrix;
 
+			iLow = MAX(1, j + bandLow);
+			iHigh = MIN(nCharString1, j + bandHigh);
+			if (banded) {
+				/* The band moved down: reset the rows it left */
+				for (i = MAX(1, iLow - 2); i < iLow; i++) {
+					CURR_MATRIX(i, 0) = NEGATIVE_INFINITY;
+					CURR_MATRIX(i, 1) = NEGATIVE_INFINITY;
+					CURR_MATRIX(i, 2) = NEGATIVE_INFINITY;
+				}
+			}
+
 			CURR_MATRIX(0, 0) = NEGATIVE_INFINITY;
-			CURR_MATRIX(0, 1) = PREV_MATRIX(0, 1) + endGapAddend;
+			CURR_MATRIX(0, 1) = (j + bandLow <= 0 ? PREV_MATRIX(0, 1) + endGapAddend : NEGATIVE_INFINITY);
 			CURR_MATRIX(0, 2) = NEGATIVE_INFINITY;
 
 			SET_LOOKUP_VALUE(fuzzyLookupTable, fuzzyLookupTableLength, align2InfoPtr->string.ptr[jElt]);
@@ -314,7 +398,7 @@ static double pairwiseAlignment(
 			SET_LOOKUP_VALUE(substitutionLookupTable, substitutionLookupTableLength, sequence2.ptr[scalar2 ? 0 : jElt]);
 			element2 = lookupValue;
 			if (localAlignment) {
-				for (i = 1, iMinus1 = 0, iElt = nCharString1Minus1; i <= nCharString1; i++, iMinus1++, iElt--) {
+				for (i = iLow, iMinus1 = iLow - 1, iElt = nCharString1 - iLow; i <= iHigh; i++, iMinus1++, iElt--) {
 					SET_LOOKUP_VALUE(fuzzyLookupTable, fuzzyLookupTableLength, align1InfoPtr->string.ptr[iElt]);
 					stringElt1 = lookupValue;
 					SET_LOOKUP_VALUE(substitutionLookupTable, substitutionLookupTableLength, sequence1.ptr[scalar1 ? 0 : iElt]);
@@ -336,7 +420,7 @@ static double pairwiseAlignment(
 					maxScore = MAX(CURR_MATRIX(i, 0), maxScore);
 				}
 			} else {
-				for (i = 1, iMinus1 = 0, iElt = nCharString1Minus1; i <= nCharString1; i++, iMinus1++, iElt--) {
+				for (i = iLow, iMinus1 = iLow - 1, iElt = nCharString1 - iLow; i <= iHigh; i++, iMinus1++, iElt--) {
 					SET_LOOKUP_VALUE(fuzzyLookupTable, fuzzyLookupTableLength, align1InfoPtr->string.ptr[iElt]);
 					stringElt1 = lookupValue;
 					SET_LOOKUP_VALUE(substitutionLookupTable, substitutionLookupTableLength, sequence1.ptr[scalar1 ? 0 : iElt]);
@@ -364,6 +448,17 @@ static double pairwiseAlignment(
 							MAX(MAX(CURR_MATRIX(iMinus1, 0), CURR_MATRIX(iMinus1, 1)), CURR_MATRIX(iMinus1, 2));
 					}
 				}
+				if (useMinScore && j < nCharString2) {
+					/* Step 3e:  Stop when the scores can no longer gain
+					 *           enough to reach 'minScore' */
+					float columnMax = CURR_MATRIX(0, 1);
+					for (i = iLow; i <= iHigh; i++) {
+						columnMax = MAX(columnMax,
+							MAX(CURR_MATRIX(i, 0), MAX(CURR_MATRIX(i, 1), CURR_MATRIX(i, 2))));
+					}
+					if (columnMax + maxGain * (nCharString2 - j) < minScore)
+						return NEGATIVE_INFINITY;
+				}
 			}
 		}
 
@@ -404,8 +499,19 @@ static double pairwiseAlignment(
 			prevMatrix = currMatrix;
 			currMatrix = tempMatrix;
 
+			iLow = MAX(1, j + bandLow);
+			iHigh = MIN(nCharString1, j + bandHigh);
+			if (banded) {
+				/* The band moved down: reset the rows it left */
+				for (i = MAX(1, iLow - 2); i < iLow; i++) {
+					CURR_MATRIX(i, 0) = NEGATIVE_INFINITY;
+					CURR_MATRIX(i, 1) = NEGATIVE_INFINITY;
+					CURR_MATRIX(i, 2) = NEGATIVE_INFINITY;
+				}
+			}
+
 			CURR_MATRIX(0, 0) = NEGATIVE_INFINITY;
-			CURR_MATRIX(0, 1) = PREV_MATRIX(0, 1) + endGapAddend;
+			CURR_MATRIX(0, 1) = (j + bandLow <= 0 ? PREV_MATRIX(0, 1) + endGapAddend : NEGATIVE_INFINITY);
 			CURR_MATRIX(0, 2) = NEGATIVE_INFINITY;
 
 			SET_LOOKUP_VALUE(fuzzyLookupTable, fuzzyLookupTableLength, align2InfoPtr->string.ptr[jElt]);
@@ -413,7 +519,7 @@ static double pairwiseAlignment(
 			SET_LOOKUP_VALUE(substitutionLookupTable, substitutionLookupTableLength, sequence2.ptr[scalar2 ? 0 : jElt]);
 			element2 = lookupValue;
 			if (localAlignment) {
-				for (i = 1, iMinus1 = 0, iElt = nCharString1Minus1; i <= nCharString1; i++, iMinus1++, iElt--) {
+				for (i = iLow, iMinus1 = iLow - 1, iElt = nCharString1 - iLow; i <= iHigh; i++, iMinus1++, iElt--) {
 					SET_LOOKUP_VALUE(fuzzyLookupTable, fuzzyLookupTableLength, align1InfoPtr->string.ptr[iElt]);
 					stringElt1 = lookupValue;
 					SET_LOOKUP_VALUE(substitutionLookupTable, substitutionLookupTableLength, sequence1.ptr[scalar1 ? 0 : iElt]);
@@ -473,7 +579,7 @@ static double pairwiseAlignment(
 					}
 				}
 			} else {
-				for (i = 1, iMinus1 = 0, iElt = nCharString1Minus1; i <= nCharString1; i++, iMinus1++, iElt--) {
+				for (i = iLow, iMinus1 = iLow - 1, iElt = nCharString1 - iLow; i <= iHigh; i++, iMinus1++, iElt--) {
 					SET_LOOKUP_VALUE(fuzzyLookupTable, fuzzyLookupTableLength, align1InfoPtr->string.ptr[iElt]);
 					stringElt1 = lookupValue;
 					SET_LOOKUP_VALUE(substitutionLookupTable, substitutionLookupTableLength, sequence1.ptr[scalar1 ? 0 : iElt]);
@@ -573,9 +679,364 @@ static double pairwiseAlignment(
 			  align1InfoPtr, align2InfoPtr);
 	}
 
+	if (maxScore < minScore)
+		return NEGATIVE_INFINITY;
 	return (double) maxScore;
 }
 
+/****************************************************************************
+ * Striped (Farrar) score-only kernel
+ * ----------------------------------
+ * When only the score is needed, the scoring scheme is made of integers and
+ * the alignment type is 'global', 'local' or 'overlap', the DP can be
+ * filled with 8 signed 16-bit saturating lanes per SSE2 register. The string
+ * that is reused across alignments (the subject) is "striped" across the
+ * lanes so its query profile (one column of substitution scores per letter
+ * of the other string) only needs to be built once. 'global', 'local' and
+ * 'overlap' treat both strings symmetrically (same end gap rules on both
+ * sides) so which string is striped does not change the score.
+ * Any value getting close to the 16-bit limits makes the kernel give up and
+ * the caller falls back to pairwiseAlignment() above, which stays the
+ * reference implementation (and is the only one used for quality-based
+ * scoring and for the 'global-local'/'local-global' types).
+ */
+
+#if defined(__SSE2__)
+#define HAVE_STRIPED_KERNEL 1
+#else
+#define HAVE_STRIPED_KERNEL 0
+#endif
+
+#define STRIPED_NLANE      8
+#define STRIPED_NEG_INF    SHRT_MIN
+#define STRIPED_MAX_SCORE  1024
+
+struct StripedProfile {
+	/* Set by init_StripedProfile(). Not modified afterwards. */
+	int typeCode;
+	int gapOpening;
+	int gapExtension;
+	int maxAbsScore;
+	const double *substitutionArray;
+	const int *substitutionArrayDim;
+	const int *substitutionLookupTable;
+	int substitutionLookupTableLength;
+	const int *fuzzyMatrix;
+	const int *fuzzyMatrixDim;
+	const int *fuzzyLookupTable;
+	int fuzzyLookupTableLength;
+	int maxSegLen;
+	int byte2slot[256];
+	short *slots;
+	short *HStore, *HLoad, *E;
+	int *queryElement, *queryStringElt;
+
+	/* Set by set_StripedProfile_query(). */
+	int queryLength;
+	int segLen;
+	int queryIsValid;
+	char slotIsBuilt[256];
+};
+
+/*
+ * Returns 1 if the striped kernel can be used with this scoring scheme.
+ * 'maxAbsScore' is set to the max absolute value found in
+ * 'substitutionArray'.
+ */
+static int striped_kernel_applies(
+		const int typeCode,
+		const double gapOpening,
+		const double gapExtension,
+		const double *substitutionArray,
+		const int substitutionArrayLength,
+		int *maxAbsScore)
+{
+	int i;
+	double val;
+
+	if (!HAVE_STRIPED_KERNEL)
+		return 0;
+	if (typeCode != GLOBAL_ALIGNMENT && typeCode != LOCAL_ALIGNMENT
+	 && typeCode != OVERLAP_ALIGNMENT)
+		return 0;
+	if (!R_FINITE(gapOpening) || gapOpening != (int) gapOpening
+	 || gapOpening > STRIPED_MAX_SCORE)
+		return 0;
+	if (!R_FINITE(gapExtension) || gapExtension != (int) gapExtension
+	 || gapExtension > STRIPED_MAX_SCORE)
+		return 0;
+	*maxAbsScore = 0;
+	for (i = 0; i < substitutionArrayLength; i++) {
+		val = substitutionArray[i];
+		if (!R_FINITE(val) || val != (int) val
+		 || val > STRIPED_MAX_SCORE || val < -STRIPED_MAX_SCORE)
+			return 0;
+		*maxAbsScore = MAX(*maxAbsScore, abs((int) val));
+	}
+	return 1;
+}
+
+static short *alloc_aligned_shorts(int nshort)
+{
+	char *buf;
+
+	buf = R_alloc((long) nshort * sizeof(short) + 15, sizeof(char));
+	return (short *) (((uintptr_t) buf + 15) & ~((uintptr_t) 15));
+}
+
+/*
+ * Allocates all the buffers needed to align strings of length up to
+ * 'maxQueryLength' (the striped ones). Only the bytes that are in both
+ * lookup tables get a profile slot. Must be called from the main thread
+ * (uses R_alloc()).
+ */
+static void init_StripedProfile(struct StripedProfile *sp,
+		const int typeCode,
+		const int gapOpening,
+		const int gapExtension,
+		const int maxAbsScore,
+		const double *substitutionArray,
+		const int *substitutionArrayDim,
+		const int *substitutionLookupTable,
+		const int substitutionLookupTableLength,
+		const int *fuzzyMatrix,
+		const int *fuzzyMatrixDim,
+		const int *fuzzyLookupTable,
+		const int fuzzyLookupTableLength,
+		const int maxQueryLength)
+{
+	int c, nslot, vecLength;
+
+	sp->typeCode = typeCode;
+	sp->gapOpening = gapOpening;
+	sp->gapExtension = gapExtension;
+	sp->maxAbsScore = maxAbsScore;
+	sp->substitutionArray = substitutionArray;
+	sp->substitutionArrayDim = substitutionArrayDim;
+	sp->substitutionLookupTable = substitutionLookupTable;
+	sp->substitutionLookupTableLength = substitutionLookupTableLength;
+	sp->fuzzyMatrix = fuzzyMatrix;
+	sp->fuzzyMatrixDim = fuzzyMatrixDim;
+	sp->fuzzyLookupTable = fuzzyLookupTable;
+	sp->fuzzyLookupTableLength = fuzzyLookupTableLength;
+	sp->maxSegLen = (MAX(maxQueryLength, 1) + STRIPED_NLANE - 1) / STRIPED_NLANE;
+	nslot = 0;
+	for (c = 0; c < 256; c++) {
+		if (c < substitutionLookupTableLength
+		 && substitutionLookupTable[c] != NA_INTEGER
+		 && c < fuzzyLookupTableLength
+		 && fuzzyLookupTable[c] != NA_INTEGER)
+			sp->byte2slot[c] = nslot++;
+		else
+			sp->byte2slot[c] = -1;
+	}
+	vecLength = sp->maxSegLen * STRIPED_NLANE;
+	sp->slots = alloc_aligned_shorts(MAX(nslot, 1) * vecLength);
+	sp->HStore = alloc_aligned_shorts(vecLength);
+	sp->HLoad = alloc_aligned_shorts(vecLength);
+	sp->E = alloc_aligned_shorts(vecLength);
+	sp->queryElement = (int *) R_alloc((long) maxQueryLength + 1, sizeof(int));
+	sp->queryStringElt = (int *) R_alloc((long) maxQueryLength + 1, sizeof(int));
+	sp->queryLength = 0;
+	sp->queryIsValid = 0;
+	return;
+}
+
+/* Sets the string to stripe. Profile slots are (re)built lazily. */
+static void set_StripedProfile_query(struct StripedProfile *sp,
+		const Chars_holder *query)
+{
+	int i, c;
+
+	sp->queryLength = query->length;
+	sp->segLen = (MAX(query->length, 1) + STRIPED_NLANE - 1) / STRIPED_NLANE;
+	sp->queryIsValid = 1;
+	for (i = 0; i < query->length; i++) {
+		c = (unsigned char) query->ptr[i];
+		if (sp->byte2slot[c] == -1) {
+			sp->queryIsValid = 0;
+			break;
+		}
+		sp->queryElement[i] = sp->substitutionLookupTable[c];
+		sp->queryStringElt[i] = sp->fuzzyLookupTable[c];
+	}
+	memset(sp->slotIsBuilt, 0, sizeof(sp->slotIsBuilt));
+	return;
+}
+
+/*
+ * Returns the striped column of scores for letter 'c' of the non-striped
+ * string (the pattern), or NULL if 'c' is not in the lookup tables.
+ */
+static const short *get_StripedProfile_slot(struct StripedProfile *sp,
+		unsigned char c)
+{
+	const double *substitutionArray = sp->substitutionArray;
+	const int *substitutionArrayDim = sp->substitutionArrayDim;
+	const int *fuzzyMatrix = sp->fuzzyMatrix;
+	const int *fuzzyMatrixDim = sp->fuzzyMatrixDim;
+	int slot, element1, stringElt1, t, k, i;
+	short *col;
+
+	slot = sp->byte2slot[c];
+	if (slot == -1)
+		return NULL;
+	col = sp->slots + (long) slot * sp->maxSegLen * STRIPED_NLANE;
+	if (sp->slotIsBuilt[c])
+		return col;
+	element1 = sp->substitutionLookupTable[c];
+	stringElt1 = sp->fuzzyLookupTable[c];
+	for (t = 0; t < sp->segLen; t++) {
+		for (k = 0; k < STRIPED_NLANE; k++) {
+			i = k * sp->segLen + t;
+			col[t * STRIPED_NLANE + k] = i >= sp->queryLength ? 0 :
+			    (short) SUBSTITUTION_ARRAY(element1, sp->queryElement[i],
+				FUZZY_MATRIX(stringElt1, sp->queryStringElt[i]));
+		}
+	}
+	sp->slotIsBuilt[c] = 1;
+	return col;
+}
+
+/*
+ * Aligns 'string' (as string 1) against the query (as string 2) of 'sp'.
+ * Returns 1 and sets '*score' on success, or 0 if the kernel could not be
+ * used (unknown letter, possible 16-bit overflow, or no SSE2 support), in
+ * which case the caller must use pairwiseAlignment().
+ */
+static int striped_pairwiseAlignment(struct StripedProfile *sp,
+		const Chars_holder *string,
+		double *score)
+{
+#if defined(__SSE2__)
+	const int m = sp->queryLength, n = string->length, segLen = sp->segLen;
+	const int gapOpening = sp->gapOpening, gapExtension = sp->gapExtension;
+	const int gapOpeningPlusExtension = gapOpening + gapExtension;
+	const int globalAlignment = sp->typeCode == GLOBAL_ALIGNMENT;
+	const int localAlignment = sp->typeCode == LOCAL_ALIGNMENT;
+	const int lastSeg = (m - 1) % segLen, lastLane = (m - 1) / segLen;
+	__m128i *pvHStore = (__m128i *) sp->HStore;
+	__m128i *pvHLoad = (__m128i *) sp->HLoad;
+	__m128i *pvE = (__m128i *) sp->E;
+	__m128i *pvTemp;
+	const __m128i *pvProfile;
+	const __m128i vZero = _mm_setzero_si128();
+	const __m128i vNegInf = _mm_set1_epi16(STRIPED_NEG_INF);
+	const __m128i vGapO = _mm_set1_epi16(gapOpeningPlusExtension);
+	const __m128i vGapE = _mm_set1_epi16(gapExtension);
+	__m128i vH, vE, vF, vHOpen, vMax, vMin, vLastRowMax;
+	short lanes[STRIPED_NLANE];
+	int i, j, k, t, hTop, hTopPrev, maxH, minH, ans;
+
+	if (!sp->queryIsValid || m < 1 || n < 1)
+		return 0;
+	/* Make sure the boundary values and every cell reachable from them
+	 * fit comfortably in a short. */
+	if (globalAlignment &&
+	    (double) gapOpening + (double) gapExtension * MAX(m, n)
+	    + gapOpeningPlusExtension + sp->maxAbsScore >= -(STRIPED_NEG_INF + 1))
+		return 0;
+
+	/* Step 1:  Column 0 */
+	for (t = 0; t < segLen; t++) {
+		for (k = 0; k < STRIPED_NLANE; k++) {
+			i = k * segLen + t + 1;
+			lanes[k] = (globalAlignment && i <= m) ?
+				- gapOpening - i * gapExtension : 0;
+		}
+		pvHStore[t] = _mm_loadu_si128((const __m128i *) lanes);
+		pvE[t] = _mm_subs_epi16(pvHStore[t], vGapO);
+	}
+	vMax = vMin = vLastRowMax = vZero;
+
+	/* Step 2:  Columns 1 to n */
+	hTop = 0;
+	for (j = 0; j < n; j++) {
+		pvProfile = (const __m128i *)
+			get_StripedProfile_slot(sp, (unsigned char) string->ptr[j]);
+		if (pvProfile == NULL)
+			return 0;
+		hTopPrev = hTop;
+		hTop = globalAlignment ?
+			- gapOpening - (j + 1) * gapExtension : 0;
+		vF = _mm_insert_epi16(vNegInf, hTop - gapOpeningPlusExtension, 0);
+		vH = _mm_slli_si128(pvHStore[segLen - 1], 2);
+		vH = _mm_insert_epi16(vH, hTopPrev, 0);
+		pvTemp = pvHLoad;
+		pvHLoad = pvHStore;
+		pvHStore = pvTemp;
+		for (t = 0; t < segLen; t++) {
+			vH = _mm_adds_epi16(vH, pvProfile[t]);
+			if (localAlignment)
+				vH = _mm_max_epi16(vH, vZero);
+			vE = pvE[t];
+			vH = _mm_max_epi16(vH, vE);
+			vH = _mm_max_epi16(vH, vF);
+			pvHStore[t] = vH;
+			vMax = _mm_max_epi16(vMax, vH);
+			vMin = _mm_min_epi16(vMin, vH);
+			vHOpen = _mm_subs_epi16(vH, vGapO);
+			pvE[t] = _mm_max_epi16(_mm_subs_epi16(vE, vGapE), vHOpen);
+			vF = _mm_max_epi16(_mm_subs_epi16(vF, vGapE), vHOpen);
+			vH = pvHLoad[t];
+		}
+		/* Lazy-F loop: propagate the vertical gaps across lanes until
+		 * they can no longer improve any cell. The stop condition uses
+		 * the H values from before the update so that a zero gap
+		 * opening cost is handled correctly. */
+		for (k = 0; k < STRIPED_NLANE; k++) {
+			vF = _mm_slli_si128(vF, 2);
+			vF = _mm_insert_epi16(vF, STRIPED_NEG_INF, 0);
+			for (t = 0; t < segLen; t++) {
+				vH = pvHStore[t];
+				vHOpen = _mm_subs_epi16(vH, vGapO);
+				vH = _mm_max_epi16(vH, vF);
+				pvHStore[t] = vH;
+				vMax = _mm_max_epi16(vMax, vH);
+				pvE[t] = _mm_max_epi16(pvE[t], _mm_subs_epi16(vH, vGapO));
+				vF = _mm_subs_epi16(vF, vGapE);
+				if (!_mm_movemask_epi8(_mm_cmpgt_epi16(vF, vHOpen)))
+					goto lazy_F_done;
+			}
+		}
+	lazy_F_done:
+		vLastRowMax = _mm_max_epi16(vLastRowMax, pvHStore[lastSeg]);
+	}
+
+	/* Step 3:  Check for 16-bit overflow */
+	_mm_storeu_si128((__m128i *) lanes, vMax);
+	for (k = 0, maxH = STRIPED_NEG_INF; k < STRIPED_NLANE; k++)
+		maxH = MAX(maxH, lanes[k]);
+	_mm_storeu_si128((__m128i *) lanes, vMin);
+	for (k = 0, minH = SHRT_MAX; k < STRIPED_NLANE; k++)
+		minH = MIN(minH, lanes[k]);
+	if (maxH >= SHRT_MAX - sp->maxAbsScore
+	 || minH <= STRIPED_NEG_INF + gapOpeningPlusExtension + sp->maxAbsScore)
+		return 0;
+
+	/* Step 4:  Get the optimal score */
+	if (localAlignment) {
+		ans = maxH;
+	} else {
+		_mm_storeu_si128((__m128i *) lanes, pvHStore[lastSeg]);
+		ans = lanes[lastLane];
+		if (!globalAlignment) {
+			/* Overlap: best cell of the last row or last column */
+			_mm_storeu_si128((__m128i *) lanes, vLastRowMax);
+			ans = MAX(ans, lanes[lastLane]);
+			for (i = 0; i < m; i++)
+				ans = MAX(ans, ((const short *) pvHStore)
+					[(i % segLen) * STRIPED_NLANE + i / segLen]);
+		}
+	}
+	*score = (double) ans;
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+
 /*
  * INPUTS
  * 'pattern':                XStringSet or QualityScaledXStringSet object for patterns
@@ -613,6 +1074,9 @@ static double pairwiseAlignment(
  * 'fuzzyLookupTable':         lookup table for translating XString bytes to
  *                             fuzzy indices
  *                             (integer vector)
+ * 'bandWidth':                width of the band of diagonals around the
+ *                             alignment diagonals to fill in the DP
+ *                             (integer vector of length 1; < 0 for no band)
  *
  * OUTPUT
  * If scoreOnly = TRUE, returns either a vector of scores
@@ -634,7 +1098,8 @@ SEXP XStringSet_align_pairwiseAlignment(
 		SEXP substitutionLookupTable,
 		SEXP fuzzyMatrix,
 		SEXP fuzzyMatrixDim,
-		SEXP fuzzyLookupTable)
+		SEXP fuzzyLookupTable,
+		SEXP bandWidth)
 {
 	const int scoreOnlyValue = LOGICAL(scoreOnly)[0];
 	const int useQualityValue = LOGICAL(useQuality)[0];
@@ -683,6 +1148,11 @@ SEXP XStringSet_align_pairwiseAlignment(
 	const int quality1Increment = ((lengthOfPatternQualitySet < numberOfStrings) ? 0 : 1);
 	const int quality2Increment = ((lengthOfSubjectQualitySet < numberOfStrings) ? 0 : 1);
 
+	/* Create the alignment band object */
+	struct AlignBand alignBand;
+	init_AlignBand(&alignBand, INTEGER(bandWidth)[0], NEGATIVE_INFINITY,
+		       REAL(substitutionArray), LENGTH(substitutionArray));
+
 	/* Create the alignment buffer object */
 	struct AlignBuffer alignBuffer;
 	int nCharString1 = 0, nCharString2 = 0, nCharProduct = 0;
@@ -744,6 +1214,33 @@ SEXP XStringSet_align_pairwiseAlignment(
 
 	double *score;
 	if (scoreOnlyValue) {
+		/* Use the striped kernel when the scoring scheme allows it */
+		struct StripedProfile stripedProfile;
+		int maxAbsScore;
+		const int useStriped = !useQualityValue &&
+			striped_kernel_applies(INTEGER(typeCode)[0],
+					       gapOpeningValue,
+					       gapExtensionValue,
+					       REAL(substitutionArray),
+					       LENGTH(substitutionArray),
+					       &maxAbsScore);
+		if (useStriped) {
+			init_StripedProfile(&stripedProfile,
+					    INTEGER(typeCode)[0],
+					    (int) gapOpeningValue,
+					    (int) gapExtensionValue,
+					    maxAbsScore,
+					    REAL(substitutionArray),
+					    INTEGER(substitutionArrayDim),
+					    INTEGER(substitutionLookupTable),
+					    LENGTH(substitutionLookupTable),
+					    INTEGER(fuzzyMatrix),
+					    INTEGER(fuzzyMatrixDim),
+					    INTEGER(fuzzyLookupTable),
+					    LENGTH(fuzzyLookupTable),
+					    nCharString2);
+			set_StripedProfile_query(&stripedProfile, &align2Info.string);
+		}
 		PROTECT(output = NEW_NUMERIC(numberOfStrings));
 		for (i = 0, score = REAL(output); i < numberOfStrings; i++, score++) {
 	        R_CheckUserInterrupt();
@@ -758,7 +1255,13 @@ SEXP XStringSet_align_pairwiseAlignment(
 					align2Info.quality = _get_elt_from_XStringSet_holder(&subjectQuality_holder, quality2Element);
 					quality2Element += quality2Increment;
 				}
+				if (useStriped)
+					set_StripedProfile_query(&stripedProfile, &align2Info.string);
 			}
+			if (useStriped
+			 && !band_is_active(&alignBand, align1Info.string.length, align2Info.string.length)
+			 && striped_pairwiseAlignment(&stripedProfile, &align1Info.string, score))
+				continue;
 			*score = pairwiseAlignment(
 					&align1Info,
 					&align2Info,
@@ -775,6 +1278,7 @@ SEXP XStringSet_align_pairwiseAlignment(
 					INTEGER(fuzzyMatrixDim),
 					INTEGER(fuzzyLookupTable),
 					LENGTH(fuzzyLookupTable),
+					&alignBand,
 					&alignBuffer);
 		}
 		UNPROTECT(1);
@@ -859,6 +1363,7 @@ SEXP XStringSet_align_pairwiseAlignment(
 					INTEGER(fuzzyMatrixDim),
 					INTEGER(fuzzyLookupTable),
 					LENGTH(fuzzyLookupTable),
+					&alignBand,
 					&alignBuffer);
 
 			*align1MismatchEnds = align1Info.lengthMismatch + align1MismatchPrevEnd;
@@ -1040,6 +1545,126 @@ SEXP XStringSet_align_pairwiseAlignment(
 
 
 
+/*
+ * All-vs-all alignment scores
+ * ---------------------------
+ * The lower triangle of the score matrix is cut in tiles of
+ * DISTANCE_TILE_SIZE x DISTANCE_TILE_SIZE pairs. When OpenMP is available
+ * and 'nthreads' > 1, the tiles are dynamically dispatched to the threads
+ * (a thread that is done with its tile grabs the next one) and each thread
+ * works with its own buffers. Every pair writes its score at a fixed
+ * position in the output so the result does not depend on the number of
+ * threads. The workers don't use the R API: the strings are checked against
+ * the lookup tables beforehand so pairwiseAlignment() cannot call error().
+ * The tiles are dispatched in batches of DISTANCE_NTILE_PER_THREAD tiles per
+ * thread so the main thread can check for user interrupts between batches.
+ */
+
+#define DISTANCE_TILE_SIZE 64
+#define DISTANCE_NTILE_PER_THREAD 16
+
+/* Buffers owned by a single thread */
+struct DistanceWorkspace {
+	struct AlignInfo align1Info, align2Info;
+	struct AlignBuffer alignBuffer;
+	struct StripedProfile stripedProfile;
+};
+
+/* Parameters shared (read-only) by all the threads */
+struct DistanceParams {
+	int numberOfStrings;
+	RoSeqs strings;
+	RoSeqs qualities;
+	int qualityIncrement;
+	int localAlignment;
+	int useStriped;
+	struct AlignBand alignBand;
+	float gapOpening;
+	float gapExtension;
+	int useQuality;
+	const double *substitutionArray;
+	const int *substitutionArrayDim;
+	const int *substitutionLookupTable;
+	int substitutionLookupTableLength;
+	const int *fuzzyMatrix;
+	const int *fuzzyMatrixDim;
+	const int *fuzzyLookupTable;
+	int fuzzyLookupTableLength;
+};
+
+static void check_lookup_keys(const Chars_holder *x,
+		const int *lookupTable, const int lookupTableLength)
+{
+	int i, lookupValue;
+
+	for (i = 0; i < x->length; i++)
+		SET_LOOKUP_VALUE(lookupTable, lookupTableLength, x->ptr[i]);
+	return;
+}
+
+/* Offset in the "dist" vector of the score for pair (i, i + 1) */
+static R_xlen_t distance_row_offset(int i, int numberOfStrings)
+{
+	return (R_xlen_t) i * (numberOfStrings - 1) - (R_xlen_t) i * (i - 1) / 2;
+}
+
+/* Computes the scores of the pairs (i, j) with 'i' in tile row 'bi' and 'j'
+ * in tile column 'bj', j > i. */
+static void align_distance_tile(const struct DistanceParams *params,
+		struct DistanceWorkspace *ws,
+		int bi, int bj,
+		double *output)
+{
+	const int n = params->numberOfStrings;
+	const int i1 = bi * DISTANCE_TILE_SIZE;
+	const int i2 = MIN(i1 + DISTANCE_TILE_SIZE, n);
+	const int j1 = bj * DISTANCE_TILE_SIZE;
+	const int j2 = MIN(j1 + DISTANCE_TILE_SIZE, n);
+	int i, j;
+	double *score;
+
+	for (i = i1; i < i2; i++) {
+		ws->align1Info.string = params->strings.elts[i];
+		if (params->useQuality)
+			ws->align1Info.quality = params->qualities.elts[i * params->qualityIncrement];
+		if (params->useStriped)
+			set_StripedProfile_query(&ws->stripedProfile, &ws->align1Info.string);
+		j = MAX(j1, i + 1);
+		score = output + distance_row_offset(i, n) + (j - i - 1);
+		for ( ; j < j2; j++, score++) {
+			ws->align2Info.string = params->strings.elts[j];
+			if (params->useStriped
+			 && !band_is_active(&params->alignBand, ws->align1Info.string.length, ws->align2Info.string.length)
+			 && striped_pairwiseAlignment(&ws->stripedProfile, &ws->align2Info.string, score)) {
+				if (*score < params->alignBand.minScore)
+					*score = NEGATIVE_INFINITY;
+				continue;
+			}
+			if (params->useQuality)
+				ws->align2Info.quality = params->qualities.elts[j * params->qualityIncrement];
+			*score = pairwiseAlignment(
+					&ws->align1Info,
+					&ws->align2Info,
+					params->localAlignment,
+					1,
+					params->gapOpening,
+					params->gapExtension,
+					params->useQuality,
+					params->substitutionArray,
+					params->substitutionArrayDim,
+					params->substitutionLookupTable,
+					params->substitutionLookupTableLength,
+					params->fuzzyMatrix,
+					params->fuzzyMatrixDim,
+					params->fuzzyLookupTable,
+					params->fuzzyLookupTableLength,
+					&params->alignBand,
+					&ws->alignBuffer);
+		}
+	}
+	return;
+}
+
 /*
  * INPUTS
  * 'string':                   XStringSet object for strings
@@ -1071,6 +1696,16 @@ SEXP XStringSet_align_pairwiseAlignment(
  * 'fuzzyLookupTable':         lookup table for translating XString bytes to
  *                             fuzzy indices
  *                             (integer vector)
+ * 'bandWidth':                width of the band of diagonals around the
+ *                             alignment diagonals to fill in the DP
+ *                             (integer vector of length 1; < 0 for no band)
+ * 'minScore':                 scores below this value are reported as -Inf,
+ *                             which lets 'global' alignments stop as
+ *                             soon as it can no longer be reached
+ *                             (double vector of length 1)
+ * 'nthreads':                 number of threads to use
+ *                             (integer vector of length 1; ignored if the
+ *                              package was compiled without OpenMP support)
  *
  * OUTPUT
  * Return a numeric vector containing the lower triangle of the score matrix.
@@ -1088,9 +1723,12 @@ SEXP XStringSet_align_distance(
 		SEXP substitutionLookupTable,
 		SEXP fuzzyMatrix,
 		SEXP fuzzyMatrixDim,
-		SEXP fuzzyLookupTable)
+		SEXP fuzzyLookupTable,
+		SEXP bandWidth,
+		SEXP minScore,
+		SEXP nthreads)
 {
-	int scoreOnlyValue = 1;
+	struct DistanceParams params;
 	int useQualityValue = LOGICAL(useQuality)[0];
 	float gapOpeningValue = REAL(gapOpening)[0];
 	float gapExtensionValue = REAL(gapExtension)[0];
@@ -1098,99 +1736,119 @@ SEXP XStringSet_align_distance(
 		gapOpeningValue = 0.0;
 		gapExtensionValue = POSITIVE_INFINITY;
 	}
-	int localAlignment = (INTEGER(typeCode)[0] == LOCAL_ALIGNMENT);
-
-	/* Create the alignment info objects */
-	struct AlignInfo align1Info, align2Info;
-	align1Info.endGap = (INTEGER(typeCode)[0] == GLOBAL_ALIGNMENT);
-	align2Info.endGap = (INTEGER(typeCode)[0] == GLOBAL_ALIGNMENT);
+	int nthreadsValue = INTEGER(nthreads)[0];
+#ifndef _OPENMP
+	nthreadsValue = 1;
+#endif
 
 	int numberOfStrings = _get_XStringSet_length(string);
 	int lengthOfStringQualitySet = 0;
 
 	SEXP stringQuality = R_NilValue;
-	XStringSet_holder string_holder = _hold_XStringSet(string);
-	XStringSet_holder stringQuality_holder;
+	params.numberOfStrings = numberOfStrings;
+	params.strings = _new_RoSeqs_from_XStringSet(numberOfStrings, string);
 	if (useQualityValue) {
 		stringQuality = GET_SLOT(string, install("quality"));
-		stringQuality_holder = _hold_XStringSet(stringQuality);
 		lengthOfStringQualitySet = _get_XStringSet_length(stringQuality);
+		params.qualities = _new_RoSeqs_from_XStringSet(lengthOfStringQualitySet, stringQuality);
 	}
-
-	SEXP output;
-
-	int i, j, iQualityElement = 0, jQualityElement = 0;
-	int qualityIncrement = ((lengthOfStringQualitySet < numberOfStrings) ? 0 : 1);
-
-	/* Create the alignment buffer object */
-	struct AlignBuffer alignBuffer;
-	int nCharString = 0;
+	params.qualityIncrement = ((lengthOfStringQualitySet < numberOfStrings) ? 0 : 1);
+	params.localAlignment = (INTEGER(typeCode)[0] == LOCAL_ALIGNMENT);
+	params.gapOpening = gapOpeningValue;
+	params.gapExtension = gapExtensionValue;
+	params.useQuality = useQualityValue;
+	params.substitutionArray = REAL(substitutionArray);
+	params.substitutionArrayDim = INTEGER(substitutionArrayDim);
+	params.substitutionLookupTable = INTEGER(substitutionLookupTable);
+	params.substitutionLookupTableLength = LENGTH(substitutionLookupTable);
+	params.fuzzyMatrix = INTEGER(fuzzyMatrix);
+	params.fuzzyMatrixDim = INTEGER(fuzzyMatrixDim);
+	params.fuzzyLookupTable = INTEGER(fuzzyLookupTable);
+	params.fuzzyLookupTableLength = LENGTH(fuzzyLookupTable);
+	init_AlignBand(&params.alignBand, INTEGER(bandWidth)[0], REAL(minScore)[0],
+		       REAL(substitutionArray), LENGTH(substitutionArray));
+
+	/* Check the keys and get the max string length */
+	int i, t, nCharString = 0;
+	Chars_holder elt;
 	for (i = 0; i < numberOfStrings; i++) {
-		nCharString = MAX(nCharString, _get_elt_from_XStringSet_holder(&string_holder, i).length);
+		elt = params.strings.elts[i];
+		nCharString = MAX(nCharString, elt.length);
+		check_lookup_keys(&elt, params.fuzzyLookupTable, params.fuzzyLookupTableLength);
+		if (useQualityValue)
+			elt = params.qualities.elts[i * params.qualityIncrement];
+		check_lookup_keys(&elt, params.substitutionLookupTable, params.substitutionLookupTableLength);
 	}
+
+	int maxAbsScore;
+	params.useStriped = !useQualityValue &&
+		striped_kernel_applies(INTEGER(typeCode)[0],
+				       gapOpeningValue,
+				       gapExtensionValue,
+				       REAL(substitutionArray),
+				       LENGTH(substitutionArray),
+				       &maxAbsScore);
+
+	/* Create the per-thread alignment buffers */
+	nthreadsValue = MAX(1, MIN(nthreadsValue, numberOfStrings));
 	int alignmentBufferSize = nCharString + 1;
-	alignBuffer.currMatrix = (float *) R_alloc((long) 3 * alignmentBufferSize, sizeof(float));
-	alignBuffer.prevMatrix = (float *) R_alloc((long) 3 * alignmentBufferSize, sizeof(float));
+	struct DistanceWorkspace *workspaces = (struct DistanceWorkspace *)
+		R_alloc((long) nthreadsValue, sizeof(struct DistanceWorkspace));
+	for (t = 0; t < nthreadsValue; t++) {
+		struct DistanceWorkspace *ws = workspaces + t;
+		ws->align1Info.endGap = (INTEGER(typeCode)[0] == GLOBAL_ALIGNMENT);
+		ws->align2Info.endGap = (INTEGER(typeCode)[0] == GLOBAL_ALIGNMENT);
+		ws->alignBuffer.currMatrix = (float *) R_alloc((long) 3 * alignmentBufferSize, sizeof(float));
+		ws->alignBuffer.prevMatrix = (float *) R_alloc((long) 3 * alignmentBufferSize, sizeof(float));
+		if (params.useStriped)
+			init_StripedProfile(&ws->stripedProfile,
+					    INTEGER(typeCode)[0],
+					    (int) gapOpeningValue,
+					    (int) gapExtensionValue,
+					    maxAbsScore,
+					    params.substitutionArray,
+					    params.substitutionArrayDim,
+					    params.substitutionLookupTable,
+					    params.substitutionLookupTableLength,
+					    params.fuzzyMatrix,
+					    params.fuzzyMatrixDim,
+					    params.fuzzyLookupTable,
+					    params.fuzzyLookupTableLength,
+					    nCharString);
+	}
 
-	double *score;
-	PROTECT(output = NEW_NUMERIC((numberOfStrings * (numberOfStrings - 1)) / 2));
-	score = REAL(output);
-	if (!useQualityValue) {
-		for (i = 0; i < numberOfStrings; i++) {
-	        R_CheckUserInterrupt();
-			align1Info.string = _get_elt_from_XStringSet_holder(&string_holder, i);
-			for (j = i + 1; j < numberOfStrings; j++) {
-				align2Info.string = _get_elt_from_XStringSet_holder(&string_holder, j);
-				*score = pairwiseAlignment(
-						&align1Info,
-						&align2Info,
-						localAlignment,
-						scoreOnlyValue,
-						gapOpeningValue,
-						gapExtensionValue,
-						useQualityValue,
-						REAL(substitutionArray),
-						INTEGER(substitutionArrayDim),
-						INTEGER(substitutionLookupTable),
-						LENGTH(substitutionLookupTable),
-						INTEGER(fuzzyMatrix),
-						INTEGER(fuzzyMatrixDim),
-						INTEGER(fuzzyLookupTable),
-						LENGTH(fuzzyLookupTable),
-						&alignBuffer);
-				score++;
-			}
+	/* Enumerate the tiles of the lower triangle */
+	int ntileRows = (numberOfStrings + DISTANCE_TILE_SIZE - 1) / DISTANCE_TILE_SIZE;
+	int ntiles = ntileRows * (ntileRows + 1) / 2;
+	int *tileRow = (int *) R_alloc((long) ntiles, sizeof(int));
+	int *tileCol = (int *) R_alloc((long) ntiles, sizeof(int));
+	int bi, bj;
+	for (bi = 0, t = 0; bi < ntileRows; bi++) {
+		for (bj = bi; bj < ntileRows; bj++, t++) {
+			tileRow[t] = bi;
+			tileCol[t] = bj;
 		}
-	} else {
-		for (i = 0; i < numberOfStrings; i++) {
-	        R_CheckUserInterrupt();
-			align1Info.string = _get_elt_from_XStringSet_holder(&string_holder, i);
-			align1Info.quality = _get_elt_from_XStringSet_holder(&stringQuality_holder, iQualityElement);
-			jQualityElement = iQualityElement + qualityIncrement;
-			iQualityElement += qualityIncrement;
-			for (j = i + 1; j < numberOfStrings; j++) {
-				align2Info.string = _get_elt_from_XStringSet_holder(&string_holder, j);
-				align2Info.quality = _get_elt_from_XStringSet_holder(&stringQuality_holder, jQualityElement);
-				jQualityElement += qualityIncrement;
-				*score = pairwiseAlignment(
-						&align1Info,
-						&align2Info,
-						localAlignment,
-						scoreOnlyValue,
-						gapOpeningValue,
-						gapExtensionValue,
-						useQualityValue,
-						REAL(substitutionArray),
-						INTEGER(substitutionArrayDim),
-						INTEGER(substitutionLookupTable),
-						LENGTH(substitutionLookupTable),
-						INTEGER(fuzzyMatrix),
-						INTEGER(fuzzyMatrixDim),
-						INTEGER(fuzzyLookupTable),
-						LENGTH(fuzzyLookupTable),
-						&alignBuffer);
-				score++;
-			}
+	}
+
+	SEXP output;
+	PROTECT(output = allocVector(REALSXP,
+		(R_xlen_t) numberOfStrings * (numberOfStrings - 1) / 2));
+	double *score = REAL(output);
+	int t0, t1, batchSize = nthreadsValue == 1 ?
+		1 : nthreadsValue * DISTANCE_NTILE_PER_THREAD;
+	for (t0 = 0; t0 < ntiles; t0 = t1) {
+		R_CheckUserInterrupt();
+		t1 = MIN(t0 + batchSize, ntiles);
+		if (nthreadsValue == 1) {
+			for (t = t0; t < t1; t++)
+				align_distance_tile(&params, workspaces, tileRow[t], tileCol[t], score);
+		} else {
+#ifdef _OPENMP
+			#pragma omp parallel for num_threads(nthreadsValue) schedule(dynamic, 1)
+			for (t = t0; t < t1; t++)
+				align_distance_tile(&params, workspaces + omp_get_thread_num(),
+						    tileRow[t], tileCol[t], score);
+#endif
 		}
 	}
 	UNPROTECT(1);
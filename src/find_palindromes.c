@@ -2,7 +2,10 @@
 #include "XVector_interface.h"
 #include "IRanges_interface.h"
 
+#include <Rconfig.h>  /* for WORDS_BIGENDIAN */
 #include <stdio.h>
+#include <stdint.h>  /* for uint64_t */
+#include <string.h>  /* for memcpy() */
 
 
 static int is_match(char c1, char c2, const int *lkup, int lkup_len)
@@ -64,6 +67,269 @@ static int get_palindrome_arm_length(const char *x, int x_len, int max_nmis,
 	return i1;
 }
 
+
+/****************************************************************************
+ * An engine based on Longest Common Extension (LCE) queries.
+ *
+ * The arms of the palindromes centered between x[i1] and x[i2] are made of
+ * the pairs (x[i1 - d], x[i2 + d]), d >= 0, where L2R_lkup[x[i1 - d]] is
+ * x[i2 + d]. If y is the reverse of x translated with L2R_lkup (i.e.
+ * y[j] = L2R_lkup[x[x_len - 1 - j]]), the d-th pair is (y[j1 + d], x[i2 + d])
+ * with j1 = x_len - 1 - i1. So walking away from the center is a forward
+ * comparison of 2 strings, which is done 8 bytes at a time: a whole run of
+ * matching (or mismatching) pairs is skipped in one query instead of being
+ * walked pair by pair. The letters that have no mapping in L2R_lkup are
+ * translated to a byte that is not in x so they never match.
+ * The palindromes are reported in the same order as with
+ * get_find_palindromes_at() above.
+ */
+
+#define ONES	0x0101010101010101ULL
+#define HIGHS	0x8080808080808080ULL
+
+/* The high bit of each byte of the returned word is set iff the
+   corresponding byte of 'v' is not 0. */
+static inline uint64_t nonzero_bytes(uint64_t v)
+{
+	return (((v & ~HIGHS) + ~HIGHS) | v) & HIGHS;
+}
+
+static inline int popcount64(uint64_t x)
+{
+#ifdef __GNUC__
+	return __builtin_popcountll(x);
+#else
+	x = x - ((x >> 1) & 0x5555555555555555ULL);
+	x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+	x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+	return (int) ((x * ONES) >> 56);
+#endif
+}
+
+/* Index of the lowest bit set in 'x' ('x' != 0). */
+static inline int lowest_bit(uint64_t x)
+{
+#ifdef __GNUC__
+	return __builtin_ctzll(x);
+#else
+	int i;
+
+	for (i = 0; !(x & 1ULL); i++, x >>= 1) ;
+	return i;
+#endif
+}
+
+/* Bit k of the returned word is set iff y[k] == x[k] (0 <= k < 64). The
+   pairs at or beyond 'max_len' are treated as mismatches. */
+static uint64_t match_bits(const char *y, const char *x, int max_len)
+{
+	uint64_t bits;
+	int k;
+#ifndef WORDS_BIGENDIAN
+	uint64_t a, b, t;
+	int w;
+
+	if (max_len >= 64) {
+		bits = 0;
+		for (w = 0; w < 8; w++) {
+			memcpy(&a, y + 8 * w, sizeof(uint64_t));
+			memcpy(&b, x + 8 * w, sizeof(uint64_t));
+			t = ~nonzero_bytes(a ^ b) & HIGHS;
+			/* Gather the 8 high bits in the lowest byte */
+			t = ((t >> 7) * 0x0102040810204080ULL) >> 56;
+			bits |= t << (8 * w);
+		}
+		return bits;
+	}
+#endif
+	if (max_len > 64)
+		max_len = 64;
+	for (bits = 0, k = 0; k < max_len; k++)
+		if (y[k] == x[k])
+			bits |= 1ULL << k;
+	return bits;
+}
+
+/* Returns the nb of pairs (y[k], x[k]) that can be matched starting at k = 0
+   (and before k = max_len) with at most '*nmis' mismatches. '*nmis' is
+   decremented by the nb of mismatches used. */
+static int extend_arm(const char *y, const char *x, int max_len, int *nmis)
+{
+	int k, nmis0, n;
+#ifndef WORDS_BIGENDIAN
+	uint64_t a, b, t;
+#endif
+
+	nmis0 = *nmis;
+#ifndef WORDS_BIGENDIAN
+	for (k = 0; k + 8 <= max_len; k += 8) {
+		memcpy(&a, y + k, sizeof(uint64_t));
+		memcpy(&b, x + k, sizeof(uint64_t));
+		t = nonzero_bytes(a ^ b);
+		if (t == 0)
+			continue;
+		n = popcount64(t);
+		if (n <= nmis0) {
+			nmis0 -= n;
+			continue;
+		}
+		/* The arm ends at the (nmis0 + 1)-th mismatch of the word */
+		for ( ; nmis0 > 0; nmis0--)
+			t &= t - 1;
+		*nmis = 0;
+		return k + (lowest_bit(t) >> 3);
+	}
+#else
+	k = 0;
+#endif
+	for ( ; k < max_len; k++) {
+		if (y[k] == x[k])
+			continue;
+		if (nmis0 == 0)
+			break;
+		nmis0--;
+	}
+	*nmis = nmis0;
+	return k;
+}
+
+/* Reports the maximal runs of matching pairs (y[d], x[d]) that have at
+   least 'min_arm_len' pairs and start at d0 <= d < start_max_d, from left
+   to right. Pair d0 - 1 must be a mismatch (if d0 != 0).
+   The diagonal is scanned 64 pairs at a time: with M the match bits of the
+   pairs, M & (M >> 1) & ... & (M >> (m - 1)) has bit d set iff the m pairs
+   starting at d all match so the runs that are too short to be reported
+   are never visited. */
+static void report_exact_arms(const char *y1, const char *x2,
+		int d0, int start_max_d, int max_d, int i1, int i2,
+		int min_arm_len)
+{
+	int mm, base, len, step, d, arm_len, nmis;
+	uint64_t lo, hi, A_lo, A_hi, prev_top, starts;
+
+	if (start_max_d - d0 <= 8) {
+		/* Too few start positions to make the bit masks worth it */
+		for (d = d0; d < start_max_d; d++) {
+			if (y1[d] != x2[d])
+				continue;
+			nmis = 0;
+			arm_len = extend_arm(y1 + d, x2 + d, max_d - d, &nmis);
+			d += arm_len;
+			if (arm_len >= min_arm_len)
+				_report_match(i1 - d + 2, i2 - i1 + 2 * d - 1);
+		}
+		return;
+	}
+	mm = min_arm_len < 1 ? 1 : min_arm_len > 64 ? 64 : min_arm_len;
+	lo = match_bits(y1 + d0, x2 + d0, max_d - d0);
+	hi = match_bits(y1 + d0 + 64, x2 + d0 + 64, max_d - d0 - 64);
+	prev_top = 0;
+	for (base = d0; base < start_max_d; base += 64) {
+		/* (A_hi:A_lo) is (hi:lo) "and-ed" with itself shifted right
+		   1, 2, ..., mm - 1 times */
+		A_lo = lo;
+		A_hi = hi;
+		for (len = 1; len < mm; len += step) {
+			step = mm - len < len ? mm - len : len;
+			A_lo &= (A_lo >> step) | (A_hi << (64 - step));
+			A_hi &= A_hi >> step;
+		}
+		/* Keep the pairs that start a run */
+		starts = A_lo & ~((lo << 1) | prev_top);
+		if (start_max_d - base < 64)
+			starts &= (1ULL << (start_max_d - base)) - 1;
+		for ( ; starts != 0; starts &= starts - 1) {
+			d = base + lowest_bit(starts);
+			nmis = 0;
+			arm_len = extend_arm(y1 + d, x2 + d, max_d - d, &nmis);
+			if (arm_len >= min_arm_len) {
+				d += arm_len;
+				_report_match(i1 - d + 2, i2 - i1 + 2 * d - 1);
+			}
+		}
+		prev_top = lo >> 63;
+		lo = hi;
+		if (base + 64 < start_max_d)
+			hi = match_bits(y1 + base + 128, x2 + base + 128,
+					max_d - base - 128);
+	}
+	return;
+}
+
+static void find_palindromes_at(const char *x, const char *y, int x_len,
+	int i1, int i2, int max_loop_len1, int min_arm_len, int max_nmis)
+{
+	int max_d, start_max_d, d, arm_len;
+	const char *y1, *x2;
+
+	if (i2 - i1 > max_loop_len1)
+		return;
+	/* Nb of pairs until we hit one end of x */
+	max_d = i1 + 1;
+	if (x_len - i2 < max_d)
+		max_d = x_len - i2;
+	/* An arm can only start at pair d if i2 - i1 + 2 * d <= max_loop_len1
+	   (i.e. if the loop is not too long) */
+	start_max_d = (max_loop_len1 - (i2 - i1)) / 2 + 1;
+	if (start_max_d > max_d)
+		start_max_d = max_d;
+	y1 = y + x_len - 1 - i1;
+	x2 = x + i2;
+	d = 0;
+	if (max_nmis > 0 && start_max_d > 0) {
+		/* The 1st arm starts at the 1st pair and uses the mismatches
+		   (all of them, unless it hits one end of x) */
+		arm_len = extend_arm(y1, x2, max_d, &max_nmis);
+		d += arm_len;
+		if (arm_len >= min_arm_len)
+			_report_match(i1 - d + 2, i2 - i1 + 2 * d - 1);
+		/* Skip the pair that ended the arm */
+		d++;
+	}
+	if (d < start_max_d)
+		report_exact_arms(y1, x2, d, start_max_d, max_d, i1, i2,
+				  min_arm_len);
+	return;
+}
+
+/* Returns a byte value that is not in 'x', or -1 if 'x' contains all of
+   them. */
+static int get_unused_byte(const char *x, int x_len)
+{
+	char is_used[256];
+	int i;
+
+	memset(is_used, 0, sizeof(is_used));
+	for (i = 0; i < x_len; i++)
+		is_used[(unsigned char) x[i]] = 1;
+	for (i = 0; i < 256; i++)
+		if (!is_used[i])
+			return i;
+	return -1;
+}
+
+/* Returns NULL if 'x' contains all the byte values. */
+static char *new_translated_rev(const char *x, int x_len,
+		const int *lkup, int lkup_len)
+{
+	char *y;
+	int unused_byte, i, key, val;
+
+	unused_byte = get_unused_byte(x, x_len);
+	if (unused_byte == -1)
+		return NULL;
+	y = (char *) R_alloc(x_len, sizeof(char));
+	for (i = 0; i < x_len; i++) {
+		key = (unsigned char) x[x_len - 1 - i];
+		if (lkup == NULL)
+			val = key;
+		else if (key >= lkup_len || (val = lkup[key]) == NA_INTEGER)
+			val = unused_byte;
+		y[i] = (char) val;
+	}
+	return y;
+}
+
 /* --- .Call ENTRY POINT --- */
 SEXP find_palindromes(SEXP x, SEXP min_armlength, SEXP max_looplength,
 		      SEXP max_mismatch, SEXP L2R_lkup)
@@ -71,6 +337,7 @@ SEXP find_palindromes(SEXP x, SEXP min_armlength, SEXP max_looplength,
 	Chars_holder x_holder;
 	int x_len, min_arm_len, max_loop_len1, max_nmis, lkup_len, n;
 	const int *lkup;
+	const char *y;
 
 	x_holder = hold_XRaw(x);
 	x_len = x_holder.length;
@@ -85,7 +352,17 @@ SEXP find_palindromes(SEXP x, SEXP min_armlength, SEXP max_looplength,
 		lkup_len = LENGTH(L2R_lkup);
 	}
 	_init_match_reporting("MATCHES_AS_RANGES", 1);
+	y = new_translated_rev(x_holder.ptr, x_len, lkup, lkup_len);
 	for (n = 0; n < x_len; n++) {
+		if (y != NULL) {
+			find_palindromes_at(x_holder.ptr, y, x_len, n - 1, n + 1,
+					    max_loop_len1, min_arm_len,
+					    max_nmis);
+			find_palindromes_at(x_holder.ptr, y, x_len, n, n + 1,
+					    max_loop_len1, min_arm_len,
+					    max_nmis);
+			continue;
+		}
 		/* Find palindromes centered on n. */
 		get_find_palindromes_at(x_holder.ptr, x_len, n - 1, n + 1,
 					max_loop_len1, min_arm_len, max_nmis,
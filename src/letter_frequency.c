@@ -2,6 +2,10 @@
 #include "XVector_interface.h"
 #include "IRanges_interface.h"
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 static ByteTrTable byte2offset;
 
 static SEXP init_numeric_vector(int n, double val, int as_integer)
@@ -59,11 +63,70 @@ static int get_ans_width(SEXP codes, int with_other)
 	return width;
 }
 
+/*
+ * Long sequences are first tabulated into a 256-bin byte histogram which
+ * is then mapped to the requested codes. The histogram is split into 4
+ * interleaved sub-histograms so that consecutive identical bytes (e.g. long
+ * runs of N) don't increment the same counter back-to-back, which would
+ * serialize the loop on store-to-load forwarding. Short sequences are
+ * counted directly because clearing and folding the histogram would cost
+ * more than the counting itself.
+ */
+#define BYTE_HIST_MINLEN 512
+
+static void tabulate_bytes(const Chars_holder *X, int *byte_counts)
+{
+	int hist[4][256], i, n;
+	const unsigned char *c;
+
+	memset(hist, 0, sizeof(hist));
+	c = (const unsigned char *) X->ptr;
+	n = X->length;
+	for (i = 0; i + 4 <= n; i += 4, c += 4) {
+		hist[0][c[0]]++;
+		hist[1][c[1]]++;
+		hist[2][c[2]]++;
+		hist[3][c[3]]++;
+	}
+	for ( ; i < n; i++, c++)
+		hist[0][*c]++;
+	for (i = 0; i < 256; i++)
+		byte_counts[i] = hist[0][i] + hist[1][i] + hist[2][i] +
+				 hist[3][i];
+	return;
+}
+
+/* Adds the histogram of 'X' to 'row' using the current 'byte2offset'
+   mapping (or the identity mapping if 'use_byte2offset' is 0). */
+static void add_byte_hist_to_row(int *row, int nrow, const Chars_holder *X,
+		int use_byte2offset)
+{
+	int byte_counts[256], i, offset;
+
+	tabulate_bytes(X, byte_counts);
+	for (i = 0; i < 256; i++) {
+		if (byte_counts[i] == 0)
+			continue;
+		offset = i;
+		if (use_byte2offset) {
+			offset = byte2offset.byte2code[i];
+			if (offset == NA_INTEGER)
+				continue;
+		}
+		row[offset * nrow] += byte_counts[i];
+	}
+	return;
+}
+
 static void update_letter_freqs(int *row, int nrow, const Chars_holder *X, SEXP codes)
 {
 	int i, offset;
 	const char *c;
 
+	if (X->length >= BYTE_HIST_MINLEN) {
+		add_byte_hist_to_row(row, nrow, X, codes != R_NilValue);
+		return;
+	}
 	for (i = 0, c = X->ptr; i < X->length; i++, c++) {
 		offset = (unsigned char) *c;
 		if (codes != R_NilValue) {
@@ -84,6 +147,10 @@ static void update_letter_freqs_without_codes(int *row, int nrow,
 	const char *c;
 	int k = X->length;
 
+	if (k >= BYTE_HIST_MINLEN) {
+		add_byte_hist_to_row(row, nrow, X, 1);
+		return;
+	}
 	for (i = 0, c = X->ptr; i < k; i++, c++) {
 		offset = byte2offset.byte2code[(unsigned char) *c];
 		if (offset != NA_INTEGER)
@@ -283,6 +350,27 @@ static void update_oligo_freqs(SEXP mat, int mat_row, int mat_nrow,
 	return;
 }
 
+/* Same as update_oligo_freqs() but works on a raw pointer to the counts so
+   it can be called from a worker thread. */
+static void update_oligo_freqs_at(void *counts, int as_integer, int stride,
+		int width, int step,
+		TwobitEncodingBuffer *teb, const Chars_holder *X)
+{
+	if (as_integer)
+		update_int_oligo_freqs((int *) counts, stride,
+				width, step, teb, X);
+	else
+		update_double_oligo_freqs((double *) counts, stride,
+				width, step, teb, X);
+	return;
+}
+
+static void *get_counts_ptr(SEXP counts)
+{
+	return TYPEOF(counts) == INTSXP ? (void *) INTEGER(counts) :
+					  (void *) REAL(counts);
+}
+
 static void normalize_oligo_freqs(SEXP mat, int mat_nrow, int mat_ncol)
 {
 	int i, j;
@@ -664,18 +752,28 @@ SEXP XString_oligo_frequency(SEXP x, SEXP width, SEXP step,
 	return ans;
 }
 
+/*
+ * When 'nthreads' > 1, the elements of 'x' are distributed across the
+ * threads in contiguous blocks, each thread using its own copy of the
+ * TwobitEncodingBuffer. The rows of the matrix (or the elements of the list)
+ * are independent so they are filled in place. With
+ * 'simplify.as="collapsed"', each thread accumulates the counts in its own
+ * histogram and the histograms are summed at the end.
+ */
 SEXP XStringSet_oligo_frequency(SEXP x, SEXP width, SEXP step,
 		SEXP as_prob, SEXP as_array,
 		SEXP fast_moving_side, SEXP with_labels,
-		SEXP simplify_as, SEXP base_codes)
+		SEXP simplify_as, SEXP base_codes, SEXP nthreads)
 {
 	SEXP ans, base_labels, ans_elt;
 	TwobitEncodingBuffer teb;
 	int width0, step0, as_integer, as_array0,
-	    invert_twobit_order, ans_width, x_length, i;
+	    invert_twobit_order, ans_width, x_length, i, nthreads0;
 	const char *simplify_as0;
 	XStringSet_holder x_holder;
 	Chars_holder x_elt;
+	size_t elt_size;
+	char *ans_p, *partials, **elt_p;
 
 	width0 = INTEGER(width)[0];
 	step0 = INTEGER(step)[0];
@@ -691,13 +789,40 @@ SEXP XStringSet_oligo_frequency(SEXP x, SEXP width, SEXP step,
 	ans_width = 1 << (width0 * 2); /* 4^width0 */
 	x_length = _get_XStringSet_length(x);
 	x_holder = _hold_XStringSet(x);
+	nthreads0 = INTEGER(nthreads)[0];
+#ifndef _OPENMP
+	nthreads0 = 1;
+#endif
+	if (nthreads0 > x_length)
+		nthreads0 = x_length;
+	if (nthreads0 < 1)
+		nthreads0 = 1;
+	elt_size = as_integer ? sizeof(int) : sizeof(double);
 	if (strcmp(simplify_as0, "matrix") == 0) {  /* the default */
 		PROTECT(ans = init_numeric_matrix(x_length, ans_width,
 						  0.00, as_integer));
-		for (i = 0; i < x_length; i++) {
-			x_elt = _get_elt_from_XStringSet_holder(&x_holder, i);
-			update_oligo_freqs(ans, i, x_length, width0, step0,
-					   &teb, &x_elt);
+		if (nthreads0 == 1) {
+			for (i = 0; i < x_length; i++) {
+				x_elt = _get_elt_from_XStringSet_holder(
+						&x_holder, i);
+				update_oligo_freqs(ans, i, x_length,
+						   width0, step0,
+						   &teb, &x_elt);
+			}
+		} else {
+			ans_p = (char *) get_counts_ptr(ans);
+#ifdef _OPENMP
+			#pragma omp parallel for num_threads(nthreads0) \
+				schedule(static) firstprivate(teb) private(x_elt)
+			for (i = 0; i < x_length; i++) {
+				x_elt = _get_elt_from_XStringSet_holder(
+						&x_holder, i);
+				update_oligo_freqs_at(ans_p + elt_size * i,
+						      as_integer, x_length,
+						      width0, step0,
+						      &teb, &x_elt);
+			}
+#endif
 		}
 		if (!as_integer)
 			normalize_oligo_freqs(ans, x_length, ans_width);
@@ -708,10 +833,59 @@ SEXP XStringSet_oligo_frequency(SEXP x, SEXP width, SEXP step,
 	}
 	if (strcmp(simplify_as0, "collapsed") == 0) {
 		PROTECT(ans = init_numeric_vector(ans_width, 0.00, as_integer));
-		for (i = 0; i < x_length; i++) {
-			x_elt = _get_elt_from_XStringSet_holder(&x_holder, i);
-			update_oligo_freqs(ans, 0, 1, width0, step0,
-					   &teb, &x_elt);
+		if (nthreads0 == 1) {
+			for (i = 0; i < x_length; i++) {
+				x_elt = _get_elt_from_XStringSet_holder(
+						&x_holder, i);
+				update_oligo_freqs(ans, 0, 1, width0, step0,
+						   &teb, &x_elt);
+			}
+		} else {
+			/* Thread 0 counts directly in 'ans', the other
+			   threads in their own zero-initialized histogram. */
+			ans_p = (char *) get_counts_ptr(ans);
+			partials = (char *) R_alloc(
+					(size_t) (nthreads0 - 1) * ans_width,
+					elt_size);
+			memset(partials, 0,
+			       (size_t) (nthreads0 - 1) * ans_width * elt_size);
+#ifdef _OPENMP
+			#pragma omp parallel num_threads(nthreads0) \
+				firstprivate(teb) private(x_elt)
+			{
+				int t = omp_get_thread_num();
+				char *counts = t == 0 ? ans_p :
+					partials + (size_t) (t - 1) *
+						   ans_width * elt_size;
+				int j;
+
+				#pragma omp for schedule(static)
+				for (j = 0; j < x_length; j++) {
+					x_elt = _get_elt_from_XStringSet_holder(
+							&x_holder, j);
+					update_oligo_freqs_at(counts,
+							as_integer, 1,
+							width0, step0,
+							&teb, &x_elt);
+				}
+			}
+			#pragma omp parallel for num_threads(nthreads0) \
+				schedule(static)
+			for (i = 0; i < ans_width; i++) {
+				int t;
+
+				for (t = 1; t < nthreads0; t++) {
+					if (as_integer)
+						((int *) ans_p)[i] +=
+						  ((int *) partials)[(size_t)
+						  (t - 1) * ans_width + i];
+					else
+						((double *) ans_p)[i] +=
+						  ((double *) partials)[(size_t)
+						  (t - 1) * ans_width + i];
+				}
+			}
+#endif
 		}
 		if (!as_integer)
 			normalize_oligo_freqs(ans, 1, ans_width);
@@ -721,17 +895,48 @@ SEXP XStringSet_oligo_frequency(SEXP x, SEXP width, SEXP step,
 		return ans;
 	}
 	PROTECT(ans = NEW_LIST(x_length));
+	if (nthreads0 == 1) {
+		for (i = 0; i < x_length; i++) {
+			PROTECT(ans_elt = init_numeric_vector(ans_width, 0.00,
+							      as_integer));
+			x_elt = _get_elt_from_XStringSet_holder(&x_holder, i);
+			update_oligo_freqs(ans_elt, 0, 1, width0, step0,
+					   &teb, &x_elt);
+			if (!as_integer)
+				normalize_oligo_freqs(ans_elt, 1, ans_width);
+			format_oligo_freqs(ans_elt, width0, base_labels,
+					   invert_twobit_order, as_array0);
+			SET_ELEMENT(ans, i, ans_elt);
+			UNPROTECT(1);
+		}
+		UNPROTECT(1);
+		return ans;
+	}
+	/* Allocate all the list elements first (the workers can't call the
+	   R API), then fill them in parallel. */
+	elt_p = (char **) R_alloc(x_length, sizeof(char *));
 	for (i = 0; i < x_length; i++) {
 		PROTECT(ans_elt = init_numeric_vector(ans_width, 0.00,
 						      as_integer));
+		SET_ELEMENT(ans, i, ans_elt);
+		UNPROTECT(1);
+		elt_p[i] = (char *) get_counts_ptr(ans_elt);
+	}
+#ifdef _OPENMP
+	#pragma omp parallel for num_threads(nthreads0) \
+		schedule(static) firstprivate(teb) private(x_elt)
+	for (i = 0; i < x_length; i++) {
 		x_elt = _get_elt_from_XStringSet_holder(&x_holder, i);
-		update_oligo_freqs(ans_elt, 0, 1, width0, step0, &teb, &x_elt);
+		update_oligo_freqs_at(elt_p[i], as_integer, 1, width0, step0,
+				      &teb, &x_elt);
+	}
+#endif
+	for (i = 0; i < x_length; i++) {
+		ans_elt = VECTOR_ELT(ans, i);
 		if (!as_integer)
 			normalize_oligo_freqs(ans_elt, 1, ans_width);
 		format_oligo_freqs(ans_elt, width0, base_labels,
 				   invert_twobit_order, as_array0);
-		SET_ELEMENT(ans, i, ans_elt);
-		UNPROTECT(1);
 	}
 	UNPROTECT(1);
 	return ans;
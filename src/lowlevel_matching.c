@@ -5,6 +5,13 @@
 #include "Biostrings.h"
 #include "XVector_interface.h"
 #include "IRanges_interface.h"
+#include <R_ext/Utils.h>  /* for R_CheckUserInterrupt() */
+
+#include <ctype.h>  /* for tolower() */
+#include <stdint.h>  /* for uint64_t */
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 
 /****************************************************************************
@@ -23,15 +30,19 @@ static BytewiseOpTable fixedPfixedS_match_table,
 		       nonfixedPfixedS_match_table,
 		       nonfixedPnonfixedS_match_table;
 
+/* Letters match iff they are equal when ignoring case */
+static BytewiseOpTable caseless_match_table;
+
 void _init_bytewise_match_tables()
 {
 	int i, j;
-	unsigned char *val1, *val2, *val3, *val4, x, y;
+	unsigned char *val1, *val2, *val3, *val4, *val5, x, y;
 
 	val1 = fixedPfixedS_match_table.xy2val[0];
 	val2 = fixedPnonfixedS_match_table.xy2val[0];
 	val3 = nonfixedPfixedS_match_table.xy2val[0];
 	val4 = nonfixedPnonfixedS_match_table.xy2val[0];
+	val5 = caseless_match_table.xy2val[0];
 	for (i = 0; i < 256; i++) {
 		x = (unsigned char) i;
 		for (j = 0; j < 256; j++) {
@@ -40,6 +51,7 @@ void _init_bytewise_match_tables()
 			*(val2++) = (x & ~y) == 0;
 			*(val3++) = (~x & y) == 0;
 			*(val4++) = (x & y) != 0;
+			*(val5++) = tolower(x) == tolower(y);
 		}
 	}
 	return;
@@ -89,6 +101,168 @@ int _nmismatch_at_Pshift(const Chars_holder *P,
 }
 
 
+/****************************************************************************
+ * A bit-parallel edit distance implementation.
+ *
+ * Myers' algorithm (Myers, 1999) in the block-based formulation of Hyyro
+ * (Hyyro, 2003): the vertical deltas (-1, 0 or +1) between consecutive rows
+ * of a column of the DP matrix are stored in 2 bit-vectors (Pv and Mv) of
+ * nchar(P) bits each, cut in 64-bit blocks, and a whole column is computed
+ * with a few word operations per block. P is the "vertical" string. Its
+ * match profile (the Peq bit-vectors) is built lazily, only for the letters
+ * of S that are actually seen.
+ */
+
+typedef uint64_t MyersWord;
+
+#define MYERS_WORD_NBIT 64
+#define MYERS_ALL_ONES (~((MyersWord) 0))
+#define MYERS_HIGH_BIT (((MyersWord) 1) << (MYERS_WORD_NBIT - 1))
+/* Index of the Peq bit-vector used for letters outside of S */
+#define MYERS_NO_LETTER 256
+
+typedef struct myers_profile {
+	int max_nblock;
+	MyersWord *Peq;  /* (MYERS_NO_LETTER + 1) x max_nblock words */
+	MyersWord *Pv, *Mv;
+	char Peq_is_built[MYERS_NO_LETTER];
+	Chars_holder P;
+	int P_is_reversed;
+	int nblock;
+	MyersWord last_bit;  /* bit of the last row of P in the last block */
+	const BytewiseOpTable *bytewise_match_table;
+} MyersProfile;
+
+static void init_MyersProfile(MyersProfile *mp, int max_Plength,
+		MyersWord *words)
+{
+	mp->max_nblock = (max_Plength + MYERS_WORD_NBIT - 1) / MYERS_WORD_NBIT;
+	if (mp->max_nblock == 0)
+		mp->max_nblock = 1;
+	if (words == NULL)
+		words = (MyersWord *) R_alloc((long) mp->max_nblock *
+				(MYERS_NO_LETTER + 3), sizeof(MyersWord));
+	mp->Peq = words;
+	mp->Pv = mp->Peq + (MYERS_NO_LETTER + 1) * mp->max_nblock;
+	mp->Mv = mp->Pv + mp->max_nblock;
+	return;
+}
+
+/* 'P->length' must be <= the 'max_Plength' passed to init_MyersProfile() */
+static void set_MyersProfile_pattern(MyersProfile *mp, const Chars_holder *P,
+		int reverse, const BytewiseOpTable *bytewise_match_table)
+{
+	mp->P = *P;
+	mp->P_is_reversed = reverse;
+	mp->nblock = (P->length + MYERS_WORD_NBIT - 1) / MYERS_WORD_NBIT;
+	mp->last_bit = ((MyersWord) 1) << ((P->length + MYERS_WORD_NBIT - 1) %
+					   MYERS_WORD_NBIT);
+	mp->bytewise_match_table = bytewise_match_table;
+	memset(mp->Peq_is_built, 0, sizeof(mp->Peq_is_built));
+	memset(mp->Peq + MYERS_NO_LETTER * mp->max_nblock, 0,
+	       mp->nblock * sizeof(MyersWord));
+	return;
+}
+
+static const MyersWord *get_MyersProfile_Peq(MyersProfile *mp, int c)
+{
+	MyersWord *Peq;
+	const unsigned char *x2val;
+	int i, Pi;
+
+	Peq = mp->Peq + c * mp->max_nblock;
+	if (c == MYERS_NO_LETTER || mp->Peq_is_built[c])
+		return Peq;
+	memset(Peq, 0, mp->nblock * sizeof(MyersWord));
+	for (i = 0; i < mp->P.length; i++) {
+		Pi = mp->P_is_reversed ? mp->P.length - 1 - i : i;
+		x2val = mp->bytewise_match_table->xy2val[(unsigned char) mp->P.ptr[Pi]];
+		if (x2val[c])
+			Peq[i / MYERS_WORD_NBIT] |=
+				((MyersWord) 1) << (i % MYERS_WORD_NBIT);
+	}
+	mp->Peq_is_built[c] = 1;
+	return Peq;
+}
+
+/* Computes one 64-row block of a DP column. 'hin' and the returned value are
+ * the horizontal deltas entering the block at the top and leaving it at row
+ * 'out_bit'. */
+static inline int advance_Myers_block(MyersWord *Pv, MyersWord *Mv,
+		MyersWord Eq, int hin, MyersWord out_bit)
+{
+	MyersWord Xv, Xh, Ph, Mh, hin_is_neg;
+	int hout;
+
+	hin_is_neg = hin < 0 ? 1 : 0;
+	Xv = Eq | *Mv;
+	Eq |= hin_is_neg;
+	Xh = (((Eq & *Pv) + *Pv) ^ *Pv) | Eq;
+	Ph = *Mv | ~(Xh | *Pv);
+	Mh = *Pv & Xh;
+	hout = (Ph & out_bit) ? 1 : ((Mh & out_bit) ? -1 : 0);
+	Ph <<= 1;
+	Mh <<= 1;
+	Mh |= hin_is_neg;
+	if (hin > 0)
+		Ph |= 1;
+	*Pv = Mh | ~(Xv | Ph);
+	*Mv = Ph & Xv;
+	return hout;
+}
+
+/*
+ * Aligns P against the 'ntext' letters of S starting at 'Soffset' and going
+ * in the direction of 'Sstep' (1 or -1). The positions outside of S are
+ * treated as letters that match nothing. The first letter of P must be
+ * aligned with the first letter of this text (top row of the DP is 0, 1, 2,
+ * ...). If 'search_min' is 0, returns the edit distance between P and the
+ * whole text, or any number > 'max_nedit' as soon as the distance is known
+ * to be > 'max_nedit'. Otherwise returns the smallest edit distance between
+ * P and a prefix of the text and sets '*min_width' to the length of the
+ * shortest such prefix.
+ */
+static int scan_MyersProfile(MyersProfile *mp, const Chars_holder *S,
+		int Soffset, int Sstep, int ntext,
+		int max_nedit, int search_min, int *min_width)
+{
+	int b, w, Si, c, hin, nedit, min_nedit;
+	const MyersWord *Peq;
+	MyersWord *Pv, *Mv;
+	const int last_block = mp->nblock - 1;
+
+	for (b = 0, Pv = mp->Pv, Mv = mp->Mv; b < mp->nblock; b++, Pv++, Mv++) {
+		*Pv = MYERS_ALL_ONES;
+		*Mv = 0;
+	}
+	nedit = min_nedit = mp->P.length;
+	if (search_min)
+		*min_width = 0;
+	for (w = 1, Si = Soffset; w <= ntext; w++, Si += Sstep) {
+		c = Si >= 0 && Si < S->length ? (unsigned char) S->ptr[Si]
+					      : MYERS_NO_LETTER;
+		Peq = get_MyersProfile_Peq(mp, c);
+		hin = 1;
+		for (b = 0, Pv = mp->Pv, Mv = mp->Mv; b < last_block; b++, Pv++, Mv++)
+			hin = advance_Myers_block(Pv, Mv, Peq[b], hin,
+						  MYERS_HIGH_BIT);
+		if (last_block >= 0)
+			hin = advance_Myers_block(Pv, Mv, Peq[b], hin,
+						  mp->last_bit);
+		nedit += hin;
+		if (search_min) {
+			if (nedit < min_nedit) {
+				min_nedit = nedit;
+				*min_width = w;
+			}
+		} else if (nedit - (ntext - w) > max_nedit) {
+			break; // bailout
+		}
+	}
+	return search_min ? min_nedit : nedit;
+}
+
+
 /****************************************************************************
  * An edit distance implementation with early bailout.
  */
@@ -101,6 +275,27 @@ int _nmismatch_at_Pshift(const Chars_holder *P,
 
 static int row1_buf[MAX_ROW_LENGTH], row2_buf[MAX_ROW_LENGTH];
 
+/* Patterns up to MYERS_MAX_PLENGTH letters go thru the bit-parallel
+ * implementation */
+#define MYERS_MAX_PLENGTH 1024
+#define MYERS_MAX_NBLOCK (MYERS_MAX_PLENGTH / MYERS_WORD_NBIT)
+
+/* The profile lives on the stack (only the part needed for 'P' is used) so
+ * this can be called from several threads at the same time. */
+static int nedit_Myers(const Chars_holder *P, const Chars_holder *S,
+		int offset, int reverse, int max_nedit, int *min_width,
+		const BytewiseOpTable *bytewise_match_table)
+{
+	MyersWord words[(MYERS_NO_LETTER + 3) * MYERS_MAX_NBLOCK];
+	MyersProfile mp;
+
+	init_MyersProfile(&mp, P->length, words);
+	set_MyersProfile_pattern(&mp, P, reverse, bytewise_match_table);
+	return scan_MyersProfile(&mp, S, offset, reverse ? -1 : 1,
+				 P->length + max_nedit, max_nedit, 1,
+				 min_width);
+}
+
 #define SWAP_NEDIT_BUFS(prev_row, curr_row) \
 { \
 	int *tmp; \
@@ -148,10 +343,13 @@ int _nedit_for_Ploffset(const Chars_holder *P, const Chars_holder *S,
 	if (max_nedit > P->length)
 		max_nedit = P->length;
 	// from now max_nedit <= P->length
-	if (max_nedit > MAX_NEDIT)
-		error("'max.nedit' too big");
 	if (bytewise_match_table == NULL)
 		bytewise_match_table = &fixedPfixedS_match_table;
+	if (P->length <= MYERS_MAX_PLENGTH)
+		return nedit_Myers(P, S, Ploffset, 0, max_nedit, min_width,
+				   bytewise_match_table);
+	if (max_nedit > MAX_NEDIT)
+		error("'max.nedit' too big");
 	prev_row = row1_buf;
 	curr_row = row2_buf;
 	row_length = 2 * max_nedit + 1;
@@ -231,10 +429,13 @@ int _nedit_for_Proffset(const Chars_holder *P, const Chars_holder *S,
 	if (max_nedit > P->length)
 		max_nedit = P->length;
 	// from now max_nedit <= P->length
-	if (max_nedit > MAX_NEDIT)
-		error("'max.nedit' too big");
 	if (bytewise_match_table == NULL)
 		bytewise_match_table = &fixedPfixedS_match_table;
+	if (P->length <= MYERS_MAX_PLENGTH)
+		return nedit_Myers(P, S, Proffset, 1, max_nedit, min_width,
+				   bytewise_match_table);
+	if (max_nedit > MAX_NEDIT)
+		error("'max.nedit' too big");
 	prev_row = row1_buf;
 	curr_row = row2_buf;
 	row_length = 2 * max_nedit + 1;
@@ -555,45 +756,493 @@ SEXP XStringSet_vmatch_pattern_at(SEXP pattern, SEXP subject, SEXP at, SEXP at_t
 }
 
 
+/****************************************************************************
+ * Hamming distances between packed strings.
+ *
+ * The letters of the set are recoded with 1, 2, 4 or 8 bits (the smallest
+ * width that can represent all the distinct letters found in the set) and
+ * packed in 64-bit words. The number of mismatches between 2 strings is the
+ * number of non-zero lanes in the XOR of their words: each lane is folded
+ * onto its lowest bit and the lowest bits are counted with a popcount.
+ * The pairs are visited by blocks of HAMMING_ROW_BLOCK rows, each block
+ * being compared to tiles of about HAMMING_TILE_NWORD words of packed
+ * strings so the 2 sides of the comparison stay in cache. The blocks are
+ * processed in batches of HAMMING_NBLOCK_PER_THREAD blocks per thread and
+ * the main thread checks for user interrupts between batches.
+ */
+
+#define HAMMING_ROW_BLOCK 64
+#define HAMMING_NBLOCK_PER_THREAD 16
+#define HAMMING_TILE_NWORD 4096
+
+typedef struct packed_strings {
+	uint64_t *words;
+	int nelt, nword, nbit;
+	uint64_t lane_lowbits;
+} PackedStrings;
+
+typedef struct hamming_edge {
+	int from, to, dist;
+} HammingEdge;
+
+/* Malloc'ed so it can be grown by the worker threads (see
+   free_HammingEdges()) */
+typedef struct hamming_edges {
+	HammingEdge *elts;
+	size_t nelt, buflength;
+	int failed;
+} HammingEdges;
+
+static inline int popcount64(uint64_t x)
+{
+#ifdef __GNUC__
+	return __builtin_popcountll(x);
+#else
+	x = x - ((x >> 1) & 0x5555555555555555ULL);
+	x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+	x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+	return (int) ((x * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+/* All the elements of 'X' must have length 'length' */
+static PackedStrings pack_XStringSet(const XStringSet_holder *X, int nelt,
+		int length)
+{
+	PackedStrings P;
+	int byte2code[256], ncode, nlane, i, k;
+	Chars_holder x_i;
+	const unsigned char *c;
+	uint64_t *w;
+
+	for (k = 0; k < 256; k++)
+		byte2code[k] = -1;
+	ncode = 0;
+	for (i = 0; i < nelt; i++) {
+		x_i = _get_elt_from_XStringSet_holder(X, i);
+		for (k = 0, c = (const unsigned char *) x_i.ptr;
+		     k < length;
+		     k++, c++)
+		{
+			if (byte2code[*c] == -1)
+				byte2code[*c] = ncode++;
+		}
+	}
+	for (P.nbit = 1; (1 << P.nbit) < ncode; P.nbit *= 2) {};
+	nlane = 64 / P.nbit;
+	P.nelt = nelt;
+	P.nword = (length + nlane - 1) / nlane;
+	P.lane_lowbits = 0;
+	for (k = 0; k < 64; k += P.nbit)
+		P.lane_lowbits |= ((uint64_t) 1) << k;
+	P.words = (uint64_t *) R_alloc((size_t) nelt * P.nword + 1,
+				       sizeof(uint64_t));
+	memset(P.words, 0, sizeof(uint64_t) * ((size_t) nelt * P.nword + 1));
+	for (i = 0; i < nelt; i++) {
+		x_i = _get_elt_from_XStringSet_holder(X, i);
+		w = P.words + (size_t) i * P.nword;
+		for (k = 0, c = (const unsigned char *) x_i.ptr;
+		     k < length;
+		     k++, c++)
+		{
+			w[k / nlane] |= ((uint64_t) byte2code[*c]) <<
+					(P.nbit * (k % nlane));
+		}
+	}
+	return P;
+}
+
+/* Stops counting as soon as 'max_nmis' is exceeded */
+static inline int packed_hamming(const PackedStrings *P, int i, int j,
+		int max_nmis)
+{
+	const uint64_t *a, *b;
+	uint64_t z;
+	int nmis, k, shift;
+
+	a = P->words + (size_t) i * P->nword;
+	b = P->words + (size_t) j * P->nword;
+	nmis = 0;
+	for (k = 0; k < P->nword; k++) {
+		z = a[k] ^ b[k];
+		for (shift = 1; shift < P->nbit; shift <<= 1)
+			z |= z >> shift;
+		nmis += popcount64(z & P->lane_lowbits);
+		if (nmis > max_nmis)
+			break;
+	}
+	return nmis;
+}
+
+static int append_HammingEdge(HammingEdges *edges, int from, int to, int dist)
+{
+	size_t new_buflength;
+	HammingEdge *new_elts;
+
+	if (edges->nelt == edges->buflength) {
+		new_buflength = edges->buflength == 0 ? 256 :
+						       2 * edges->buflength;
+		new_elts = (HammingEdge *) realloc(edges->elts,
+					new_buflength * sizeof(HammingEdge));
+		if (new_elts == NULL) {
+			edges->failed = 1;
+			return -1;
+		}
+		edges->elts = new_elts;
+		edges->buflength = new_buflength;
+	}
+	edges->elts[edges->nelt].from = from;
+	edges->elts[edges->nelt].to = to;
+	edges->elts[edges->nelt].dist = dist;
+	edges->nelt++;
+	return 0;
+}
+
+static int cmp_HammingEdge(const void *p1, const void *p2)
+{
+	const HammingEdge *e1 = p1, *e2 = p2;
+
+	if (e1->from != e2->from)
+		return e1->from < e2->from ? -1 : 1;
+	return e1->to < e2->to ? -1 : e1->to > e2->to;
+}
+
 /*
- * XStringSet_dist_hamming() used by stringDist, method = "hamming".
+ * Compares the rows in [i0, i1) with all the following strings. The
+ * distances go to 'int_ans' or 'double_ans' (lower triangle of the distance
+ * matrix, the distances > 'max_nmis' being set to Inf in 'double_ans'), or,
+ * if 'edges' is not NULL, the pairs within 'max_nmis' are appended to it
+ * (sorted by row then column).
  */
-SEXP XStringSet_dist_hamming(SEXP x)
+static void hamming_row_block(const PackedStrings *P, int i0, int i1,
+		int max_nmis, int *int_ans, double *double_ans,
+		HammingEdges *edges)
+{
+	int n, tile, j0, j1, i, j, nmis;
+	R_xlen_t offset;
+
+	n = P->nelt;
+	tile = P->nword == 0 ? n : HAMMING_TILE_NWORD / P->nword;
+	if (tile < HAMMING_ROW_BLOCK)
+		tile = HAMMING_ROW_BLOCK;
+	for (j0 = i0 + 1; j0 < n; j0 += tile) {
+		j1 = j0 + tile < n ? j0 + tile : n;
+		for (i = i0; i < i1; i++) {
+			j = i + 1 > j0 ? i + 1 : j0;
+			offset = (R_xlen_t) i * (n - 1) -
+				 (R_xlen_t) i * (i - 1) / 2 - i - 1;
+			for (; j < j1; j++) {
+				nmis = packed_hamming(P, i, j, max_nmis);
+				if (int_ans != NULL) {
+					int_ans[offset + j] = nmis;
+				} else if (double_ans != NULL) {
+					double_ans[offset + j] =
+						nmis > max_nmis ? R_PosInf
+								: (double) nmis;
+				} else if (nmis <= max_nmis &&
+					   append_HammingEdge(edges, i, j,
+							      nmis) != 0) {
+					return;
+				}
+			}
+		}
+	}
+	if (edges != NULL)
+		qsort(edges->elts, edges->nelt, sizeof(HammingEdge),
+		      cmp_HammingEdge);
+	return;
+}
+
+static PackedStrings pack_equal_length_strings(SEXP x)
 {
-	Chars_holder x_i, x_j;
 	XStringSet_holder X;
-	int X_length, *ans_elt, i, j, max_nmis;
-	unsigned long ans_length;
-	SEXP ans;
+	int X_length, length, i;
 
 	X = _hold_XStringSet(x);
 	X_length = _get_length_from_XStringSet_holder(&X);
-	if (X_length < 2)
-		return NEW_INTEGER(0);
-
-	x_i = _get_elt_from_XStringSet_holder(&X, 0);
-	for (j = 1; j < X_length; j++) {
-		x_j = _get_elt_from_XStringSet_holder(&X, j);
-		if (x_i.length != x_j.length)
+	length = X_length == 0 ? 0 :
+			_get_elt_from_XStringSet_holder(&X, 0).length;
+	for (i = 1; i < X_length; i++) {
+		if (_get_elt_from_XStringSet_holder(&X, i).length != length)
 		      error("Hamming distance requires equal length strings");
 	}
+	return pack_XStringSet(&X, X_length, length);
+}
+
+static int get_nthreads(SEXP nthreads, int nblock)
+{
+	int nthreads0;
 
-	ans_length = ((unsigned long) X_length) *
-		     ((unsigned long) X_length - 1) / 2;
-	if (ans_length > INT_MAX)
-		error("result would be too big an object");
-	PROTECT(ans = NEW_INTEGER((int) ans_length));
-	ans_elt = INTEGER(ans);
+	nthreads0 = INTEGER(nthreads)[0];
+#ifndef _OPENMP
+	nthreads0 = 1;
+#endif
+	if (nthreads0 > nblock)
+		nthreads0 = nblock;
+	if (nthreads0 < 1)
+		nthreads0 = 1;
+	return nthreads0;
+}
+
+/* Processes blocks 'b0' to 'b1' - 1. If 'edges' is not NULL, the edges of
+   block 'b' go to 'edges[b]'. */
+static void hamming_row_blocks(const PackedStrings *P, int b0, int b1,
+		int max_nmis, int *int_ans, double *double_ans,
+		HammingEdges *edges, int nthreads0)
+{
+	int b, i0, i1;
 
-	max_nmis = _get_elt_from_XStringSet_holder(&X, 0).length;
-	for (i = 0; i < (X_length - 1); i++) {
-		x_i = _get_elt_from_XStringSet_holder(&X, i);
-		for (j = (i+1); j < X_length; j++, ans_elt++) {
-			x_j = _get_elt_from_XStringSet_holder(&X, j);
-			*ans_elt = nedit_at(&x_i, &x_j, 1, 0, max_nmis, 0, 1, 1);
+	if (nthreads0 == 1) {
+		for (b = b0; b < b1; b++) {
+			i0 = b * HAMMING_ROW_BLOCK;
+			i1 = i0 + HAMMING_ROW_BLOCK;
+			if (i1 > P->nelt)
+				i1 = P->nelt;
+			hamming_row_block(P, i0, i1, max_nmis,
+					  int_ans, double_ans,
+					  edges == NULL ? NULL : edges + b);
 		}
+		return;
+	}
+#ifdef _OPENMP
+	#pragma omp parallel for num_threads(nthreads0) \
+		schedule(dynamic, 1) private(i0, i1)
+	for (b = b0; b < b1; b++) {
+		i0 = b * HAMMING_ROW_BLOCK;
+		i1 = i0 + HAMMING_ROW_BLOCK;
+		if (i1 > P->nelt)
+			i1 = P->nelt;
+		hamming_row_block(P, i0, i1, max_nmis,
+				  int_ans, double_ans,
+				  edges == NULL ? NULL : edges + b);
+	}
+#endif
+	return;
+}
+
+static void hamming_all_row_blocks(const PackedStrings *P, int nblock,
+		int max_nmis, int *int_ans, double *double_ans,
+		HammingEdges *edges, int nthreads0)
+{
+	int batch_size, b0, b1;
+
+	batch_size = nthreads0 * HAMMING_NBLOCK_PER_THREAD;
+	for (b0 = 0; b0 < nblock; b0 = b1) {
+		R_CheckUserInterrupt();
+		b1 = b0 + batch_size;
+		if (b1 > nblock)
+			b1 = nblock;
+		hamming_row_blocks(P, b0, b1, max_nmis,
+				   int_ans, double_ans, edges, nthreads0);
+	}
+	return;
+}
+
+/*
+ * XStringSet_dist_hamming() used by stringDist, method = "hamming".
+ * Returns the lower triangle of the distance matrix as an integer vector,
+ * or, if 'max_dist' is not NA, as a double vector where the distances
+ * > 'max_dist' are reported as Inf. When OpenMP is available and 'nthreads'
+ * > 1, the blocks of rows are dynamically dispatched to the threads.
+ */
+SEXP XStringSet_dist_hamming(SEXP x, SEXP max_dist, SEXP nthreads)
+{
+	PackedStrings P;
+	int max_nmis, nblock, nthreads0, *int_ans;
+	double ans_length, *double_ans;
+	SEXP ans;
+
+	P = pack_equal_length_strings(x);
+	max_nmis = INTEGER(max_dist)[0];
+	ans_length = (double) P.nelt * (P.nelt - 1) / 2;
+	if (P.nelt < 2)
+		ans_length = 0;
+	if (max_nmis == NA_INTEGER) {
+		if (ans_length > INT_MAX)
+			error("result would be too big an object");
+		PROTECT(ans = NEW_INTEGER((int) ans_length));
+		int_ans = INTEGER(ans);
+		double_ans = NULL;
+		max_nmis = INT_MAX;
+	} else {
+		PROTECT(ans = allocVector(REALSXP, (R_xlen_t) ans_length));
+		int_ans = NULL;
+		double_ans = REAL(ans);
 	}
+	nblock = (P.nelt + HAMMING_ROW_BLOCK - 1) / HAMMING_ROW_BLOCK;
+	nthreads0 = get_nthreads(nthreads, nblock);
+	hamming_all_row_blocks(&P, nblock, max_nmis,
+			       int_ans, double_ans, NULL, nthreads0);
 	UNPROTECT(1);
 	return ans;
 }
 
+/*
+ * The HammingEdges buffers (1 per row block) are owned by an external
+ * pointer whose tag is the nb of blocks. Its finalizer frees them if
+ * XStringSet_hamming_pairs() doesn't get to do it because of an error or a
+ * user interrupt.
+ */
+static void free_HammingEdges(SEXP xp)
+{
+	HammingEdges *edges;
+	int nblock, b;
+
+	edges = (HammingEdges *) R_ExternalPtrAddr(xp);
+	if (edges == NULL)
+		return;
+	nblock = INTEGER(R_ExternalPtrTag(xp))[0];
+	for (b = 0; b < nblock; b++)
+		free(edges[b].elts);
+	Free(edges);
+	R_ClearExternalPtr(xp);
+	return;
+}
+
+/*
+ * XStringSet_hamming_pairs() used by hammingNeighbors().
+ * Returns the pairs of elements of 'x' that are within Hamming distance
+ * 'max_dist' as a list of 3 integer vectors (1-based 'from' < 'to', and
+ * 'distance'), sorted by 'from' then 'to'.
+ */
+SEXP XStringSet_hamming_pairs(SEXP x, SEXP max_dist, SEXP nthreads)
+{
+	PackedStrings P;
+	int max_nmis, nblock, nthreads0, b, failed,
+	    *from, *to, *dist;
+	HammingEdges *edges;
+	size_t nedge, k;
+	const HammingEdge *e;
+	SEXP tag, edges_xp, ans, ans_elt;
+
+	P = pack_equal_length_strings(x);
+	max_nmis = INTEGER(max_dist)[0];
+	nblock = (P.nelt + HAMMING_ROW_BLOCK - 1) / HAMMING_ROW_BLOCK;
+	nthreads0 = get_nthreads(nthreads, nblock);
+	PROTECT(tag = ScalarInteger(nblock));
+	PROTECT(edges_xp = R_MakeExternalPtr(NULL, tag, R_NilValue));
+	R_RegisterCFinalizer(edges_xp, free_HammingEdges);
+	edges = Calloc(nblock + 1, HammingEdges);
+	R_SetExternalPtrAddr(edges_xp, edges);
+	hamming_all_row_blocks(&P, nblock, max_nmis,
+			       NULL, NULL, edges, nthreads0);
+	failed = 0;
+	nedge = 0;
+	for (b = 0; b < nblock; b++) {
+		failed |= edges[b].failed;
+		nedge += edges[b].nelt;
+	}
+	if (failed) {
+		free_HammingEdges(edges_xp);
+		error("XStringSet_hamming_pairs(): cannot allocate memory");
+	}
+	PROTECT(ans = NEW_LIST(3));
+	for (k = 0; k < 3; k++) {
+		ans_elt = allocVector(INTSXP, (R_xlen_t) nedge);
+		SET_VECTOR_ELT(ans, k, ans_elt);
+	}
+	from = INTEGER(VECTOR_ELT(ans, 0));
+	to = INTEGER(VECTOR_ELT(ans, 1));
+	dist = INTEGER(VECTOR_ELT(ans, 2));
+	for (b = 0; b < nblock; b++) {
+		for (k = 0, e = edges[b].elts; k < edges[b].nelt; k++, e++) {
+			*(from++) = e->from + 1;
+			*(to++) = e->to + 1;
+			*(dist++) = e->dist;
+		}
+	}
+	free_HammingEdges(edges_xp);
+	UNPROTECT(3);
+	return ans;
+}
+
+
+/* Fills the distances between 'X->elts[i]' and the following strings */
+static void dist_levenshtein_row(const RoSeqs *X, int i, int max_nedit,
+		const BytewiseOpTable *bytewise_match_table,
+		MyersProfile *mp, double *ans)
+{
+	const Chars_holder *x_i, *x_j;
+	int j, nedit;
+	double *ans_elt;
+
+	x_i = X->elts + i;
+	set_MyersProfile_pattern(mp, x_i, 0, bytewise_match_table);
+	ans_elt = ans + (R_xlen_t) i * (X->nelt - 1) -
+			(R_xlen_t) i * (i - 1) / 2;
+	for (j = i + 1, x_j = X->elts + j; j < X->nelt; j++, x_j++, ans_elt++) {
+		if (abs(x_i->length - x_j->length) > max_nedit) {
+			*ans_elt = R_PosInf;
+			continue;
+		}
+		nedit = scan_MyersProfile(mp, x_j, 0, 1, x_j->length,
+					  max_nedit, 0, NULL);
+		*ans_elt = nedit > max_nedit ? R_PosInf : (double) nedit;
+	}
+	return;
+}
+
+/*
+ * XStringSet_dist_levenshtein() used by stringDist, method = "levenshtein".
+ * Returns the lower triangle of the distance matrix as a double vector.
+ * The distances > 'max_dist' (if not NA) are reported as Inf. When OpenMP
+ * is available and 'nthreads' > 1, the rows of the triangle are dynamically
+ * dispatched to the threads, each of them with its own Myers profile.
+ */
+SEXP XStringSet_dist_levenshtein(SEXP x, SEXP ignore_case, SEXP max_dist,
+		SEXP nthreads)
+{
+	RoSeqs X;
+	int X_length, max_nedit, nthreads0, max_length, i, t;
+	const BytewiseOpTable *bytewise_match_table;
+	MyersProfile *profiles;
+	double *ans_elt;
+	SEXP ans;
+
+	X_length = _get_XStringSet_length(x);
+	X = _new_RoSeqs_from_XStringSet(X_length, x);
+	bytewise_match_table = LOGICAL(ignore_case)[0] ?
+			&caseless_match_table : &fixedPfixedS_match_table;
+	max_nedit = INTEGER(max_dist)[0];
+	if (max_nedit == NA_INTEGER)
+		max_nedit = INT_MAX;
+	nthreads0 = INTEGER(nthreads)[0];
+#ifndef _OPENMP
+	nthreads0 = 1;
+#endif
+	if (nthreads0 > X_length - 1)
+		nthreads0 = X_length - 1;
+	if (nthreads0 < 1)
+		nthreads0 = 1;
+	max_length = 0;
+	for (i = 0; i < X_length; i++)
+		if (X.elts[i].length > max_length)
+			max_length = X.elts[i].length;
+	profiles = (MyersProfile *) R_alloc((long) nthreads0,
+					     sizeof(MyersProfile));
+	for (t = 0; t < nthreads0; t++)
+		init_MyersProfile(profiles + t, max_length, NULL);
+
+	PROTECT(ans = allocVector(REALSXP,
+			(R_xlen_t) X_length * (X_length - 1) / 2));
+	ans_elt = REAL(ans);
+	if (nthreads0 == 1) {
+		for (i = 0; i < X_length - 1; i++) {
+			R_CheckUserInterrupt();
+			dist_levenshtein_row(&X, i, max_nedit,
+					     bytewise_match_table,
+					     profiles, ans_elt);
+		}
+	} else {
+#ifdef _OPENMP
+		#pragma omp parallel for num_threads(nthreads0) schedule(dynamic, 1)
+		for (i = 0; i < X_length - 1; i++)
+			dist_levenshtein_row(&X, i, max_nedit,
+					     bytewise_match_table,
+					     profiles + omp_get_thread_num(),
+					     ans_elt);
+#endif
+	}
+	UNPROTECT(1);
+	return ans;
+}
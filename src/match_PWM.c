@@ -6,6 +6,17 @@
 #include "XVector_interface.h"
 #include "IRanges_interface.h"
 
+#include <float.h>  /* for DBL_EPSILON */
+#include <limits.h> /* for INT_MAX */
+#include <stdlib.h> /* for realloc() and free() */
+#include <string.h> /* for memcpy() */
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
 /*
  * Table used for fast look up between A, C, G, T internal codes and the
  * corresponding 0-based row index (the row offset) in the PWM:
@@ -45,16 +56,239 @@ static double compute_pwm_score(const double *pwm, int pwm_ncol,
 	return score;
 }
 
-static void _match_PWM_XString(const double *pwm, int pwm_ncol,
-		const Chars_holder *S, double minscore)
+
+/****************************************************************************
+ * The scanning engine used by matchPWM() and countPWM().
+ *
+ * The subject is encoded by chunks of PWM_CHUNK_NOFFSET offsets into row
+ * offsets (0-3 for A, C, G, T and 4 for any other letter) and the PWM is
+ * extended with a 5th row of zeros so the inner loops need no byte2offset
+ * lookup and no branch on the letter. The columns are visited in
+ * decreasing order of their "spread" (max weight minus mean weight) and an
+ * offset is abandoned as soon as its partial score plus the highest
+ * possible score of the remaining columns cannot reach 'minscore'
+ * (permuted lookahead).
+ * Because the columns are summed in a different order, the partial scores
+ * can differ from compute_pwm_score() in the last bits: the lookahead test
+ * is made with some slack and the offsets that pass it are rescored in
+ * the original order. So the matches are exactly the same as with
+ * compute_pwm_score().
+ */
+
+#define PWM_CHUNK_NOFFSET 16384
+#define PWM_NCOL_STAGE1   4
+
+typedef struct pwm_scanner {
+	const double *pwm;  /* original PWM (4 x ncol) */
+	int ncol;
+	int *col_order;     /* lookahead order */
+	double *weights;    /* 5 x ncol, columns in lookahead order */
+	double *bound;      /* bound[k]: max score of cols k to ncol-1 */
+	double minscore, threshold;  /* threshold = minscore - slack */
+} PWMScanner;
+
+/* The work buffers (one set per thread) */
+typedef struct pwm_scan_buf {
+	unsigned char *codes;  /* PWM_CHUNK_NOFFSET + max_ncol - 1 codes */
+	double *scores;        /* scores of the chunk offsets */
+	int *idx;              /* offsets that can still reach 'minscore' */
+} PWMScanBuf;
+
+static PWMScanner new_PWMScanner(const double *pwm, int pwm_ncol,
+		double minscore)
+{
+	PWMScanner scanner;
+	double *spread, colmax, abs_sum, w, tmp;
+	int j, k, i, tmpj;
+
+	scanner.pwm = pwm;
+	scanner.ncol = pwm_ncol;
+	scanner.col_order = (int *) R_alloc(pwm_ncol, sizeof(int));
+	scanner.weights = (double *) R_alloc(5 * pwm_ncol, sizeof(double));
+	scanner.bound = (double *) R_alloc(pwm_ncol + 1, sizeof(double));
+	spread = (double *) R_alloc(pwm_ncol, sizeof(double));
+	abs_sum = 0.00;
+	for (j = 0; j < pwm_ncol; j++) {
+		colmax = pwm[4 * j];
+		tmp = 0.00;
+		for (i = 0; i < 4; i++) {
+			w = pwm[4 * j + i];
+			if (w > colmax)
+				colmax = w;
+			tmp += w;
+			abs_sum += w >= 0.00 ? w : -w;
+		}
+		spread[j] = colmax - tmp / 4.00;
+		/* Insertion sort by decreasing spread */
+		for (k = j; k > 0 && spread[scanner.col_order[k - 1]] <
+				     spread[j]; k--)
+			scanner.col_order[k] = scanner.col_order[k - 1];
+		scanner.col_order[k] = j;
+	}
+	scanner.bound[pwm_ncol] = 0.00;
+	for (k = pwm_ncol - 1; k >= 0; k--) {
+		tmpj = scanner.col_order[k];
+		colmax = 0.00;  /* weight of the letters not in [ACGT] */
+		for (i = 0; i < 4; i++) {
+			w = pwm[4 * tmpj + i];
+			scanner.weights[5 * k + i] = w;
+			if (w > colmax)
+				colmax = w;
+		}
+		scanner.weights[5 * k + 4] = 0.00;
+		scanner.bound[k] = scanner.bound[k + 1] + colmax;
+	}
+	scanner.minscore = minscore;
+	/* Bound on the rounding error of 2 sums of 'pwm_ncol' terms */
+	scanner.threshold = minscore -
+			    4.00 * (pwm_ncol + 1) * DBL_EPSILON * abs_sum;
+	return scanner;
+}
+
+static PWMScanBuf new_PWMScanBuf(int max_ncol)
+{
+	PWMScanBuf buf;
+
+	buf.codes = (unsigned char *) R_alloc(PWM_CHUNK_NOFFSET + max_ncol,
+					      sizeof(unsigned char));
+	buf.scores = (double *) R_alloc(PWM_CHUNK_NOFFSET, sizeof(double));
+	buf.idx = (int *) R_alloc(PWM_CHUNK_NOFFSET, sizeof(int));
+	return buf;
+}
+
+/* Returns the nb of letters not in [ACGT] */
+static int encode_subject_chunk(const char *S, int nletter,
+		unsigned char *codes)
+{
+	int i, rowoffset, ninvalid;
+
+	ninvalid = 0;
+	for (i = 0; i < nletter; i++) {
+		rowoffset = byte2offset.byte2code[(unsigned char) S[i]];
+		if (rowoffset == NA_INTEGER) {
+			codes[i] = 4;
+			ninvalid++;
+		} else {
+			codes[i] = (unsigned char) rowoffset;
+		}
+	}
+	return ninvalid;
+}
+
+/* Same as compute_pwm_score() but on the encoded subject */
+static double rescore_offset(const PWMScanner *scanner,
+		const unsigned char *codes)
 {
-	int n1, n2;
+	const double *pwm;
+	int j;
 	double score;
 
-	for (n1 = 0, n2 = pwm_ncol; n2 <= S->length; n1++, n2++) {
-		score = compute_pwm_score(pwm, pwm_ncol, S->ptr, S->length, n1);
-		if (score >= minscore)
-			_report_match(n1 + 1, pwm_ncol);
+	score = 0.00;
+	for (j = 0, pwm = scanner->pwm; j < scanner->ncol; j++, pwm += 4) {
+		if (codes[j] != 4)
+			score += pwm[codes[j]];
+	}
+	return score;
+}
+
+/*
+ * Scans the first 'noffset' offsets of the chunk encoded in 'buf->codes'.
+ * The first PWM_NCOL_STAGE1 columns (in lookahead order) are scored for
+ * all the offsets at once, then the offsets that can still reach
+ * 'minscore' are collected in 'buf->idx' and this list is filtered again
+ * after each of the remaining columns. The loops have no data-dependent
+ * branch so they pipeline (and vectorize) well.
+ * Returns the nb of hits. The hits are stored in the first elements of
+ * 'buf->idx' (in increasing order) and their scores in 'buf->scores'
+ * (i.e. the score of hit 'n' is 'buf->scores[n]').
+ */
+static int scan_subject_chunk(const PWMScanner *scanner,
+		const PWMScanBuf *buf, int noffset)
+{
+	double *scores, threshold;
+	const double *weights;
+	const unsigned char *codes, *col_codes;
+	int *idx, ncol1, k, n, nidx, i, m;
+
+	codes = buf->codes;
+	scores = buf->scores;
+	idx = buf->idx;
+	ncol1 = scanner->ncol < PWM_NCOL_STAGE1 ?
+		scanner->ncol : PWM_NCOL_STAGE1;
+	memset(scores, 0, sizeof(double) * noffset);
+	for (k = 0, weights = scanner->weights; k < ncol1; k++, weights += 5) {
+		col_codes = codes + scanner->col_order[k];
+		n = 0;
+#if defined(__AVX2__)
+		{
+			__m128i vindex;
+			int four_codes;
+
+			/* The codes of 4 consecutive offsets for this column
+			   are contiguous */
+			for ( ; n + 4 <= noffset; n += 4) {
+				memcpy(&four_codes, col_codes + n, sizeof(int));
+				vindex = _mm_cvtepu8_epi32(
+					_mm_cvtsi32_si128(four_codes));
+				_mm256_storeu_pd(scores + n, _mm256_add_pd(
+					_mm256_loadu_pd(scores + n),
+					_mm256_i32gather_pd(weights, vindex, 8)));
+			}
+		}
+#endif
+		for ( ; n < noffset; n++)
+			scores[n] += weights[col_codes[n]];
+	}
+	threshold = scanner->threshold - scanner->bound[ncol1];
+	for (n = nidx = 0; n < noffset; n++) {
+		idx[nidx] = n;
+		nidx += scores[n] >= threshold;
+	}
+	for ( ; k < scanner->ncol && nidx != 0; k++, weights += 5) {
+		col_codes = codes + scanner->col_order[k];
+		threshold = scanner->threshold - scanner->bound[k + 1];
+		for (i = m = 0; i < nidx; i++) {
+			n = idx[i];
+			scores[n] += weights[col_codes[n]];
+			idx[m] = n;
+			m += scores[n] >= threshold;
+		}
+		nidx = m;
+	}
+	for (i = m = 0; i < nidx; i++) {
+		n = idx[i];
+		scores[n] = rescore_offset(scanner, codes + n);
+		idx[m] = n;
+		m += scores[n] >= scanner->minscore;
+	}
+	return m;
+}
+
+static void _match_PWM_XString(const PWMScanner *scanner,
+		const PWMScanBuf *buf, const Chars_holder *S)
+{
+	int offset0, noffset, nletter, nhit, i;
+
+	for (offset0 = 0;
+	     offset0 + scanner->ncol <= S->length;
+	     offset0 += noffset)
+	{
+		noffset = S->length - scanner->ncol + 1 - offset0;
+		if (noffset > PWM_CHUNK_NOFFSET)
+			noffset = PWM_CHUNK_NOFFSET;
+		/* The letters covered by the 'noffset' windows */
+		nletter = scanner->ncol == 0 ? 0 : noffset + scanner->ncol - 1;
+		if (encode_subject_chunk(S->ptr + offset0, nletter,
+				buf->codes) != 0 && no_warning_yet)
+		{
+			warning("'subject' contains letters not in "
+				"[ACGT] ==> assigned weight 0 to them");
+			no_warning_yet = 0;
+		}
+		nhit = scan_subject_chunk(scanner, buf, noffset);
+		for (i = 0; i < nhit; i++)
+			_report_match(offset0 + buf->idx[i] + 1,
+				      scanner->ncol);
 	}
 	return;
 }
@@ -115,6 +349,8 @@ SEXP XString_match_PWM(SEXP pwm, SEXP subject,
 	Chars_holder S;
 	int pwm_ncol, is_count_only;
 	double minscore;
+	PWMScanner scanner;
+	PWMScanBuf buf;
 
 	if (INTEGER(GET_DIM(pwm))[0] != 4)
 		error("'pwm' must have 4 rows");
@@ -126,7 +362,9 @@ SEXP XString_match_PWM(SEXP pwm, SEXP subject,
 	no_warning_yet = 1;
 	_init_match_reporting(is_count_only ?
 		"MATCHES_AS_COUNTS" : "MATCHES_AS_RANGES", 1);
-	_match_PWM_XString(REAL(pwm), pwm_ncol, &S, minscore);
+	scanner = new_PWMScanner(REAL(pwm), pwm_ncol, minscore);
+	buf = new_PWMScanBuf(pwm_ncol);
+	_match_PWM_XString(&scanner, &buf, &S);
 	return _reported_matches_asSEXP();
 }
 
@@ -149,6 +387,8 @@ SEXP XStringViews_match_PWM(SEXP pwm,
 	int pwm_ncol, is_count_only;
 	int nviews, v, *start_p, *width_p, view_offset;
 	double minscore;
+	PWMScanner scanner;
+	PWMScanBuf buf;
 
 	if (INTEGER(GET_DIM(pwm))[0] != 4)
 		error("'pwm' must have 4 rows");
@@ -160,6 +400,8 @@ SEXP XStringViews_match_PWM(SEXP pwm,
 	no_warning_yet = 1;
 	_init_match_reporting(is_count_only ?
 		"MATCHES_AS_COUNTS" : "MATCHES_AS_RANGES", 1);
+	scanner = new_PWMScanner(REAL(pwm), pwm_ncol, minscore);
+	buf = new_PWMScanBuf(pwm_ncol);
 	nviews = LENGTH(views_start);
 	for (v = 0,
 	     start_p = INTEGER(views_start),
@@ -173,8 +415,261 @@ SEXP XStringViews_match_PWM(SEXP pwm,
 		S_view.ptr = S.ptr + view_offset;
 		S_view.length = *width_p;
 		_set_match_shift(view_offset);
-		_match_PWM_XString(REAL(pwm), pwm_ncol, &S_view, minscore);
+		_match_PWM_XString(&scanner, &buf, &S_view);
 	}
 	return _reported_matches_asSEXP();
 }
 
+
+
+/****************************************************************************
+ * Scanning a list of PWMs in a single pass over the subject.
+ *
+ * Each chunk of the subject is encoded once and scanned with all the PWMs
+ * while it's still in the cache. The hits are collected in malloc()'ed
+ * buffers (one per thread) that are turned into the returned vectors at
+ * the end.
+ */
+
+typedef struct pwm_hit {
+	int seq, pwm, start;
+	double score;
+} PWMHit;
+
+typedef struct pwm_hits {
+	PWMHit *elts;
+	size_t nelt, buflength;
+	int failed;
+} PWMHits;
+
+static void PWMHits_append(PWMHits *hits, int seq, int pwm, int start,
+		double score)
+{
+	size_t new_buflength;
+	PWMHit *new_elts, *hit;
+
+	if (hits->failed)
+		return;
+	if (hits->nelt == hits->buflength) {
+		new_buflength = hits->buflength == 0 ? 1024 :
+						       2 * hits->buflength;
+		new_elts = (PWMHit *) realloc(hits->elts,
+					      new_buflength * sizeof(PWMHit));
+		if (new_elts == NULL) {
+			hits->failed = 1;
+			return;
+		}
+		hits->elts = new_elts;
+		hits->buflength = new_buflength;
+	}
+	hit = hits->elts + hits->nelt++;
+	hit->seq = seq;
+	hit->pwm = pwm;
+	hit->start = start;
+	hit->score = score;
+	return;
+}
+
+/* Returns the nb of letters not in [ACGT] in the chunk */
+static int scan_chunk_with_all_pwms(const PWMScanner *scanners, int npwm,
+		int max_ncol, const PWMScanBuf *buf,
+		const Chars_holder *S, int seq, int offset0, PWMHits *hits)
+{
+	int nletter, ninvalid, p, noffset, nhit, i, n;
+	const PWMScanner *scanner;
+
+	nletter = S->length - offset0;
+	if (nletter > PWM_CHUNK_NOFFSET + max_ncol - 1)
+		nletter = PWM_CHUNK_NOFFSET + max_ncol - 1;
+	ninvalid = encode_subject_chunk(S->ptr + offset0, nletter, buf->codes);
+	for (p = 0, scanner = scanners; p < npwm; p++, scanner++) {
+		noffset = S->length - scanner->ncol + 1 - offset0;
+		if (noffset <= 0)
+			continue;
+		if (noffset > PWM_CHUNK_NOFFSET)
+			noffset = PWM_CHUNK_NOFFSET;
+		nhit = scan_subject_chunk(scanner, buf, noffset);
+		for (i = 0; i < nhit; i++) {
+			n = buf->idx[i];
+			PWMHits_append(hits, seq + 1, p + 1, offset0 + n + 1,
+				       buf->scores[n]);
+		}
+	}
+	return ninvalid;
+}
+
+static SEXP PWMHits_asLIST(const PWMHits *hits, int nbuf)
+{
+	SEXP ans, ans_names, ans_elt;
+	size_t nelt, k;
+	int b, *seq, *pwm, *start;
+	double *score;
+	const PWMHit *hit;
+
+	for (b = 0, nelt = 0; b < nbuf; b++)
+		nelt += hits[b].nelt;
+	PROTECT(ans = NEW_LIST(4));
+	PROTECT(ans_names = NEW_CHARACTER(4));
+	SET_STRING_ELT(ans_names, 0, mkChar("seq"));
+	SET_STRING_ELT(ans_names, 1, mkChar("pwm"));
+	SET_STRING_ELT(ans_names, 2, mkChar("start"));
+	SET_STRING_ELT(ans_names, 3, mkChar("score"));
+	SET_NAMES(ans, ans_names);
+	UNPROTECT(1);
+	PROTECT(ans_elt = NEW_INTEGER(nelt));
+	SET_ELEMENT(ans, 0, ans_elt);
+	UNPROTECT(1);
+	PROTECT(ans_elt = NEW_INTEGER(nelt));
+	SET_ELEMENT(ans, 1, ans_elt);
+	UNPROTECT(1);
+	PROTECT(ans_elt = NEW_INTEGER(nelt));
+	SET_ELEMENT(ans, 2, ans_elt);
+	UNPROTECT(1);
+	PROTECT(ans_elt = NEW_NUMERIC(nelt));
+	SET_ELEMENT(ans, 3, ans_elt);
+	UNPROTECT(1);
+	seq = INTEGER(VECTOR_ELT(ans, 0));
+	pwm = INTEGER(VECTOR_ELT(ans, 1));
+	start = INTEGER(VECTOR_ELT(ans, 2));
+	score = REAL(VECTOR_ELT(ans, 3));
+	for (b = 0; b < nbuf; b++) {
+		for (k = 0, hit = hits[b].elts; k < hits[b].nelt; k++, hit++) {
+			*(seq++) = hit->seq;
+			*(pwm++) = hit->pwm;
+			*(start++) = hit->start;
+			*(score++) = hit->score;
+		}
+	}
+	UNPROTECT(1);
+	return ans;
+}
+
+/*
+ * --- .Call ENTRY POINT ---
+ * XStringSet_match_PWMList() arguments are assumed to be:
+ *   pwms: list of matrices of doubles with row names A, C, G and T;
+ *   min_scores: double vector of the same length as 'pwms' (no NAs);
+ *   subject: DNAStringSet object containing the subject sequences;
+ *   base_codes: named integer vector of length 4 obtained with
+ *       'xscodes(subject, baseOnly=TRUE)';
+ *   nthreads: single integer.
+ * Returns a named list of 4 vectors of the same length: "seq" (index of
+ * the sequence in 'subject'), "pwm" (index of the PWM in 'pwms'), "start"
+ * and "score". The hits are not sorted.
+ * When 'nthreads' > 1, the chunks of all the sequences in 'subject' are
+ * distributed across the threads, each thread using its own work and hit
+ * buffers.
+ */
+SEXP XStringSet_match_PWMList(SEXP pwms, SEXP min_scores, SEXP subject,
+		SEXP base_codes, SEXP nthreads)
+{
+	int npwm, p, pwm_ncol, min_ncol, max_ncol, S_length, j, nchunk, c,
+	    offset0, nthreads0, t, has_invalid, failed;
+	size_t nhit;
+	SEXP pwm, ans;
+	PWMScanner *scanners;
+	XStringSet_holder S_holder;
+	Chars_holder *S;
+	int *chunk_seq, *chunk_offset0;
+	PWMScanBuf *bufs;
+	PWMHits *hits;
+
+	npwm = LENGTH(pwms);
+	scanners = (PWMScanner *) R_alloc(npwm, sizeof(PWMScanner));
+	min_ncol = INT_MAX;
+	max_ncol = 0;
+	for (p = 0; p < npwm; p++) {
+		pwm = VECTOR_ELT(pwms, p);
+		if (INTEGER(GET_DIM(pwm))[0] != 4)
+			error("each PWM must have 4 rows");
+		pwm_ncol = INTEGER(GET_DIM(pwm))[1];
+		scanners[p] = new_PWMScanner(REAL(pwm), pwm_ncol,
+					     REAL(min_scores)[p]);
+		if (pwm_ncol < min_ncol)
+			min_ncol = pwm_ncol;
+		if (pwm_ncol > max_ncol)
+			max_ncol = pwm_ncol;
+	}
+	_init_byte2offset_with_INTEGER(&byte2offset, base_codes, 1);
+	S_length = _get_XStringSet_length(subject);
+	S_holder = _hold_XStringSet(subject);
+	S = (Chars_holder *) R_alloc(S_length, sizeof(Chars_holder));
+	nchunk = 0;
+	for (j = 0; j < S_length; j++) {
+		S[j] = _get_elt_from_XStringSet_holder(&S_holder, j);
+		if (npwm != 0 && S[j].length >= min_ncol)
+			nchunk += (S[j].length - min_ncol) /
+				  PWM_CHUNK_NOFFSET + 1;
+	}
+	chunk_seq = (int *) R_alloc(nchunk, sizeof(int));
+	chunk_offset0 = (int *) R_alloc(nchunk, sizeof(int));
+	for (j = c = 0; j < S_length; j++) {
+		if (npwm == 0)
+			break;
+		for (offset0 = 0;
+		     offset0 + min_ncol <= S[j].length;
+		     offset0 += PWM_CHUNK_NOFFSET, c++)
+		{
+			chunk_seq[c] = j;
+			chunk_offset0[c] = offset0;
+		}
+	}
+	nthreads0 = INTEGER(nthreads)[0];
+#ifndef _OPENMP
+	nthreads0 = 1;
+#endif
+	if (nthreads0 > nchunk)
+		nthreads0 = nchunk;
+	if (nthreads0 < 1)
+		nthreads0 = 1;
+	bufs = (PWMScanBuf *) R_alloc(nthreads0, sizeof(PWMScanBuf));
+	hits = (PWMHits *) R_alloc(nthreads0, sizeof(PWMHits));
+	for (t = 0; t < nthreads0; t++) {
+		bufs[t] = new_PWMScanBuf(max_ncol);
+		hits[t].elts = NULL;
+		hits[t].nelt = hits[t].buflength = 0;
+		hits[t].failed = 0;
+	}
+	has_invalid = 0;
+	if (nthreads0 == 1) {
+		for (c = 0; c < nchunk; c++) {
+			j = chunk_seq[c];
+			has_invalid |= scan_chunk_with_all_pwms(scanners,
+					npwm, max_ncol, bufs, S + j, j,
+					chunk_offset0[c], hits) != 0;
+		}
+	} else {
+#ifdef _OPENMP
+		#pragma omp parallel for num_threads(nthreads0) \
+			schedule(dynamic) private(j, t) \
+			reduction(|:has_invalid)
+		for (c = 0; c < nchunk; c++) {
+			t = omp_get_thread_num();
+			j = chunk_seq[c];
+			has_invalid |= scan_chunk_with_all_pwms(scanners,
+					npwm, max_ncol, bufs + t, S + j, j,
+					chunk_offset0[c], hits + t) != 0;
+		}
+#endif
+	}
+	for (t = failed = 0, nhit = 0; t < nthreads0; t++) {
+		failed |= hits[t].failed;
+		nhit += hits[t].nelt;
+	}
+	if (failed || nhit > INT_MAX) {
+		for (t = 0; t < nthreads0; t++)
+			free(hits[t].elts);
+		if (failed)
+			error("XStringSet_match_PWMList(): failed to "
+			      "allocate memory for the hits");
+		error("too many hits");
+	}
+	if (has_invalid)
+		warning("'subject' contains letters not in "
+			"[ACGT] ==> assigned weight 0 to them");
+	PROTECT(ans = PWMHits_asLIST(hits, nthreads0));
+	for (t = 0; t < nthreads0; t++)
+		free(hits[t].elts);
+	UNPROTECT(1);
+	return ans;
+}
@@ -64,8 +64,12 @@ static void match_pdict(SEXP pptb, HeadTail *headtail, const Chars_holder *S,
 
 	if (strcmp(type, "Twobit") == 0)
 		_match_Twobit(pptb, S, fixedS, tb_matches);
+	else if (strcmp(type, "TwobitHash") == 0)
+		_match_TwobitHash(pptb, S, fixedS, tb_matches);
 	else if (strcmp(type, "ACtree2") == 0)
 		_match_tbACtree2(pptb, S, fixedS, tb_matches);
+	else if (strcmp(type, "ACtree2DFA") == 0)
+		_match_ACtree2DFA(pptb, S, fixedS, tb_matches);
 	else
 		error("%s: unsupported Trusted Band type in 'pdict'", type);
 	/* Call _match_pdict_all_flanks() even if 'headtail' is empty
@@ -76,6 +80,173 @@ static void match_pdict(SEXP pptb, HeadTail *headtail, const Chars_holder *S,
 	return;
 }
 
+/*
+ * The vcount_*() and vwhich_*() functions below can walk up to MAX_TB_NLANE
+ * subjects in lockstep (one "lane" per subject) when the subjects are fixed
+ * and the Trusted Band is of type Twobit, TwobitHash, ACtree2 or ACtree2DFA.
+ * The matches
+ * found in the Trusted Band are recorded per lane and then replayed, one
+ * subject at a time, through the same flank matching as match_pdict() so the
+ * results are identical to those of the subject-by-subject walk.
+ * With 'nthreads' > 1, the subjects are processed by batches of 'nthreads'
+ * groups of MAX_TB_NLANE subjects, and the groups of a batch are walked in
+ * parallel, each thread writing to the TBLaneMatchBuf of its group. Only
+ * the walk of the Trusted Band is parallelized: the flank matching and the
+ * reporting use R-allocated buffers so they're done by the main thread.
+ */
+typedef struct tb_lanes {
+	int nthreads;
+	int batch_length;  /* nthreads * MAX_TB_NLANE */
+	Chars_holder *batch;
+	TBLaneMatchBuf *lane_matches;  /* one per group in the batch */
+	SEXP xp;  /* owns 'lane_matches' (see free_lane_matches()) */
+} TBLanes;
+
+/*
+ * The lane buffers are grown with realloc() by the worker threads so they
+ * cannot be R_alloc'ed. They are owned by an external pointer whose
+ * finalizer frees them if we don't get to free_TBLanes() because of an
+ * error or a user interrupt. The tag of the external pointer is the nb of
+ * TBLaneMatchBuf structs.
+ */
+static void free_lane_matches(SEXP xp)
+{
+	TBLaneMatchBuf *lane_matches;
+	int nthreads, g;
+
+	lane_matches = (TBLaneMatchBuf *) R_ExternalPtrAddr(xp);
+	if (lane_matches == NULL)
+		return;
+	nthreads = INTEGER(R_ExternalPtrTag(xp))[0];
+	for (g = 0; g < nthreads; g++)
+		_free_TBLaneMatchBuf(lane_matches + g);
+	Free(lane_matches);
+	R_ClearExternalPtr(xp);
+	return;
+}
+
+/*
+ * Returns NULL if the subjects cannot be walked in lockstep. Otherwise the
+ * returned TBLanes object must be released with free_TBLanes() (which does
+ * an UNPROTECT(1)).
+ */
+static TBLanes *new_TBLanes(SEXP pptb, SEXP fixed, int S_length,
+		SEXP nthreads)
+{
+	const char *type;
+	int nthreads0, ngroup, g;
+	TBLanes *lanes;
+	SEXP tag, xp;
+
+	if (!LOGICAL(fixed)[1])
+		return NULL;
+	type = get_classname(pptb);
+	if (strcmp(type, "Twobit") != 0 &&
+	    strcmp(type, "TwobitHash") != 0 &&
+	    strcmp(type, "ACtree2") != 0 &&
+	    strcmp(type, "ACtree2DFA") != 0)
+		return NULL;
+	nthreads0 = INTEGER(nthreads)[0];
+#ifndef _OPENMP
+	nthreads0 = 1;
+#endif
+	ngroup = (S_length + MAX_TB_NLANE - 1) / MAX_TB_NLANE;
+	if (nthreads0 > ngroup)
+		nthreads0 = ngroup;
+	if (nthreads0 < 1)
+		nthreads0 = 1;
+	lanes = (TBLanes *) R_alloc(1, sizeof(TBLanes));
+	lanes->nthreads = nthreads0;
+	lanes->batch_length = nthreads0 * MAX_TB_NLANE;
+	lanes->batch = (Chars_holder *) R_alloc(lanes->batch_length,
+						sizeof(Chars_holder));
+	PROTECT(tag = ScalarInteger(nthreads0));
+	xp = R_MakeExternalPtr(NULL, tag, R_NilValue);
+	UNPROTECT(1);
+	PROTECT(xp);
+	R_RegisterCFinalizer(xp, free_lane_matches);
+	lanes->lane_matches = Calloc(nthreads0, TBLaneMatchBuf);
+	for (g = 0; g < nthreads0; g++)
+		lanes->lane_matches[g] = _new_TBLaneMatchBuf();
+	R_SetExternalPtrAddr(xp, lanes->lane_matches);
+	lanes->xp = xp;
+	return lanes;
+}
+
+static void free_TBLanes(TBLanes *lanes)
+{
+	if (lanes == NULL)
+		return;
+	free_lane_matches(lanes->xp);
+	UNPROTECT(1);
+	return;
+}
+
+static void match_tb_lanes(SEXP pptb, TBLanes *lanes,
+		const XStringSet_holder *S, int S_length, int j)
+{
+	const char *type;
+	int batch_length, k, g, alloc_failed;
+
+	batch_length = S_length - j;
+	if (batch_length > lanes->batch_length)
+		batch_length = lanes->batch_length;
+	for (k = 0; k < batch_length; k++)
+		lanes->batch[k] = _get_elt_from_XStringSet_holder(S, j + k);
+	type = get_classname(pptb);
+	if (strcmp(type, "Twobit") == 0)
+		_match_Twobit_lane_groups(pptb, lanes->batch, batch_length,
+				lanes->lane_matches, lanes->nthreads);
+	else if (strcmp(type, "TwobitHash") == 0)
+		_match_TwobitHash_lane_groups(pptb, lanes->batch, batch_length,
+				lanes->lane_matches, lanes->nthreads);
+	else if (strcmp(type, "ACtree2DFA") == 0)
+		_match_ACtree2DFA_lane_groups(pptb, lanes->batch, batch_length,
+				lanes->lane_matches, lanes->nthreads);
+	else
+		_match_tbACtree2_lane_groups(pptb, lanes->batch, batch_length,
+				lanes->lane_matches, lanes->nthreads);
+	alloc_failed = 0;
+	for (g = 0; g < lanes->nthreads; g++)
+		alloc_failed |= lanes->lane_matches[g].alloc_failed;
+	if (alloc_failed)
+		error("cannot allocate memory for the Trusted Band matches");
+	return;
+}
+
+/*
+ * Finds the matches in the j-th subject. If 'lanes' is not NULL, the
+ * subjects are walked by batches and the batch is walked when 'j' is the
+ * 1st subject in it.
+ */
+static void match_pdict_in_jth_subject(SEXP pptb, HeadTail *headtail,
+		const XStringSet_holder *S, int S_length, int j,
+		SEXP max_mismatch, SEXP min_mismatch, SEXP fixed,
+		TBLanes *lanes, MatchPDictBuf *matchpdict_buf)
+{
+	int k;
+	Chars_holder S_elt;
+
+	if (lanes == NULL) {
+		S_elt = _get_elt_from_XStringSet_holder(S, j);
+		match_pdict(pptb, headtail, &S_elt,
+			    max_mismatch, min_mismatch, fixed,
+			    matchpdict_buf);
+		return;
+	}
+	k = j % lanes->batch_length;
+	if (k == 0)
+		match_tb_lanes(pptb, lanes, S, S_length, j);
+	S_elt = lanes->batch[k];
+	_TBLaneMatchBuf_move_lane_to_TBMatchBuf(
+		lanes->lane_matches + k / MAX_TB_NLANE, k % MAX_TB_NLANE,
+		&(matchpdict_buf->tb_matches));
+	_match_pdict_all_flanks(_get_PreprocessedTB_low2high(pptb), headtail,
+		&S_elt, INTEGER(max_mismatch)[0], INTEGER(min_mismatch)[0],
+		LOGICAL(fixed)[0], LOGICAL(fixed)[1], matchpdict_buf);
+	return;
+}
+
 
 
 /****************************************************************************
@@ -315,32 +486,36 @@ SEXP match_XStringSet_XStringViews(SEXP pattern,
  *     - matches_as: "MATCHES_AS_NULL", "MATCHES_AS_WHICH",
  *         "MATCHES_AS_COUNTS" or "MATCHES_AS_ENDS";
  *     - envir: NULL or environment to be populated with the matches.
+ *   o vmatch_PDict3Parts_XStringSet() only:
+ *     - nthreads: nb of threads to use for walking the Trusted Band
+ *         (ignored if the subjects cannot be walked in lockstep).
  */
 
 static SEXP vwhich_PDict3Parts_XStringSet(SEXP pptb, HeadTail *headtail,
 		SEXP subject,
 		SEXP max_mismatch, SEXP min_mismatch, SEXP fixed,
-		MatchPDictBuf *matchpdict_buf)
+		SEXP nthreads, MatchPDictBuf *matchpdict_buf)
 {
 	int S_length, j;
 	XStringSet_holder S;
 	SEXP ans, ans_elt;
-	Chars_holder S_elt;
+	TBLanes *lanes;
 
 	S = _hold_XStringSet(subject);
 	S_length = _get_length_from_XStringSet_holder(&S);
 	PROTECT(ans = NEW_LIST(S_length));
+	lanes = new_TBLanes(pptb, fixed, S_length, nthreads);
 	for (j = 0; j < S_length; j++) {
-		S_elt = _get_elt_from_XStringSet_holder(&S, j);
-		match_pdict(pptb, headtail, &S_elt,
-			    max_mismatch, min_mismatch, fixed,
-			    matchpdict_buf);
+		match_pdict_in_jth_subject(pptb, headtail, &S, S_length, j,
+			max_mismatch, min_mismatch, fixed,
+			lanes, matchpdict_buf);
 		PROTECT(ans_elt = _MatchBuf_which_asINTEGER(
 					&(matchpdict_buf->matches)));
 		SET_ELEMENT(ans, j, ans_elt);
 		UNPROTECT(1);
 		_MatchPDictBuf_flush(matchpdict_buf);
 	}
+	free_TBLanes(lanes);
 	UNPROTECT(1);
 	return ans;
 }
@@ -387,13 +562,13 @@ static SEXP vcount_PDict3Parts_XStringSet(SEXP pptb, HeadTail *headtail,
 		SEXP subject,
 		SEXP max_mismatch, SEXP min_mismatch, SEXP fixed,
 		SEXP collapse, SEXP weight,
-		MatchPDictBuf *matchpdict_buf)
+		SEXP nthreads, MatchPDictBuf *matchpdict_buf)
 {
 	int tb_length, S_length, collapse0, i, j, match_count, *ans_col;
 	XStringSet_holder S;
 	SEXP ans;
-	Chars_holder S_elt;
 	const IntAE *count_buf;
+	TBLanes *lanes;
 
 	tb_length = _get_PreprocessedTB_length(pptb);
 	S = _hold_XStringSet(subject);
@@ -406,11 +581,11 @@ static SEXP vcount_PDict3Parts_XStringSet(SEXP pptb, HeadTail *headtail,
 		PROTECT(ans = init_vcount_collapsed_ans(tb_length, S_length,
 					collapse0, weight));
 	}
+	lanes = new_TBLanes(pptb, fixed, S_length, nthreads);
 	for (j = 0; j < S_length; j++) {
-		S_elt = _get_elt_from_XStringSet_holder(&S, j);
-		match_pdict(pptb, headtail, &S_elt,
+		match_pdict_in_jth_subject(pptb, headtail, &S, S_length, j,
 			max_mismatch, min_mismatch, fixed,
-			matchpdict_buf);
+			lanes, matchpdict_buf);
 		count_buf = matchpdict_buf->matches.match_counts;
 		/* 'IntAE_get_nelt(count_buf)' is 'tb_length' */
 		if (collapse0 == 0) {
@@ -427,6 +602,7 @@ static SEXP vcount_PDict3Parts_XStringSet(SEXP pptb, HeadTail *headtail,
 		}
 		_MatchPDictBuf_flush(matchpdict_buf);
 	}
+	free_TBLanes(lanes);
 	UNPROTECT(1);
 	return ans;
 }
@@ -485,7 +661,7 @@ SEXP vmatch_PDict3Parts_XStringSet(SEXP pptb, SEXP pdict_head, SEXP pdict_tail,
 		SEXP subject,
 		SEXP max_mismatch, SEXP min_mismatch, SEXP fixed,
 		SEXP collapse, SEXP weight,
-		SEXP matches_as, SEXP envir)
+		SEXP matches_as, SEXP envir, SEXP nthreads)
 {
 	HeadTail headtail;
 	MatchPDictBuf matchpdict_buf;
@@ -503,13 +679,13 @@ SEXP vmatch_PDict3Parts_XStringSet(SEXP pptb, SEXP pdict_head, SEXP pdict_tail,
 		return vwhich_PDict3Parts_XStringSet(pptb, &headtail,
 				subject,
 				max_mismatch, min_mismatch, fixed,
-				&matchpdict_buf);
+				nthreads, &matchpdict_buf);
 	    case MATCHES_AS_COUNTS:
 		return vcount_PDict3Parts_XStringSet(pptb, &headtail,
 				subject,
 				max_mismatch, min_mismatch, fixed,
 				collapse, weight,
-				&matchpdict_buf);
+				nthreads, &matchpdict_buf);
 	}
 	error("vmatchPDict() is not supported yet, sorry");
 	return R_NilValue;
@@ -5,10 +5,23 @@
  *                            Author: H. Pag\`es                            *
  ****************************************************************************/
 #include "Biostrings.h"
+#include "XVector_interface.h"
 #include "IRanges_interface.h"
 
 #include <stdlib.h> /* for div() */
 #include <limits.h> /* for UINT_MAX */
+#include <time.h> /* for clock() and CLOCKS_PER_SEC */
+#include <stdio.h>  /* for fopen, fwrite */
+#ifndef _WIN32
+#include <fcntl.h>  /* for open */
+#include <unistd.h>  /* for close */
+#include <sys/stat.h>  /* for fstat */
+#include <sys/mman.h>  /* for mmap, munmap */
+#endif
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 
 /*
@@ -239,15 +252,13 @@ static unsigned int get_ACnodeBuf_nelt(const ACnodeBuf *buf)
 static ACnodeBuf new_ACnodeBuf(SEXP bab)
 {
 	ACnodeBuf buf;
-	SEXP bab_blocks;
 	int nblock, b;
 
 	buf.bab = bab;
 	nblock = *(buf.nblock = _get_BAB_nblock_ptr(bab));
 	buf.lastblock_nelt = _get_BAB_lastblock_nelt_ptr(bab);
-	bab_blocks = _get_BAB_blocks(bab);
 	for (b = 0; b < nblock; b++)
-		buf.block[b] = (ACnode *) INTEGER(VECTOR_ELT(bab_blocks, b));
+		buf.block[b] = (ACnode *) _get_BAB_block(bab, b);
 	return buf;
 }
 
@@ -342,15 +353,13 @@ static unsigned int get_ACnodeextBuf_nelt(ACnodeextBuf *buf)
 static ACnodeextBuf new_ACnodeextBuf(SEXP bab)
 {
 	ACnodeextBuf buf;
-	SEXP bab_blocks;
 	int nblock, b;
 
 	buf.bab = bab;
 	nblock = *(buf.nblock = _get_BAB_nblock_ptr(bab));
 	buf.lastblock_nelt = _get_BAB_lastblock_nelt_ptr(bab);
-	bab_blocks = _get_BAB_blocks(bab);
 	for (b = 0; b < nblock; b++)
-		buf.block[b] = (ACnodeext *) INTEGER(VECTOR_ELT(bab_blocks, b));
+		buf.block[b] = (ACnodeext *) _get_BAB_block(bab, b);
 	return buf;
 }
 
@@ -405,6 +414,7 @@ typedef struct actree {
 	ByteTrTable char2linktag;
 	unsigned int max_nodeextbuf_nelt;  /* 0U means "no max" */
 	int dont_extend_nodes;  /* always at 0 during preprocessing */
+	int read_only;  /* 1 when the tree is shared between threads or mapped */
 } ACtree;
 
 #define GET_NODEEXT(tree, eid) get_nodeext_from_buf(&((tree)->nodeextbuf), eid)
@@ -651,6 +661,9 @@ static ACtree pptb_asACtree(SEXP pptb)
 	tree.max_nodeextbuf_nelt = max_nelt;
 	nelt = get_ACnodeextBuf_nelt(&(tree.nodeextbuf));
 	tree.dont_extend_nodes = max_nelt != 0U && nelt >= max_nelt;
+	/* the node buffers of an ACtree2 object loaded with loadPDict() are
+	   mapped read-only */
+	tree.read_only = _BAB_is_mapped(_get_ACtree2_nodebuf_ptr(pptb));
 	return tree;
 }
 
@@ -677,6 +690,54 @@ static int get_ACnode_nlink(ACtree *tree, ACnode *node)
 	return nlink;
 }
 
+/*
+ * The preprocessing times of an ACtree2 object are stored in the "timings"
+ * attribute of the external pointer of its node buffer so they are shared
+ * by all the copies of the object (like the tree itself).
+ */
+#define TIMING_BUILD 0
+#define TIMING_FLINKS 1
+#define TIMING_NTHREADS 2
+
+static double elapsed_time(void)
+{
+#ifdef _OPENMP
+	return omp_get_wtime();
+#else
+	return (double) clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+static SEXP get_timings(SEXP nodebuf_ptr)
+{
+	return getAttrib(GET_SLOT(nodebuf_ptr, install("xp")),
+			 install("timings"));
+}
+
+static void set_timing(SEXP nodebuf_ptr, int i, double value)
+{
+	SEXP xp, timings, timings_names;
+
+	xp = GET_SLOT(nodebuf_ptr, install("xp"));
+	timings = getAttrib(xp, install("timings"));
+	if (timings == R_NilValue) {
+		PROTECT(timings = NEW_NUMERIC(3));
+		REAL(timings)[TIMING_BUILD] = NA_REAL;
+		REAL(timings)[TIMING_FLINKS] = NA_REAL;
+		REAL(timings)[TIMING_NTHREADS] = NA_REAL;
+		PROTECT(timings_names = NEW_CHARACTER(3));
+		SET_STRING_ELT(timings_names, TIMING_BUILD, mkChar("build"));
+		SET_STRING_ELT(timings_names, TIMING_FLINKS, mkChar("flinks"));
+		SET_STRING_ELT(timings_names, TIMING_NTHREADS,
+			       mkChar("nthreads"));
+		SET_NAMES(timings, timings_names);
+		setAttrib(xp, install("timings"), timings);
+		UNPROTECT(2);
+	}
+	REAL(timings)[i] = value;
+	return;
+}
+
 /* --- .Call ENTRY POINT --- */
 SEXP ACtree2_nnodes(SEXP pptb)
 {
@@ -713,6 +774,7 @@ SEXP ACtree2_summary(SEXP pptb)
 	ACnodeBuf *nodebuf;
 	ACnode *node;
 	int nleaves, nlink;
+	SEXP timings;
 
 	tree = pptb_asACtree(pptb);
 	nnodes = TREE_SIZE(&tree);
@@ -738,6 +800,22 @@ SEXP ACtree2_summary(SEXP pptb)
 	min_nn = count_min_needed_nnodes(nleaves, TREE_DEPTH(&tree));
 	Rprintf("| - max_needed_nnodes(nleaves, TREE_DEPTH) = %u\n", max_nn);
 	Rprintf("| - min_needed_nnodes(nleaves, TREE_DEPTH) = %u\n", min_nn);
+	/* all the non-root nodes have 4 links and a failure link */
+	Rprintf("| Frozen = %s\n",
+		nlink_table[MAX_CHILDREN_PER_NODE+1] == nnodes - 1U ?
+		"yes" : "no");
+	timings = get_timings(_get_ACtree2_nodebuf_ptr(pptb));
+	if (timings != R_NilValue) {
+		Rprintf("| Preprocessing times:\n");
+		if (!ISNA(REAL(timings)[TIMING_BUILD]))
+			Rprintf("| - build = %.3f s\n",
+				REAL(timings)[TIMING_BUILD]);
+		if (!ISNA(REAL(timings)[TIMING_FLINKS]))
+			Rprintf("| - computeAllFlinks() = %.3f s "
+				"(%d thread(s))\n",
+				REAL(timings)[TIMING_FLINKS],
+				(int) REAL(timings)[TIMING_NTHREADS]);
+	}
 	return R_NilValue;
 }
 
@@ -796,8 +874,10 @@ SEXP ACtree2_build(SEXP tb, SEXP pp_exclude, SEXP base_codes,
 	int tb_length, tb_width, P_offset;
 	XStringSet_holder tb_holder;
 	Chars_holder P;
+	double t0;
 	SEXP ans, ans_names, ans_elt;
 
+	t0 = elapsed_time();
 	tb_length = _get_XStringSet_length(tb);
 	if (tb_length == 0)
 		error("Trusted Band is empty");
@@ -823,6 +903,7 @@ SEXP ACtree2_build(SEXP tb, SEXP pp_exclude, SEXP base_codes,
 		}
 		add_pattern(&tree, &P, P_offset);
 	}
+	set_timing(nodebuf_ptr, TIMING_BUILD, elapsed_time() - t0);
 
 	PROTECT(ans = NEW_LIST(2));
 
@@ -867,6 +948,8 @@ static unsigned int compute_flink(ACtree *tree,
 /*
  * 'node_path' will only be used to compute failure links so it's safe to not
  * provide it (i.e. NULL) if all the nodes already have one.
+ * If the tree is read-only, the links and failure links that are computed
+ * are not stored so it's better to call compute_all_flinks() first.
  */
 static unsigned int transition(ACtree *tree,
 		ACnode *node, const char *node_path, int linktag)
@@ -883,10 +966,12 @@ static unsigned int transition(ACtree *tree,
 	flink = GET_NODE_FLINK(tree, node);
 	if (flink == NOT_AN_ID) {
 		flink = compute_flink(tree, node, node_path);
-		SET_NODE_FLINK(tree, node, flink);
+		if (!tree->read_only)
+			SET_NODE_FLINK(tree, node, flink);
 	}
 	link = transition(tree, GET_NODE(tree, flink), node_path, linktag);
-	SET_NODE_LINK(tree, node, linktag, link); /* sets a shortcut */
+	if (!tree->read_only)
+		SET_NODE_LINK(tree, node, linktag, link); /* sets a shortcut */
 	return link;
 }
 
@@ -926,44 +1011,127 @@ static int has_all_flinks(ACtree *tree)
 	return 1;
 }
 
-static void compute_flinks_along_pattern(ACtree *tree, const Chars_holder *P)
+/* Returns 1 if 'nid1' is a child of 'node' (and not a shortcut link). A
+   shortcut from a node of depth d always points to a node of depth <= d. */
+static int is_child(ACtree *tree, ACnode *node, unsigned int nid1)
+{
+	if (nid1 == NOT_AN_ID || IS_LEAFNODE(node))
+		return 0;
+	return NODE_DEPTH(tree, GET_NODE(tree, nid1)) ==
+	       NODE_DEPTH(tree, node) + 1;
+}
+
+/* Same as transition() but never modifies the tree. The failure links are
+   taken from 'flinks' (indexed by node id) and must be set for all the
+   nodes on the path of failure links from node 'nid'. */
+static unsigned int const_transition(ACtree *tree, unsigned int nid,
+		int linktag, const unsigned int *flinks)
+{
+	unsigned int link;
+
+	while ((link = GET_NODE_LINK(tree, GET_NODE(tree, nid), linktag))
+			== NOT_AN_ID) {
+		if (nid == 0U)
+			return 0U;
+		nid = flinks[nid];
+	}
+	return link;
+}
+
+/*
+ * Puts the failure links of the children of node 'nid' in 'flinks' and, if
+ * 'freeze' is 1, sets the links of the node that are not set yet. Assumes
+ * that all the nodes of depth < depth(node) have their failure link in
+ * 'flinks' (and, if 'freeze' is 1, all their links set and the node is
+ * extended). Only modifies the node and the 'flinks' elements of its
+ * children so the nodes of a given depth can be processed in parallel.
+ */
+static void set_children_flinks(ACtree *tree, unsigned int nid, int freeze,
+		unsigned int *flinks)
 {
+	int linktag;
+	unsigned int nid1;
 	ACnode *node;
-	int n, linktag;
-	const char *node_path;
-	unsigned int nid, flink;
 
-	node = GET_NODE(tree, 0U);
-	node_path = P->ptr;
-	for (n = 1; n <= P->length; n++) {
-		linktag = CHAR2LINKTAG(tree, *node_path);
-		nid = transition(tree, node, node_path, linktag);
-		node = GET_NODE(tree, nid);
-		node_path++;
-		flink = GET_NODE_FLINK(tree, node);
-		if (flink == NOT_AN_ID) {
-			flink = compute_flink(tree, node, node_path);
-			SET_NODE_FLINK(tree, node, flink);
+	node = GET_NODE(tree, nid);
+	for (linktag = 0; linktag < MAX_CHILDREN_PER_NODE; linktag++) {
+		nid1 = GET_NODE_LINK(tree, node, linktag);
+		if (is_child(tree, node, nid1)) {
+			flinks[nid1] = nid == 0U ? 0U :
+				const_transition(tree, flinks[nid], linktag,
+						 flinks);
+		} else if (freeze && nid != 0U && nid1 == NOT_AN_ID) {
+			SET_NODE_LINK(tree, node, linktag,
+				const_transition(tree, flinks[nid], linktag,
+						 flinks));
 		}
 	}
 	return;
 }
 
-static void compute_all_flinks(ACtree *tree, const XStringSet_holder *tb)
+/*
+ * Level-synchronous computation of all the failure links: the nodes are
+ * visited in BFS order and the nodes of a given depth are processed in
+ * parallel with 'nthreads' threads. The failure links are first computed
+ * in a temporary array and then stored in the tree by the main thread
+ * (this extends the nodes as needed, like when they are set on the fly by
+ * transition()).
+ * If 'freeze' is 1, all the links of all the nodes (except the root) are
+ * also set i.e. the tree is turned into a full automaton and walking it
+ * will never modify it again. In that case all the nodes are extended
+ * beforehand (by the main thread) so the threads never need to allocate
+ * memory.
+ */
+static void compute_all_flinks(ACtree *tree, int nthreads, int freeze)
 {
-	unsigned int nnodes, nid;
+	unsigned int nnodes, nid, nid1, *bfs, nbfs, level_start, level_end,
+		     *flinks;
+	int linktag;
+	long long int i;
 	ACnode *node;
-	int P_offset;
-	Chars_holder P;
 
 	nnodes = TREE_SIZE(tree);
-	for (nid = 1U; nid < nnodes; nid++) {
-		node = GET_NODE(tree, nid);
-		if (!IS_LEAFNODE(node))
-			continue;
-		P_offset = NODE_P_ID(node) - 1;
-		P = _get_elt_from_XStringSet_holder(tb, P_offset);
-		compute_flinks_along_pattern(tree, &P);
+	bfs = (unsigned int *) R_alloc(nnodes, sizeof(unsigned int));
+	flinks = (unsigned int *) R_alloc(nnodes, sizeof(unsigned int));
+	bfs[0] = 0U;
+	nbfs = 1U;
+	for (i = 0; i < nbfs; i++) {
+		node = GET_NODE(tree, bfs[i]);
+		if (freeze && i != 0 && !IS_EXTENDEDNODE(node)) {
+			if (tree->dont_extend_nodes)
+				error("cannot freeze this ACtree2 object "
+				      "(reached max nb of node extensions)");
+			extend_ACnode(tree, node);
+		}
+		for (linktag = 0; linktag < MAX_CHILDREN_PER_NODE; linktag++) {
+			nid1 = GET_NODE_LINK(tree, node, linktag);
+			if (is_child(tree, node, nid1))
+				bfs[nbfs++] = nid1;
+		}
+	}
+	for (level_start = 0U; level_start < nbfs; level_start = level_end) {
+		nid = bfs[level_start];
+		for (level_end = level_start + 1U; level_end < nbfs; level_end++)
+			if (NODE_DEPTH(tree, GET_NODE(tree, bfs[level_end])) !=
+			    NODE_DEPTH(tree, GET_NODE(tree, nid)))
+				break;
+		if (nthreads == 1 || level_end - level_start < 1024U) {
+			for (i = level_start; i < level_end; i++)
+				set_children_flinks(tree, bfs[i], freeze,
+						    flinks);
+		} else {
+#ifdef _OPENMP
+			#pragma omp parallel for num_threads(nthreads) \
+				schedule(static)
+			for (i = level_start; i < level_end; i++)
+				set_children_flinks(tree, bfs[i], freeze,
+						    flinks);
+#endif
+		}
+	}
+	for (i = 1; i < nbfs; i++) {
+		nid = bfs[i];
+		SET_NODE_FLINK(tree, GET_NODE(tree, nid), flinks[nid]);
 	}
 	return;
 }
@@ -977,17 +1145,29 @@ SEXP ACtree2_has_all_flinks(SEXP pptb)
 	return ScalarLogical(has_all_flinks(&tree));
 }
 
-/* --- .Call ENTRY POINT --- */
-SEXP ACtree2_compute_all_flinks(SEXP pptb)
+/* --- .Call ENTRY POINT ---
+ * The trees that are mapped read-only (see loadPDict()) already have all
+ * their links set.
+ */
+SEXP ACtree2_compute_all_flinks(SEXP pptb, SEXP nthreads, SEXP freeze)
 {
 	ACtree tree;
-	SEXP tb;
-	XStringSet_holder tb_holder;
+	int nthreads0;
+	double t0;
 
 	tree = pptb_asACtree(pptb);
-	tb = _get_PreprocessedTB_tb(pptb);
-	tb_holder = _hold_XStringSet(tb);
-	compute_all_flinks(&tree, &tb_holder);
+	if (tree.read_only)
+		return R_NilValue;
+	nthreads0 = INTEGER(nthreads)[0];
+#ifndef _OPENMP
+	nthreads0 = 1;
+#endif
+	t0 = elapsed_time();
+	compute_all_flinks(&tree, nthreads0, LOGICAL(freeze)[0]);
+	set_timing(_get_ACtree2_nodebuf_ptr(pptb), TIMING_FLINKS,
+		   elapsed_time() - t0);
+	set_timing(_get_ACtree2_nodebuf_ptr(pptb), TIMING_NTHREADS,
+		   (double) nthreads0);
 	return R_NilValue;
 }
 
@@ -1020,6 +1200,57 @@ static void walk_tb_subject(ACtree *tree, const Chars_holder *S,
 	return;
 }
 
+/*
+ * Interleaved version of walk_tb_subject(): the 'nlane' subjects are walked
+ * in lockstep. Each step is done in 2 passes over the lanes: the 1st pass
+ * checks the nodes reached at the previous step (they were prefetched) and
+ * prefetches their extension, the 2nd pass does the transitions and
+ * prefetches the new nodes. So the latency of a node access is hidden
+ * behind the work done on the other lanes.
+ * Does report matches.
+ */
+static void walk_tb_subject_lanes(ACtree *tree, const Chars_holder *S,
+		int nlane, TBLaneMatchBuf *lane_matches)
+{
+	ACnode *node[MAX_TB_NLANE];
+	const char *node_path[MAX_TB_NLANE];
+	int max_length, k, n, linktag;
+	unsigned int nid;
+
+	max_length = 0;
+	for (k = 0; k < nlane; k++) {
+		node[k] = GET_NODE(tree, 0U);
+		node_path[k] = S[k].ptr;
+		if (S[k].length > max_length)
+			max_length = S[k].length;
+	}
+	for (n = 1; n <= max_length + 1; n++) {
+		for (k = 0; k < nlane; k++) {
+			if (n > S[k].length + 1)
+				continue;
+			/* Check the node reached at step n - 1 */
+			if (IS_LEAFNODE(node[k]))
+				_TBLaneMatchBuf_report_match(lane_matches, k,
+					NODE_P_ID(node[k]) - 1, n - 1);
+			else if (IS_EXTENDEDNODE(node[k]))
+				PREFETCH_READ(GET_NODEEXT(tree,
+						node[k]->nid_or_eid));
+		}
+		if (n > max_length)
+			break;
+		for (k = 0; k < nlane; k++) {
+			if (n > S[k].length)
+				continue;
+			linktag = CHAR2LINKTAG(tree, *node_path[k]);
+			nid = transition(tree, node[k], node_path[k], linktag);
+			node[k] = GET_NODE(tree, nid);
+			PREFETCH_READ(node[k]);
+			node_path[k]++;
+		}
+	}
+	return;
+}
+
 /* 1st helper function for walk_tb_nonfixed_subject() */
 #define	NODE_SUBSET_MAXSIZE	5000000 /* 5 million node pointers */
 static ACnode *node_subset[NODE_SUBSET_MAXSIZE];
@@ -1161,25 +1392,54 @@ void _match_tbACtree2(SEXP pptb, const Chars_holder *S, int fixedS,
 		TBMatchBuf *tb_matches)
 {
 	ACtree tree;
-	SEXP tb;
-	XStringSet_holder tb_holder;
 
 	tree = pptb_asACtree(pptb);
 	if (fixedS) {
 		walk_tb_subject(&tree, S, tb_matches);
 		return;
 	}
-	if (!has_all_flinks(&tree)) {
-		tb = _get_PreprocessedTB_tb(pptb);
-		tb_holder = _hold_XStringSet(tb);
-		//Rprintf("computing all flinks... ");
-		compute_all_flinks(&tree, &tb_holder);
-		//Rprintf("OK\n");
-	}
+	if (!has_all_flinks(&tree))
+		compute_all_flinks(&tree, 1, 0);
 	walk_tb_nonfixed_subject(&tree, S, tb_matches);
 	return;
 }
 
+/*
+ * The 'S_length' subjects in 'S' are walked by groups of MAX_TB_NLANE, the
+ * matches for the g-th group going to 'lane_matches[g]'. The groups are
+ * distributed across 'nthreads' threads. The subjects are assumed to be
+ * fixed (i.e. 'fixedS' is TRUE).
+ * When 'nthreads' > 1, the tree is shared by the threads and is walked in
+ * read-only mode. For best performance, the caller should make sure that
+ * all the failure links are set (see computeAllFlinks() at the R level).
+ */
+void _match_tbACtree2_lane_groups(SEXP pptb, const Chars_holder *S,
+		int S_length, TBLaneMatchBuf *lane_matches, int nthreads)
+{
+	ACtree tree;
+	int ngroup, g;
+
+	tree = pptb_asACtree(pptb);
+	ngroup = (S_length + MAX_TB_NLANE - 1) / MAX_TB_NLANE;
+	if (nthreads == 1) {
+		for (g = 0; g < ngroup; g++)
+			walk_tb_subject_lanes(&tree, S + g * MAX_TB_NLANE,
+				TB_GROUP_NLANE(S_length, g),
+				lane_matches + g);
+	} else {
+		tree.read_only = 1;
+#ifdef _OPENMP
+		#pragma omp parallel for num_threads(nthreads) \
+			schedule(dynamic)
+		for (g = 0; g < ngroup; g++)
+			walk_tb_subject_lanes(&tree, S + g * MAX_TB_NLANE,
+				TB_GROUP_NLANE(S_length, g),
+				lane_matches + g);
+#endif
+	}
+	return;
+}
+
 
 
 /****************************************************************************
@@ -1248,3 +1508,612 @@ void _match_pdictACtree2(SEXP pptb, HeadTail *headtail,
 	return;
 }
 
+
+
+
+/****************************************************************************
+ *                     K. FROZEN ACtree2 (ACtree2DFA)                       *
+ ****************************************************************************/
+
+/*
+ * An ACtree2DFA object is a frozen, compacted copy of an ACtree2 object
+ * where the tree is turned into a full DFA (Deterministic Finite
+ * Automaton):
+ *   - the states are the nodes of the tree renumbered in BFS order (the
+ *     root is state 0);
+ *   - 'transitions' is a dense table with 4 ints per state: the state
+ *     reached from state i with letter of linktag j is
+ *     transitions[4 * i + j]. All the shortcut links are resolved so
+ *     walking the subject costs one table lookup per letter;
+ *   - because the dictionary is rectangular, all the leaf nodes have the
+ *     same depth, i.e. they are the last states in BFS order. So a state i
+ *     is a leaf iff i >= first_leaf, where first_leaf is
+ *     nstate - length(leaf_P_ids), and its P_id is
+ *     leaf_P_ids[i - first_leaf].
+ */
+
+typedef struct actree_dfa {
+	const int *transitions;
+	const int *leaf_P_ids;
+	int first_leaf;
+	ByteTrTable char2linktag;
+} ACtreeDFA;
+
+static ACtreeDFA pptb_asACtreeDFA(SEXP pptb)
+{
+	ACtreeDFA dfa;
+	SEXP transitions, leaf_P_ids;
+
+	transitions = _get_ACtree2DFA_transitions_tag(pptb);
+	leaf_P_ids = _get_ACtree2DFA_leaf_P_ids_tag(pptb);
+	dfa.transitions = INTEGER(transitions);
+	dfa.leaf_P_ids = INTEGER(leaf_P_ids);
+	dfa.first_leaf = LENGTH(transitions) / MAX_CHILDREN_PER_NODE -
+			 LENGTH(leaf_P_ids);
+	_init_byte2offset_with_INTEGER(&(dfa.char2linktag),
+			_get_PreprocessedTB_base_codes(pptb), 1);
+	return dfa;
+}
+
+/* --- .Call ENTRY POINT ---
+ * Computes the failure links of the ACtree2 object 'pptb' if needed and
+ * returns an R list with the following elements:
+ *   - transitions: XInteger object of length 4 * nb of nodes;
+ *   - leaf_P_ids: XInteger object (the P_ids of the leaf states).
+ */
+SEXP ACtree2_freeze(SEXP pptb)
+{
+	ACtree tree;
+	unsigned int nnodes, nid, nid1, *bfs2nid, *nid2bfs, nstate, i;
+	int j, nleaf, *transitions, *leaf_P_ids;
+	ACnode *node;
+	SEXP transitions_tag, leaf_P_ids_tag, ans, ans_names, ans_elt;
+
+	tree = pptb_asACtree(pptb);
+	if (!has_all_flinks(&tree))
+		compute_all_flinks(&tree, 1, 0);
+	nnodes = TREE_SIZE(&tree);
+	if (nnodes > INT_MAX / MAX_CHILDREN_PER_NODE)
+		error("ACtree2 object is too big to be frozen");
+	bfs2nid = (unsigned int *) R_alloc(nnodes, sizeof(unsigned int));
+	nid2bfs = (unsigned int *) R_alloc(nnodes, sizeof(unsigned int));
+
+	/* Renumber the nodes in BFS order */
+	bfs2nid[0] = 0U;
+	nid2bfs[0] = 0U;
+	nstate = 1U;
+	nleaf = 0;
+	for (i = 0U; i < nstate; i++) {
+		node = GET_NODE(&tree, bfs2nid[i]);
+		if (IS_LEAFNODE(node)) {
+			nleaf++;
+			continue;
+		}
+		for (j = 0; j < MAX_CHILDREN_PER_NODE; j++) {
+			nid1 = GET_NODE_LINK(&tree, node, j);
+			if (!is_child(&tree, node, nid1))
+				continue;
+			bfs2nid[nstate] = nid1;
+			nid2bfs[nid1] = nstate;
+			nstate++;
+		}
+	}
+	if (nstate != nnodes)
+		error("Biostrings internal error in ACtree2_freeze(): "
+		      "nstate != nnodes");
+
+	/* Fill the transition table. The failure link of a node points to
+	   a node of lower depth so its transitions have already been set. */
+	PROTECT(transitions_tag = NEW_INTEGER((R_xlen_t) nnodes *
+					      MAX_CHILDREN_PER_NODE));
+	transitions = INTEGER(transitions_tag);
+	for (i = 0U; i < nnodes; i++) {
+		nid = bfs2nid[i];
+		node = GET_NODE(&tree, nid);
+		for (j = 0; j < MAX_CHILDREN_PER_NODE; j++) {
+			nid1 = GET_NODE_LINK(&tree, node, j);
+			if (is_child(&tree, node, nid1))
+				transitions[MAX_CHILDREN_PER_NODE * i + j] =
+					nid2bfs[nid1];
+			else if (i == 0U)
+				transitions[j] = 0;
+			else
+				transitions[MAX_CHILDREN_PER_NODE * i + j] =
+				    transitions[MAX_CHILDREN_PER_NODE *
+				      nid2bfs[GET_NODE_FLINK(&tree, node)] + j];
+		}
+	}
+	PROTECT(leaf_P_ids_tag = NEW_INTEGER(nleaf));
+	leaf_P_ids = INTEGER(leaf_P_ids_tag);
+	for (j = 0; j < nleaf; j++) {
+		node = GET_NODE(&tree, bfs2nid[nnodes - nleaf + j]);
+		leaf_P_ids[j] = NODE_P_ID(node);
+	}
+
+	PROTECT(ans = NEW_LIST(2));
+	PROTECT(ans_names = NEW_CHARACTER(2));
+	SET_STRING_ELT(ans_names, 0, mkChar("transitions"));
+	SET_STRING_ELT(ans_names, 1, mkChar("leaf_P_ids"));
+	SET_NAMES(ans, ans_names);
+	UNPROTECT(1);
+	PROTECT(ans_elt = new_XInteger_from_tag("XInteger",
+						transitions_tag));
+	SET_ELEMENT(ans, 0, ans_elt);
+	UNPROTECT(1);
+	PROTECT(ans_elt = new_XInteger_from_tag("XInteger", leaf_P_ids_tag));
+	SET_ELEMENT(ans, 1, ans_elt);
+	UNPROTECT(1);
+	UNPROTECT(3);
+	return ans;
+}
+
+/* Does report matches */
+static void walk_dfa_subject(const ACtreeDFA *dfa, const Chars_holder *S,
+		TBMatchBuf *tb_matches)
+{
+	int state, n, linktag;
+	const char *s;
+
+	state = 0;
+	for (n = 1, s = S->ptr; n <= S->length; n++, s++) {
+		linktag = dfa->char2linktag.byte2code[(unsigned char) *s];
+		if (linktag == NA_INTEGER) {
+			state = 0;
+			continue;
+		}
+		state = dfa->transitions[MAX_CHILDREN_PER_NODE * state +
+					 linktag];
+		if (state >= dfa->first_leaf)
+			_TBMatchBuf_report_match(tb_matches,
+				dfa->leaf_P_ids[state - dfa->first_leaf] - 1,
+				n);
+	}
+	return;
+}
+
+void _match_ACtree2DFA(SEXP pptb, const Chars_holder *S, int fixedS,
+		TBMatchBuf *tb_matches)
+{
+	ACtreeDFA dfa;
+
+	if (!fixedS)
+		error("cannot treat IUPAC extended letters in the subject "
+		      "as ambiguities when 'pdict' is a PDict object of "
+		      "the \"ACtree2DFA\" type");
+	dfa = pptb_asACtreeDFA(pptb);
+	walk_dfa_subject(&dfa, S, tb_matches);
+	return;
+}
+
+/*
+ * Interleaved version of walk_dfa_subject() (see walk_tb_subject_lanes()).
+ * The row of the transition table for the state reached in a lane is
+ * prefetched and only read at the next step of the lane.
+ */
+static void walk_dfa_subject_lanes(const ACtreeDFA *dfa,
+		const Chars_holder *S, int nlane, TBLaneMatchBuf *lane_matches)
+{
+	int state[MAX_TB_NLANE], max_length, k, n, linktag;
+
+	max_length = 0;
+	for (k = 0; k < nlane; k++) {
+		state[k] = 0;
+		if (S[k].length > max_length)
+			max_length = S[k].length;
+	}
+	for (n = 1; n <= max_length; n++) {
+		for (k = 0; k < nlane; k++) {
+			if (n > S[k].length)
+				continue;
+			linktag = dfa->char2linktag.byte2code[
+					(unsigned char) S[k].ptr[n - 1]];
+			if (linktag == NA_INTEGER) {
+				state[k] = 0;
+				continue;
+			}
+			state[k] = dfa->transitions[
+				MAX_CHILDREN_PER_NODE * state[k] + linktag];
+			PREFETCH_READ(dfa->transitions +
+				      MAX_CHILDREN_PER_NODE * state[k]);
+			if (state[k] >= dfa->first_leaf)
+				_TBLaneMatchBuf_report_match(lane_matches, k,
+				    dfa->leaf_P_ids[state[k] - dfa->first_leaf]
+				    - 1, n);
+		}
+	}
+	return;
+}
+
+/* See _match_tbACtree2_lane_groups() above. The DFA is never modified so
+   it can always be shared by the threads. */
+void _match_ACtree2DFA_lane_groups(SEXP pptb, const Chars_holder *S,
+		int S_length, TBLaneMatchBuf *lane_matches, int nthreads)
+{
+	ACtreeDFA dfa;
+	int ngroup, g;
+
+	dfa = pptb_asACtreeDFA(pptb);
+	ngroup = (S_length + MAX_TB_NLANE - 1) / MAX_TB_NLANE;
+	if (nthreads == 1) {
+		for (g = 0; g < ngroup; g++)
+			walk_dfa_subject_lanes(&dfa, S + g * MAX_TB_NLANE,
+				TB_GROUP_NLANE(S_length, g),
+				lane_matches + g);
+	} else {
+#ifdef _OPENMP
+		#pragma omp parallel for num_threads(nthreads) \
+			schedule(dynamic)
+		for (g = 0; g < ngroup; g++)
+			walk_dfa_subject_lanes(&dfa, S + g * MAX_TB_NLANE,
+				TB_GROUP_NLANE(S_length, g),
+				lane_matches + g);
+#endif
+	}
+	return;
+}
+
+
+
+/****************************************************************************
+ *                    L. SAVING AND MAPPING ACtree2 FILES                   *
+ ****************************************************************************/
+
+/*
+ * The node buffers of one or more ACtree2 objects are saved in a binary
+ * file that can later be mapped read-only in memory (with mmap(), except on
+ * Windows where it is read), so that the processes that load the same file
+ * share the same copy of the buffers.
+ * Layout of the file (all integers in native byte order):
+ *   - an ACtree2FileHeader;
+ *   - 2 BABRecord's per tree (the node buffer and then the node extension
+ *     buffer);
+ *   - the buffers, each one starting on a FILE_ALIGNMENT boundary. The
+ *     blocks of a buffer are stored contiguously and only the used part of
+ *     the last block is saved;
+ *   - an arbitrary sequence of bytes (the serialized R object that wraps
+ *     the trees, see savePDict()).
+ * Before being saved, the trees are frozen (see compute_all_flinks()) so
+ * walking a mapped tree never needs to modify it.
+ */
+
+#define ACTREE2_FILE_MAGIC "ACtree2\0"
+#define ACTREE2_FILE_VERSION 1
+#define ACTREE2_FILE_BYTE_ORDER 0x01020304
+#define FILE_ALIGNMENT 4096
+
+typedef struct actree2_file_header {
+	char magic[8];
+	int version;
+	int byte_order;
+	int sizeof_ACnode;
+	int sizeof_ACnodeext;
+	int ntree;
+	int unused;
+	long long int bytes_offset;
+	long long int bytes_length;
+} ACtree2FileHeader;
+
+typedef struct bab_record {
+	int nblock;
+	int lastblock_nelt;
+	int block_length;  /* nb of ints in a full block */
+	int elt_length;  /* nb of ints per element */
+	long long int offset;
+} BABRecord;
+
+/* nb of ints used by the buffer */
+static long long int BABRecord_nint(const BABRecord *rec)
+{
+	if (rec->nblock == 0)
+		return 0;
+	return (long long int) (rec->nblock - 1) * rec->block_length +
+	       (long long int) rec->lastblock_nelt * rec->elt_length;
+}
+
+static long long int align_offset(long long int offset)
+{
+	return (offset + FILE_ALIGNMENT - 1) / FILE_ALIGNMENT * FILE_ALIGNMENT;
+}
+
+static BABRecord new_BABRecord(int nblock, int lastblock_nelt,
+		int block_length, int elt_length, long long int *offset)
+{
+	BABRecord rec;
+
+	rec.nblock = nblock;
+	rec.lastblock_nelt = lastblock_nelt;
+	rec.block_length = block_length;
+	rec.elt_length = elt_length;
+	rec.offset = *offset = align_offset(*offset);
+	*offset += BABRecord_nint(&rec) * sizeof(int);
+	return rec;
+}
+
+/* Returns 0 on success, -1 on error. */
+static int write_padding(FILE *stream, long long int *pos,
+		long long int offset)
+{
+	static const char zeros[FILE_ALIGNMENT] = {0};
+
+	if (offset == *pos)
+		return 0;
+	if (fwrite(zeros, 1, offset - *pos, stream) != offset - *pos)
+		return -1;
+	*pos = offset;
+	return 0;
+}
+
+/* Returns 0 on success, -1 on error. */
+static int write_blocks(FILE *stream, long long int *pos,
+		const BABRecord *rec, void * const *block)
+{
+	int b;
+	size_t nint;
+
+	if (write_padding(stream, pos, rec->offset) != 0)
+		return -1;
+	for (b = 0; b < rec->nblock; b++) {
+		nint = b == rec->nblock - 1 ?
+		       (size_t) rec->lastblock_nelt * rec->elt_length :
+		       (size_t) rec->block_length;
+		if (fwrite(block[b], sizeof(int), nint, stream) != nint)
+			return -1;
+		*pos += (long long int) nint * sizeof(int);
+	}
+	return 0;
+}
+
+/* --- .Call ENTRY POINT ---
+ * 'pptbs': a list of ACtree2 objects.
+ * 'bytes': a raw vector that is appended to the file.
+ */
+SEXP ACtree2_write_file(SEXP pptbs, SEXP bytes, SEXP filepath)
+{
+	int ntree, i, ok;
+	ACtree *trees;
+	ACtree2FileHeader header;
+	BABRecord *recs;
+	long long int offset, pos;
+	const char *path;
+	FILE *stream;
+
+	ntree = LENGTH(pptbs);
+	trees = (ACtree *) R_alloc(ntree, sizeof(ACtree));
+	recs = (BABRecord *) R_alloc(2 * ntree, sizeof(BABRecord));
+	offset = sizeof(ACtree2FileHeader) + 2 * ntree * sizeof(BABRecord);
+	for (i = 0; i < ntree; i++) {
+		trees[i] = pptb_asACtree(VECTOR_ELT(pptbs, i));
+		if (!trees[i].read_only)
+			compute_all_flinks(trees + i, 1, 1);
+		recs[2 * i] = new_BABRecord(*(trees[i].nodebuf.nblock),
+				*(trees[i].nodebuf.lastblock_nelt),
+				ACNODEBUF_MAX_NELT_PER_BLOCK * INTS_PER_NODE,
+				INTS_PER_NODE, &offset);
+		recs[2 * i + 1] = new_BABRecord(*(trees[i].nodeextbuf.nblock),
+				*(trees[i].nodeextbuf.lastblock_nelt),
+				ACNODEEXTBUF_MAX_NELT_PER_BLOCK *
+				INTS_PER_NODEEXT,
+				INTS_PER_NODEEXT, &offset);
+	}
+	memset(&header, 0, sizeof(ACtree2FileHeader));
+	memcpy(header.magic, ACTREE2_FILE_MAGIC, sizeof(header.magic));
+	header.version = ACTREE2_FILE_VERSION;
+	header.byte_order = ACTREE2_FILE_BYTE_ORDER;
+	header.sizeof_ACnode = sizeof(ACnode);
+	header.sizeof_ACnodeext = sizeof(ACnodeext);
+	header.ntree = ntree;
+	header.bytes_offset = offset;
+	header.bytes_length = LENGTH(bytes);
+
+	path = translateChar(STRING_ELT(filepath, 0));
+	stream = fopen(path, "wb");
+	if (stream == NULL)
+		error("cannot open file '%s' for writing", path);
+	ok = fwrite(&header, sizeof(ACtree2FileHeader), 1, stream) == 1 &&
+	     fwrite(recs, sizeof(BABRecord), 2 * ntree, stream) == 2 * ntree;
+	pos = sizeof(ACtree2FileHeader) + 2 * ntree * sizeof(BABRecord);
+	for (i = 0; ok && i < ntree; i++) {
+		ok = write_blocks(stream, &pos, recs + 2 * i,
+				  (void * const *) trees[i].nodebuf.block) == 0 &&
+		     write_blocks(stream, &pos, recs + 2 * i + 1,
+				  (void * const *) trees[i].nodeextbuf.block) == 0;
+	}
+	ok = ok && write_padding(stream, &pos, header.bytes_offset) == 0 &&
+	     fwrite(RAW(bytes), 1, LENGTH(bytes), stream) == LENGTH(bytes);
+	if (fclose(stream) != 0)
+		ok = 0;
+	if (!ok)
+		error("error while writing file '%s'", path);
+	return R_NilValue;
+}
+
+typedef struct mapped_region {
+	void *addr;
+	size_t size;
+} MappedRegion;
+
+static void free_MappedRegion(SEXP region)
+{
+	MappedRegion *mr;
+
+	mr = (MappedRegion *) R_ExternalPtrAddr(region);
+	if (mr == NULL)
+		return;
+#ifdef _WIN32
+	free(mr->addr);
+#else
+	if (mr->addr != NULL)
+		munmap(mr->addr, mr->size);
+#endif
+	free(mr);
+	R_ClearExternalPtr(region);
+	return;
+}
+
+/* Returns NULL on success or an error message. */
+static const char *map_file(MappedRegion *mr, const char *path)
+{
+#ifdef _WIN32
+	FILE *stream;
+	long long int size;
+
+	stream = fopen(path, "rb");
+	if (stream == NULL)
+		return "cannot open file";
+	if (fseeko64(stream, 0, SEEK_END) != 0
+	 || (size = ftello64(stream)) < 0
+	 || fseeko64(stream, 0, SEEK_SET) != 0) {
+		fclose(stream);
+		return "cannot seek file";
+	}
+	mr->size = (size_t) size;
+	mr->addr = malloc(mr->size);
+	if (mr->addr == NULL) {
+		fclose(stream);
+		return "cannot allocate memory";
+	}
+	if (fread(mr->addr, 1, mr->size, stream) != mr->size) {
+		fclose(stream);
+		return "cannot read file";
+	}
+	fclose(stream);
+#else
+	int fd;
+	struct stat file_stat;
+	void *addr;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return "cannot open file";
+	if (fstat(fd, &file_stat) != 0) {
+		close(fd);
+		return "cannot stat file";
+	}
+	mr->size = (size_t) file_stat.st_size;
+	if (mr->size < sizeof(ACtree2FileHeader)) {
+		close(fd);
+		return "file is too small";
+	}
+	addr = mmap(NULL, mr->size, PROT_READ, MAP_SHARED, fd, 0);
+	/* the mapping stays valid after the file is closed */
+	close(fd);
+	if (addr == MAP_FAILED)
+		return "cannot map file into memory";
+	mr->addr = addr;
+#endif
+	return NULL;
+}
+
+static const char *check_header(const ACtree2FileHeader *header,
+		size_t size)
+{
+	if (size < sizeof(ACtree2FileHeader)
+	 || memcmp(header->magic, ACTREE2_FILE_MAGIC,
+		   sizeof(header->magic)) != 0)
+		return "not a file created by savePDict()";
+	if (header->version != ACTREE2_FILE_VERSION)
+		return "unsupported file format version";
+	if (header->byte_order != ACTREE2_FILE_BYTE_ORDER
+	 || header->sizeof_ACnode != sizeof(ACnode)
+	 || header->sizeof_ACnodeext != sizeof(ACnodeext))
+		return "file was created on an incompatible platform";
+	if (header->ntree < 0
+	 || sizeof(ACtree2FileHeader) +
+	    (size_t) header->ntree * 2 * sizeof(BABRecord) > size
+	 || header->bytes_offset < 0 || header->bytes_length < 0
+	 || header->bytes_length > INT_MAX
+	 || (size_t) (header->bytes_offset + header->bytes_length) > size)
+		return "file is corrupted";
+	return NULL;
+}
+
+static const char *check_BABRecord(const BABRecord *rec,
+		int max_nblock, int block_length, int elt_length, size_t size)
+{
+	if (rec->nblock < 0 || rec->nblock > max_nblock
+	 || rec->block_length != block_length
+	 || rec->elt_length != elt_length
+	 || rec->lastblock_nelt < 0
+	 || rec->lastblock_nelt > block_length / elt_length
+	 || rec->offset < 0 || rec->offset % FILE_ALIGNMENT != 0
+	 || (size_t) (rec->offset + BABRecord_nint(rec) * sizeof(int)) > size)
+		return "file is corrupted";
+	return NULL;
+}
+
+/* --- .Call ENTRY POINT ---
+ * Maps a file created by ACtree2_write_file() and returns a list with 2
+ * elements: the raw vector that was appended to the file and a list of
+ * read-only IntegerBAB objects (the node buffer and the node extension
+ * buffer of each tree). The file stays mapped until all the IntegerBAB
+ * objects have been garbage collected.
+ */
+SEXP ACtree2_map_file(SEXP filepath)
+{
+	const char *path, *errmsg;
+	MappedRegion *mr;
+	SEXP region, ans, ans_names, bytes, babs, bab;
+	const ACtree2FileHeader *header;
+	const BABRecord *rec;
+	int i, max_nblock, block_length, elt_length;
+
+	path = translateChar(STRING_ELT(filepath, 0));
+	mr = (MappedRegion *) malloc(sizeof(MappedRegion));
+	if (mr == NULL)
+		error("cannot allocate memory");
+	mr->addr = NULL;
+	mr->size = 0;
+	/* From now on 'mr' is owned by 'region' (the finalizer will unmap
+	   the file even if an error is raised) */
+	PROTECT(region = R_MakeExternalPtr(mr, R_NilValue, R_NilValue));
+	R_RegisterCFinalizerEx(region, free_MappedRegion, TRUE);
+	errmsg = map_file(mr, path);
+	if (errmsg != NULL)
+		error("%s: '%s'", errmsg, path);
+	header = (const ACtree2FileHeader *) mr->addr;
+	errmsg = check_header(header, mr->size);
+	if (errmsg != NULL)
+		error("%s: '%s'", errmsg, path);
+	rec = (const BABRecord *) (header + 1);
+	for (i = 0; i < 2 * header->ntree; i++) {
+		if (i % 2 == 0) {
+			max_nblock = ACNODEBUF_MAX_NBLOCK;
+			elt_length = INTS_PER_NODE;
+			block_length = ACNODEBUF_MAX_NELT_PER_BLOCK *
+				       elt_length;
+		} else {
+			max_nblock = ACNODEEXTBUF_MAX_NBLOCK;
+			elt_length = INTS_PER_NODEEXT;
+			block_length = ACNODEEXTBUF_MAX_NELT_PER_BLOCK *
+				       elt_length;
+		}
+		errmsg = check_BABRecord(rec + i, max_nblock, block_length,
+					 elt_length, mr->size);
+		if (errmsg != NULL)
+			error("%s: '%s'", errmsg, path);
+	}
+
+	PROTECT(babs = NEW_LIST(2 * header->ntree));
+	for (i = 0; i < 2 * header->ntree; i++) {
+		PROTECT(bab = _IntegerBAB_new_mapped(region,
+				(int *) ((char *) mr->addr + rec[i].offset),
+				rec[i].nblock, rec[i].lastblock_nelt,
+				rec[i].block_length));
+		SET_ELEMENT(babs, i, bab);
+		UNPROTECT(1);
+	}
+	PROTECT(bytes = NEW_RAW((R_xlen_t) header->bytes_length));
+	memcpy(RAW(bytes), (char *) mr->addr + header->bytes_offset,
+	       (size_t) header->bytes_length);
+
+	PROTECT(ans = NEW_LIST(2));
+	PROTECT(ans_names = NEW_CHARACTER(2));
+	SET_STRING_ELT(ans_names, 0, mkChar("bytes"));
+	SET_STRING_ELT(ans_names, 1, mkChar("babs"));
+	SET_NAMES(ans, ans_names);
+	UNPROTECT(1);
+	SET_ELEMENT(ans, 0, bytes);
+	SET_ELEMENT(ans, 1, babs);
+	UNPROTECT(4);
+	return ans;
+}
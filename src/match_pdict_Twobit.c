@@ -1,5 +1,5 @@
 /****************************************************************************
- *                           The Twobit algorithm                           *
+ *                  The Twobit and TwobitHash algorithms                    *
  *                   for constant width DNA dictionaries                    *
  *                                                                          *
  *                            Author: H. Pag\`es                            *
@@ -11,6 +11,12 @@
 #include "XVector_interface.h"
 #include "IRanges_interface.h"
 
+#include <stdint.h>  /* for uint64_t */
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 
 /****************************************************************************
  *                                                                          *
@@ -126,7 +132,9 @@ SEXP build_Twobit(SEXP tb, SEXP pp_exclude, SEXP base_codes)
 			tb_width = pattern.length;
 			if (tb_width > 14)
 				error("the width of the Trusted Band must "
-				      "be <= 14 when 'type=\"Twobit\"'");
+				      "be <= 14 when 'type=\"Twobit\"' "
+				      "(use 'type=\"TwobitHash\"' for "
+				      "wider Trusted Bands)");
 			teb = _new_TwobitEncodingBuffer(base_codes, tb_width, 0);
 			twobit_len = 1 << (tb_width * 2); // 4^tb_width
 			PROTECT(twobit_sign2pos = NEW_INTEGER(twobit_len));
@@ -149,6 +157,183 @@ SEXP build_Twobit(SEXP tb, SEXP pp_exclude, SEXP base_codes)
 
 
 
+/****************************************************************************
+ * The TwobitHash variant
+ * ----------------------
+ *
+ * The dense sign2pos table of the Twobit algo has 4^tb_width elements, which
+ * limits the width of the Trusted Band to 14. The TwobitHash algo packs the
+ * oligonucleotides of the Trusted Band (up to 32 nt) in 64-bit signatures
+ * and stores them in an open-addressing hash table with linear probing.
+ * The table has at least 2 buckets per pattern so its size is proportional
+ * to the number of patterns, not to 4^tb_width. It is made of 2 parallel
+ * vectors: 'keys' (the 64-bit signatures, stored in a raw vector) and 'pos'
+ * (the 1-based position of the pattern in the Trusted Band, or NA for an
+ * empty bucket).
+ */
+
+typedef struct twobit_hash {
+	uint64_t *keys;
+	int *pos;
+	uint64_t bucket_mask;  /* the nb of buckets is a power of 2 */
+} TwobitHash;
+
+static uint64_t get_sign_mask(int tb_width)
+{
+	return tb_width >= 32 ? ~((uint64_t) 0) :
+				(((uint64_t) 1) << (2 * tb_width)) - 1;
+}
+
+static uint64_t hash_sign(uint64_t sign)
+{
+	/* 64-bit finalizer from MurmurHash3 */
+	sign ^= sign >> 33;
+	sign *= 0xff51afd7ed558ccdULL;
+	sign ^= sign >> 33;
+	sign *= 0xc4ceb9fe1a85ec53ULL;
+	sign ^= sign >> 33;
+	return sign;
+}
+
+/* Returns the bucket containing 'sign' or the empty bucket where it
+   should be inserted. */
+static uint64_t find_sign_bucket(const TwobitHash *hash, uint64_t sign)
+{
+	uint64_t b;
+
+	for (b = hash_sign(sign) & hash->bucket_mask;
+	     hash->pos[b] != NA_INTEGER && hash->keys[b] != sign;
+	     b = (b + 1) & hash->bucket_mask)
+		;
+	return b;
+}
+
+static int pp_pattern_hashed(TwobitHash *hash, const ByteTrTable *byte2twobit,
+		const Chars_holder *pattern, int poffset)
+{
+	uint64_t sign, b;
+	int i, twobit;
+	const char *c;
+
+	sign = 0;
+	for (i = 0, c = pattern->ptr; i < pattern->length; i++, c++) {
+		twobit = byte2twobit->byte2code[(unsigned char) *c];
+		if (twobit == NA_INTEGER)
+			return -1;
+		sign = (sign << 2) | twobit;
+	}
+	b = find_sign_bucket(hash, sign);
+	if (hash->pos[b] == NA_INTEGER) {
+		hash->keys[b] = sign;
+		hash->pos[b] = poffset + 1;
+	} else {
+		_report_ppdup(poffset, hash->pos[b]);
+	}
+	return 0;
+}
+
+/*
+ * TwobitHash_asLIST() returns an R list with the following elements:
+ *   - keys: XRaw object (the 64-bit signatures);
+ *   - pos: XInteger object;
+ *   - high2low: an integer vector containing the mapping between duplicated
+ *         and primary reads.
+ */
+static SEXP TwobitHash_asLIST(SEXP keys, SEXP pos)
+{
+	SEXP ans, ans_names, ans_elt;
+
+	PROTECT(ans = NEW_LIST(3));
+
+	/* set the names */
+	PROTECT(ans_names = NEW_CHARACTER(3));
+	SET_STRING_ELT(ans_names, 0, mkChar("keys"));
+	SET_STRING_ELT(ans_names, 1, mkChar("pos"));
+	SET_STRING_ELT(ans_names, 2, mkChar("high2low"));
+	SET_NAMES(ans, ans_names);
+	UNPROTECT(1);
+
+	/* set the "keys" element */
+	PROTECT(ans_elt = new_XRaw_from_tag("XRaw", keys));
+	SET_ELEMENT(ans, 0, ans_elt);
+	UNPROTECT(1);
+
+	/* set the "pos" element */
+	PROTECT(ans_elt = new_XInteger_from_tag("XInteger", pos));
+	SET_ELEMENT(ans, 1, ans_elt);
+	UNPROTECT(1);
+
+	/* set the "high2low" element */
+	PROTECT(ans_elt = _get_ppdups_buf_asINTEGER());
+	SET_ELEMENT(ans, 2, ans_elt);
+	UNPROTECT(1);
+
+	UNPROTECT(1);
+	return ans;
+}
+
+/*
+ * Same arguments as build_Twobit().
+ * See TwobitHash_asLIST() for a description of the returned SEXP.
+ */
+SEXP build_TwobitHash(SEXP tb, SEXP pp_exclude, SEXP base_codes)
+{
+	int tb_length, tb_width, poffset, i;
+	R_xlen_t nbucket;
+	XStringSet_holder tb_holder;
+	Chars_holder pattern;
+	ByteTrTable byte2twobit;
+	TwobitHash hash;
+	SEXP ans, keys, pos;
+
+	tb_length = _get_XStringSet_length(tb);
+	_init_ppdups_buf(tb_length);
+	_init_byte2offset_with_INTEGER(&byte2twobit, base_codes, 1);
+	for (nbucket = 16; nbucket < 2 * (R_xlen_t) tb_length; nbucket *= 2)
+		;
+	PROTECT(keys = NEW_RAW(nbucket * sizeof(uint64_t)));
+	PROTECT(pos = NEW_INTEGER(nbucket));
+	hash.keys = (uint64_t *) RAW(keys);
+	hash.pos = INTEGER(pos);
+	hash.bucket_mask = (uint64_t) nbucket - 1;
+	memset(hash.keys, 0, nbucket * sizeof(uint64_t));
+	for (i = 0; i < nbucket; i++)
+		hash.pos[i] = NA_INTEGER;
+	tb_width = -1;
+	tb_holder = _hold_XStringSet(tb);
+	for (poffset = 0; poffset < tb_length; poffset++) {
+		/* Skip duplicated patterns */
+		if (pp_exclude != R_NilValue
+		 && INTEGER(pp_exclude)[poffset] != NA_INTEGER)
+			continue;
+		pattern = _get_elt_from_XStringSet_holder(&tb_holder, poffset);
+		if (pattern.length == 0)
+			error("empty trusted region for pattern %d",
+			      poffset + 1);
+		if (tb_width == -1) {
+			tb_width = pattern.length;
+			if (tb_width > 32)
+				error("the width of the Trusted Band must "
+				      "be <= 32 when 'type=\"TwobitHash\"'");
+		} else if (pattern.length != tb_width) {
+			error("all the trusted regions must have "
+			      "the same length");
+		}
+		if (pp_pattern_hashed(&hash, &byte2twobit,
+				      &pattern, poffset) != 0)
+		{
+			UNPROTECT(2);
+			error("non-base DNA letter found in Trusted Band "
+			      "for pattern %d", poffset + 1);
+		}
+	}
+	PROTECT(ans = TwobitHash_asLIST(keys, pos));
+	UNPROTECT(3);
+	return ans;
+}
+
+
+
 /****************************************************************************
  *                                                                          *
  *                             B. MATCH FINDING                             *
@@ -194,3 +379,235 @@ void _match_Twobit(SEXP pptb, const Chars_holder *S, int fixedS,
 	return;
 }
 
+
+/*
+ * Interleaved version of walk_subject(): the 'nlane' subjects are walked in
+ * lockstep. The sign2pos entry for the signature just computed in a lane is
+ * prefetched and only looked up at the next step of the lane, i.e. after
+ * the other lanes have been advanced, which hides the latency of the
+ * lookup when sign2pos doesn't fit in the cache.
+ */
+static void walk_subject_lanes(const int *twobit_sign2pos,
+		TwobitEncodingBuffer *teb, const Chars_holder *S, int nlane,
+		TBLaneMatchBuf *lane_matches)
+{
+	int pending_sign[MAX_TB_NLANE], max_length, k, n, P_id;
+
+	max_length = 0;
+	for (k = 0; k < nlane; k++) {
+		_reset_twobit_signature(teb + k);
+		pending_sign[k] = NA_INTEGER;
+		if (S[k].length > max_length)
+			max_length = S[k].length;
+	}
+	for (n = 1; n <= max_length + 1; n++) {
+		for (k = 0; k < nlane; k++) {
+			if (n > S[k].length + 1)
+				continue;
+			/* Look up the signature computed at step n - 1 */
+			if (pending_sign[k] != NA_INTEGER) {
+				P_id = twobit_sign2pos[pending_sign[k]];
+				if (P_id != NA_INTEGER)
+					_TBLaneMatchBuf_report_match(
+						lane_matches, k,
+						P_id - 1, n - 1);
+			}
+			if (n > S[k].length) {
+				pending_sign[k] = NA_INTEGER;
+				continue;
+			}
+			pending_sign[k] = _shift_twobit_signature(teb + k,
+							S[k].ptr[n - 1]);
+			if (pending_sign[k] != NA_INTEGER)
+				PREFETCH_READ(twobit_sign2pos +
+					      pending_sign[k]);
+		}
+	}
+	return;
+}
+
+/*
+ * The 'S_length' subjects in 'S' are walked by groups of MAX_TB_NLANE, the
+ * matches for the g-th group going to 'lane_matches[g]'. The groups are
+ * distributed across 'nthreads' threads. The subjects are assumed to be
+ * fixed (i.e. 'fixedS' is TRUE).
+ */
+void _match_Twobit_lane_groups(SEXP pptb, const Chars_holder *S,
+		int S_length, TBLaneMatchBuf *lane_matches, int nthreads)
+{
+	int tb_width, ngroup, g, k;
+	const int *twobit_sign2pos;
+	SEXP base_codes;
+	TwobitEncodingBuffer teb[MAX_TB_NLANE];
+
+	tb_width = _get_PreprocessedTB_width(pptb);
+	twobit_sign2pos = INTEGER(_get_Twobit_sign2pos_tag(pptb));
+	base_codes = _get_PreprocessedTB_base_codes(pptb);
+	teb[0] = _new_TwobitEncodingBuffer(base_codes, tb_width, 0);
+	for (k = 1; k < MAX_TB_NLANE; k++)
+		teb[k] = teb[0];
+	ngroup = (S_length + MAX_TB_NLANE - 1) / MAX_TB_NLANE;
+	if (nthreads == 1) {
+		for (g = 0; g < ngroup; g++)
+			walk_subject_lanes(twobit_sign2pos, teb,
+				S + g * MAX_TB_NLANE,
+				TB_GROUP_NLANE(S_length, g),
+				lane_matches + g);
+	} else {
+#ifdef _OPENMP
+		#pragma omp parallel for num_threads(nthreads) \
+			schedule(dynamic) firstprivate(teb)
+		for (g = 0; g < ngroup; g++)
+			walk_subject_lanes(twobit_sign2pos, teb,
+				S + g * MAX_TB_NLANE,
+				TB_GROUP_NLANE(S_length, g),
+				lane_matches + g);
+#endif
+	}
+	return;
+}
+
+/* Same rolling scan as walk_subject() but with 64-bit signatures looked up
+   in the hash table. */
+static void walk_subject_hashed(const TwobitHash *hash,
+		const ByteTrTable *byte2twobit, int tb_width,
+		const Chars_holder *S, TBMatchBuf *tb_matches)
+{
+	uint64_t sign_mask, sign, b;
+	int nvalid, n, twobit, P_id;
+	const char *s;
+
+	sign_mask = get_sign_mask(tb_width);
+	sign = 0;
+	nvalid = 0;
+	for (n = 1, s = S->ptr; n <= S->length; n++, s++) {
+		twobit = byte2twobit->byte2code[(unsigned char) *s];
+		if (twobit == NA_INTEGER) {
+			nvalid = 0;
+			continue;
+		}
+		sign = ((sign << 2) | twobit) & sign_mask;
+		if (nvalid < tb_width && ++nvalid < tb_width)
+			continue;
+		b = find_sign_bucket(hash, sign);
+		P_id = hash->pos[b];
+		if (P_id == NA_INTEGER)
+			continue;
+		_TBMatchBuf_report_match(tb_matches, P_id - 1, n);
+	}
+	return;
+}
+
+void _match_TwobitHash(SEXP pptb, const Chars_holder *S, int fixedS,
+		TBMatchBuf *tb_matches)
+{
+	int tb_width;
+	TwobitHash hash;
+	ByteTrTable byte2twobit;
+	SEXP pos;
+
+	tb_width = _get_PreprocessedTB_width(pptb);
+	hash.keys = (uint64_t *) RAW(_get_TwobitHash_keys_tag(pptb));
+	pos = _get_TwobitHash_pos_tag(pptb);
+	hash.pos = INTEGER(pos);
+	hash.bucket_mask = (uint64_t) LENGTH(pos) - 1;
+	_init_byte2offset_with_INTEGER(&byte2twobit,
+			_get_PreprocessedTB_base_codes(pptb), 1);
+	if (!fixedS)
+		error("cannot treat IUPAC extended letters in the subject "
+		      "as ambiguities when 'pdict' is a PDict object of "
+		      "the \"TwobitHash\" type");
+	walk_subject_hashed(&hash, &byte2twobit, tb_width, S, tb_matches);
+	return;
+}
+
+/* Interleaved version of walk_subject_hashed(). Same as walk_subject_lanes()
+   except that it's the first bucket of the probe sequence that gets
+   prefetched. */
+static void walk_subject_hashed_lanes(const TwobitHash *hash,
+		const ByteTrTable *byte2twobit, int tb_width,
+		const Chars_holder *S, int nlane,
+		TBLaneMatchBuf *lane_matches)
+{
+	uint64_t sign_mask, sign[MAX_TB_NLANE], b;
+	int nvalid[MAX_TB_NLANE], pending[MAX_TB_NLANE],
+	    max_length, k, n, twobit, P_id;
+
+	sign_mask = get_sign_mask(tb_width);
+	max_length = 0;
+	for (k = 0; k < nlane; k++) {
+		sign[k] = 0;
+		nvalid[k] = pending[k] = 0;
+		if (S[k].length > max_length)
+			max_length = S[k].length;
+	}
+	for (n = 1; n <= max_length + 1; n++) {
+		for (k = 0; k < nlane; k++) {
+			if (n > S[k].length + 1)
+				continue;
+			/* Look up the signature computed at step n - 1 */
+			if (pending[k]) {
+				b = find_sign_bucket(hash, sign[k]);
+				P_id = hash->pos[b];
+				if (P_id != NA_INTEGER)
+					_TBLaneMatchBuf_report_match(
+						lane_matches, k,
+						P_id - 1, n - 1);
+				pending[k] = 0;
+			}
+			if (n > S[k].length)
+				continue;
+			twobit = byte2twobit->byte2code[
+					(unsigned char) S[k].ptr[n - 1]];
+			if (twobit == NA_INTEGER) {
+				nvalid[k] = 0;
+				continue;
+			}
+			sign[k] = ((sign[k] << 2) | twobit) & sign_mask;
+			if (nvalid[k] < tb_width && ++nvalid[k] < tb_width)
+				continue;
+			pending[k] = 1;
+			b = hash_sign(sign[k]) & hash->bucket_mask;
+			PREFETCH_READ(hash->pos + b);
+			PREFETCH_READ(hash->keys + b);
+		}
+	}
+	return;
+}
+
+/* See _match_Twobit_lane_groups() above. */
+void _match_TwobitHash_lane_groups(SEXP pptb, const Chars_holder *S,
+		int S_length, TBLaneMatchBuf *lane_matches, int nthreads)
+{
+	int tb_width, ngroup, g;
+	TwobitHash hash;
+	ByteTrTable byte2twobit;
+	SEXP pos;
+
+	tb_width = _get_PreprocessedTB_width(pptb);
+	hash.keys = (uint64_t *) RAW(_get_TwobitHash_keys_tag(pptb));
+	pos = _get_TwobitHash_pos_tag(pptb);
+	hash.pos = INTEGER(pos);
+	hash.bucket_mask = (uint64_t) LENGTH(pos) - 1;
+	_init_byte2offset_with_INTEGER(&byte2twobit,
+			_get_PreprocessedTB_base_codes(pptb), 1);
+	ngroup = (S_length + MAX_TB_NLANE - 1) / MAX_TB_NLANE;
+	if (nthreads == 1) {
+		for (g = 0; g < ngroup; g++)
+			walk_subject_hashed_lanes(&hash, &byte2twobit,
+				tb_width, S + g * MAX_TB_NLANE,
+				TB_GROUP_NLANE(S_length, g),
+				lane_matches + g);
+	} else {
+#ifdef _OPENMP
+		#pragma omp parallel for num_threads(nthreads) \
+			schedule(dynamic)
+		for (g = 0; g < ngroup; g++)
+			walk_subject_hashed_lanes(&hash, &byte2twobit,
+				tb_width, S + g * MAX_TB_NLANE,
+				TB_GROUP_NLANE(S_length, g),
+				lane_matches + g);
+#endif
+	}
+	return;
+}
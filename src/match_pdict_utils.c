@@ -8,8 +8,12 @@
 #include "S4Vectors_interface.h"
 #include <S.h> /* for Salloc() */
 
-#include <limits.h> /* for ULONG_MAX */
+#include <stdlib.h> /* for realloc() and free() */
+#include <limits.h> /* for CHAR_BIT */
 #include <time.h> /* for clock() and CLOCKS_PER_SEC */
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
 
 /****************************************************************************
@@ -64,6 +68,74 @@ void _TBMatchBuf_flush(TBMatchBuf *buf)
 	return;
 }
 
+TBLaneMatchBuf _new_TBLaneMatchBuf()
+{
+	TBLaneMatchBuf buf;
+
+	memset(&buf, 0, sizeof(TBLaneMatchBuf));
+	return buf;
+}
+
+/* Doesn't use the R API so it's safe to call from a worker thread. If
+   memory cannot be allocated, the match is dropped and 'buf->alloc_failed'
+   is set: the caller must check it and raise an error. */
+void _TBLaneMatchBuf_report_match(TBLaneMatchBuf *buf, int lane,
+		int PSpair_id, int end)
+{
+	int nelt, new_buflength, *PSpair_ids, *ends;
+
+	nelt = buf->nelt[lane];
+	if (nelt == buf->buflength[lane]) {
+		new_buflength = nelt == 0 ? 256 : 2 * nelt;
+		PSpair_ids = (int *) realloc(buf->PSpair_ids[lane],
+					     sizeof(int) * new_buflength);
+		if (PSpair_ids == NULL) {
+			buf->alloc_failed = 1;
+			return;
+		}
+		buf->PSpair_ids[lane] = PSpair_ids;
+		ends = (int *) realloc(buf->ends[lane],
+				       sizeof(int) * new_buflength);
+		if (ends == NULL) {
+			buf->alloc_failed = 1;
+			return;
+		}
+		buf->ends[lane] = ends;
+		buf->buflength[lane] = new_buflength;
+	}
+	buf->PSpair_ids[lane][nelt] = PSpair_id;
+	buf->ends[lane][nelt] = end;
+	buf->nelt[lane]++;
+	return;
+}
+
+/* Reports the matches found in 'lane' to 'tb_matches' (in the order they
+   were found) and empties the lane. */
+void _TBLaneMatchBuf_move_lane_to_TBMatchBuf(TBLaneMatchBuf *buf, int lane,
+		TBMatchBuf *tb_matches)
+{
+	int nelt, i;
+
+	nelt = buf->nelt[lane];
+	for (i = 0; i < nelt; i++)
+		_TBMatchBuf_report_match(tb_matches,
+				buf->PSpair_ids[lane][i], buf->ends[lane][i]);
+	buf->nelt[lane] = 0;
+	return;
+}
+
+void _free_TBLaneMatchBuf(TBLaneMatchBuf *buf)
+{
+	int lane;
+
+	for (lane = 0; lane < MAX_TB_NLANE; lane++) {
+		free(buf->PSpair_ids[lane]);
+		free(buf->ends[lane]);
+	}
+	memset(buf, 0, sizeof(TBLaneMatchBuf));
+	return;
+}
+
 MatchPDictBuf _new_MatchPDictBuf(SEXP matches_as, int tb_length, int tb_width,
 		const int *head_widths, const int *tail_widths)
 {
@@ -310,16 +382,24 @@ static void match_headtail_by_key(HeadTail *headtail,
  * called.
  * TODO: Estimate the cost of this preprocessing and decide whether it's
  * worth to make it persistent. Not a trivial task!
+ *
+ * The heads and tails of the keys in a group are one-hot packed (see the
+ * FlankWord typedef) and stored "by word" i.e. word w of the i-th key is
+ * at packed_flanks[w * nkey_max + i]. That way the same word of 4
+ * consecutive keys can be loaded in a single 256-bit register. The head is
+ * stored reversed (its 1st letter is the one adjacent to the Trusted Band)
+ * at letters 0 to max_Hwidth - 1, and the tail at letters max_Hwidth to
+ * max_Hwidth + max_Twidth - 1. For each candidate location, the flanks of
+ * the subject are packed once with the same layout and the number of
+ * matching letters is computed for all the keys of the group with
+ * AND+popcount.
  */
 
-#define MAX_REMAINING_KEYS 24  // >= 0 and < NBIT_PER_BITWORD
-#define TMPMATCH_BMBUF_MAXNCOL 200
-
-static PPHeadTail new_PPHeadTail(SEXP base_codes, int bmbuf_nrow,
-		int max_Hwidth, int max_Twidth, int max_nmis)
+static PPHeadTail new_PPHeadTail(SEXP base_codes, int nkey_max,
+		int max_Hwidth, int max_Twidth)
 {
 	PPHeadTail ppheadtail;
-	int i;
+	int nword;
 
 	ppheadtail.is_init = 1;
 	if (LENGTH(base_codes) != 4)
@@ -327,19 +407,17 @@ static PPHeadTail new_PPHeadTail(SEXP base_codes, int bmbuf_nrow,
 			"LENGTH(base_codes) != 4");
 	_init_byte2offset_with_INTEGER(&(ppheadtail.byte2offset),
 				       base_codes, 1);
-	if (max_Hwidth > 0)
-		for (i = 0; i < 4; i++)
-			ppheadtail.head_bmbuf[i] = _new_BitMatrix(bmbuf_nrow,
-							max_Hwidth, 0UL);
-	if (max_Twidth > 0)
-		for (i = 0; i < 4; i++)
-			ppheadtail.tail_bmbuf[i] = _new_BitMatrix(bmbuf_nrow,
-							max_Twidth, 0UL);
-	ppheadtail.nmis_bmbuf = _new_BitMatrix(bmbuf_nrow, max_nmis + 1, 0UL);
-	ppheadtail.tmp_match_bmbuf = _new_BitMatrix(bmbuf_nrow, TMPMATCH_BMBUF_MAXNCOL, ULONG_MAX);
-	ppheadtail.tmp_tb_end_buf = Salloc((long) TMPMATCH_BMBUF_MAXNCOL, int);
+	nword = (max_Hwidth + max_Twidth + NLETTER_PER_FLANKWORD - 1)
+		/ NLETTER_PER_FLANKWORD;
+	nkey_max = (nkey_max + 3) / 4 * 4;
+	ppheadtail.nword_per_flank = nword;
+	ppheadtail.nkey_max = nkey_max;
+	ppheadtail.packed_flanks = Salloc((long) nword * nkey_max, FlankWord);
+	ppheadtail.packed_S = Salloc((long) nword, FlankWord);
+	ppheadtail.nmatch_buf = Salloc((long) nkey_max, FlankWord);
+	ppheadtail.HTwidth_buf = Salloc((long) nkey_max, int);
 	//Rprintf("new_PPHeadTail():\n");
-	//Rprintf("  nb of rows in each BitMatrix buffer=%d\n", bmbuf_nrow);
+	//Rprintf("  nword_per_flank=%d nkey_max=%d\n", nword, nkey_max);
 	return ppheadtail;
 }
 
@@ -403,341 +481,252 @@ HeadTail _new_HeadTail(SEXP pdict_head, SEXP pdict_tail, SEXP pptb,
 	//	max_Hwidth, max_Twidth, max_HTwidth);
 	//Rprintf("  grouped_keys_buflength=%d\n", grouped_keys_buflength);
 
-	/* The (max_nmis <= 4) and (max_Hwidth + max_Twidth <= 10 + 4 * max_nmis)
-	   criteria together with the MAX_REMAINING_KEYS value above (20)
-	   are optimized for the Core 2 Duo arch (64bit) */
+	/* The one-hot packed flanks can only tell whether 2 bases are the
+	   same so they are used for exact letter comparison only */
 	if (with_ppheadtail
 	 && (max_nmis < max_HTwidth)
-	 && (max_nmis <= 4)
-	 && (max_Hwidth + max_Twidth <= 10 + 4 * max_nmis)
 	 && (fixedP && fixedS)) {
 		/* The base codes for the head and tail are assumed to be the
 		   same as for the Trusted Band */
 		base_codes = _get_PreprocessedTB_base_codes(pptb);
 		headtail.ppheadtail = new_PPHeadTail(base_codes,
 					grouped_keys_buflength,
-					max_Hwidth, max_Twidth, max_nmis);
+					max_Hwidth, max_Twidth);
 	} else {
 		headtail.ppheadtail.is_init = 0;
 	}
 	return headtail;
 }
 
-static void init_headortail_bmbuf(BitMatrix *bmbuf, int nrow)
-{
-	int i;
-
-	//Rprintf("init_headortail_bmbuf(): nrow=%d\n", nrow);
-	for (i = 0; i < 4; i++) {
-		if (nrow > bmbuf[i].nword_per_col * NBIT_PER_BITWORD)
-			error("Biostrings internal error in init_headortail_bmbuf(): "
-			      "not enough rows in 'bmbuf[%d]'", i);
-		bmbuf[i].nrow = nrow;
-		/* Set all bits to 1 */
-		_BitMatrix_set_val(bmbuf + i, ULONG_MAX);
-	}
-	return;
-}
-
-static void init_nmis_bmbuf(BitMatrix *bmbuf, int nrow)
+static inline int popcount_FlankWord(FlankWord x)
 {
-	if (nrow > bmbuf->nword_per_col * NBIT_PER_BITWORD)
-		error("Biostrings internal error in init_nmis_bmbuf(): "
-		      "not enough rows in 'bmbuf'");
-	bmbuf->nrow = nrow;
-	/* Set all bits to 0 */
-	_BitMatrix_set_val(bmbuf, 0UL);
-	return;
+#ifdef __GNUC__
+	return __builtin_popcountll(x);
+#else
+	x = x - ((x >> 1) & 0x5555555555555555ULL);
+	x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+	x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+	return (int) ((x * 0x0101010101010101ULL) >> 56);
+#endif
 }
 
-static void preprocess_H(const Chars_holder *H,
-		const ByteTrTable *byte2offset, BitMatrix *bmbuf0, int i)
+/* Returns 0 for a non-base letter */
+static inline FlankWord onehot_letter(const ByteTrTable *byte2offset, char c)
 {
-	int j, offset;
-	const char *c;
-	BitMatrix *bmbuf;
+	int offset;
 
-	for (j = 0, c = H->ptr + H->length - 1; j < H->length; j++, c--) {
-		offset = byte2offset->byte2code[(unsigned char) *c];
-		if (offset == NA_INTEGER)
-			error("preprocess_H(): don't know how to handle "
-			      "non-base letters in the preprocessed head or "
-			      "tail of a PDict object yet, sorry ==> FIXME");
-		bmbuf = bmbuf0 + offset;
-		_BitMatrix_set_bit(bmbuf, i, j, 0);
-	}
-	for (offset = 0; offset < 4; offset++) {
-		bmbuf = bmbuf0 + offset;
-		for (j = H->length; j < bmbuf->ncol; j++)
-			_BitMatrix_set_bit(bmbuf, i, j, 0);
-	}
-	return;
+	offset = byte2offset->byte2code[(unsigned char) c];
+	return offset == NA_INTEGER ? 0ULL : 1ULL << offset;
 }
 
-static void preprocess_T(const Chars_holder *T,
-		const ByteTrTable *byte2offset, BitMatrix *bmbuf0, int i)
+static inline void set_packed_letter(FlankWord *words, int nkey_max,
+		int i, int j, FlankWord bits)
 {
-	int j, offset;
-	const char *c;
-	BitMatrix *bmbuf;
-
-	for (j = 0, c = T->ptr; j < T->length; j++, c++) {
-		offset = byte2offset->byte2code[(unsigned char) *c];
-		if (offset == NA_INTEGER)
-			error("preprocess_T(): don't know how to handle "
-			      "non-base letters in the preprocessed head or "
-			      "tail of a PDict object yet, sorry ==> FIXME");
-		bmbuf = bmbuf0 + offset;
-		_BitMatrix_set_bit(bmbuf, i, j, 0);
-	}
-	for (offset = 0; offset < 4; offset++) {
-		bmbuf = bmbuf0 + offset;
-		for (j = T->length; j < bmbuf->ncol; j++)
-			_BitMatrix_set_bit(bmbuf, i, j, 0);
-	}
-	return;
-}
-
-static void preprocess_head(const RoSeqs *head, const IntAE *grouped_keys,
-		const ByteTrTable *byte2offset, BitMatrix *bmbuf0)
-{
-	int nelt, i, *key;
-
-	nelt = IntAE_get_nelt(grouped_keys);
-	init_headortail_bmbuf(bmbuf0, nelt);
-	for (i = 0, key = grouped_keys->elts;
-	     i < nelt;
-	     i++, key++)
-		preprocess_H(head->elts + *key, byte2offset, bmbuf0, i);
+	words[(j / NLETTER_PER_FLANKWORD) * nkey_max + i] |=
+		bits << (4 * (j % NLETTER_PER_FLANKWORD));
 	return;
 }
 
-static void preprocess_tail(const RoSeqs *tail, const IntAE *grouped_keys,
-		const ByteTrTable *byte2offset, BitMatrix *bmbuf0)
+/* Returns 0 if the head or tail of one of the grouped keys contains
+   non-base letters. The caller must then fall back to brute force. */
+static int pack_grouped_flanks(HeadTail *headtail)
 {
-	int nelt, i, *key;
-
-	nelt = IntAE_get_nelt(grouped_keys);
-	init_headortail_bmbuf(bmbuf0, nelt);
-	for (i = 0, key = grouped_keys->elts;
-	     i < nelt;
-	     i++, key++)
-		preprocess_T(tail->elts + *key, byte2offset, bmbuf0, i);
-	return;
+	PPHeadTail *ppheadtail;
+	int nkey, i, key, j;
+	const Chars_holder *H, *T;
+	FlankWord bits;
+
+	ppheadtail = &(headtail->ppheadtail);
+	nkey = IntAE_get_nelt(headtail->grouped_keys);
+	if (nkey > ppheadtail->nkey_max)
+		error("Biostrings internal error in pack_grouped_flanks(): "
+		      "not enough room in 'ppheadtail->packed_flanks'");
+	memset(ppheadtail->packed_flanks, 0, sizeof(FlankWord) *
+	       ppheadtail->nword_per_flank * ppheadtail->nkey_max);
+	for (i = 0; i < nkey; i++) {
+		key = headtail->grouped_keys->elts[i];
+		H = headtail->head.elts + key;
+		T = headtail->tail.elts + key;
+		for (j = 0; j < H->length; j++) {
+			bits = onehot_letter(&(ppheadtail->byte2offset),
+					     H->ptr[H->length - 1 - j]);
+			if (bits == 0ULL)
+				return 0;
+			set_packed_letter(ppheadtail->packed_flanks,
+					  ppheadtail->nkey_max, i, j, bits);
+		}
+		for (j = 0; j < T->length; j++) {
+			bits = onehot_letter(&(ppheadtail->byte2offset),
+					     T->ptr[j]);
+			if (bits == 0ULL)
+				return 0;
+			set_packed_letter(ppheadtail->packed_flanks,
+					  ppheadtail->nkey_max, i,
+					  headtail->max_Hwidth + j, bits);
+		}
+		ppheadtail->HTwidth_buf[i] = H->length + T->length;
+	}
+	return 1;
 }
 
-static BitCol match_ppheadtail_for_loc(HeadTail *headtail, int tb_width,
-		const Chars_holder *S, int tb_end, int max_nmis, int min_nmis)
+/* The letters that fall outside 'S' or that are not bases are packed as
+   0 so they never match. */
+static void pack_S_flanks(HeadTail *headtail, int tb_width,
+		const Chars_holder *S, int tb_end)
 {
-	BitMatrix *nmis_bmbuf;
-	const BitMatrix *head_bmbuf, *tail_bmbuf;
-	int j1, j2, offset;
-	char s;
-	BitCol bitcol, max_nmis_bitcol, min_nmis_bitcol;
+	PPHeadTail *ppheadtail;
+	int j1, j2;
 
-	nmis_bmbuf = &(headtail->ppheadtail.nmis_bmbuf);
-	// Match the heads
-	head_bmbuf = headtail->ppheadtail.head_bmbuf;
+	ppheadtail = &(headtail->ppheadtail);
+	memset(ppheadtail->packed_S, 0,
+	       sizeof(FlankWord) * ppheadtail->nword_per_flank);
 	for (j1 = 0, j2 = tb_end - tb_width - 1;
-	     j1 < headtail->max_Hwidth;
+	     j1 < headtail->max_Hwidth && j2 >= 0;
 	     j1++, j2--)
 	{
-		// 'j2' should be a safe location in 'S' because we call
-		// match_ppheadtail_for_loc() only when 'tb_end' is guaranteed
-		// not to be too close to 'S' boundaries.
-		s = S->ptr[j2];
-		offset = headtail->ppheadtail.byte2offset.byte2code[(unsigned char) s];
-		if (offset == NA_INTEGER) {
-			_BitMatrix_Rrot1(nmis_bmbuf);
-			continue;
-		}
-		bitcol = _BitMatrix_get_col(head_bmbuf + offset, j1);
-		_BitMatrix_grow1rows(nmis_bmbuf, &bitcol);
+		set_packed_letter(ppheadtail->packed_S, 1, 0, j1,
+			onehot_letter(&(ppheadtail->byte2offset), S->ptr[j2]));
 	}
-	// Match the tails
-	tail_bmbuf = headtail->ppheadtail.tail_bmbuf;
 	for (j1 = 0, j2 = tb_end;
-	     j1 < headtail->max_Twidth;
+	     j1 < headtail->max_Twidth && j2 < S->length;
 	     j1++, j2++)
 	{
-		// 'j2' should be a safe location in 'S' because we call
-		// match_ppheadtail_for_loc() only when 'tb_end' is guaranteed
-		// not to be too close from 'S' boundaries.
-		s = S->ptr[j2];
-		offset = headtail->ppheadtail.byte2offset.byte2code[(unsigned char) s];
-		if (offset == NA_INTEGER) {
-			_BitMatrix_Rrot1(nmis_bmbuf);
-			continue;
-		}
-		bitcol = _BitMatrix_get_col(tail_bmbuf + offset, j1);
-		_BitMatrix_grow1rows(nmis_bmbuf, &bitcol);
-	}
-	max_nmis_bitcol = _BitMatrix_get_col(nmis_bmbuf, max_nmis);
-	if (min_nmis >= 1) {
-		min_nmis_bitcol = _BitMatrix_get_col(nmis_bmbuf, min_nmis - 1);
-		_BitCol_A_gets_BimpliesA(&max_nmis_bitcol, &min_nmis_bitcol);
-	}
-	return max_nmis_bitcol;
-}
-
-static void report_matches_for_loc(const BitCol *bitcol, HeadTail *headtail,
-		int tb_end, MatchPDictBuf *matchpdict_buf)
-{
-	// Note that using _BitCol_get_bit() for this would be easier but is
-	// also twice slower!
-	BitWord *bitword;
-	int i, i2;
-
-	bitword = bitcol->bitword0;
-	for (i = i2 = 0; i < bitcol->nbit; i++, i2++) {
-		if (i2 >= NBIT_PER_BITWORD) {
-			i2 = 0;
-			bitword++;
-		}
-		if (!(*bitword & 1UL)) {
-			//_MatchPDictBuf_report_match(matchpdict_buf,
-			//	headtail->grouped_keys.elts[i], tb_end);
-			int key, start, width;
-			key = headtail->grouped_keys->elts[i];
-			width = headtail->head.elts[key].length
-			      + matchpdict_buf->tb_matches.tb_width
-			      + headtail->tail.elts[key].length;
-			start = tb_end + headtail->tail.elts[key].length - width + 1;
-			_MatchPDictBuf_report_match2(matchpdict_buf, key, start, width);
-		}
-		*bitword >>= 1;
+		set_packed_letter(ppheadtail->packed_S, 1, 0,
+			headtail->max_Hwidth + j1,
+			onehot_letter(&(ppheadtail->byte2offset), S->ptr[j2]));
 	}
 	return;
 }
 
 /*
-static void flush_tmp_match_bmbuf(HeadTail *headtail, MatchPDictBuf *matchpdict_buf)
-{
-	BitMatrix *tmp_match_bmbuf;
-	const int *tmp_tb_end_buf;
-	BitWord *bitword2, *bitword, mask;
-	int i, j;
-
-	tmp_match_bmbuf = &(headtail->ppheadtail.tmp_match_bmbuf);
-	tmp_tb_end_buf = headtail->ppheadtail.tmp_tb_end_buf;
-	bitword2 = tmp_match_bmbuf->bitword00;
-	mask = 1UL;
-	for (i = 0; i < tmp_match_bmbuf->nrow; i++) {
-		if (mask == 0UL) { // this means that i % NBIT_PER_BITWORD == 0
-			bitword2++;
-			mask = 1UL;
-		}
-		bitword = bitword2;
-		for (j = 0; j < tmp_match_bmbuf->ncol; j++) {
-			if (!(*bitword & mask)) {
-				_MatchPDictBuf_report_match(matchpdict_buf,
-					headtail->grouped_keys.elts[i], tmp_tb_end_buf[j]);
-			}
-			bitword += tmp_match_bmbuf->nword_per_col;
+ * Stores the nb of letters in the flanks of the first 'nkey' grouped keys
+ * that match the packed subject flanks in 'ppheadtail->nmatch_buf'.
+ * With AVX2, the 4 keys in a 256-bit register are processed at once: the
+ * popcount of each byte is obtained with 2 nibble lookups (vpshufb) and
+ * the bytes are summed by 64-bit lane with vpsadbw. The padding keys are
+ * all 0 so it's safe to process 'nkey' rounded up to a multiple of 4.
+ */
+static void count_packed_matches(PPHeadTail *ppheadtail, int nkey)
+{
+	int nkey_max, nword, i, w;
+	const FlankWord *words;
+#if defined(__AVX2__)
+	__m256i lookup, low4, zero, acc, x, cnt;
+
+	nkey_max = ppheadtail->nkey_max;
+	nword = ppheadtail->nword_per_flank;
+	lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3,
+				  1, 2, 2, 3, 2, 3, 3, 4,
+				  0, 1, 1, 2, 1, 2, 2, 3,
+				  1, 2, 2, 3, 2, 3, 3, 4);
+	low4 = _mm256_set1_epi8(0x0f);
+	zero = _mm256_setzero_si256();
+	for (i = 0; i < nkey; i += 4) {
+		acc = zero;
+		for (w = 0, words = ppheadtail->packed_flanks + i;
+		     w < nword;
+		     w++, words += nkey_max)
+		{
+			x = _mm256_and_si256(
+				_mm256_loadu_si256((const __m256i *) words),
+				_mm256_set1_epi64x(
+					(long long) ppheadtail->packed_S[w]));
+			cnt = _mm256_add_epi8(
+				_mm256_shuffle_epi8(lookup,
+					_mm256_and_si256(x, low4)),
+				_mm256_shuffle_epi8(lookup,
+					_mm256_and_si256(
+						_mm256_srli_epi16(x, 4),
+						low4)));
+			acc = _mm256_add_epi64(acc, _mm256_sad_epu8(cnt, zero));
 		}
-		mask <<= 1;
+		_mm256_storeu_si256((__m256i *) (ppheadtail->nmatch_buf + i),
+				    acc);
+	}
+#else
+	FlankWord nmatch;
+
+	nkey_max = ppheadtail->nkey_max;
+	nword = ppheadtail->nword_per_flank;
+	for (i = 0; i < nkey; i++) {
+		nmatch = 0;
+		for (w = 0, words = ppheadtail->packed_flanks + i;
+		     w < nword;
+		     w++, words += nkey_max)
+			nmatch += popcount_FlankWord(*words &
+						ppheadtail->packed_S[w]);
+		ppheadtail->nmatch_buf[i] = nmatch;
 	}
-	tmp_match_bmbuf->ncol = 0;
+#endif
 	return;
 }
-*/
 
-static void match_ppheadtail0(HeadTail *headtail,
-		const Chars_holder *S, const IntAE *tb_end_buf,
-		int max_nmis, int min_nmis,
-		const BytewiseOpTable *bytewise_match_table,
+static void report_matches_for_loc(HeadTail *headtail, int nkey,
+		int tb_end, int max_nmis, int min_nmis,
 		MatchPDictBuf *matchpdict_buf)
 {
-	BitMatrix *tmp_match_bmbuf;
-	int nelt, min_safe_tb_end, max_safe_tb_end, j, ncol;
-	const int *tb_end;
-	BitCol bitcol;
-
-	if (headtail->max_Hwidth > 0)
-		preprocess_head(&(headtail->head), headtail->grouped_keys,
-			&(headtail->ppheadtail.byte2offset),
-			headtail->ppheadtail.head_bmbuf);
-	if (headtail->max_Twidth > 0)
-		preprocess_tail(&(headtail->tail), headtail->grouped_keys,
-			&(headtail->ppheadtail.byte2offset),
-			headtail->ppheadtail.tail_bmbuf);
-	tmp_match_bmbuf = &(headtail->ppheadtail.tmp_match_bmbuf);
-	tmp_match_bmbuf->nrow = IntAE_get_nelt(headtail->grouped_keys);
-	tmp_match_bmbuf->ncol = 0;
-
-	min_safe_tb_end = headtail->max_Hwidth
-			+ matchpdict_buf->tb_matches.tb_width;
-	max_safe_tb_end = S->length - headtail->max_Twidth;
-	nelt = IntAE_get_nelt(tb_end_buf);
-	for (j = 0, tb_end = tb_end_buf->elts;
-	     j < nelt;
-	     j++, tb_end++)
-	{
-		if (*tb_end < min_safe_tb_end || max_safe_tb_end < *tb_end) {
-			match_headtail_for_loc(headtail,
-				S, *tb_end,
-				max_nmis, min_nmis, bytewise_match_table,
-				matchpdict_buf);
+	const PPHeadTail *ppheadtail;
+	int tb_width, i, nmis, key, Hwidth, start, width;
+
+	ppheadtail = &(headtail->ppheadtail);
+	tb_width = matchpdict_buf->tb_matches.tb_width;
+	for (i = 0; i < nkey; i++) {
+		nmis = ppheadtail->HTwidth_buf[i]
+		     - (int) ppheadtail->nmatch_buf[i];
+		if (nmis > max_nmis || nmis < min_nmis)
 			continue;
-		}
-		// From now 'tb_end' is guaranteed to be "safe" i.e. not too
-		// close to 'S' boundaries.
-		init_nmis_bmbuf(&(headtail->ppheadtail.nmis_bmbuf),
-				IntAE_get_nelt(headtail->grouped_keys));
-		bitcol = match_ppheadtail_for_loc(headtail,
-				matchpdict_buf->tb_matches.tb_width,
-				S, *tb_end, max_nmis, min_nmis);
-		report_matches_for_loc(&bitcol, headtail, *tb_end, matchpdict_buf);
-/*
-		ncol = tmp_match_bmbuf->ncol;
-		_BitMatrix_set_col(tmp_match_bmbuf, ncol, &bitcol);
-		tmp_match_bmbuf->ncol++;
-		headtail->ppheadtail.tmp_tb_end_buf[ncol] = *tb_end;
-		if (tmp_match_bmbuf->ncol == TMPMATCH_BMBUF_MAXNCOL)
-			flush_tmp_match_bmbuf(headtail, matchpdict_buf);
-*/
+		key = headtail->grouped_keys->elts[i];
+		Hwidth = headtail->head.elts[key].length;
+		width = Hwidth + tb_width + headtail->tail.elts[key].length;
+		start = tb_end - tb_width - Hwidth + 1;
+		_MatchPDictBuf_report_match2(matchpdict_buf, key, start, width);
 	}
-/*
-	flush_tmp_match_bmbuf(headtail, matchpdict_buf);
-*/
 	return;
 }
 
+/*
+ * Packing the subject flanks costs about max_HTwidth letter lookups per
+ * location while brute force compares about (max_nmis + 1) * 4/3 letters
+ * per key and location before it gives up (on a random sequence). Packing
+ * the heads and tails of the keys costs about the same as one location
+ * processed by brute force.
+ */
+static int use_ppheadtail(const HeadTail *headtail, int nloci, int max_nmis)
+{
+	int nkey;
+
+	if (!headtail->ppheadtail.is_init || nloci < 2)
+		return 0;
+	nkey = IntAE_get_nelt(headtail->grouped_keys);
+	return nkey * (max_nmis + 1) >= headtail->max_HTwidth;
+}
+
 static void match_ppheadtail(HeadTail *headtail,
 		const Chars_holder *S, const IntAE *tb_end_buf,
 		int max_nmis, int min_nmis,
 		const BytewiseOpTable *bytewise_match_table,
 		MatchPDictBuf *matchpdict_buf)
 {
-	int nelt, nkey0, nkey1, nkey2, i, key;
+	int nkey, nelt, j;
+	const int *tb_end;
 
-	nkey0 = IntAE_get_nelt(headtail->grouped_keys);
-	nkey2 = nkey0 % NBIT_PER_BITWORD;
-	if (nkey2 > MAX_REMAINING_KEYS) {
-		match_ppheadtail0(headtail,
-			S, tb_end_buf,
+	if (!pack_grouped_flanks(headtail)) {
+		match_headtail_by_key(headtail, S, tb_end_buf,
 			max_nmis, min_nmis, bytewise_match_table,
 			matchpdict_buf);
 		return;
 	}
-	nkey1 = nkey0 - nkey2;
-	if (nkey1 != 0) {
-		IntAE_set_nelt(headtail->grouped_keys, nkey1);
-		match_ppheadtail0(headtail,
-			S, tb_end_buf,
-			max_nmis, min_nmis, bytewise_match_table,
-			matchpdict_buf);
-		IntAE_set_nelt(headtail->grouped_keys, nkey0);
-	}
-	/* FIXME: If headtail->grouped_keys is guaranteed to not grow
-	   during the loop below, then extract its nelt before entering
-	   the loop. */
-	for (i = nkey1; i < IntAE_get_nelt(headtail->grouped_keys); i++) {
-		key = headtail->grouped_keys->elts[i];
-		match_headtail_for_key(headtail, key,
-			S, tb_end_buf,
-			max_nmis, min_nmis, bytewise_match_table,
-			matchpdict_buf);
+	nkey = IntAE_get_nelt(headtail->grouped_keys);
+	nelt = IntAE_get_nelt(tb_end_buf);
+	for (j = 0, tb_end = tb_end_buf->elts;
+	     j < nelt;
+	     j++, tb_end++)
+	{
+		pack_S_flanks(headtail, matchpdict_buf->tb_matches.tb_width,
+			      S, *tb_end);
+		count_packed_matches(&(headtail->ppheadtail), nkey);
+		report_matches_for_loc(headtail, nkey,
+			*tb_end, max_nmis, min_nmis, matchpdict_buf);
 	}
 	return;
 }
@@ -755,7 +744,7 @@ static void BENCHMARK_match_ppheadtail(HeadTail *headtail,
 
 	time0 = clock();
 	for (i = 0; i < 100; i++) {
-		match_ppheadtail0(headtail,
+		match_ppheadtail(headtail,
 			S, tb_end_buf, max_nmis, min_nmis,
 			bytewise_match_table,
 			matchpdict_buf);
@@ -774,7 +763,6 @@ static void BENCHMARK_match_ppheadtail(HeadTail *headtail,
 }
 */
 
-
 /*****************************************************************************
  * _match_pdict_flanks_at() and _match_pdict_all_flanks()
  * ------------------------------------------------------
@@ -831,9 +819,9 @@ void _match_pdict_all_flanks(SEXP low2high,
 		NFC = ndup * nloci;
 		total_NFC += NFC;
 */
-		if (headtail->ppheadtail.is_init
-		 && IntAE_get_nelt(tb_end_buf) >= 15) {
-			// Use the BitMatrix horse-power
+		if (use_ppheadtail(headtail, IntAE_get_nelt(tb_end_buf),
+				   max_nmis)) {
+			// Use the one-hot packed flanks
 /*
 			Rprintf("_match_pdict_all_flanks(): "
 				"key0=%d "
@@ -0,0 +1,324 @@
+/****************************************************************************
+ *          Sparse oligonucleotide (k-mer) counting for large widths         *
+ ****************************************************************************/
+#include "Biostrings.h"
+#include "XVector_interface.h"
+#include "S4Vectors_interface.h"
+
+#include <stdint.h>  /* for uint64_t */
+#include <limits.h>  /* for INT_MAX */
+
+/*
+ * The k-mers (1 <= k <= 31) are packed 2 bits per base in a 64-bit word so
+ * their numeric order is the lexicographic order of the k-mers (the bases
+ * being ordered as in 'base_codes', i.e. A < C < G < T).
+ * Per-sequence counts are obtained by sorting the k-mers of the sequence
+ * and counting the runs. The collapsed counts are accumulated in a hash
+ * table so that memory is proportional to the number of distinct k-mers.
+ */
+
+#define EMPTY_KEY UINT64_MAX  /* never a valid k-mer since k <= 31 */
+
+typedef struct kmer_extractor {
+	ByteTrTable byte2twobit;
+	int width, step, canonical;
+	uint64_t mask;
+	int rc_shift;
+} KmerExtractor;
+
+static KmerExtractor new_KmerExtractor(SEXP base_codes, int width, int step,
+		int canonical)
+{
+	KmerExtractor extractor;
+
+	_init_byte2offset_with_INTEGER(&(extractor.byte2twobit),
+				       base_codes, 1);
+	extractor.width = width;
+	extractor.step = step;
+	extractor.canonical = canonical;
+	extractor.mask = (((uint64_t) 1) << (2 * width)) - 1;
+	extractor.rc_shift = 2 * (width - 1);
+	return extractor;
+}
+
+/* Stores the k-mers of 'X' in 'kmers' (must have room for X->length
+   elements) and returns their number. */
+static int extract_kmers(const KmerExtractor *extractor,
+		const Chars_holder *X, uint64_t *kmers)
+{
+	int nkmer, nvalid, i, twobit;
+	uint64_t fwd, rc;
+	const char *c;
+
+	nkmer = nvalid = 0;
+	fwd = rc = 0;
+	for (i = 0, c = X->ptr; i < X->length; i++, c++) {
+		twobit = extractor->byte2twobit.byte2code[(unsigned char) *c];
+		if (twobit == NA_INTEGER) {
+			nvalid = 0;
+			continue;
+		}
+		fwd = ((fwd << 2) | twobit) & extractor->mask;
+		rc = (rc >> 2) |
+		     ((uint64_t) (3 - twobit) << extractor->rc_shift);
+		if (++nvalid < extractor->width)
+			continue;
+		/* 0-based start of the k-mer */
+		if ((i - extractor->width + 1) % extractor->step != 0)
+			continue;
+		kmers[nkmer++] = extractor->canonical && rc < fwd ? rc : fwd;
+	}
+	return nkmer;
+}
+
+/* LSD radix sort on the lower 'nbit' bits, 8 bits at a time. */
+static void sort_kmers(uint64_t *kmers, uint64_t *tmp, int n, int nbit)
+{
+	int count[256], shift, i, b, sum, nb;
+	uint64_t *src, *dest, *swap;
+
+	src = kmers;
+	dest = tmp;
+	for (shift = 0; shift < nbit; shift += 8) {
+		memset(count, 0, sizeof(count));
+		for (i = 0; i < n; i++)
+			count[(src[i] >> shift) & 0xff]++;
+		for (b = sum = 0; b < 256; b++) {
+			nb = count[b];
+			count[b] = sum;
+			sum += nb;
+		}
+		for (i = 0; i < n; i++)
+			dest[count[(src[i] >> shift) & 0xff]++] = src[i];
+		swap = src;
+		src = dest;
+		dest = swap;
+	}
+	if (src != kmers)
+		memcpy(kmers, src, sizeof(uint64_t) * n);
+	return;
+}
+
+/* Replaces the sorted k-mers by the distinct ones and stores their counts
+   in 'counts'. Returns the number of distinct k-mers. */
+static int count_sorted_kmers(uint64_t *kmers, int n, int *counts)
+{
+	int ndistinct, i;
+
+	ndistinct = 0;
+	for (i = 0; i < n; i++) {
+		if (ndistinct != 0 && kmers[ndistinct - 1] == kmers[i]) {
+			counts[ndistinct - 1]++;
+			continue;
+		}
+		kmers[ndistinct] = kmers[i];
+		counts[ndistinct] = 1;
+		ndistinct++;
+	}
+	return ndistinct;
+}
+
+
+/****************************************************************************
+ * A minimal open-addressing hash table of k-mer counts.
+ */
+
+typedef struct kmer_table {
+	uint64_t *keys;
+	double *counts;
+	size_t nbucket, nelt;
+} KmerTable;
+
+static KmerTable new_KmerTable(size_t nbucket)
+{
+	KmerTable table;
+	size_t i;
+
+	table.nbucket = nbucket;
+	table.nelt = 0;
+	table.keys = (uint64_t *) R_alloc(nbucket, sizeof(uint64_t));
+	table.counts = (double *) R_alloc(nbucket, sizeof(double));
+	for (i = 0; i < nbucket; i++)
+		table.keys[i] = EMPTY_KEY;
+	return table;
+}
+
+static size_t hash_kmer(uint64_t kmer, size_t nbucket)
+{
+	/* 64-bit finalizer from MurmurHash3 */
+	kmer ^= kmer >> 33;
+	kmer *= 0xff51afd7ed558ccdULL;
+	kmer ^= kmer >> 33;
+	kmer *= 0xc4ceb9fe1a85ec53ULL;
+	kmer ^= kmer >> 33;
+	return (size_t) kmer & (nbucket - 1);  /* 'nbucket' is a power of 2 */
+}
+
+static void KmerTable_add(KmerTable *table, uint64_t kmer, double count);
+
+static void grow_KmerTable(KmerTable *table)
+{
+	KmerTable new_table;
+	size_t i;
+
+	new_table = new_KmerTable(2 * table->nbucket);
+	for (i = 0; i < table->nbucket; i++)
+		if (table->keys[i] != EMPTY_KEY)
+			KmerTable_add(&new_table, table->keys[i],
+				      table->counts[i]);
+	/* The old buckets are reclaimed by R at the end of the .Call */
+	*table = new_table;
+	return;
+}
+
+static void KmerTable_add(KmerTable *table, uint64_t kmer, double count)
+{
+	size_t b;
+
+	/* Keep the load factor below 0.5 */
+	if (2 * (table->nelt + 1) > table->nbucket)
+		grow_KmerTable(table);
+	for (b = hash_kmer(kmer, table->nbucket);
+	     table->keys[b] != EMPTY_KEY;
+	     b = (b + 1) & (table->nbucket - 1))
+	{
+		if (table->keys[b] == kmer) {
+			table->counts[b] += count;
+			return;
+		}
+	}
+	table->keys[b] = kmer;
+	table->counts[b] = count;
+	table->nelt++;
+	return;
+}
+
+
+/****************************************************************************
+ * Building the result.
+ */
+
+static SEXP mk_kmer_labels(const uint64_t *kmers, int n, int width,
+		SEXP base_codes)
+{
+	SEXP base_labels, ans;
+	char letters[4], buf[33];
+	int i, j;
+
+	base_labels = GET_NAMES(base_codes);
+	for (j = 0; j < 4; j++)
+		letters[j] = CHAR(STRING_ELT(base_labels, j))[0];
+	buf[width] = '\0';
+	PROTECT(ans = NEW_CHARACTER(n));
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < width; j++)
+			buf[j] = letters[(kmers[i] >> (2 * (width - 1 - j))) & 3];
+		SET_STRING_ELT(ans, i, mkChar(buf));
+	}
+	UNPROTECT(1);
+	return ans;
+}
+
+/* Returns an integer vector (or a double vector if some counts don't fit
+   in an int) named with the k-mers. */
+static SEXP mk_named_counts(const uint64_t *kmers, const double *counts,
+		int n, int width, SEXP base_codes)
+{
+	SEXP ans, ans_names;
+	int as_integer, i;
+
+	as_integer = 1;
+	for (i = 0; i < n; i++) {
+		if (counts[i] > INT_MAX) {
+			as_integer = 0;
+			break;
+		}
+	}
+	if (as_integer) {
+		PROTECT(ans = NEW_INTEGER(n));
+		for (i = 0; i < n; i++)
+			INTEGER(ans)[i] = (int) counts[i];
+	} else {
+		PROTECT(ans = NEW_NUMERIC(n));
+		memcpy(REAL(ans), counts, sizeof(double) * n);
+	}
+	PROTECT(ans_names = mk_kmer_labels(kmers, n, width, base_codes));
+	SET_NAMES(ans, ans_names);
+	UNPROTECT(2);
+	return ans;
+}
+
+/* --- .Call ENTRY POINT ---
+ * Returns the counts of the k-mers present in each element of 'x' as a list
+ * of named integer vectors sorted by k-mer, or, if 'collapse' is TRUE, the
+ * counts for the whole set as a single named vector.
+ */
+SEXP XStringSet_sparse_oligo_frequency(SEXP x, SEXP width, SEXP step,
+		SEXP canonical, SEXP collapse, SEXP base_codes)
+{
+	KmerExtractor extractor;
+	XStringSet_holder x_holder;
+	Chars_holder x_elt;
+	KmerTable table;
+	int width0, x_length, max_length, i, nkmer, ndistinct, *counts, j, n;
+	uint64_t *kmers, *tmp;
+	double *dcounts;
+	size_t b;
+	SEXP ans, ans_elt;
+
+	width0 = INTEGER(width)[0];
+	extractor = new_KmerExtractor(base_codes, width0, INTEGER(step)[0],
+				      LOGICAL(canonical)[0]);
+	x_length = _get_XStringSet_length(x);
+	x_holder = _hold_XStringSet(x);
+	max_length = 0;
+	for (i = 0; i < x_length; i++) {
+		x_elt = _get_elt_from_XStringSet_holder(&x_holder, i);
+		if (x_elt.length > max_length)
+			max_length = x_elt.length;
+	}
+	kmers = (uint64_t *) R_alloc(max_length, sizeof(uint64_t));
+	if (LOGICAL(collapse)[0]) {
+		table = new_KmerTable(1024);
+		for (i = 0; i < x_length; i++) {
+			x_elt = _get_elt_from_XStringSet_holder(&x_holder, i);
+			nkmer = extract_kmers(&extractor, &x_elt, kmers);
+			while (nkmer--)
+				KmerTable_add(&table, kmers[nkmer], 1.0);
+		}
+		/* Pack the non-empty buckets and sort them by k-mer */
+		kmers = (uint64_t *) R_alloc(table.nelt, sizeof(uint64_t));
+		tmp = (uint64_t *) R_alloc(table.nelt, sizeof(uint64_t));
+		for (b = 0, n = 0; b < table.nbucket; b++)
+			if (table.keys[b] != EMPTY_KEY)
+				kmers[n++] = table.keys[b];
+		sort_kmers(kmers, tmp, n, 2 * width0);
+		dcounts = (double *) R_alloc(n, sizeof(double));
+		for (j = 0; j < n; j++) {
+			for (b = hash_kmer(kmers[j], table.nbucket);
+			     table.keys[b] != kmers[j];
+			     b = (b + 1) & (table.nbucket - 1))
+				;
+			dcounts[j] = table.counts[b];
+		}
+		return mk_named_counts(kmers, dcounts, n, width0, base_codes);
+	}
+	tmp = (uint64_t *) R_alloc(max_length, sizeof(uint64_t));
+	counts = (int *) R_alloc(max_length, sizeof(int));
+	dcounts = (double *) R_alloc(max_length, sizeof(double));
+	PROTECT(ans = NEW_LIST(x_length));
+	for (i = 0; i < x_length; i++) {
+		x_elt = _get_elt_from_XStringSet_holder(&x_holder, i);
+		nkmer = extract_kmers(&extractor, &x_elt, kmers);
+		sort_kmers(kmers, tmp, nkmer, 2 * width0);
+		ndistinct = count_sorted_kmers(kmers, nkmer, counts);
+		for (j = 0; j < ndistinct; j++)
+			dcounts[j] = counts[j];
+		PROTECT(ans_elt = mk_named_counts(kmers, dcounts, ndistinct,
+						  width0, base_codes));
+		SET_ELEMENT(ans, i, ans_elt);
+		UNPROTECT(1);
+	}
+	UNPROTECT(1);
+	return ans;
+}
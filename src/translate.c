@@ -2,108 +2,164 @@
 #include "XVector_interface.h"
 #include "IRanges_interface.h"
 
+#include <stdlib.h>  /* for realloc() and free() */
+#include <limits.h>  /* for INT_MAX */
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 
 #define TRANSLATE_ERROR	1
 #define TRANSLATE_SOLVE	2
 #define TRANSLATE_TO_X	3
 
-static char errmsg_buf[200];
+/* Error codes returned by translate() */
+#define NOT_A_BASE		-1
+#define NON_AMBIG_FUZZY_CODON	-2
+#define AMBIG_FUZZY_CODON	-3
 
 /*
- * Returns -1 if error, or the nb of trailing letters that were ignored
- * if successful (0, 1, or 2).
+ * The DNA and RNA letters are encoded as 4-bit masks (A=1, C=2, G=4, T/U=8,
+ * the IUPAC ambiguity letters being the union of the bases they stand for),
+ * so a codon packs in 12 bits and can be translated with a single lookup in
+ * a 4096-entry table. This table covers the fuzzy codons too: the amino
+ * acid letters of the codons that contain an ambiguity letter are flagged
+ * with FUZZY_CODON so the 'if.fuzzy.codon' logic only kicks in for them.
  */
-static int fast_translate(const Chars_holder *dna, Chars_holder *aa,
-			  char skip_code,
-			  TwobitEncodingBuffer *teb, SEXP lkup)
+#define SKIP_NIBBLE	0x10
+#define INVALID_NIBBLE	0x20
+#define FUZZY_CODON	0x100
+
+typedef struct codon_table {
+	unsigned char byte2nibble[256], byte2rcnibble[256];
+	unsigned short codon2aa[4096];
+	int if_non_ambig, if_ambig;
+} CodonTable;
+
+/* The first 4 elements of 'dna_codes' must be the codes of A, C, G and T
+   (or U), in this order. */
+static int complement_nibble(SEXP dna_codes, int nibble)
 {
-	int phase, i, lkup_key;
-	const char *c;
-	char aa_letter;
+	int o, rcnibble;
 
-	aa->length = phase = 0;
-	_reset_twobit_signature(teb);
-	for (i = 0, c = dna->ptr; i < dna->length; i++, c++) {
-		if (*c == skip_code)
-			continue;
-		lkup_key = _shift_twobit_signature(teb, *c);
-		if (teb->lastin_twobit == NA_INTEGER) {
-			snprintf(errmsg_buf, sizeof(errmsg_buf),
-				 "not a base at pos %d", i + 1);
-			return -1;
-		}
-		if (phase < 2) {
-			phase++;
-			continue;
+	rcnibble = 0;
+	for (o = 0; o < 4; o++)
+		if (nibble & INTEGER(dna_codes)[o])
+			rcnibble |= INTEGER(dna_codes)[3 - o];
+	return rcnibble;
+}
+
+static void init_CodonTable(CodonTable *table, char skip_code,
+		SEXP dna_codes, SEXP lkup, int if_non_ambig, int if_ambig)
+{
+	int ncodes, i1, i2, i3, c1, c2, c3, key;
+	unsigned short aa_code;
+
+	ncodes = LENGTH(dna_codes);
+	memset(table->byte2nibble, INVALID_NIBBLE,
+	       sizeof(table->byte2nibble));
+	memset(table->byte2rcnibble, INVALID_NIBBLE,
+	       sizeof(table->byte2rcnibble));
+	memset(table->codon2aa, 0, sizeof(table->codon2aa));
+	for (i1 = 0; i1 < ncodes; i1++) {
+		c1 = INTEGER(dna_codes)[i1];
+		if (c1 < 1 || c1 > 15)
+			error("Biostrings internal error in "
+			      "DNAStringSet_translate(): "
+			      "'dna_codes' must be 4-bit codes");
+		table->byte2nibble[c1] = c1;
+		table->byte2rcnibble[c1] = complement_nibble(dna_codes, c1);
+	}
+	table->byte2nibble[(unsigned char) skip_code] = SKIP_NIBBLE;
+	table->byte2rcnibble[(unsigned char) skip_code] = SKIP_NIBBLE;
+	for (i1 = 0; i1 < ncodes; i1++) {
+		c1 = INTEGER(dna_codes)[i1];
+		for (i2 = 0; i2 < ncodes; i2++) {
+			c2 = INTEGER(dna_codes)[i2];
+			for (i3 = 0; i3 < ncodes; i3++) {
+				c3 = INTEGER(dna_codes)[i3];
+				key = (c1 << 8) | (c2 << 4) | c3;
+				aa_code = (unsigned char) INTEGER(lkup)
+					[(i1 * ncodes + i2) * ncodes + i3];
+				/* the first 4 codes are the bases */
+				if (i1 >= 4 || i2 >= 4 || i3 >= 4)
+					aa_code |= FUZZY_CODON;
+				table->codon2aa[key] = aa_code;
+			}
 		}
-		aa_letter = (char) INTEGER(lkup)[lkup_key];
-		/* aa->ptr is a const char * so we need to cast it to
-		   char * before we can write to it */
-		((char *) aa->ptr)[aa->length++] = aa_letter;
-		phase = 0;
 	}
-	return phase;
+	table->if_non_ambig = if_non_ambig;
+	table->if_ambig = if_ambig;
+	return;
 }
 
 /*
- * Returns -1 if error, or the nb of trailing letters that were ignored
- * if successful (0, 1, or 2).
+ * Translates 'dna' in the given reading frame: 'frame' (0, 1 or 2) is the nb
+ * of letters to skip before the first codon and, if 'reverse' is TRUE, 'dna'
+ * is translated from its last to its first letter using the complementary
+ * bases (i.e. the reverse complement of 'dna' is translated but without
+ * being materialized).
+ * The 'frame' leading letters are not part of any codon so they are skipped
+ * without being checked.
+ * Returns a negative error code (and sets '*errpos') if error, or the nb of
+ * trailing letters that were ignored if successful (0, 1, or 2).
+ * Doesn't use the R API so can be called from a worker thread.
  */
-static int translate(const Chars_holder *dna, Chars_holder *aa,
-		     char skip_code,
-		     int ncodes, ByteTrTable *byte2offset, SEXP lkup,
-		     int if_non_ambig, int if_ambig)
+static int translate_frame(const CodonTable *table,
+		const Chars_holder *dna, int reverse, int frame,
+		Chars_holder *aa, int *errpos)
 {
-	int phase, i, lkup_key, offset, is_fuzzy;
-	const char *c;
+	int phase, n, i, step;
+	unsigned int key;
+	const unsigned char *byte2nibble;
+	unsigned char nibble;
+	unsigned short aa_code;
 	char aa_letter;
 
-	aa->length = phase = 0;
-	for (i = 0, c = dna->ptr; i < dna->length; i++, c++) {
-		if (*c == skip_code)
-			continue;
-		offset = byte2offset->byte2code[(unsigned char) *c];
-		if (offset == NA_INTEGER) {
-			snprintf(errmsg_buf, sizeof(errmsg_buf),
-				 "not a base at pos %d", i + 1);
-			return -1;
-		}
-		if (phase == 0) {
-			lkup_key = offset;
-			is_fuzzy = 0;
-			phase++;
-			continue;
+	if (reverse) {
+		byte2nibble = table->byte2rcnibble;
+		i = dna->length - 1 - frame;
+		step = -1;
+	} else {
+		byte2nibble = table->byte2nibble;
+		i = frame;
+		step = 1;
+	}
+	aa->length = 0;
+	phase = 0;
+	key = 0;
+	for (n = frame; n < dna->length; n++, i += step) {
+		nibble = byte2nibble[(unsigned char) dna->ptr[i]];
+		if (nibble & ~0x0F) {
+			if (nibble == SKIP_NIBBLE)
+				continue;
+			*errpos = i + 1;
+			return NOT_A_BASE;
 		}
-		lkup_key *= ncodes;
-		lkup_key += offset;
-		if (offset >= 4)
-			is_fuzzy = 1;
+		key = (key << 4) | nibble;
 		if (phase < 2) {
 			phase++;
 			continue;
 		}
-		aa_letter = (char) INTEGER(lkup)[lkup_key];
-		if (is_fuzzy) {
-			/* codon is fuzzy */
+		aa_code = table->codon2aa[key & 0xFFF];
+		aa_letter = (char) (aa_code & 0xFF);
+		if (aa_code & FUZZY_CODON) {
+			/* '*errpos' is set to the pos of the 1st letter
+			   of the codon */
 			if (aa_letter != 'X') {
 				/* non-ambiguous fuzzy codon */
-				if (if_non_ambig == TRANSLATE_ERROR) {
-					snprintf(errmsg_buf,
-						 sizeof(errmsg_buf),
-						 "non-ambiguous fuzzy codon "
-						 "starting at pos %d", i - 1);
-					return -1;
+				if (table->if_non_ambig == TRANSLATE_ERROR) {
+					*errpos = reverse ? i + 3 : i - 1;
+					return NON_AMBIG_FUZZY_CODON;
 				}
-				if (if_non_ambig == TRANSLATE_TO_X)
+				if (table->if_non_ambig == TRANSLATE_TO_X)
 					aa_letter = 'X';
 			} else {
 				/* ambiguous fuzzy codon */
-				if (if_ambig == TRANSLATE_ERROR) {
-					snprintf(errmsg_buf,
-						 sizeof(errmsg_buf),
-						 "ambiguous fuzzy codon "
-						 "starting at pos %d", i - 1);
-					return -1;
+				if (table->if_ambig == TRANSLATE_ERROR) {
+					*errpos = reverse ? i + 3 : i - 1;
+					return AMBIG_FUZZY_CODON;
 				}
 			}
 		}
@@ -115,21 +171,42 @@ static int translate(const Chars_holder *dna, Chars_holder *aa,
 	return phase;
 }
 
-/*
- * --- .Call ENTRY POINT ---
- * Return an AAStringSet object.
- */
-SEXP DNAStringSet_translate(SEXP x, SEXP skip_code, SEXP dna_codes, SEXP lkup,
+static int translate(const CodonTable *table,
+		     const Chars_holder *dna, Chars_holder *aa, int *errpos)
+{
+	return translate_frame(table, dna, 0, 0, aa, errpos);
+}
+
+static void format_errmsg(char *buf, size_t buf_size, int errcode, int errpos)
+{
+	switch (errcode) {
+	    case NOT_A_BASE:
+		snprintf(buf, buf_size, "not a base at pos %d", errpos);
+		break;
+	    case NON_AMBIG_FUZZY_CODON:
+		snprintf(buf, buf_size, "non-ambiguous fuzzy codon "
+			 "starting at pos %d", errpos);
+		break;
+	    case AMBIG_FUZZY_CODON:
+		snprintf(buf, buf_size, "ambiguous fuzzy codon "
+			 "starting at pos %d", errpos);
+		break;
+	    case 1:
+		snprintf(buf, buf_size, "last base was ignored");
+		break;
+	    default:
+		snprintf(buf, buf_size, "last %d bases were ignored", errcode);
+	}
+	return;
+}
+
+static CodonTable *new_CodonTable(SEXP skip_code, SEXP dna_codes, SEXP lkup,
 		SEXP if_non_ambig, SEXP if_ambig)
 {
 	char skip_code0;
-	int ncodes, if_non_ambig0, if_ambig0, ans_length, i, errcode;
-	TwobitEncodingBuffer teb;
-	ByteTrTable byte2offset;
+	int ncodes, if_non_ambig0, if_ambig0;
+	CodonTable *table;
 	const char *s1, *s2;
-	XStringSet_holder X, Y;
-	Chars_holder X_elt, Y_elt;
-	SEXP ans, width, ans_width;
 
 	skip_code0 = (unsigned char) INTEGER(skip_code)[0];
 	ncodes = LENGTH(dna_codes);
@@ -137,31 +214,66 @@ SEXP DNAStringSet_translate(SEXP x, SEXP skip_code, SEXP dna_codes, SEXP lkup,
 		error("Biostrings internal error in "
 		      "DNAStringSet_translate(): length of 'lkup' "
 		      "must equal length of 'dna_codes' power 3");
-	if (ncodes == 4) {
-		teb = _new_TwobitEncodingBuffer(dna_codes, 3, 0);
-	} else {
-		_init_byte2offset_with_INTEGER(&byte2offset, dna_codes, 1);
-		s1 = CHAR(STRING_ELT(if_non_ambig, 0));
-		if (strcmp(s1, "error") == 0)
-			if_non_ambig0 = TRANSLATE_ERROR;
-		else if (strcmp(s1, "solve") == 0)
-			if_non_ambig0 = TRANSLATE_SOLVE;
-		else if (strcmp(s1, "X") == 0)
-			if_non_ambig0 = TRANSLATE_TO_X;
-		else
-			error("Biostrings internal error in "
-			      "DNAStringSet_translate(): "
-			      "invalid 'if_non_ambig' argument");
-		s2 = CHAR(STRING_ELT(if_ambig, 0));
-		if (strcmp(s2, "error") == 0)
-			if_ambig0 = TRANSLATE_ERROR;
-		else if (strcmp(s2, "X") == 0)
-			if_ambig0 = TRANSLATE_TO_X;
-		else
-			error("Biostrings internal error in "
-			      "DNAStringSet_translate(): "
-			      "invalid 'if_ambig' argument");
-	}
+	s1 = CHAR(STRING_ELT(if_non_ambig, 0));
+	if (strcmp(s1, "error") == 0)
+		if_non_ambig0 = TRANSLATE_ERROR;
+	else if (strcmp(s1, "solve") == 0)
+		if_non_ambig0 = TRANSLATE_SOLVE;
+	else if (strcmp(s1, "X") == 0)
+		if_non_ambig0 = TRANSLATE_TO_X;
+	else
+		error("Biostrings internal error in "
+		      "DNAStringSet_translate(): "
+		      "invalid 'if_non_ambig' argument");
+	s2 = CHAR(STRING_ELT(if_ambig, 0));
+	if (strcmp(s2, "error") == 0)
+		if_ambig0 = TRANSLATE_ERROR;
+	else if (strcmp(s2, "X") == 0)
+		if_ambig0 = TRANSLATE_TO_X;
+	else
+		error("Biostrings internal error in "
+		      "DNAStringSet_translate(): "
+		      "invalid 'if_ambig' argument");
+	table = (CodonTable *) R_alloc(1, sizeof(CodonTable));
+	init_CodonTable(table, skip_code0, dna_codes, lkup,
+			if_non_ambig0, if_ambig0);
+	return table;
+}
+
+static int get_nthreads(SEXP nthreads, int ntask)
+{
+	int nthreads0;
+
+	nthreads0 = INTEGER(nthreads)[0];
+#ifndef _OPENMP
+	nthreads0 = 1;
+#endif
+	if (nthreads0 > ntask)
+		nthreads0 = ntask;
+	if (nthreads0 < 1)
+		nthreads0 = 1;
+	return nthreads0;
+}
+
+/*
+ * --- .Call ENTRY POINT ---
+ * Return an AAStringSet object.
+ * When 'nthreads' > 1, the elements of 'x' are translated in parallel. The
+ * errors and warnings are collected per element and reported once all the
+ * threads are done, in the order of the elements.
+ */
+SEXP DNAStringSet_translate(SEXP x, SEXP skip_code, SEXP dna_codes, SEXP lkup,
+		SEXP if_non_ambig, SEXP if_ambig, SEXP nthreads)
+{
+	char errmsg_buf[200];
+	int ans_length, i, nthreads0, *ans_width_p, *errcodes, *errpos;
+	CodonTable *table;
+	XStringSet_holder X, Y;
+	Chars_holder X_elt, Y_elt;
+	SEXP ans, width, ans_width;
+
+	table = new_CodonTable(skip_code, dna_codes, lkup,
+			       if_non_ambig, if_ambig);
 	X = _hold_XStringSet(x);
 	ans_length = _get_length_from_XStringSet_holder(&X);
 	PROTECT(width = NEW_INTEGER(ans_length));
@@ -172,38 +284,446 @@ SEXP DNAStringSet_translate(SEXP x, SEXP skip_code, SEXP dna_codes, SEXP lkup,
 	PROTECT(ans = alloc_XRawList("AAStringSet", "AAString", width));
 	Y = _hold_XStringSet(ans);
 	ans_width = _get_XStringSet_width(ans);
+	ans_width_p = INTEGER(ans_width);
+	errcodes = (int *) R_alloc(ans_length, sizeof(int));
+	errpos = (int *) R_alloc(ans_length, sizeof(int));
+	nthreads0 = get_nthreads(nthreads, ans_length);
+	if (nthreads0 == 1) {
+		for (i = 0; i < ans_length; i++) {
+			X_elt = _get_elt_from_XStringSet_holder(&X, i);
+			Y_elt = _get_elt_from_XStringSet_holder(&Y, i);
+			errcodes[i] = translate(table, &X_elt, &Y_elt,
+						errpos + i);
+			ans_width_p[i] = Y_elt.length;
+			if (errcodes[i] < 0)
+				break;
+		}
+	} else {
+#ifdef _OPENMP
+		#pragma omp parallel for num_threads(nthreads0) \
+			schedule(dynamic, 16) private(X_elt, Y_elt)
+		for (i = 0; i < ans_length; i++) {
+			X_elt = _get_elt_from_XStringSet_holder(&X, i);
+			Y_elt = _get_elt_from_XStringSet_holder(&Y, i);
+			errcodes[i] = translate(table, &X_elt, &Y_elt,
+						errpos + i);
+			ans_width_p[i] = Y_elt.length;
+		}
+#endif
+	}
 	for (i = 0; i < ans_length; i++) {
-		X_elt = _get_elt_from_XStringSet_holder(&X, i);
-		Y_elt = _get_elt_from_XStringSet_holder(&Y, i);
-		errcode = ncodes == 4 ?
-			fast_translate(&X_elt, &Y_elt,
-				       skip_code0, &teb, lkup) :
-			translate(&X_elt, &Y_elt,
-				  skip_code0, ncodes, &byte2offset, lkup,
-				  if_non_ambig0, if_ambig0);
-		if (errcode == -1) {
+		if (errcodes[i] == 0)
+			continue;
+		format_errmsg(errmsg_buf, sizeof(errmsg_buf),
+			      errcodes[i], errpos[i]);
+		if (errcodes[i] < 0) {
 			UNPROTECT(2);
 			if (ans_length == 1)
 				error("%s", errmsg_buf);
 			else
 				error("in 'x[[%d]]': %s", i + 1, errmsg_buf);
 		}
-		if (errcode >= 1) {
-			if (errcode == 1) {
-				snprintf(errmsg_buf, sizeof(errmsg_buf),
-					 "last base was ignored");
-			} else {
-				snprintf(errmsg_buf, sizeof(errmsg_buf),
-					 "last %d bases were ignored", errcode);
-			}
-			if (ans_length == 1)
-				warning("%s", errmsg_buf);
-			else
-				warning("in 'x[[%d]]': %s", i + 1, errmsg_buf);
+		if (ans_length == 1)
+			warning("%s", errmsg_buf);
+		else
+			warning("in 'x[[%d]]': %s", i + 1, errmsg_buf);
+	}
+	UNPROTECT(2);
+	return ans;
+}
+
+/*
+ * --- .Call ENTRY POINT ---
+ * Translates each element of 'x' in its 6 reading frames in one pass over
+ * the element (the frames of the minus strand are obtained by walking the
+ * element backward so its reverse complement is never materialized).
+ * Return an AAStringSet object of length 6 * length(x) where the 6
+ * consecutive elements of the i-th group are the translations of x[[i]] in
+ * frames +1, +2, +3, -1, -2 and -3. The incomplete trailing codons are
+ * silently ignored.
+ */
+SEXP DNAStringSet_translate_six_frames(SEXP x, SEXP skip_code, SEXP dna_codes,
+		SEXP lkup, SEXP if_non_ambig, SEXP if_ambig, SEXP nthreads)
+{
+	static const char *frame_labels[] = {"+1", "+2", "+3",
+					     "-1", "-2", "-3"};
+	char errmsg_buf[200];
+	int x_length, ans_length, i, k, frame, nthreads0,
+	    *ans_width_p, *errcodes, *errpos;
+	CodonTable *table;
+	XStringSet_holder X, Y;
+	Chars_holder X_elt, Y_elt;
+	SEXP ans, width, ans_width;
+
+	table = new_CodonTable(skip_code, dna_codes, lkup,
+			       if_non_ambig, if_ambig);
+	X = _hold_XStringSet(x);
+	x_length = _get_length_from_XStringSet_holder(&X);
+	ans_length = 6 * x_length;
+	PROTECT(width = NEW_INTEGER(ans_length));
+	for (k = 0; k < ans_length; k++) {
+		X_elt = _get_elt_from_XStringSet_holder(&X, k / 6);
+		frame = k % 3;
+		INTEGER(width)[k] = X_elt.length > frame ?
+				    (X_elt.length - frame) / 3 : 0;
+	}
+	PROTECT(ans = alloc_XRawList("AAStringSet", "AAString", width));
+	Y = _hold_XStringSet(ans);
+	ans_width = _get_XStringSet_width(ans);
+	ans_width_p = INTEGER(ans_width);
+	errcodes = (int *) R_alloc(ans_length, sizeof(int));
+	errpos = (int *) R_alloc(ans_length, sizeof(int));
+	nthreads0 = get_nthreads(nthreads, ans_length);
+	if (nthreads0 == 1) {
+		for (k = 0; k < ans_length; k++) {
+			X_elt = _get_elt_from_XStringSet_holder(&X, k / 6);
+			Y_elt = _get_elt_from_XStringSet_holder(&Y, k);
+			errcodes[k] = translate_frame(table, &X_elt,
+					k % 6 >= 3, k % 3, &Y_elt, errpos + k);
+			ans_width_p[k] = Y_elt.length;
+			if (errcodes[k] < 0)
+				break;
 		}
-		INTEGER(ans_width)[i] = Y_elt.length;
+	} else {
+#ifdef _OPENMP
+		#pragma omp parallel for num_threads(nthreads0) \
+			schedule(dynamic, 16) private(X_elt, Y_elt)
+		for (k = 0; k < ans_length; k++) {
+			X_elt = _get_elt_from_XStringSet_holder(&X, k / 6);
+			Y_elt = _get_elt_from_XStringSet_holder(&Y, k);
+			errcodes[k] = translate_frame(table, &X_elt,
+					k % 6 >= 3, k % 3, &Y_elt, errpos + k);
+			ans_width_p[k] = Y_elt.length;
+		}
+#endif
+	}
+	for (k = 0; k < ans_length; k++) {
+		if (errcodes[k] >= 0)
+			continue;
+		format_errmsg(errmsg_buf, sizeof(errmsg_buf),
+			      errcodes[k], errpos[k]);
+		UNPROTECT(2);
+		i = k / 6;
+		if (x_length == 1)
+			error("in frame %s: %s", frame_labels[k % 6],
+			      errmsg_buf);
+		else
+			error("in 'x[[%d]]', frame %s: %s", i + 1,
+			      frame_labels[k % 6], errmsg_buf);
 	}
 	UNPROTECT(2);
 	return ans;
 }
 
+
+/****************************************************************************
+ * Finding the Open Reading Frames (ORFs).
+ *
+ * The 6 reading frames of a sequence are searched in 2 passes (one per
+ * strand) over the sequence, with the 3 frames of a strand being tracked
+ * simultaneously. The codons are classified with a 4096-entry table indexed
+ * by the 12-bit packed codon (see above). Any codon that contains a letter
+ * that is not a base is a "break" i.e. an ORF cannot span it.
+ */
+
+#define ORF_START	1
+#define ORF_STOP	2
+#define ORF_BREAK	4
+
+typedef struct orf_finder {
+	unsigned char byte2nibble[256];
+	unsigned char codon2type[4096], rccodon2type[4096];
+	int min_width;
+} ORFFinder;
+
+typedef struct orf {
+	int seq, start, width, strand;
+} ORF;
+
+typedef struct orfs {
+	ORF *elts;
+	size_t nelt, buflength;
+	int failed;
+} ORFs;
+
+/* 'codon_types' must be parallel to 'mkAllStrings(DNA_BASES, 3)' and
+   'base_codes' must contain the codes of A, C, G and T (or U), in this
+   order. */
+static void init_ORFFinder(ORFFinder *finder, SEXP base_codes,
+		SEXP codon_types, int min_width)
+{
+	int i1, i2, i3, c1, c2, c3, type;
+	const int *codes;
+
+	codes = INTEGER(base_codes);
+	for (i1 = 0; i1 < 4; i1++)
+		if (codes[i1] < 1 || codes[i1] > 15)
+			error("Biostrings internal error in "
+			      "DNAStringSet_find_ORFs(): "
+			      "'base_codes' must be 4-bit codes");
+	/* A letter that is not a base produces a 0 nibble so any codon
+	   containing it is mapped to ORF_BREAK */
+	memset(finder->byte2nibble, 0, sizeof(finder->byte2nibble));
+	memset(finder->codon2type, ORF_BREAK, sizeof(finder->codon2type));
+	memset(finder->rccodon2type, ORF_BREAK, sizeof(finder->rccodon2type));
+	for (i1 = 0; i1 < 4; i1++) {
+		c1 = codes[i1];
+		finder->byte2nibble[c1] = c1;
+		for (i2 = 0; i2 < 4; i2++) {
+			c2 = codes[i2];
+			for (i3 = 0; i3 < 4; i3++) {
+				c3 = codes[i3];
+				type = INTEGER(codon_types)
+					[(i1 * 4 + i2) * 4 + i3];
+				finder->codon2type[(c1 << 8) | (c2 << 4) | c3] =
+					type;
+				/* the reverse complement of codon c1 c2 c3 */
+				finder->rccodon2type[(codes[3 - i3] << 8) |
+						     (codes[3 - i2] << 4) |
+						     codes[3 - i1]] = type;
+			}
+		}
+	}
+	finder->min_width = min_width;
+	return;
+}
+
+static void ORFs_append(ORFs *orfs, int seq, int start, int width,
+		int strand)
+{
+	size_t new_buflength;
+	ORF *new_elts, *orf;
+
+	if (orfs->failed)
+		return;
+	if (orfs->nelt == orfs->buflength) {
+		new_buflength = orfs->buflength == 0 ? 1024 :
+						       2 * orfs->buflength;
+		new_elts = (ORF *) realloc(orfs->elts,
+					   new_buflength * sizeof(ORF));
+		if (new_elts == NULL) {
+			orfs->failed = 1;
+			return;
+		}
+		orfs->elts = new_elts;
+		orfs->buflength = new_buflength;
+	}
+	orf = orfs->elts + orfs->nelt++;
+	orf->seq = seq;
+	orf->start = start;
+	orf->width = width;
+	orf->strand = strand;
+	return;
+}
+
+/* 'start' is 0-based */
+static void report_ORF(const ORFFinder *finder, ORFs *orfs, int seq,
+		int start, int width, int strand)
+{
+	if (width >= finder->min_width)
+		ORFs_append(orfs, seq + 1, start + 1, width, strand);
+	return;
+}
+
+/* On the plus strand, an ORF goes from the first start codon following a
+   stop codon (or a break, or the beginning of the sequence) to the next
+   stop codon (included). */
+static void find_plus_strand_ORFs(const ORFFinder *finder,
+		const Chars_holder *X, int seq, ORFs *orfs)
+{
+	int open_start[3], i, f;
+	unsigned int key;
+	unsigned char type;
+
+	open_start[0] = open_start[1] = open_start[2] = -1;
+	key = 0;
+	for (i = 0, f = 0; i < X->length; i++) {
+		key = (key << 4) |
+		      finder->byte2nibble[(unsigned char) X->ptr[i]];
+		if (++f == 3)
+			f = 0;
+		if (i < 2)
+			continue;
+		type = finder->codon2type[key & 0xFFF];
+		if (type == 0)
+			continue;
+		if (type & ORF_BREAK) {
+			open_start[f] = -1;
+		} else if (type & ORF_STOP) {
+			if (open_start[f] >= 0) {
+				report_ORF(finder, orfs, seq, open_start[f],
+					   i + 1 - open_start[f], 0);
+				open_start[f] = -1;
+			}
+		} else if (open_start[f] < 0) {
+			open_start[f] = i - 2;
+		}
+	}
+	return;
+}
+
+/* On the minus strand the sequence is still walked from left to right so
+   a stop codon is seen before the start codons of its ORF: the ORF goes
+   from this stop codon to the right-most start codon that precedes the next
+   stop codon (or break, or the end of the sequence). */
+static void find_minus_strand_ORFs(const ORFFinder *finder,
+		const Chars_holder *X, int seq, ORFs *orfs)
+{
+	int last_stop[3], last_start[3], i, f;
+	unsigned int key;
+	unsigned char type;
+
+	for (f = 0; f < 3; f++)
+		last_stop[f] = last_start[f] = -1;
+	key = 0;
+	for (i = 0, f = 0; i < X->length; i++) {
+		key = (key << 4) |
+		      finder->byte2nibble[(unsigned char) X->ptr[i]];
+		if (++f == 3)
+			f = 0;
+		if (i < 2)
+			continue;
+		type = finder->rccodon2type[key & 0xFFF];
+		if (type == 0)
+			continue;
+		if (type & (ORF_BREAK | ORF_STOP)) {
+			if (last_stop[f] >= 0 && last_start[f] >= 0)
+				report_ORF(finder, orfs, seq, last_stop[f],
+					   last_start[f] + 3 - last_stop[f], 1);
+			last_stop[f] = type & ORF_BREAK ? -1 : i - 2;
+			last_start[f] = -1;
+		} else if (last_stop[f] >= 0) {
+			last_start[f] = i - 2;
+		}
+	}
+	for (f = 0; f < 3; f++)
+		if (last_stop[f] >= 0 && last_start[f] >= 0)
+			report_ORF(finder, orfs, seq, last_stop[f],
+				   last_start[f] + 3 - last_stop[f], 1);
+	return;
+}
+
+static SEXP ORFs_asLIST(const ORFs *orfs, int nbuf)
+{
+	SEXP ans, ans_names, ans_elt;
+	size_t nelt, k;
+	int b, j, *cols[4];
+	const ORF *orf;
+	static const char *colnames[] = {"seq", "start", "width", "strand"};
+
+	for (b = 0, nelt = 0; b < nbuf; b++)
+		nelt += orfs[b].nelt;
+	PROTECT(ans = NEW_LIST(4));
+	PROTECT(ans_names = NEW_CHARACTER(4));
+	for (j = 0; j < 4; j++) {
+		SET_STRING_ELT(ans_names, j, mkChar(colnames[j]));
+		PROTECT(ans_elt = NEW_INTEGER(nelt));
+		SET_ELEMENT(ans, j, ans_elt);
+		UNPROTECT(1);
+		cols[j] = INTEGER(ans_elt);
+	}
+	SET_NAMES(ans, ans_names);
+	UNPROTECT(1);
+	for (b = 0; b < nbuf; b++) {
+		for (k = 0, orf = orfs[b].elts; k < orfs[b].nelt; k++, orf++) {
+			*(cols[0]++) = orf->seq;
+			*(cols[1]++) = orf->start;
+			*(cols[2]++) = orf->width;
+			*(cols[3]++) = orf->strand;
+		}
+	}
+	UNPROTECT(1);
+	return ans;
+}
+
+/*
+ * --- .Call ENTRY POINT ---
+ * DNAStringSet_find_ORFs() arguments are assumed to be:
+ *   x: DNAStringSet or RNAStringSet object;
+ *   base_codes: named integer vector of length 4 obtained with
+ *       'xscodes(x, baseOnly=TRUE)';
+ *   codon_types: integer vector of length 64 parallel to
+ *       'mkAllStrings(DNA_BASES, 3)' with values 0 (other codon),
+ *       1 (start codon) or 2 (stop codon);
+ *   min_width: single integer, the min nb of nucleotides of an ORF
+ *       (stop codon included);
+ *   both_strands: TRUE or FALSE;
+ *   nthreads: single integer.
+ * Returns a named list of 4 integer vectors of the same length: "seq"
+ * (index of the sequence in 'x'), "start", "width" and "strand" (0 for the
+ * plus strand and 1 for the minus strand). The ORFs are not sorted.
+ * When 'nthreads' > 1, the strands of the sequences in 'x' are searched
+ * in parallel, each thread using its own ORF buffer.
+ */
+SEXP DNAStringSet_find_ORFs(SEXP x, SEXP base_codes, SEXP codon_types,
+		SEXP min_width, SEXP both_strands, SEXP nthreads)
+{
+	ORFFinder *finder;
+	XStringSet_holder X;
+	Chars_holder *X_elts;
+	int x_length, nstrand, ntask, k, t, i, nthreads0, failed;
+	size_t norf;
+	ORFs *orfs;
+	SEXP ans;
+
+	finder = (ORFFinder *) R_alloc(1, sizeof(ORFFinder));
+	init_ORFFinder(finder, base_codes, codon_types,
+		       INTEGER(min_width)[0]);
+	X = _hold_XStringSet(x);
+	x_length = _get_length_from_XStringSet_holder(&X);
+	X_elts = (Chars_holder *) R_alloc(x_length, sizeof(Chars_holder));
+	for (i = 0; i < x_length; i++)
+		X_elts[i] = _get_elt_from_XStringSet_holder(&X, i);
+	nstrand = LOGICAL(both_strands)[0] ? 2 : 1;
+	ntask = nstrand * x_length;
+	nthreads0 = get_nthreads(nthreads, ntask);
+	orfs = (ORFs *) R_alloc(nthreads0, sizeof(ORFs));
+	for (t = 0; t < nthreads0; t++) {
+		orfs[t].elts = NULL;
+		orfs[t].nelt = orfs[t].buflength = 0;
+		orfs[t].failed = 0;
+	}
+	if (nthreads0 == 1) {
+		for (k = 0; k < ntask; k++) {
+			i = k / nstrand;
+			if (k % nstrand == 0)
+				find_plus_strand_ORFs(finder, X_elts + i,
+						      i, orfs);
+			else
+				find_minus_strand_ORFs(finder, X_elts + i,
+						       i, orfs);
+		}
+	} else {
+#ifdef _OPENMP
+		#pragma omp parallel for num_threads(nthreads0) \
+			schedule(dynamic) private(i, t)
+		for (k = 0; k < ntask; k++) {
+			t = omp_get_thread_num();
+			i = k / nstrand;
+			if (k % nstrand == 0)
+				find_plus_strand_ORFs(finder, X_elts + i,
+						      i, orfs + t);
+			else
+				find_minus_strand_ORFs(finder, X_elts + i,
+						       i, orfs + t);
+		}
+#endif
+	}
+	for (t = failed = 0, norf = 0; t < nthreads0; t++) {
+		failed |= orfs[t].failed;
+		norf += orfs[t].nelt;
+	}
+	if (failed || norf > INT_MAX) {
+		for (t = 0; t < nthreads0; t++)
+			free(orfs[t].elts);
+		if (failed)
+			error("DNAStringSet_find_ORFs(): failed to "
+			      "allocate memory for the ORFs");
+		error("too many ORFs");
+	}
+	PROTECT(ans = ORFs_asLIST(orfs, nthreads0));
+	for (t = 0; t < nthreads0; t++)
+		free(orfs[t].elts);
+	UNPROTECT(1);
+	return ans;
+}